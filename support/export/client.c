@@ -14,12 +14,18 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <ctype.h>
 #include <netdb.h>
 #include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
 
 #include "sockaddr.h"
+#include "xmalloc.h"
 #include "misc.h"
 #include "nfslib.h"
 #include "exportfs.h"
@@ -32,29 +38,144 @@ extern int	innetgr(char *netgr, char *host, char *, char *);
 #endif
 
 static char	*add_name(char *old, const char *add);
+static void	subnet_insert(nfs_client *clp);
+static void	subnet_freeall(void);
 
 nfs_client	*clientlist[MCL_MAXTYPES] = { NULL, };
 
 
+/*
+ * The address lists of clients are interned: clients with the same
+ * addresses, such as the copies client_dup() makes for each host that
+ * matches a wildcard, share one reference-counted array sized to fit.
+ */
+#define CLIENT_ADDRS_INITSIZE	64	/* a power of two */
+
+struct client_addrs {
+	struct client_addrs *	ca_next;
+	unsigned int		ca_hash;
+	int			ca_refs;
+	int			ca_count;
+	union nfs_sockaddr	ca_addrs[];
+};
+
+static struct client_addrs **	addrs_table;
+static unsigned int		addrs_size;
+static unsigned int		addrs_count;
+
+static struct client_addrs *
+addrs_entry(union nfs_sockaddr *list)
+{
+	return (struct client_addrs *)((char *)list -
+				offsetof(struct client_addrs, ca_addrs));
+}
+
+static void
+addrs_grow(void)
+{
+	struct client_addrs **table, *ca, *next;
+	unsigned int size, i;
+
+	size = addrs_size ? addrs_size << 1 : CLIENT_ADDRS_INITSIZE;
+	table = xmalloc(size * sizeof(*table));
+	memset(table, 0, size * sizeof(*table));
+	for (i = 0; i < addrs_size; i++)
+		for (ca = addrs_table[i]; ca; ca = next) {
+			next = ca->ca_next;
+			ca->ca_next = table[ca->ca_hash & (size - 1)];
+			table[ca->ca_hash & (size - 1)] = ca;
+		}
+	xfree(addrs_table);
+	addrs_table = table;
+	addrs_size = size;
+}
+
+/*
+ * Return a shared copy of the @count addresses at @addrs, which must
+ * have been zeroed before they were filled in so that they compare
+ * equal byte for byte.
+ */
+static union nfs_sockaddr *
+addrs_intern(const union nfs_sockaddr *addrs, const int count)
+{
+	size_t len = count * sizeof(*addrs);
+	unsigned int hash;
+	struct client_addrs *ca;
+
+	if (count == 0)
+		return NULL;
+
+	hash = fnv1a_buf(FNV1A_OFFSET, addrs, len);
+	if (addrs_size != 0)
+		for (ca = addrs_table[hash & (addrs_size - 1)]; ca;
+		     ca = ca->ca_next)
+			if (ca->ca_hash == hash && ca->ca_count == count &&
+			    memcmp(ca->ca_addrs, addrs, len) == 0) {
+				ca->ca_refs++;
+				return ca->ca_addrs;
+			}
+
+	if (addrs_count >= addrs_size)
+		addrs_grow();
+	ca = xmalloc(sizeof(*ca) + len);
+	ca->ca_hash = hash;
+	ca->ca_refs = 1;
+	ca->ca_count = count;
+	memcpy(ca->ca_addrs, addrs, len);
+	ca->ca_next = addrs_table[hash & (addrs_size - 1)];
+	addrs_table[hash & (addrs_size - 1)] = ca;
+	addrs_count++;
+	return ca->ca_addrs;
+}
+
+static void
+addrs_release(union nfs_sockaddr *list)
+{
+	struct client_addrs *ca, **cap;
+
+	if (list == NULL)
+		return;
+	ca = addrs_entry(list);
+	if (--ca->ca_refs > 0)
+		return;
+	for (cap = &addrs_table[ca->ca_hash & (addrs_size - 1)]; *cap;
+	     cap = &(*cap)->ca_next)
+		if (*cap == ca) {
+			*cap = ca->ca_next;
+			break;
+		}
+	addrs_count--;
+	free(ca);
+}
+
 static void
 init_addrlist(nfs_client *clp, const struct addrinfo *ai)
 {
+	union nfs_sockaddr addrs[NFSCLNT_ADDRMAX], *old;
 	int i;
 
 	if (ai == NULL)
 		return;
 
+	/* fill in a scratch list, then swap in its shared copy */
+	memset(addrs, 0, sizeof(addrs));
+	old = clp->m_addrlist;
+	clp->m_addrlist = addrs;
 	for (i = 0; (ai != NULL) && (i < NFSCLNT_ADDRMAX); i++) {
 		set_addrlist(clp, i, ai->ai_addr);
 		ai = ai->ai_next;
 	}
 
+	clp->m_addrlist = addrs_intern(addrs, i);
 	clp->m_naddr = i;
+	clp->m_resolved = time(NULL);
+	addrs_release(old);
 }
 
 static void
 client_free(nfs_client *clp)
 {
+	addrs_release(clp->m_addrlist);
 	free(clp->m_hostname);
 	free(clp);
 }
@@ -230,6 +351,10 @@ init_subnetwork(nfs_client *clp)
 static int
 client_init(nfs_client *clp, const char *hname, const struct addrinfo *ai)
 {
+	union nfs_sockaddr subnet[2];
+	int result;
+
+	clp->m_addrlist = NULL;
 	clp->m_hostname = strdup(hname);
 	if (clp->m_hostname == NULL)
 		return 0;
@@ -238,8 +363,14 @@ client_init(nfs_client *clp, const char *hname, const struct addrinfo *ai)
 	clp->m_count = 0;
 	clp->m_naddr = 0;
 
-	if (clp->m_type == MCL_SUBNETWORK)
-		return init_subnetwork(clp);
+	if (clp->m_type == MCL_SUBNETWORK) {
+		/* the network address, then the netmask */
+		memset(subnet, 0, sizeof(subnet));
+		clp->m_addrlist = subnet;
+		result = init_subnetwork(clp);
+		clp->m_addrlist = addrs_intern(subnet, 2);
+		return result;
+	}
 
 	init_addrlist(clp, ai);
 	return 1;
@@ -255,6 +386,112 @@ client_add(nfs_client *clp)
 		cpp = &((*cpp)->m_next);
 	clp->m_next = NULL;
 	*cpp = clp;
+
+	if (clp->m_type == MCL_SUBNETWORK)
+		subnet_insert(clp);
+}
+
+/*
+ * Client names resolved ahead of time, for instance by several threads
+ * at once.  client_lookup() uses these results rather than resolving
+ * the names again one at a time.
+ */
+#define CLIENT_NAMES_INITSIZE	64	/* a power of two */
+
+struct client_name {
+	struct client_name *	cn_next;
+	unsigned int		cn_hash;
+	char *			cn_name;
+	struct addrinfo *	cn_ai;		/* NULL if resolving failed */
+};
+
+static struct client_name **	names_table;
+static unsigned int		names_size;
+static unsigned int		names_count;
+
+static void
+names_grow(void)
+{
+	struct client_name **table, *cn, *next;
+	unsigned int size, i;
+
+	size = names_size ? names_size << 1 : CLIENT_NAMES_INITSIZE;
+	table = xmalloc(size * sizeof(*table));
+	memset(table, 0, size * sizeof(*table));
+	for (i = 0; i < names_size; i++)
+		for (cn = names_table[i]; cn; cn = next) {
+			next = cn->cn_next;
+			cn->cn_next = table[cn->cn_hash & (size - 1)];
+			table[cn->cn_hash & (size - 1)] = cn;
+		}
+	xfree(names_table);
+	names_table = table;
+	names_size = size;
+}
+
+static struct client_name *
+names_find(const char *hname, const unsigned int hash)
+{
+	struct client_name *cn;
+
+	if (names_count == 0)
+		return NULL;
+	for (cn = names_table[hash & (names_size - 1)]; cn; cn = cn->cn_next)
+		if (cn->cn_hash == hash && strcmp(cn->cn_name, hname) == 0)
+			return cn;
+	return NULL;
+}
+
+/**
+ * client_resolved - remember what a client name resolved to
+ * @hname: '\0'-terminated ASCII string containing a client name
+ * @ai: result of host_addrinfo(@hname), or NULL if it failed
+ *
+ * Until client_resolved_flush() is called, client_lookup() uses @ai
+ * instead of resolving @hname again.  @ai now belongs to the cache.
+ */
+void
+client_resolved(const char *hname, struct addrinfo *ai)
+{
+	unsigned int hash = fnv1a_str(hname);
+	struct client_name *cn;
+
+	if (names_find(hname, hash) != NULL) {
+		freeaddrinfo(ai);
+		return;
+	}
+	if (names_count >= names_size)
+		names_grow();
+
+	cn = xmalloc(sizeof(*cn));
+	cn->cn_hash = hash;
+	cn->cn_name = xstrdup(hname);
+	cn->cn_ai = ai;
+	cn->cn_next = names_table[hash & (names_size - 1)];
+	names_table[hash & (names_size - 1)] = cn;
+	names_count++;
+}
+
+/**
+ * client_resolved_flush - forget the names given to client_resolved()
+ *
+ */
+void
+client_resolved_flush(void)
+{
+	struct client_name *cn, *next;
+	unsigned int i;
+
+	for (i = 0; i < names_size; i++)
+		for (cn = names_table[i]; cn; cn = next) {
+			next = cn->cn_next;
+			freeaddrinfo(cn->cn_ai);
+			xfree(cn->cn_name);
+			xfree(cn);
+		}
+	xfree(names_table);
+	names_table = NULL;
+	names_size = names_count = 0;
 }
 
 /**
@@ -271,11 +508,13 @@ client_lookup(char *hname, int canonical)
 	nfs_client	*clp = NULL;
 	int		htype;
 	struct addrinfo	*ai = NULL;
+	struct client_name *cn = NULL;
 
 	htype = client_gettype(hname);
 
 	if (htype == MCL_FQDN && !canonical) {
-		ai = host_addrinfo(hname);
+		cn = names_find(hname, fnv1a_str(hname));
+		ai = cn ? cn->cn_ai : host_addrinfo(hname);
 		if (!ai) {
 			xlog(L_ERROR, "Failed to resolve %s", hname);
 			goto out;
@@ -309,7 +548,27 @@ client_lookup(char *hname, int canonical)
 		init_addrlist(clp, ai);
 
 out:
-	freeaddrinfo(ai);
+	if (cn == NULL)
+		freeaddrinfo(ai);
+	return clp;
+}
+
+/**
+ * client_find - look for @hname in our list of cached nfs_clients
+ * @hname: '\0'-terminated ASCII string containing client name to look for
+ *
+ * Unlike client_lookup(), only the names of the cached clients are
+ * compared, and no new nfs_client is created.  Returns a pointer to
+ * the matching nfs_client, or NULL if there is none.
+ */
+nfs_client *
+client_find(char *hname)
+{
+	nfs_client *clp;
+
+	for (clp = clientlist[client_gettype(hname)]; clp; clp = clp->m_next)
+		if (strcasecmp(hname, clp->m_hostname) == 0)
+			break;
 	return clp;
 }
 
@@ -371,6 +630,136 @@ client_freeall(void)
 			client_free(clp);
 		}
 	}
+	subnet_freeall();
+}
+
+/**
+ * client_memstat - log how much memory the nfs_client records use
+ *
+ * Reports, at the D_GENERAL debugging level, the number of clients of
+ * each type with the bytes held by their records and names, and how
+ * much the shared address lists save over a full list per client.
+ */
+void
+client_memstat(void)
+{
+	static const char *names[MCL_MAXTYPES] = {
+		[MCL_ANONYMOUS]		= "anonymous",
+		[MCL_FQDN]		= "fqdn",
+		[MCL_SUBNETWORK]	= "subnet",
+		[MCL_NETGROUP]		= "netgroup",
+		[MCL_WILDCARD]		= "wildcard",
+		[MCL_GSS]		= "gss",
+	};
+	struct client_addrs *ca;
+	size_t bytes, lists = 0, inline_bytes = 0;
+	unsigned int count, i, refs = 0;
+	nfs_client *clp;
+
+	if (!xlog_enabled(D_GENERAL))
+		return;
+
+	for (i = 0; i < MCL_MAXTYPES; i++) {
+		count = 0;
+		bytes = 0;
+		for (clp = clientlist[i]; clp; clp = clp->m_next) {
+			count++;
+			bytes += sizeof(*clp) + strlen(clp->m_hostname) + 1;
+			if (clp->m_addrlist != NULL)
+				inline_bytes += NFSCLNT_ADDRMAX *
+						sizeof(union nfs_sockaddr);
+		}
+		if (count)
+			xlog(D_GENERAL, "clients: %u %s, %zu bytes",
+					count, names[i] ? names[i] : "?", bytes);
+	}
+
+	count = 0;
+	for (i = 0; i < addrs_size; i++)
+		for (ca = addrs_table[i]; ca; ca = ca->ca_next) {
+			count++;
+			refs += ca->ca_refs;
+			lists += sizeof(*ca) +
+				ca->ca_count * sizeof(union nfs_sockaddr);
+		}
+	xlog(D_GENERAL, "client addresses: %u lists shared by %u clients, "
+			"%zu bytes (%zu unshared)", count, refs,
+			lists + addrs_size * sizeof(*addrs_table), inline_bytes);
+}
+
+/*
+ * Drop the resolved time of each FQDN client that a reload just gave
+ * a new or changed export, unless its addresses were looked up during
+ * the reload, so that client_sweep() looks it up again.
+ */
+static void
+client_sweep_touched(const time_t since)
+{
+	nfs_export *exp;
+	int i;
+
+	for (i = 0; i < MCL_MAXTYPES; i++)
+		for (exp = exportlist[i].p_head; exp; exp = exp->m_next) {
+			if (!exp->m_added && !exp->m_changed)
+				continue;
+			if (exp->m_client->m_type != MCL_FQDN)
+				continue;
+			if (exp->m_client->m_resolved < since)
+				exp->m_client->m_resolved = 0;
+		}
+}
+
+/**
+ * client_sweep - tidy up the client list after a reload
+ * @since: when the reload started
+ *
+ * Frees every nfs_client no export refers to any more.  The addresses
+ * of the remaining FQDN clients are looked up again if the reload
+ * added or changed one of their exports, or if they are older than
+ * DEFAULT_TTL; the rest keep the addresses they have.
+ */
+void
+client_sweep(const time_t since)
+{
+	nfs_client *clp, **cpp;
+	struct addrinfo *ai;
+	int i, subnets = 0;
+
+	for (i = 0; i < MCL_MAXTYPES; i++) {
+		cpp = &clientlist[i];
+		while ((clp = *cpp) != NULL) {
+			if (clp->m_count > 0) {
+				cpp = &clp->m_next;
+				continue;
+			}
+			*cpp = clp->m_next;
+			if (i == MCL_SUBNETWORK)
+				subnets++;
+			client_free(clp);
+		}
+	}
+
+	client_sweep_touched(since);
+	for (clp = clientlist[MCL_FQDN]; clp; clp = clp->m_next) {
+		if (since - clp->m_resolved < DEFAULT_TTL)
+			continue;
+		ai = host_addrinfo(clp->m_hostname);
+		if (ai == NULL) {
+			xlog(D_GENERAL, "%s: keeping old addresses of %s",
+					__func__, clp->m_hostname);
+			/* don't ask again until it is due */
+			clp->m_resolved = since;
+			continue;
+		}
+		init_addrlist(clp, ai);
+		freeaddrinfo(ai);
+	}
+
+	if (subnets) {
+		subnet_freeall();
+		for (clp = clientlist[MCL_SUBNETWORK]; clp; clp = clp->m_next)
+			subnet_insert(clp);
+	}
 }
 
 /**
@@ -408,17 +797,28 @@ client_resolve(const struct sockaddr *sap)
 char *
 client_compose(const struct addrinfo *ai)
 {
+	client_match cm;
 	char *name = NULL;
+	unsigned int j;
 	int i;
 
+	client_match_init(&cm, ai);
 	for (i = 0 ; i < MCL_MAXTYPES; i++) {
 		nfs_client	*clp;
+
+		if (i == MCL_SUBNETWORK) {
+			for (j = 0; j < cm.cm_count; j++)
+				name = add_name(name,
+						cm.cm_subnets[j]->m_hostname);
+			continue;
+		}
 		for (clp = clientlist[i]; clp ; clp = clp->m_next) {
 			if (!client_check(clp, ai))
 				continue;
 			name = add_name(name, clp->m_hostname);
 		}
 	}
+	client_match_release(&cm);
 	return name;
 }
 
@@ -482,7 +882,9 @@ add_name(char *old, const char *add)
 		else
 			cp = cp + strlen(cp);
 	}
-	strncpy(new, old, cp-old);
+	/* @old may be NULL; don't let the compiler assume otherwise */
+	if (old)
+		strncpy(new, old, cp-old);
 	new[cp-old] = 0;
 	if (cp != old && !*cp)
 		strcat(new, ",");
@@ -595,6 +997,242 @@ check_subnetwork(const nfs_client *clp, const struct addrinfo *ai)
 	return 0;
 }
 
+/*
+ * MCL_SUBNETWORK clients are also entered in a binary radix tree, one
+ * per address family, keyed by the network bits of their address.
+ * Walking the tree along an address visits every subnet containing
+ * it, longest prefix last, so all matching subnet clients are found
+ * in one walk of at most 32 or 128 steps instead of a scan of
+ * clientlist[MCL_SUBNETWORK].  Clients with a non-contiguous netmask
+ * can't be entered and are kept on a list that is still scanned.
+ *
+ * The tree is changed only when clients are added or all freed,
+ * that is while the export table is being (re)loaded.
+ */
+struct subnet_node {
+	struct subnet_node *	sn_child[2];
+	unsigned int		sn_count;
+	nfs_client **		sn_clients;
+};
+
+static struct subnet_node	*subnet_root4, *subnet_root6;
+static nfs_client		**subnet_other;
+static unsigned int		subnet_nother;
+
+static inline int
+subnet_bit(const unsigned char *addr, const int bit)
+{
+	return (addr[bit >> 3] >> (7 - (bit & 7))) & 1;
+}
+
+/*
+ * Return the address bytes of @sap and the root of its tree, or
+ * NULL if the tree doesn't hold addresses of this family.
+ */
+static const unsigned char *
+subnet_key(const struct sockaddr *sap, int *nbits,
+		struct subnet_node ***root)
+{
+	switch (sap->sa_family) {
+	case AF_INET:
+		*nbits = 32;
+		*root = &subnet_root4;
+		return (const unsigned char *)
+			&((const struct sockaddr_in *)sap)->sin_addr;
+#ifdef IPV6_SUPPORTED
+	case AF_INET6:
+		*nbits = 128;
+		*root = &subnet_root6;
+		return (const unsigned char *)
+			&((const struct sockaddr_in6 *)sap)->sin6_addr;
+#endif
+	}
+	return NULL;
+}
+
+/* Length of a netmask, or -1 if its one bits are not contiguous */
+static int
+subnet_prefixlen(const unsigned char *mask, const int nbits)
+{
+	int bit, len;
+
+	for (len = 0; len < nbits && subnet_bit(mask, len); len++)
+		;
+	for (bit = len; bit < nbits; bit++)
+		if (subnet_bit(mask, bit))
+			return -1;
+	return len;
+}
+
+static int
+subnet_node_add(struct subnet_node *node, nfs_client *clp)
+{
+	nfs_client **clients;
+
+	clients = realloc(node->sn_clients,
+			(node->sn_count + 1) * sizeof(*clients));
+	if (clients == NULL)
+		return 0;
+	clients[node->sn_count++] = clp;
+	node->sn_clients = clients;
+	return 1;
+}
+
+static void
+subnet_insert(nfs_client *clp)
+{
+	const unsigned char *addr, *mask;
+	struct subnet_node **root, **np;
+	int bit, len, nbits;
+	nfs_client **other;
+
+	addr = subnet_key(get_addrlist(clp, 0), &nbits, &root);
+	if (addr == NULL)
+		goto out_other;
+	mask = subnet_key(get_addrlist(clp, 1), &nbits, &root);
+	len = subnet_prefixlen(mask, nbits);
+	if (len < 0)
+		goto out_other;
+
+	np = root;
+	for (bit = 0; ; bit++) {
+		if (*np == NULL) {
+			*np = calloc(1, sizeof(struct subnet_node));
+			if (*np == NULL)
+				goto out_other;
+		}
+		if (bit == len)
+			break;
+		np = &(*np)->sn_child[subnet_bit(addr, bit)];
+	}
+	if (subnet_node_add(*np, clp))
+		return;
+
+out_other:
+	other = realloc(subnet_other, (subnet_nother + 1) * sizeof(*other));
+	if (other == NULL) {
+		xlog(L_ERROR, "%s: no memory for subnet %s",
+				__func__, clp->m_hostname);
+		return;
+	}
+	other[subnet_nother++] = clp;
+	subnet_other = other;
+}
+
+static void
+subnet_free(struct subnet_node *node)
+{
+	if (node == NULL)
+		return;
+	subnet_free(node->sn_child[0]);
+	subnet_free(node->sn_child[1]);
+	free(node->sn_clients);
+	free(node);
+}
+
+static void
+subnet_freeall(void)
+{
+	subnet_free(subnet_root4);
+	subnet_free(subnet_root6);
+	subnet_root4 = subnet_root6 = NULL;
+	free(subnet_other);
+	subnet_other = NULL;
+	subnet_nother = 0;
+}
+
+static void
+client_match_add(client_match *cm, const nfs_client *clp)
+{
+	unsigned int i;
+
+	/* @clp may match more than one address in cm_ai */
+	for (i = 0; i < cm->cm_count; i++)
+		if (cm->cm_subnets[i] == clp)
+			return;
+	if (cm->cm_count == cm->cm_max) {
+		cm->cm_max = cm->cm_max ? cm->cm_max << 1 : 8;
+		cm->cm_subnets = xrealloc(cm->cm_subnets,
+				cm->cm_max * sizeof(*cm->cm_subnets));
+	}
+	cm->cm_subnets[cm->cm_count++] = clp;
+}
+
+/**
+ * client_match_init - find every subnetwork client matching an address
+ * @cm: client_match to fill in
+ * @ai: pointer to addrinfo containing IP address information to match
+ *
+ * The result lets client_match_check() test many nfs_client records
+ * against @ai without comparing them with each subnetwork in turn.
+ * Caller must release @cm with client_match_release().
+ */
+void
+client_match_init(client_match *cm, const struct addrinfo *ai)
+{
+	struct subnet_node **root, *node;
+	const unsigned char *addr;
+	unsigned int i;
+	int bit, nbits;
+
+	memset(cm, 0, sizeof(*cm));
+	cm->cm_ai = ai;
+	if (ai == NULL)
+		return;
+
+	for (; ai; ai = ai->ai_next) {
+		addr = subnet_key(ai->ai_addr, &nbits, &root);
+		if (addr == NULL)
+			continue;
+		node = *root;
+		for (bit = 0; node; bit++) {
+			for (i = 0; i < node->sn_count; i++)
+				client_match_add(cm, node->sn_clients[i]);
+			if (bit == nbits)
+				break;
+			node = node->sn_child[subnet_bit(addr, bit)];
+		}
+	}
+
+	for (i = 0; i < subnet_nother; i++)
+		if (check_subnetwork(subnet_other[i], cm->cm_ai))
+			client_match_add(cm, subnet_other[i]);
+}
+
+/**
+ * client_match_check - check if a cached nfs_client matches an address
+ * @cm: client_match set up by client_match_init()
+ * @clp: pointer to a cached nfs_client record
+ *
+ * Returns 1 if @clp matches the address information in @cm,
+ * otherwise zero.  Equivalent to client_check(@clp, @cm->cm_ai).
+ */
+int
+client_match_check(const client_match *cm, const nfs_client *clp)
+{
+	unsigned int i;
+
+	if (clp->m_type != MCL_SUBNETWORK)
+		return client_check(clp, cm->cm_ai);
+	for (i = 0; i < cm->cm_count; i++)
+		if (cm->cm_subnets[i] == clp)
+			return 1;
+	return 0;
+}
+
+/**
+ * client_match_release - release resources held by a client_match
+ * @cm: client_match set up by client_match_init()
+ *
+ */
+void
+client_match_release(client_match *cm)
+{
+	xfree(cm->cm_subnets);
+	cm->cm_subnets = NULL;
+	cm->cm_count = cm->cm_max = 0;
+}
+
 /*
  * Check if a wildcard nfs_client record matches the canonical name
  * or the aliases of a host.  Return 1 if a match is found, otherwise
@@ -605,16 +1243,18 @@ check_wildcard(const nfs_client *clp, const struct addrinfo *ai)
 {
 	char *cname = clp->m_hostname;
 	char *hname = ai->ai_canonname;
-	struct hostent *hp;
+	struct hostent hent, *hp;
+	char hbuf[8192];
 	char **ap;
+	int herr;
 
 	if (wildmat(hname, cname))
 		return 1;
 
 	/* See if hname aliases listed in /etc/hosts or nis[+]
 	 * match the requested wildcard */
-	hp = gethostbyname(hname);
-	if (hp != NULL) {
+	if (gethostbyname_r(hname, &hent, hbuf, sizeof(hbuf),
+			    &hp, &herr) == 0 && hp != NULL) {
 		for (ap = hp->h_aliases; *ap; ap++)
 			if (wildmat(*ap, cname))
 				return 1;
@@ -629,14 +1269,423 @@ check_wildcard(const nfs_client *clp, const struct addrinfo *ai)
  * zero.
  */
 #ifdef HAVE_INNETGR
+/*
+ * innetgr(3) and getnetgrent(3) keep their iteration state in static
+ * storage, so threads must take turns calling them.  netgroup_lock
+ * protects the expanded netgroups; when both are taken, it is taken
+ * first.
+ */
+static pthread_mutex_t netgroup_nis_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t netgroup_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t netgroup_stale = PTHREAD_COND_INITIALIZER;
+
+/*
+ * When expansion is enabled, each netgroup is enumerated once with
+ * getnetgrent(3) and its hosts are entered in a hash table, so that a
+ * membership test costs a lookup instead of a round trip to NIS or
+ * LDAP.  Netgroups that can't be enumerated are still checked with
+ * innetgr(3).
+ *
+ * Once a netgroup is older than the expansion interval, a refresher
+ * thread enumerates it again into a table of its own, and swaps that
+ * in.  Until then, membership is still tested against the old table,
+ * so no request waits for NIS or LDAP.  New netgroups are enumerated
+ * by the refresher as well, and tested with innetgr(3) until then.
+ */
+#define NETGROUP_HASHSIZE	64
+
+struct netgroup_host {
+	struct netgroup_host *	nh_next;
+	unsigned int		nh_hash;
+	char *			nh_name;
+};
+
+struct netgroup {
+	struct netgroup *	ng_next;
+	unsigned int		ng_hash;
+	char *			ng_name;
+	time_t			ng_expiry;
+	int			ng_valid;	/* could be enumerated */
+	int			ng_all;		/* has an empty host field */
+	int			ng_refresh;	/* NG_REFRESH_* */
+	int			ng_used;	/* client_netgroup_reload() */
+	unsigned int		ng_size;
+	unsigned int		ng_count;
+	struct netgroup_host **	ng_hosts;
+};
+
+enum {
+	NG_REFRESH_NONE = 0,
+	NG_REFRESH_WANTED,
+	NG_REFRESH_RUNNING,
+};
+
+static int		netgroup_interval;
+static struct netgroup	*netgroups[NETGROUP_HASHSIZE];
+static pid_t		netgroup_refresher_pid;	/* where it runs, if anywhere */
+
+/* Host names in netgroups are compared without regard to case */
+static unsigned int
+netgroup_host_hash(const char *name)
+{
+	unsigned int hash = FNV1A_OFFSET;
+
+	while (*name)
+		hash = fnv1a_add(hash, tolower((unsigned char)*name++));
+	return hash;
+}
+
+static void
+netgroup_clear(struct netgroup *ng)
+{
+	struct netgroup_host *nh, *next;
+	unsigned int i;
+
+	for (i = 0; i < ng->ng_size; i++)
+		for (nh = ng->ng_hosts[i]; nh; nh = next) {
+			next = nh->nh_next;
+			free(nh->nh_name);
+			free(nh);
+		}
+	free(ng->ng_hosts);
+	ng->ng_hosts = NULL;
+	ng->ng_size = ng->ng_count = 0;
+	ng->ng_valid = ng->ng_all = 0;
+}
+
+static int
+netgroup_add_host(struct netgroup *ng, const char *name)
+{
+	struct netgroup_host *nh, **table;
+	unsigned int i, size;
+
+	if (ng->ng_count >= ng->ng_size) {
+		size = ng->ng_size ? ng->ng_size << 1 : 64;
+		table = calloc(size, sizeof(*table));
+		if (table == NULL)
+			return 0;
+		for (i = 0; i < ng->ng_size; i++)
+			while ((nh = ng->ng_hosts[i]) != NULL) {
+				ng->ng_hosts[i] = nh->nh_next;
+				nh->nh_next = table[nh->nh_hash & (size - 1)];
+				table[nh->nh_hash & (size - 1)] = nh;
+			}
+		free(ng->ng_hosts);
+		ng->ng_hosts = table;
+		ng->ng_size = size;
+	}
+
+	nh = malloc(sizeof(*nh));
+	if (nh == NULL)
+		return 0;
+	nh->nh_name = strdup(name);
+	if (nh->nh_name == NULL) {
+		free(nh);
+		return 0;
+	}
+	nh->nh_hash = netgroup_host_hash(name);
+	nh->nh_next = ng->ng_hosts[nh->nh_hash & (ng->ng_size - 1)];
+	ng->ng_hosts[nh->nh_hash & (ng->ng_size - 1)] = nh;
+	ng->ng_count++;
+	return 1;
+}
+
+/* Enumerate the hosts in @ng.  Caller holds netgroup_nis_lock. */
+static void
+netgroup_enumerate(struct netgroup *ng)
+{
+	char *host, *user, *domain;
+	int valid = 1;
+
+	netgroup_clear(ng);
+	ng->ng_expiry = time(NULL) + netgroup_interval;
+
+	if (!setnetgrent(ng->ng_name)) {
+		endnetgrent();
+		xlog(D_GENERAL, "%s: can't enumerate netgroup %s",
+				__func__, ng->ng_name);
+		return;
+	}
+	while (getnetgrent(&host, &user, &domain)) {
+		if (host == NULL) {
+			ng->ng_all = 1;
+			continue;
+		}
+		if (!netgroup_add_host(ng, host)) {
+			valid = 0;
+			break;
+		}
+	}
+	endnetgrent();
+
+	if (!valid) {
+		xlog(L_WARNING, "%s: no memory to expand netgroup %s",
+				__func__, ng->ng_name);
+		netgroup_clear(ng);
+		return;
+	}
+	ng->ng_valid = 1;
+	xlog(D_GENERAL, "%s: netgroup %s has %u hosts%s", __func__,
+			ng->ng_name, ng->ng_count,
+			ng->ng_all ? " and a wildcard" : "");
+}
+
+/* Enumerate the hosts in @ng.  Caller holds netgroup_lock. */
+static void
+netgroup_fill(struct netgroup *ng)
+{
+	pthread_mutex_lock(&netgroup_nis_lock);
+	netgroup_enumerate(ng);
+	pthread_mutex_unlock(&netgroup_nis_lock);
+}
+
+static struct netgroup *
+netgroup_find(const char *name)
+{
+	unsigned int hash = fnv1a_str(name);
+	struct netgroup *ng;
+
+	for (ng = netgroups[hash % NETGROUP_HASHSIZE]; ng; ng = ng->ng_next)
+		if (ng->ng_hash == hash && strcmp(ng->ng_name, name) == 0)
+			return ng;
+	return NULL;
+}
+
+static struct netgroup *
+netgroup_lookup(const char *name)
+{
+	unsigned int hash = fnv1a_str(name);
+	struct netgroup *ng;
+
+	ng = netgroup_find(name);
+	if (ng != NULL)
+		return ng;
+
+	ng = calloc(1, sizeof(*ng));
+	if (ng == NULL)
+		return NULL;
+	ng->ng_name = strdup(name);
+	if (ng->ng_name == NULL) {
+		free(ng);
+		return NULL;
+	}
+	ng->ng_hash = hash;
+	ng->ng_next = netgroups[hash % NETGROUP_HASHSIZE];
+	netgroups[hash % NETGROUP_HASHSIZE] = ng;
+	/* expired and not valid, so netgroup_expire() enumerates it */
+	return ng;
+}
+
+static int
+netgroup_has_host(const struct netgroup *ng, const char *host)
+{
+	unsigned int hash = netgroup_host_hash(host);
+	struct netgroup_host *nh;
+
+	if (ng->ng_all)
+		return 1;
+	if (ng->ng_size == 0)
+		return 0;
+	for (nh = ng->ng_hosts[hash & (ng->ng_size - 1)]; nh; nh = nh->nh_next)
+		if (nh->nh_hash == hash && strcasecmp(nh->nh_name, host) == 0)
+			return 1;
+	return 0;
+}
+
+static void
+netgroup_freeall(void)
+{
+	struct netgroup *ng, *next;
+	int i;
+
+	for (i = 0; i < NETGROUP_HASHSIZE; i++) {
+		for (ng = netgroups[i]; ng; ng = next) {
+			next = ng->ng_next;
+			netgroup_clear(ng);
+			free(ng->ng_name);
+			free(ng);
+		}
+		netgroups[i] = NULL;
+	}
+}
+
+/* Free the netgroups no client refers to any longer */
+static void
+netgroup_sweep(void)
+{
+	struct netgroup *ng, **ngp;
+	int i;
+
+	for (i = 0; i < NETGROUP_HASHSIZE; i++) {
+		ngp = &netgroups[i];
+		while ((ng = *ngp) != NULL) {
+			if (ng->ng_used) {
+				ngp = &ng->ng_next;
+				continue;
+			}
+			*ngp = ng->ng_next;
+			netgroup_clear(ng);
+			free(ng->ng_name);
+			free(ng);
+		}
+	}
+}
+
+/*
+ * Take a netgroup due for enumeration, and return a copy of its name.
+ * Caller holds netgroup_lock.
+ */
+static char *
+netgroup_next_stale(void)
+{
+	struct netgroup *ng;
+	char *name;
+	int i;
+
+	for (i = 0; i < NETGROUP_HASHSIZE; i++)
+		for (ng = netgroups[i]; ng; ng = ng->ng_next) {
+			if (ng->ng_refresh != NG_REFRESH_WANTED)
+				continue;
+			name = strdup(ng->ng_name);
+			if (name == NULL)
+				return NULL;
+			ng->ng_refresh = NG_REFRESH_RUNNING;
+			return name;
+		}
+	return NULL;
+}
+
+static void *
+netgroup_refresher(__attribute__((unused)) void *arg)
+{
+	struct netgroup fresh, *ng;
+	pid_t pid = getpid();
+
+	for (;;) {
+		memset(&fresh, 0, sizeof(fresh));
+
+		pthread_mutex_lock(&netgroup_lock);
+		while ((fresh.ng_name = netgroup_next_stale()) == NULL)
+			pthread_cond_wait(&netgroup_stale, &netgroup_lock);
+		pthread_mutex_unlock(&netgroup_lock);
+
+		pthread_mutex_lock(&netgroup_nis_lock);
+		netgroup_enumerate(&fresh);
+		pthread_mutex_unlock(&netgroup_nis_lock);
+
+		/* A reload may have replaced or dropped it meanwhile */
+		pthread_mutex_lock(&netgroup_lock);
+		ng = netgroup_find(fresh.ng_name);
+		if (ng != NULL && ng->ng_refresh == NG_REFRESH_RUNNING &&
+		    netgroup_refresher_pid == pid) {
+			netgroup_clear(ng);
+			ng->ng_expiry = fresh.ng_expiry;
+			ng->ng_valid = fresh.ng_valid;
+			ng->ng_all = fresh.ng_all;
+			ng->ng_size = fresh.ng_size;
+			ng->ng_count = fresh.ng_count;
+			ng->ng_hosts = fresh.ng_hosts;
+			ng->ng_refresh = NG_REFRESH_NONE;
+			fresh.ng_hosts = NULL;
+			fresh.ng_size = 0;
+		}
+		pthread_mutex_unlock(&netgroup_lock);
+
+		netgroup_clear(&fresh);
+		free(fresh.ng_name);
+	}
+	return NULL;
+}
+
+/*
+ * Start the refresher thread, unless it is running in this process
+ * already; a child of fork(2) needs its own.  Caller holds
+ * netgroup_lock.  Returns 1 if the thread is running, otherwise 0.
+ */
+static int
+netgroup_refresher_start(void)
+{
+	struct netgroup *ng;
+	pthread_attr_t attr;
+	pthread_t thread;
+	sigset_t all, old;
+	int i, err;
+
+	if (netgroup_refresher_pid == getpid())
+		return 1;
+
+	/* Refreshes the parent's thread was running never finish here */
+	for (i = 0; i < NETGROUP_HASHSIZE; i++)
+		for (ng = netgroups[i]; ng; ng = ng->ng_next)
+			if (ng->ng_refresh == NG_REFRESH_RUNNING)
+				ng->ng_refresh = NG_REFRESH_WANTED;
+
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	err = pthread_create(&thread, &attr, netgroup_refresher, NULL);
+	pthread_attr_destroy(&attr);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (err != 0) {
+		xlog(L_WARNING, "%s: pthread_create: %s",
+				__func__, strerror(err));
+		return 0;
+	}
+	netgroup_refresher_pid = getpid();
+	return 1;
+}
+
+/*
+ * An expired netgroup is still used while the refresher enumerates
+ * it again.  Caller holds netgroup_lock.
+ */
+static void
+netgroup_expire(struct netgroup *ng)
+{
+	if (ng->ng_expiry > time(NULL) || ng->ng_refresh != NG_REFRESH_NONE)
+		return;
+	if (!netgroup_refresher_start()) {
+		netgroup_fill(ng);
+		return;
+	}
+	ng->ng_refresh = NG_REFRESH_WANTED;
+	pthread_cond_signal(&netgroup_stale);
+}
+
+static int
+client_innetgr(const char *netgroup, const char *host)
+{
+	struct netgroup *ng = NULL;
+	int match = -1;
+
+	pthread_mutex_lock(&netgroup_lock);
+	if (netgroup_interval) {
+		ng = netgroup_lookup(netgroup);
+		if (ng)
+			netgroup_expire(ng);
+	}
+	if (ng && ng->ng_valid)
+		match = netgroup_has_host(ng, host);
+	pthread_mutex_unlock(&netgroup_lock);
+
+	if (match == -1) {
+		pthread_mutex_lock(&netgroup_nis_lock);
+		match = innetgr(netgroup, host, NULL, NULL);
+		pthread_mutex_unlock(&netgroup_nis_lock);
+	}
+	return match;
+}
+
 static int
 check_netgroup(const nfs_client *clp, const struct addrinfo *ai)
 {
 	const char *netgroup = clp->m_hostname + 1;
 	struct addrinfo *tmp = NULL;
-	struct hostent *hp;
+	struct hostent hent, *hp;
+	char hbuf[8192];
 	char *dot, *hname;
-	int i, match;
+	int i, herr, match;
 
 	match = 0;
 
@@ -648,17 +1697,17 @@ check_netgroup(const nfs_client *clp, const struct addrinfo *ai)
 
 	/* First, try to match the hostname without
 	 * splitting off the domain */
-	if (innetgr(netgroup, hname, NULL, NULL)) {
+	if (client_innetgr(netgroup, hname)) {
 		match = 1;
 		goto out;
 	}
 
 	/* See if hname aliases listed in /etc/hosts or nis[+]
 	 * match the requested netgroup */
-	hp = gethostbyname(hname);
-	if (hp != NULL) {
+	if (gethostbyname_r(hname, &hent, hbuf, sizeof(hbuf),
+			    &hp, &herr) == 0 && hp != NULL) {
 		for (i = 0; hp->h_aliases[i]; i++)
-			if (innetgr(netgroup, hp->h_aliases[i], NULL, NULL)) {
+			if (client_innetgr(netgroup, hp->h_aliases[i])) {
 				match = 1;
 				goto out;
 			}
@@ -675,7 +1724,7 @@ check_netgroup(const nfs_client *clp, const struct addrinfo *ai)
 		if (cname != NULL) {
 			free(hname);
 			hname = cname;
-			if (innetgr(netgroup, hname, NULL, NULL)) {
+			if (client_innetgr(netgroup, hname)) {
 				match = 1;
 				goto out;
 			}
@@ -688,12 +1737,63 @@ check_netgroup(const nfs_client *clp, const struct addrinfo *ai)
 		goto out;
 
 	*dot = '\0';
-	match = innetgr(netgroup, hname, NULL, NULL);
+	match = client_innetgr(netgroup, hname);
 
 out:
 	free(hname);
 	return match;
 }
+
+/**
+ * client_netgroup_expand - look up netgroups by enumerating them
+ * @interval: seconds after which a netgroup is enumerated again, or
+ *	      zero to query each netgroup with innetgr(3) instead
+ *
+ */
+void
+client_netgroup_expand(int interval)
+{
+	pthread_mutex_lock(&netgroup_lock);
+	netgroup_interval = interval > 0 ? interval : 0;
+	netgroup_freeall();
+	pthread_mutex_unlock(&netgroup_lock);
+}
+
+/**
+ * client_netgroup_reload - track the netgroups of the current clients
+ * @expire: if set, enumerate every netgroup again
+ *
+ * Called after the client list has been reloaded.  Netgroups no client
+ * refers to any longer are forgotten.  New netgroups, expired ones,
+ * and all of them if @expire is set, are enumerated by the refresher
+ * thread, while the old expansion or innetgr(3) is used meanwhile.
+ * Does nothing unless netgroup expansion has been enabled.
+ */
+void
+client_netgroup_reload(int expire)
+{
+	struct netgroup *ng;
+	nfs_client *clp;
+	int i;
+
+	pthread_mutex_lock(&netgroup_lock);
+	if (netgroup_interval) {
+		for (i = 0; i < NETGROUP_HASHSIZE; i++)
+			for (ng = netgroups[i]; ng; ng = ng->ng_next)
+				ng->ng_used = 0;
+		for (clp = clientlist[MCL_NETGROUP]; clp; clp = clp->m_next) {
+			ng = netgroup_lookup(clp->m_hostname + 1);
+			if (ng == NULL)
+				continue;
+			ng->ng_used = 1;
+			if (expire)
+				ng->ng_expiry = 0;
+			netgroup_expire(ng);
+		}
+		netgroup_sweep();
+	}
+	pthread_mutex_unlock(&netgroup_lock);
+}
 #else	/* !HAVE_INNETGR */
 static int
 check_netgroup(__attribute__((unused)) const nfs_client *clp,
@@ -701,6 +1801,16 @@ check_netgroup(__attribute__((unused)) const nfs_client *clp,
 {
 	return 0;
 }
+
+void
+client_netgroup_expand(__attribute__((unused)) int interval)
+{
+}
+
+void
+client_netgroup_reload(__attribute__((unused)) int expire)
+{
+}
 #endif	/* !HAVE_INNETGR */
 
 /**
@@ -0,0 +1,529 @@
+/*
+ * support/export/etabsnap.c
+ *
+ * Binary snapshot of etab.
+ *
+ * Whenever etab is written, the same exports are also written to a
+ * snapshot file in a form that needs no parsing: fixed-size records
+ * whose strings point into a string table, and a table of the clients
+ * they are exported to, so that each client is looked up only once.
+ * The snapshot records the identity of the etab it was written with,
+ * and is ignored if etab has since been replaced by anything else, or
+ * if its version or checksum is wrong; etab is then parsed as before.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include "xmalloc.h"
+#include "xlog.h"
+#include "misc.h"
+#include "nfslib.h"
+#include "exportfs.h"
+#include "pseudoflavors.h"
+
+#define ETABSNAP_MAGIC		0x4e455442	/* "NETB"; also the byte order */
+#define ETABSNAP_VERSION	1
+#define ETABSNAP_NOSTR		UINT32_MAX
+
+struct etabsnap_header {
+	uint32_t	sh_magic;
+	uint32_t	sh_version;
+	uint32_t	sh_cksum;	/* of everything after the header */
+	uint32_t	sh_nclients;
+	uint32_t	sh_nexports;
+	uint32_t	sh_nids;	/* squash list entries */
+	uint32_t	sh_strsize;
+	uint32_t	sh_pad;
+	/* the etab this snapshot was written with */
+	uint64_t	sh_dev;
+	uint64_t	sh_ino;
+	uint64_t	sh_size;
+	int64_t		sh_mtime;
+	int64_t		sh_mtime_nsec;
+};
+
+struct etabsnap_export {
+	uint32_t	se_client;	/* index into the client table */
+	uint32_t	se_path;	/* string table offsets ... */
+	uint32_t	se_mountpoint;
+	uint32_t	se_fslocdata;
+	uint32_t	se_uuid;
+	int32_t		se_flags;
+	int32_t		se_anonuid;
+	int32_t		se_anongid;
+	uint32_t	se_fsid;
+	int32_t		se_fslocmethod;
+	uint32_t	se_ttl;
+	uint32_t	se_squids;	/* index into the squash ids */
+	uint32_t	se_nsquids;
+	uint32_t	se_sqgids;
+	uint32_t	se_nsqgids;
+	uint32_t	se_nsec;
+	struct {
+		uint32_t	flav;	/* index into flav_map[] */
+		int32_t		flags;
+	}		se_sec[SECFLAVOR_COUNT];
+};
+
+/*
+ * The file is laid out as the header, the client table (one string
+ * offset per client), the export records, the squash ids and then
+ * the string table.
+ */
+struct etabsnap {
+	char *			sn_data;
+	size_t			sn_size;
+	const uint32_t *	sn_clients;
+	const struct etabsnap_export *sn_exports;
+	const int32_t *		sn_ids;
+	const char *		sn_strs;
+	uint32_t		sn_nexports;
+	uint32_t		sn_next;
+	void **			sn_hostdata;
+	const struct etabsnap_export *sn_cur;
+	struct exportent	sn_ee;
+};
+
+/* A growing section of the snapshot being written */
+struct etabsnap_buf {
+	char *		b_data;
+	size_t		b_len;
+	size_t		b_size;
+};
+
+static void *
+etabsnap_reserve(struct etabsnap_buf *buf, const size_t len)
+{
+	void *p;
+
+	if (buf->b_len + len > buf->b_size) {
+		buf->b_size = buf->b_size ? buf->b_size : 4096;
+		while (buf->b_len + len > buf->b_size)
+			buf->b_size <<= 1;
+		buf->b_data = xrealloc(buf->b_data, buf->b_size);
+	}
+	p = buf->b_data + buf->b_len;
+	buf->b_len += len;
+	return p;
+}
+
+static uint32_t
+etabsnap_addstr(struct etabsnap_buf *strs, const char *str)
+{
+	size_t len, off = strs->b_len;
+
+	if (str == NULL)
+		return ETABSNAP_NOSTR;
+	len = strlen(str) + 1;
+	memcpy(etabsnap_reserve(strs, len), str, len);
+	return (uint32_t)off;
+}
+
+static uint32_t
+etabsnap_addids(struct etabsnap_buf *ids, const int *list, const int count)
+{
+	size_t off = ids->b_len / sizeof(int32_t);
+	int32_t *p;
+	int i;
+
+	p = etabsnap_reserve(ids, count * sizeof(int32_t));
+	for (i = 0; i < count; i++)
+		p[i] = list[i];
+	return (uint32_t)off;
+}
+
+/*
+ * Find the index of @clp in the client table, adding it if need be.
+ * @slots is an open-addressed table of @size client indexes plus one.
+ */
+static uint32_t
+etabsnap_client(struct etabsnap_buf *clients, struct etabsnap_buf *strs,
+		nfs_client **seen, uint32_t *slots, const unsigned int size,
+		nfs_client *clp)
+{
+	unsigned int i;
+	uint32_t idx, *off;
+
+	i = fnv1a_buf(FNV1A_OFFSET, &clp, sizeof(clp)) & (size - 1);
+	while (slots[i] != 0) {
+		if (seen[slots[i] - 1] == clp)
+			return slots[i] - 1;
+		i = (i + 1) & (size - 1);
+	}
+
+	idx = clients->b_len / sizeof(*off);
+	off = etabsnap_reserve(clients, sizeof(*off));
+	*off = etabsnap_addstr(strs, clp->m_hostname);
+	seen[idx] = clp;
+	slots[i] = idx + 1;
+	return idx;
+}
+
+static void
+etabsnap_record(struct etabsnap_export *se, const struct exportent *ee,
+		struct etabsnap_buf *ids, struct etabsnap_buf *strs)
+{
+	const struct sec_entry *p;
+
+	memset(se, 0, sizeof(*se));
+	se->se_path = etabsnap_addstr(strs, ee->e_path);
+	se->se_mountpoint = etabsnap_addstr(strs, ee->e_mountpoint);
+	se->se_fslocdata = etabsnap_addstr(strs, ee->e_fslocdata);
+	se->se_uuid = etabsnap_addstr(strs, ee->e_uuid);
+	se->se_flags = ee->e_flags;
+	se->se_anonuid = ee->e_anonuid;
+	se->se_anongid = ee->e_anongid;
+	se->se_fsid = ee->e_fsid;
+	se->se_fslocmethod = ee->e_fslocmethod;
+	se->se_ttl = ee->e_ttl;
+	se->se_nsquids = ee->e_nsquids;
+	se->se_squids = etabsnap_addids(ids, ee->e_squids, ee->e_nsquids);
+	se->se_nsqgids = ee->e_nsqgids;
+	se->se_sqgids = etabsnap_addids(ids, ee->e_sqgids, ee->e_nsqgids);
+	for (p = ee->e_secinfo; p->flav && se->se_nsec < SECFLAVOR_COUNT; p++) {
+		se->se_sec[se->se_nsec].flav = p->flav - flav_map;
+		se->se_sec[se->se_nsec].flags = p->flags;
+		se->se_nsec++;
+	}
+}
+
+static int
+etabsnap_writeall(const int fd, const struct etabsnap_buf *buf)
+{
+	size_t done = 0;
+	ssize_t n;
+
+	while (done < buf->b_len) {
+		n = write(fd, buf->b_data + done, buf->b_len - done);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		done += n;
+	}
+	return 0;
+}
+
+/**
+ * etabsnap_write - write a snapshot of the exports in etab
+ * @etab: pathname of the etab just written
+ * @snap: pathname of the snapshot
+ * @snaptmp: temporary file the snapshot is written to first
+ *
+ * Every export with an etab entry is written, in the same order as
+ * xtab_export_write() writes them.  Called with the etab lock held.
+ * Returns zero on success, otherwise -1; the old snapshot is removed
+ * if a new one could not be written, so that it cannot be mistaken
+ * for a current one.
+ */
+int
+etabsnap_write(const char *etab, const char *snap, const char *snaptmp)
+{
+	struct etabsnap_buf hdr = { NULL, 0, 0 }, clients = { NULL, 0, 0 },
+			    exports = { NULL, 0, 0 }, ids = { NULL, 0, 0 },
+			    strs = { NULL, 0, 0 };
+	struct etabsnap_header *sh;
+	struct etabsnap_export *se;
+	unsigned int size, count = 0;
+	nfs_client **seen;
+	nfs_export *exp;
+	uint32_t *slots, cksum;
+	struct stat stb;
+	int i, fd, ret = -1;
+
+	if (stat(etab, &stb) < 0)
+		goto out_unlink;
+
+	for (i = 0; i < MCL_MAXTYPES; i++)
+		for (exp = exportlist[i].p_head; exp; exp = exp->m_next)
+			count++;
+	for (size = 64; size < 2 * count; size <<= 1)
+		;
+	seen = xmalloc((count + 1) * sizeof(*seen));
+	slots = xmalloc(size * sizeof(*slots));
+	memset(slots, 0, size * sizeof(*slots));
+
+	for (i = 0; i < MCL_MAXTYPES; i++) {
+		for (exp = exportlist[i].p_head; exp; exp = exp->m_next) {
+			if (!exp->m_xtabent)
+				continue;
+			se = etabsnap_reserve(&exports, sizeof(*se));
+			etabsnap_record(se, &exp->m_export, &ids, &strs);
+			se->se_client = etabsnap_client(&clients, &strs,
+						seen, slots, size,
+						exp->m_client);
+		}
+	}
+	xfree(slots);
+	xfree(seen);
+
+	cksum = fnv1a_buf(FNV1A_OFFSET, clients.b_data, clients.b_len);
+	cksum = fnv1a_buf(cksum, exports.b_data, exports.b_len);
+	cksum = fnv1a_buf(cksum, ids.b_data, ids.b_len);
+	cksum = fnv1a_buf(cksum, strs.b_data, strs.b_len);
+
+	sh = etabsnap_reserve(&hdr, sizeof(*sh));
+	memset(sh, 0, sizeof(*sh));
+	sh->sh_magic = ETABSNAP_MAGIC;
+	sh->sh_version = ETABSNAP_VERSION;
+	sh->sh_cksum = cksum;
+	sh->sh_nclients = clients.b_len / sizeof(uint32_t);
+	sh->sh_nexports = exports.b_len / sizeof(*se);
+	sh->sh_nids = ids.b_len / sizeof(int32_t);
+	sh->sh_strsize = strs.b_len;
+	sh->sh_dev = stb.st_dev;
+	sh->sh_ino = stb.st_ino;
+	sh->sh_size = stb.st_size;
+	sh->sh_mtime = stb.st_mtim.tv_sec;
+	sh->sh_mtime_nsec = stb.st_mtim.tv_nsec;
+
+	fd = open(snaptmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		xlog(L_ERROR, "can't create %s: %m", snaptmp);
+		goto out_free;
+	}
+	if (etabsnap_writeall(fd, &hdr) < 0 ||
+	    etabsnap_writeall(fd, &clients) < 0 ||
+	    etabsnap_writeall(fd, &exports) < 0 ||
+	    etabsnap_writeall(fd, &ids) < 0 ||
+	    etabsnap_writeall(fd, &strs) < 0) {
+		xlog(L_ERROR, "can't write %s: %m", snaptmp);
+		close(fd);
+		unlink(snaptmp);
+		goto out_free;
+	}
+	close(fd);
+	if (rename(snaptmp, snap) < 0) {
+		xlog(L_ERROR, "can't rename %s to %s: %m", snaptmp, snap);
+		unlink(snaptmp);
+		goto out_free;
+	}
+	ret = 0;
+
+out_free:
+	xfree(hdr.b_data);
+	xfree(clients.b_data);
+	xfree(exports.b_data);
+	xfree(ids.b_data);
+	xfree(strs.b_data);
+out_unlink:
+	if (ret < 0)
+		unlink(snap);
+	return ret;
+}
+
+static int
+etabsnap_stroff_ok(const struct etabsnap_header *sh, const char *strs,
+		const uint32_t off, const int optional)
+{
+	if (off == ETABSNAP_NOSTR)
+		return optional;
+	return off < sh->sh_strsize &&
+		memchr(strs + off, '\0', sh->sh_strsize - off) != NULL;
+}
+
+/* Check every offset in the snapshot, so that reading it cannot fault */
+static int
+etabsnap_check(const struct etabsnap *sn, const struct etabsnap_header *sh)
+{
+	const struct etabsnap_export *se;
+	uint32_t i, j;
+
+	for (i = 0; i < sh->sh_nclients; i++)
+		if (!etabsnap_stroff_ok(sh, sn->sn_strs, sn->sn_clients[i], 0))
+			return 0;
+
+	for (i = 0; i < sh->sh_nexports; i++) {
+		se = &sn->sn_exports[i];
+		if (se->se_client >= sh->sh_nclients ||
+		    !etabsnap_stroff_ok(sh, sn->sn_strs, se->se_path, 0) ||
+		    strlen(sn->sn_strs + se->se_path) > NFS_MAXPATHLEN ||
+		    !etabsnap_stroff_ok(sh, sn->sn_strs, se->se_mountpoint, 1) ||
+		    !etabsnap_stroff_ok(sh, sn->sn_strs, se->se_fslocdata, 1) ||
+		    !etabsnap_stroff_ok(sh, sn->sn_strs, se->se_uuid, 1))
+			return 0;
+		if (se->se_squids > sh->sh_nids ||
+		    se->se_nsquids > sh->sh_nids - se->se_squids ||
+		    se->se_sqgids > sh->sh_nids ||
+		    se->se_nsqgids > sh->sh_nids - se->se_sqgids)
+			return 0;
+		if (se->se_nsec > SECFLAVOR_COUNT)
+			return 0;
+		for (j = 0; j < se->se_nsec; j++)
+			if (se->se_sec[j].flav >= (uint32_t)flav_map_size)
+				return 0;
+	}
+	return 1;
+}
+
+/**
+ * etabsnap_open - open the snapshot of an etab
+ * @etab: pathname of etab
+ * @snap: pathname of its snapshot
+ *
+ * Returns a handle for etabsnap_next(), or NULL if there is no
+ * snapshot, or it does not describe the current contents of @etab.
+ * Called with the etab lock held.
+ */
+struct etabsnap *
+etabsnap_open(const char *etab, const char *snap)
+{
+	const struct etabsnap_header *sh;
+	struct etabsnap *sn;
+	struct stat stb, etb;
+	size_t size;
+	uint32_t cksum;
+	char *data;
+	int fd;
+
+	if (stat(etab, &etb) < 0)
+		return NULL;
+	fd = open(snap, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &stb) < 0 ||
+	    (size_t)stb.st_size < sizeof(*sh)) {
+		close(fd);
+		return NULL;
+	}
+	data = mmap(NULL, stb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+		return NULL;
+	sh = (const struct etabsnap_header *)data;
+
+	if (sh->sh_magic != ETABSNAP_MAGIC ||
+	    sh->sh_version != ETABSNAP_VERSION)
+		goto out_stale;
+	if (sh->sh_dev != (uint64_t)etb.st_dev ||
+	    sh->sh_ino != (uint64_t)etb.st_ino ||
+	    sh->sh_size != (uint64_t)etb.st_size ||
+	    sh->sh_mtime != (int64_t)etb.st_mtim.tv_sec ||
+	    sh->sh_mtime_nsec != (int64_t)etb.st_mtim.tv_nsec)
+		goto out_stale;
+
+	size = sizeof(*sh) +
+		(uint64_t)sh->sh_nclients * sizeof(uint32_t) +
+		(uint64_t)sh->sh_nexports * sizeof(struct etabsnap_export) +
+		(uint64_t)sh->sh_nids * sizeof(int32_t) +
+		sh->sh_strsize;
+	if (size != (size_t)stb.st_size)
+		goto out_corrupt;
+	cksum = fnv1a_buf(FNV1A_OFFSET, data + sizeof(*sh),
+				size - sizeof(*sh));
+	if (cksum != sh->sh_cksum)
+		goto out_corrupt;
+
+	sn = xmalloc(sizeof(*sn));
+	memset(sn, 0, sizeof(*sn));
+	sn->sn_data = data;
+	sn->sn_size = size;
+	sn->sn_clients = (const uint32_t *)(data + sizeof(*sh));
+	sn->sn_exports = (const struct etabsnap_export *)
+				(sn->sn_clients + sh->sh_nclients);
+	sn->sn_ids = (const int32_t *)(sn->sn_exports + sh->sh_nexports);
+	sn->sn_strs = (const char *)(sn->sn_ids + sh->sh_nids);
+	sn->sn_nexports = sh->sh_nexports;
+	if (!etabsnap_check(sn, sh)) {
+		xfree(sn);
+		goto out_corrupt;
+	}
+	sn->sn_hostdata = xmalloc((sh->sh_nclients + 1) *
+					sizeof(*sn->sn_hostdata));
+	memset(sn->sn_hostdata, 0,
+		(sh->sh_nclients + 1) * sizeof(*sn->sn_hostdata));
+	return sn;
+
+out_corrupt:
+	xlog(L_WARNING, "%s is damaged; reading %s instead", snap, etab);
+out_stale:
+	munmap(data, stb.st_size);
+	return NULL;
+}
+
+/**
+ * etabsnap_next - return the next export in a snapshot
+ * @sn: handle returned by etabsnap_open()
+ *
+ * The returned exportent, and the strings and lists it points to,
+ * stay valid only until the next call; callers copy what they keep,
+ * as export_update() does.  Returns NULL at the end of the snapshot.
+ */
+struct exportent *
+etabsnap_next(struct etabsnap *sn)
+{
+	const struct etabsnap_export *se;
+	struct exportent *ee = &sn->sn_ee;
+	uint32_t i;
+
+	if (sn->sn_next >= sn->sn_nexports)
+		return NULL;
+	se = sn->sn_cur = &sn->sn_exports[sn->sn_next++];
+
+	memset(ee, 0, sizeof(*ee));
+	ee->e_hostname = (char *)sn->sn_strs + sn->sn_clients[se->se_client];
+	strcpy(ee->e_path, sn->sn_strs + se->se_path);
+	if (se->se_mountpoint != ETABSNAP_NOSTR)
+		ee->e_mountpoint = (char *)sn->sn_strs + se->se_mountpoint;
+	if (se->se_fslocdata != ETABSNAP_NOSTR)
+		ee->e_fslocdata = (char *)sn->sn_strs + se->se_fslocdata;
+	if (se->se_uuid != ETABSNAP_NOSTR)
+		ee->e_uuid = (char *)sn->sn_strs + se->se_uuid;
+	ee->e_flags = se->se_flags;
+	ee->e_anonuid = se->se_anonuid;
+	ee->e_anongid = se->se_anongid;
+	ee->e_fsid = se->se_fsid;
+	ee->e_fslocmethod = se->se_fslocmethod;
+	ee->e_ttl = se->se_ttl;
+	if ((ee->e_nsquids = se->se_nsquids) != 0)
+		ee->e_squids = (int *)&sn->sn_ids[se->se_squids];
+	if ((ee->e_nsqgids = se->se_nsqgids) != 0)
+		ee->e_sqgids = (int *)&sn->sn_ids[se->se_sqgids];
+	for (i = 0; i < se->se_nsec; i++) {
+		ee->e_secinfo[i].flav = &flav_map[se->se_sec[i].flav];
+		ee->e_secinfo[i].flags = se->se_sec[i].flags;
+	}
+	ee->e_secinfo[i].flav = NULL;
+	return ee;
+}
+
+/**
+ * etabsnap_hostdata - per-client slot for the caller
+ * @sn: handle returned by etabsnap_open()
+ *
+ * Returns the address of a pointer, initially NULL, that is shared by
+ * every export to the client of the export last returned by
+ * etabsnap_next().
+ */
+void **
+etabsnap_hostdata(struct etabsnap *sn)
+{
+	return &sn->sn_hostdata[sn->sn_cur->se_client];
+}
+
+/**
+ * etabsnap_close - release a snapshot handle
+ * @sn: handle returned by etabsnap_open(), or NULL
+ *
+ */
+void
+etabsnap_close(struct etabsnap *sn)
+{
+	if (sn == NULL)
+		return;
+	munmap(sn->sn_data, sn->sn_size);
+	xfree(sn->sn_hostdata);
+	xfree(sn);
+}
@@ -15,24 +15,20 @@
 #include <sys/param.h>
 #include <netinet/in.h>
 #include <stdlib.h>
+#include <time.h>
 #include "xmalloc.h"
+#include "misc.h"
 #include "nfslib.h"
 #include "exportfs.h"
 
-exp_hash_table exportlist[MCL_MAXTYPES] = {{NULL, {{NULL,NULL}, }}, }; 
-static int export_hash(char *);
+exp_hash_table exportlist[MCL_MAXTYPES] = {{NULL}, };
 
 static void	export_init(nfs_export *exp, nfs_client *clp,
 					struct exportent *nep);
 static void	export_add(nfs_export *exp);
-static int	export_check(const nfs_export *exp, const struct addrinfo *ai,
-				const char *path);
-static nfs_export *
-		export_allowed_internal(const struct addrinfo *ai,
-				const char *path);
 
 static void
-export_free(nfs_export *exp)
+export_free_options(nfs_export *exp)
 {
 	xfree(exp->m_export.e_squids);
 	xfree(exp->m_export.e_sqgids);
@@ -41,6 +37,12 @@ export_free(nfs_export *exp)
 	free(exp->m_export.e_uuid);
 
 	xfree(exp->m_export.e_hostname);
+}
+
+static void
+export_free(nfs_export *exp)
+{
+	export_free_options(exp);
 	xfree(exp);
 }
 
@@ -69,19 +71,30 @@ void
 export_read(char *fname)
 {
 	struct exportent	*eep;
-	nfs_export		*exp;
 
 	setexportent(fname, "r");
-	while ((eep = getexportent(0,1)) != NULL) {
-		exp = export_lookup(eep->e_hostname, eep->e_path, 0);
-		if (!exp)
-			export_create(eep, 0);
-		else
-			warn_duplicated_exports(exp, eep);
-	}
+	while ((eep = getexportent(0,1)) != NULL)
+		export_read_entry(eep);
 	endexportent();
 }
 
+/**
+ * export_read_entry - add one entry read from /etc/exports
+ * @eep: export entry, as returned by getexportent()
+ *
+ */
+void
+export_read_entry(struct exportent *eep)
+{
+	nfs_export		*exp;
+
+	exp = export_lookup(eep->e_hostname, eep->e_path, 0);
+	if (!exp)
+		export_create(eep, 0);
+	else
+		warn_duplicated_exports(exp, eep);
+}
+
 /**
  * export_create - create an in-core nfs_export record from an export entry
  * @xep: export entry to lookup
@@ -121,6 +134,8 @@ export_init(nfs_export *exp, nfs_client *clp, struct exportent *nep)
 	exp->m_mayexport = 0;
 	exp->m_changed = 0;
 	exp->m_warned = 0;
+	exp->m_stale = 0;
+	exp->m_added = 0;
 	exp->m_client = clp;
 	clp->m_count++;
 }
@@ -153,37 +168,59 @@ export_dup(nfs_export *exp, const struct addrinfo *ai)
 	new->m_xtabent = 0;
 	new->m_changed = 0;
 	new->m_warned = 0;
+	new->m_stale = 0;
+	new->m_added = 0;
 	export_add(new);
 
 	return new;
 }
 
+/*
+ * The exports of a path to one type of client are kept next to each
+ * other on its exportlist[] entry, in the order they were added, as
+ * the path index keeps them.
+ */
 static void
 export_add(nfs_export *exp)
 {
-	exp_hash_table *p_tbl;
-	exp_hash_entry *p_hen;
-	nfs_export *p_next;
-
-	int type = exp->m_client->m_type;
-	int pos;
-
-	pos = export_hash(exp->m_export.e_path);
-	p_tbl = &(exportlist[type]); /* pointer to hash table */
-	p_hen = &(p_tbl->entries[pos]); /* pointer to hash table entry */
-
-	if (!(p_hen->p_first)) { /* hash table entry is empty */ 
- 		p_hen->p_first = exp;
- 		p_hen->p_last  = exp;
-
- 		exp->m_next = p_tbl->p_head;
- 		p_tbl->p_head = exp;
-	} else { /* hash table entry is NOT empty */
-		p_next = p_hen->p_last->m_next;
-		p_hen->p_last->m_next = exp;
-		exp->m_next = p_next;
-		p_hen->p_last = exp;
+	exp_hash_table *p_tbl = &exportlist[exp->m_client->m_type];
+	nfs_export *last = NULL;
+	pathidx_node *node;
+	int i;
+
+	node = pathidx_lookup(exp->m_export.e_path);
+	if (node != NULL)
+		for (i = 0; i < node->n_count; i++)
+			if (node->n_exports[i]->m_client->m_type ==
+						exp->m_client->m_type)
+				last = node->n_exports[i];
+
+	if (last == NULL) {	/* first export of this path */
+		exp->m_next = p_tbl->p_head;
+		p_tbl->p_head = exp;
+	} else {
+		exp->m_next = last->m_next;
+		last->m_next = exp;
 	}
+
+	pathidx_add(exp);
+}
+
+/* Return the export of @path to @clp, if there is one */
+static nfs_export *
+export_search_client(const nfs_client *clp, const char *path)
+{
+	pathidx_node *node;
+	int i;
+
+	node = pathidx_lookup(path);
+	if (node == NULL)
+		return NULL;
+
+	for (i = 0; i < node->n_count; i++)
+		if (node->n_exports[i]->m_client == clp)
+			return node->n_exports[i];
+	return NULL;
 }
 
 /**
@@ -197,38 +234,28 @@ export_add(nfs_export *exp)
 nfs_export *
 export_find(const struct addrinfo *ai, const char *path)
 {
-	nfs_export	*exp;
+	nfs_export	*exp = NULL;
+	pathidx_node	*node;
+	client_match	cm;
 	int		i;
 
-	for (i = 0; i < MCL_MAXTYPES; i++) {
-		for (exp = exportlist[i].p_head; exp; exp = exp->m_next) {
-			if (!export_check(exp, ai, path))
-				continue;
-			if (exp->m_client->m_type == MCL_FQDN)
-				return exp;
-			return export_dup(exp, ai);
-		}
-	}
-
-	return NULL;
-}
-
-static nfs_export *
-export_allowed_internal(const struct addrinfo *ai, const char *path)
-{
-	nfs_export	*exp;
-	int		i;
+	node = pathidx_lookup(path);
+	if (node == NULL)
+		return NULL;
 
-	for (i = 0; i < MCL_MAXTYPES; i++) {
-		for (exp = exportlist[i].p_head; exp; exp = exp->m_next) {
-			if (!exp->m_mayexport ||
-			    !export_check(exp, ai, path))
-				continue;
-			return exp;
-		}
+	/* The exports of a path are ordered by client type */
+	client_match_init(&cm, ai);
+	for (i = 0; i < node->n_count; i++) {
+		exp = node->n_exports[i];
+		if (client_match_check(&cm, exp->m_client))
+			break;
+		exp = NULL;
 	}
+	client_match_release(&cm);
 
-	return NULL;
+	if (exp != NULL && exp->m_client->m_type != MCL_FQDN)
+		exp = export_dup(exp, ai);
+	return exp;
 }
 
 /**
@@ -236,34 +263,40 @@ export_allowed_internal(const struct addrinfo *ai, const char *path)
  * @ai: pointer to addrinfo for client
  * @path: '\0'-terminated ASCII string containing export path
  *
+ * The longest exported prefix of @path that is exported to @ai wins.
+ * The path index yields every exported prefix in one walk, so only
+ * the exports of those prefixes are checked against @ai.
+ *
  * Returns a pointer to nfs_export data matching @ai and @path,
  * or NULL if the export is not allowed.
  */
 nfs_export *
 export_allowed(const struct addrinfo *ai, const char *path)
 {
-	nfs_export		*exp;
-	char			epath[MAXPATHLEN+1];
-	char			*p = NULL;
+	pathidx_node		*nodes[PATHIDX_MAXDEPTH];
+	nfs_export		*exp = NULL;
+	client_match		cm;
+	int			i, j, n;
 
 	if (path [0] != '/') return NULL;
 
-	strncpy(epath, path, sizeof (epath) - 1);
-	epath[sizeof (epath) - 1] = '\0';
+	n = pathidx_walk(path, nodes, PATHIDX_MAXDEPTH);
+	if (n == 0)
+		return NULL;
 
 	/* Try the longest matching exported pathname. */
-	while (1) {
-		exp = export_allowed_internal(ai, epath);
-		if (exp)
-			return exp;
-		/* We have to treat the root, "/", specially. */
-		if (p == &epath[1]) break;
-		p = strrchr(epath, '/');
-		if (p == epath) p++;
-		*p = '\0';
-	}
+	client_match_init(&cm, ai);
+	for (i = n - 1; exp == NULL && i >= 0; i--)
+		for (j = 0; j < nodes[i]->n_count; j++) {
+			exp = nodes[i]->n_exports[j];
+			if (exp->m_mayexport &&
+			    client_match_check(&cm, exp->m_client))
+				break;
+			exp = NULL;
+		}
+	client_match_release(&cm);
 
-	return NULL;
+	return exp;
 }
 
 /**
@@ -279,85 +312,233 @@ nfs_export *
 export_lookup(char *hname, char *path, int canonical)
 {
 	nfs_client *clp;
-	nfs_export *exp;
-	exp_hash_entry *p_hen;
-
-	int pos;
 
 	clp = client_lookup(hname, canonical);
 	if(clp == NULL)
 		return NULL;
 
-	pos = export_hash(path);
-	p_hen = &(exportlist[clp->m_type].entries[pos]); 
-	for(exp = p_hen->p_first; exp && (exp != p_hen->p_last->m_next); 
-  			exp = exp->m_next) {
-		if (exp->m_client == clp && !strcmp(exp->m_export.e_path, path)) {
-  			return exp;
+	return export_search_client(clp, path);
+}
+
+/**
+ * export_reload_begin - start reloading the in-core export table
+ * @delta: to be filled in with a summary of what the reload does
+ *
+ * Every export is marked stale.  Exports entered again with
+ * export_update() are kept, and export_reload_prune() and
+ * export_reload_end() discard the rest.
+ */
+void
+export_reload_begin(struct export_delta *delta)
+{
+	nfs_export	*exp;
+	int		i;
+
+	memset(delta, 0, sizeof(*delta));
+	delta->ed_started = time(NULL);
+	for (i = 0; i < MCL_MAXTYPES; i++)
+		for (exp = exportlist[i].p_head; exp; exp = exp->m_next) {
+			exp->m_stale = 1;
+			exp->m_added = 0;
+			exp->m_changed = 0;
+		}
+}
+
+/**
+ * export_update - enter an export entry read from etab into the table
+ * @xep: export entry read from etab
+ * @clp: the client @xep->e_hostname names
+ *
+ * An existing export of the same path to @clp is reused.  While the
+ * table is being reloaded, it is marked changed if its options differ
+ * from those in @xep.  Otherwise a new export is created.  Returns a
+ * pointer to the nfs_export for @xep, or NULL if a problem occurred.
+ */
+nfs_export *
+export_update(struct exportent *xep, nfs_client *clp)
+{
+	nfs_export	*exp;
+
+	exp = export_search_client(clp, xep->e_path);
+	if (exp == NULL) {
+		exp = (nfs_export *) xmalloc(sizeof(*exp));
+		export_init(exp, clp, xep);
+		export_add(exp);
+		exp->m_added = 1;
+		return exp;
+	}
+
+	/* A duplicate entry later in etab doesn't override the first */
+	if (exp->m_stale && !sameexportent(&exp->m_export, xep)) {
+		export_free_options(exp);
+		dupexportent(&exp->m_export, xep);
+		if (xep->e_hostname)
+			exp->m_export.e_hostname = xstrdup(xep->e_hostname);
+		exp->m_changed = 1;
+		exp->m_warned = 0;
+	}
+	exp->m_stale = 0;
+	return exp;
+}
+
+/* Drop @exp, which follows @prev on the p_head list of @p_tbl */
+static void
+export_remove(exp_hash_table *p_tbl, nfs_export *prev, nfs_export *exp)
+{
+	pathidx_remove(exp);
+	if (prev)
+		prev->m_next = exp->m_next;
+	else
+		p_tbl->p_head = exp->m_next;
+	client_release(exp->m_client);
+	export_free(exp);
+}
+
+/* Note the path of @exp, unless it is the last one noted */
+static void
+export_delta_add(struct export_delta *delta, nfs_export *exp)
+{
+	const char *path = exp->m_export.e_path;
+	unsigned int n = delta->ed_npaths;
+
+	if (n && strcmp(delta->ed_paths[n - 1], path) == 0)
+		return;
+	if (n == 0 || (n >= 8 && (n & (n - 1)) == 0))
+		delta->ed_paths = xrealloc(delta->ed_paths,
+				(n ? n * 2 : 8) * sizeof(char *));
+	delta->ed_paths[n] = xstrdup(path);
+	delta->ed_npaths = n + 1;
+}
+
+/*
+ * Discard stale exports, except pseudo exports if @keep_v4root is
+ * set.  Returns the number discarded.
+ */
+static unsigned int
+export_drop_stale(struct export_delta *delta, const int keep_v4root)
+{
+	nfs_export	*exp, *prev, *next;
+	unsigned int	count = 0;
+	int		i;
+
+	for (i = 0; i < MCL_MAXTYPES; i++) {
+		prev = NULL;
+		for (exp = exportlist[i].p_head; exp; exp = next) {
+			next = exp->m_next;
+			if (exp->m_stale && !(keep_v4root &&
+			    (exp->m_export.e_flags & NFSEXP_V4ROOT))) {
+				export_delta_add(delta, exp);
+				export_remove(&exportlist[i], prev, exp);
+				count++;
+				continue;
+			}
+			prev = exp;
 		}
 	}
-	return NULL;
+	delta->ed_removed += count;
+	return count;
 }
 
-static int
-export_check(const nfs_export *exp, const struct addrinfo *ai, const char *path)
+static void
+export_pathidx_rebuild(void)
 {
-	if (strcmp(path, exp->m_export.e_path))
-		return 0;
+	nfs_export	*exp;
+	int		i;
 
-	return client_check(exp->m_client, ai);
+	pathidx_freeall();
+	for (i = 0; i < MCL_MAXTYPES; i++)
+		for (exp = exportlist[i].p_head; exp; exp = exp->m_next)
+			pathidx_add(exp);
 }
 
 /**
- * export_freeall - deallocate all nfs_export records
+ * export_reload_prune - discard real exports a reload did not see
+ * @delta: passed to export_reload_begin()
  *
+ * Stale pseudo exports are kept, for v4root_set() to reuse or leave
+ * to export_reload_end().  Call before building pseudo exports, so
+ * that real exports on their way out are not mistaken for exports
+ * of the path a pseudo export is needed for.
  */
 void
-export_freeall(void)
+export_reload_prune(struct export_delta *delta)
 {
-	nfs_export	*exp, *nxt;
-	int		i, j;
+	if (export_drop_stale(delta, 1))
+		export_pathidx_rebuild();
+}
+
+/**
+ * export_reload_end - finish reloading the in-core export table
+ * @delta: passed to export_reload_begin(); filled in with a summary
+ *	of what the reload did
+ *
+ * Exports that were not entered again since export_reload_begin()
+ * are discarded, along with clients no export refers to any longer.
+ * The paths of exports that were added, changed or discarded are
+ * listed in @delta, which must be released with
+ * export_delta_release().
+ */
+void
+export_reload_end(struct export_delta *delta)
+{
+	nfs_export	*exp;
+	int		i;
 
+	(void)export_drop_stale(delta, 0);
 	for (i = 0; i < MCL_MAXTYPES; i++) {
-		for (exp = exportlist[i].p_head; exp; exp = nxt) {
-			nxt = exp->m_next;
-			client_release(exp->m_client);
-			export_free(exp);
-		}
-		for (j = 0; j < HASH_TABLE_SIZE; j++) {
-			exportlist[i].entries[j].p_first = NULL;
-			exportlist[i].entries[j].p_last = NULL;
+		for (exp = exportlist[i].p_head; exp; exp = exp->m_next) {
+			if (exp->m_added || exp->m_changed)
+				export_delta_add(delta, exp);
+			if (exp->m_added)
+				delta->ed_added++;
+			else if (exp->m_changed)
+				delta->ed_changed++;
+			else
+				delta->ed_kept++;
 		}
-		exportlist[i].p_head = NULL;
 	}
-	client_freeall();
+
+	/* The path index counts crossmnt exports, which changes can alter */
+	if (delta->ed_changed)
+		export_pathidx_rebuild();
+	client_sweep(delta->ed_started);
 }
 
-/*
- * Compute and returns integer from string. 
- * Note: Its understood the smae integers can be same for 
- *       different strings, but it should not matter.
+/**
+ * export_delta_release - free the path list of an export_delta
+ * @delta: filled in by export_reload_end()
+ *
  */
-static unsigned int 
-strtoint(char *str)
+void
+export_delta_release(struct export_delta *delta)
 {
-	int i = 0;
-	unsigned int n = 0;
+	unsigned int i;
 
-	while ( str[i] != '\0') {
-		n+=((int)str[i])*i;
-		i++;
-	}
-	return n;
+	for (i = 0; i < delta->ed_npaths; i++)
+		xfree(delta->ed_paths[i]);
+	xfree(delta->ed_paths);
+	delta->ed_paths = NULL;
+	delta->ed_npaths = 0;
 }
 
-/*
- * Hash function
+/**
+ * export_freeall - deallocate all nfs_export records
+ *
  */
-static int 
-export_hash(char *str)
+void
+export_freeall(void)
 {
-	int num = strtoint(str);
+	nfs_export	*exp, *nxt;
+	int		i;
 
-	return num % HASH_TABLE_SIZE;
+	for (i = 0; i < MCL_MAXTYPES; i++) {
+		for (exp = exportlist[i].p_head; exp; exp = nxt) {
+			nxt = exp->m_next;
+			client_release(exp->m_client);
+			export_free(exp);
+		}
+		exportlist[i].p_head = NULL;
+	}
+	pathidx_freeall();
+	client_freeall();
 }
@@ -0,0 +1,228 @@
+/*
+ * support/export/pathidx.c
+ *
+ * Index of in-core exports by export path.
+ *
+ * Every nfs_export added to exportlist[] is also entered here under
+ * its e_path.  This is the only index of exportlist[]: looking up an
+ * export of a given path, to anyone or to one client, probes it once.
+ * Looking up a pathname costs one hash probe per path component
+ * instead of a walk over every export, and the walk naturally yields
+ * each exported ancestor of the pathname, which is what the crossmnt
+ * and longest-prefix matching in mountd needs.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+#include <stdlib.h>
+#include "xmalloc.h"
+#include "misc.h"
+#include "nfslib.h"
+#include "exportfs.h"
+
+#define PATHIDX_INITSIZE	1024
+
+static pathidx_node	**pathidx_table;
+static unsigned int	pathidx_size;
+static unsigned int	pathidx_count;
+
+static void
+pathidx_grow(void)
+{
+	pathidx_node **table, *node, *next;
+	unsigned int size, i;
+
+	size = pathidx_size ? pathidx_size << 1 : PATHIDX_INITSIZE;
+	table = xmalloc(size * sizeof(*table));
+	memset(table, 0, size * sizeof(*table));
+
+	for (i = 0; i < pathidx_size; i++)
+		for (node = pathidx_table[i]; node; node = next) {
+			next = node->n_next;
+			node->n_next = table[node->n_hash & (size - 1)];
+			table[node->n_hash & (size - 1)] = node;
+		}
+
+	xfree(pathidx_table);
+	pathidx_table = table;
+	pathidx_size = size;
+}
+
+static pathidx_node *
+pathidx_find(const char *path, const size_t len, const unsigned int hash)
+{
+	pathidx_node *node;
+
+	if (pathidx_size == 0)
+		return NULL;
+
+	for (node = pathidx_table[hash & (pathidx_size - 1)];
+	     node; node = node->n_next)
+		if (node->n_hash == hash && node->n_pathlen == len &&
+		    memcmp(node->n_path, path, len) == 0)
+			return node;
+	return NULL;
+}
+
+/**
+ * pathidx_add - enter an nfs_export into the path index
+ * @exp: export to add
+ *
+ * Exports sharing a path are kept ordered by client type, and in
+ * order of addition within a type, mirroring a walk of exportlist[].
+ */
+void
+pathidx_add(nfs_export *exp)
+{
+	const char *path = exp->m_export.e_path;
+	unsigned int hash = fnv1a_str(path);
+	size_t len = strlen(path);
+	pathidx_node *node;
+	int type = exp->m_client->m_type;
+	int i;
+
+	node = pathidx_find(path, len, hash);
+	if (node == NULL) {
+		if (pathidx_count >= pathidx_size)
+			pathidx_grow();
+		node = xmalloc(sizeof(*node));
+		memset(node, 0, sizeof(*node));
+		node->n_path = xstrdup(path);
+		node->n_pathlen = len;
+		node->n_hash = hash;
+		node->n_next = pathidx_table[hash & (pathidx_size - 1)];
+		pathidx_table[hash & (pathidx_size - 1)] = node;
+		pathidx_count++;
+	}
+
+	if (node->n_count == node->n_max) {
+		node->n_max = node->n_max ? node->n_max << 1 : 2;
+		node->n_exports = xrealloc(node->n_exports,
+				node->n_max * sizeof(nfs_export *));
+	}
+	for (i = node->n_count; i > 0; i--) {
+		if (node->n_exports[i - 1]->m_client->m_type <= type)
+			break;
+		node->n_exports[i] = node->n_exports[i - 1];
+	}
+	node->n_exports[i] = exp;
+	node->n_count++;
+	if (exp->m_export.e_flags & NFSEXP_CROSSMOUNT)
+		node->n_crossmnt++;
+}
+
+/**
+ * pathidx_remove - take an nfs_export out of the path index
+ * @exp: export to remove, which must have been added
+ *
+ */
+void
+pathidx_remove(nfs_export *exp)
+{
+	const char *path = exp->m_export.e_path;
+	unsigned int hash = fnv1a_str(path);
+	pathidx_node *node, **np;
+	int i;
+
+	if (pathidx_size == 0)
+		return;
+	for (np = &pathidx_table[hash & (pathidx_size - 1)];
+	     (node = *np) != NULL; np = &node->n_next)
+		if (node->n_hash == hash && strcmp(node->n_path, path) == 0)
+			break;
+	if (node == NULL)
+		return;
+
+	for (i = 0; i < node->n_count; i++)
+		if (node->n_exports[i] == exp)
+			break;
+	if (i == node->n_count)
+		return;
+	node->n_count--;
+	memmove(&node->n_exports[i], &node->n_exports[i + 1],
+			(node->n_count - i) * sizeof(nfs_export *));
+	if (exp->m_export.e_flags & NFSEXP_CROSSMOUNT)
+		node->n_crossmnt--;
+
+	if (node->n_count == 0) {
+		*np = node->n_next;
+		xfree(node->n_exports);
+		xfree(node->n_path);
+		xfree(node);
+		pathidx_count--;
+	}
+}
+
+/**
+ * pathidx_lookup - find the index node for an exported path
+ * @path: '\0'-terminated ASCII string containing path to look for
+ *
+ * Returns a pointer to the node holding every export of @path, or
+ * NULL if @path is not exported to anyone.
+ */
+pathidx_node *
+pathidx_lookup(const char *path)
+{
+	return pathidx_find(path, strlen(path), fnv1a_str(path));
+}
+
+/**
+ * pathidx_walk - find index nodes for @path and all its exported ancestors
+ * @path: '\0'-terminated ASCII string containing an absolute path
+ * @nodes: array to fill in, ordered from "/" towards @path
+ * @max: number of entries in @nodes
+ *
+ * Returns the number of nodes stored in @nodes.  An array of
+ * PATHIDX_MAXDEPTH entries is always large enough.
+ */
+int
+pathidx_walk(const char *path, pathidx_node **nodes, const int max)
+{
+	unsigned int hash = FNV1A_OFFSET;
+	pathidx_node *node;
+	size_t i;
+	int n = 0;
+
+	if (path[0] != '/' || pathidx_count == 0)
+		return 0;
+
+	for (i = 0; path[i] != '\0' && i < NFS_MAXPATHLEN; i++) {
+		hash = fnv1a_add(hash, (unsigned char)path[i]);
+		if (i != 0 && path[i + 1] != '/' && path[i + 1] != '\0')
+			continue;
+		node = pathidx_find(path, i + 1, hash);
+		if (node == NULL)
+			continue;
+		if (n == max)
+			break;
+		nodes[n++] = node;
+	}
+	return n;
+}
+
+/**
+ * pathidx_freeall - release the path index
+ *
+ * The indexed nfs_export records themselves are not touched.
+ */
+void
+pathidx_freeall(void)
+{
+	pathidx_node *node, *next;
+	unsigned int i;
+
+	for (i = 0; i < pathidx_size; i++)
+		for (node = pathidx_table[i]; node; node = next) {
+			next = node->n_next;
+			xfree(node->n_exports);
+			xfree(node->n_path);
+			xfree(node);
+		}
+	xfree(pathidx_table);
+	pathidx_table = NULL;
+	pathidx_size = 0;
+	pathidx_count = 0;
+}
@@ -11,9 +11,13 @@
 #endif
 
 #include <sys/fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include "xmalloc.h"
 #include "nfslib.h"
 #include "exportfs.h"
@@ -22,7 +26,60 @@
 #include "v4root.h"
 
 int v4root_needed;
-static void cond_rename(char *newfile, char *oldfile);
+
+/*
+ * etab is only ever written by xtab_write(), so it is read from the
+ * snapshot written along with it if that is current, and otherwise
+ * with the single-pass exportmap parser.  Each client named in it is
+ * looked up once per read, however many exports it has.
+ */
+static int
+xtab_read_etab(char *xtab, char *lockfn)
+{
+	struct etabsnap		*snap;
+	struct exportmap	*map = NULL;
+	struct exportent	*xp;
+	nfs_export		*exp;
+	nfs_client		**clpp;
+	int			lockid;
+
+	if ((lockid = xflock(lockfn, "r")) < 0)
+		return 0;
+	v4root_needed = 1;
+	snap = etabsnap_open(xtab, _PATH_ETABSNAP);
+	if (snap == NULL)
+		map = exportmap_open(xtab);
+	for (;;) {
+		if (snap != NULL) {
+			if ((xp = etabsnap_next(snap)) == NULL)
+				break;
+			clpp = (nfs_client **)etabsnap_hostdata(snap);
+		} else {
+			if (map == NULL || (xp = exportmap_next(map)) == NULL)
+				break;
+			clpp = (nfs_client **)exportmap_hostdata(map);
+		}
+		if (*clpp == NULL) {
+			/* Try the client's name before asking DNS */
+			*clpp = client_find(xp->e_hostname);
+			if (*clpp == NULL)
+				*clpp = client_lookup(xp->e_hostname, 0);
+			if (*clpp == NULL)
+				continue;
+		}
+		if (!(exp = export_update(xp, *clpp)))
+			continue;
+		exp->m_xtabent = 1;
+		exp->m_mayexport = 1;
+		if ((xp->e_flags & NFSEXP_FSID) && xp->e_fsid == 0)
+			v4root_needed = 0;
+	}
+	etabsnap_close(snap);
+	exportmap_close(map);
+	xfunlock(lockid);
+
+	return 0;
+}
 
 static int
 xtab_read(char *xtab, char *lockfn, int is_export)
@@ -30,31 +87,27 @@ xtab_read(char *xtab, char *lockfn, int is_export)
     /* is_export == 0  => reading /proc/fs/nfs/exports - we know these things are exported to kernel
      * is_export == 1  => reading /var/lib/nfs/etab - these things are allowed to be exported
      * is_export == 2  => reading /var/lib/nfs/xtab - these things might be known to kernel
+     * is_export == 3  => reading /var/lib/nfs/etab into a table being reloaded
      */
 	struct exportent	*xp;
 	nfs_export		*exp;
 	int			lockid;
 
+	if (is_export == 1 || is_export == 3)
+		return xtab_read_etab(xtab, lockfn);
+
 	if ((lockid = xflock(lockfn, "r")) < 0)
 		return 0;
 	setexportent(xtab, "r");
-	if (is_export == 1)
-		v4root_needed = 1;
 	while ((xp = getexportent(is_export==0, 0)) != NULL) {
-		if (!(exp = export_lookup(xp->e_hostname, xp->e_path, is_export != 1)) &&
-		    !(exp = export_create(xp, is_export!=1))) {
+		if (!(exp = export_lookup(xp->e_hostname, xp->e_path, 1)) &&
+		    !(exp = export_create(xp, 1))) {
 			continue;
 		}
 		switch (is_export) {
 		case 0:
 			exp->m_exported = 1;
 			break;
-		case 1:
-			exp->m_xtabent = 1;
-			exp->m_mayexport = 1;
-			if ((xp->e_flags & NFSEXP_FSID) && xp->e_fsid == 0)
-				v4root_needed = 0;
-			break;
 		case 2:
 			exp->m_exported = -1;/* may be exported */
 			break;
@@ -88,24 +141,247 @@ xtab_export_read(void)
 	return xtab_read(_PATH_ETAB, _PATH_ETABLCK, 1);
 }
 
+/*
+ * Like xtab_export_read(), but for use between export_reload_begin()
+ * and export_reload_end(), so that unchanged exports are reused.
+ */
+int
+xtab_export_reload(void)
+{
+	return xtab_read(_PATH_ETAB, _PATH_ETABLCK, 3);
+}
+
+/*
+ * Does @xtab hold anything other than the @len bytes at @buf?
+ */
+static int
+xtab_changed(const char *xtab, const char *buf, const size_t len)
+{
+	struct stat stb;
+	char *old;
+	int fd, changed = 1;
+
+	fd = open(xtab, O_RDONLY);
+	if (fd < 0)
+		return 1;
+	if (fstat(fd, &stb) == 0 && (size_t)stb.st_size == len) {
+		if (len == 0)
+			changed = 0;
+		else {
+			old = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (old != MAP_FAILED) {
+				changed = memcmp(old, buf, len) != 0;
+				munmap(old, len);
+			}
+		}
+	}
+	close(fd);
+	return changed;
+}
+
+/*
+ * Replace @xtab with the @len bytes at @buf, which are first written
+ * in one go to @xtabtmp and flushed to disk, so that @xtab is always
+ * either the old table or the new one in full.
+ */
+static int
+xtab_replace(const char *xtab, const char *xtabtmp, const char *buf,
+		const size_t len)
+{
+	int fd;
+
+	fd = open(xtabtmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		xlog(L_ERROR, "can't open %s for writing: %m", xtabtmp);
+		return 0;
+	}
+	if ((size_t)atomicio((void *)write, fd, (void *)buf, len) != len ||
+	    fdatasync(fd) < 0) {
+		xlog(L_ERROR, "can't write %s: %m", xtabtmp);
+		close(fd);
+		unlink(xtabtmp);
+		return 0;
+	}
+	close(fd);
+	if (rename(xtabtmp, xtab) < 0) {
+		xlog(L_ERROR, "can't rename %s to %s: %m", xtabtmp, xtab);
+		unlink(xtabtmp);
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * etab.gen holds a counter that xtab_write() bumps each time it
+ * replaces etab, and that xtab_export_touch() bumps on request.
+ * mountd keeps the file mapped, so that it can tell whether etab has
+ * changed by looking at memory rather than with an open(2) and
+ * fstat(2) for every request.  etab may still be replaced
+ * some other way, e.g. by an older exportfs or by hand, and etab.gen
+ * may itself be removed, so both are also checked once a second.
+ */
+#define ETABGEN_RECHECK		1	/* seconds */
+
+struct etabgen {
+	uint64_t	eg_generation;
+	uint64_t	eg_touched;	/* by xtab_export_touch() */
+};
+
+/* If @stbp is not NULL, it is filled in with the status of etab.gen */
+static struct etabgen *
+etabgen_map(const int prot, struct stat *stbp)
+{
+	struct etabgen *eg;
+	struct stat stb;
+	int fd;
+
+	fd = open(_PATH_ETABGEN, O_RDWR | O_CREAT, 0644);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &stb) < 0 ||
+	    ((size_t)stb.st_size < sizeof(*eg) &&
+	     ftruncate(fd, sizeof(*eg)) < 0)) {
+		close(fd);
+		return NULL;
+	}
+	eg = mmap(NULL, sizeof(*eg), prot, MAP_SHARED, fd, 0);
+	close(fd);
+	if (eg == MAP_FAILED)
+		return NULL;
+	if (stbp != NULL)
+		*stbp = stb;
+	return eg;
+}
+
+/* Caller holds the etab lock. */
+static void
+etabgen_bump(const int touch)
+{
+	struct etabgen *eg;
+
+	eg = etabgen_map(PROT_READ | PROT_WRITE, NULL);
+	if (eg == NULL) {
+		xlog(L_WARNING, "can't update %s: %m", _PATH_ETABGEN);
+		return;
+	}
+	if (touch)
+		__atomic_store_n(&eg->eg_touched,
+			__atomic_load_n(&eg->eg_touched, __ATOMIC_RELAXED) + 1,
+			__ATOMIC_RELAXED);
+	__atomic_store_n(&eg->eg_generation,
+			__atomic_load_n(&eg->eg_generation, __ATOMIC_RELAXED) + 1,
+			__ATOMIC_RELEASE);
+	munmap(eg, sizeof(*eg));
+}
+
+/**
+ * xtab_export_touch - ask mountd to read etab again
+ *
+ * etab.gen is bumped even if etab has not changed, e.g. because
+ * "exportfs -r" found nothing new, so that mountd recomputes what it
+ * knows of the clients that DNS and netgroups name.
+ */
+void
+xtab_export_touch(void)
+{
+	int lockid;
+
+	if ((lockid = xflock(_PATH_ETABLCK, "w")) < 0) {
+		xlog(L_ERROR, "can't lock %s for writing", _PATH_ETAB);
+		return;
+	}
+	etabgen_bump(1);
+	xfunlock(lockid);
+}
+
+/**
+ * xtab_export_changed - might etab have changed since the last call?
+ *
+ * Returns XTAB_BUMPED on the first call, and whenever etab.gen has
+ * been bumped since then, in which case the caller should read etab
+ * again.  XTAB_TOUCHED is returned instead if xtab_export_touch() did
+ * that, and answers that depend on DNS or netgroups should then be
+ * recomputed as well.  Otherwise, returns XTAB_MAYBE at most every
+ * ETABGEN_RECHECK seconds, in which case the caller should check
+ * whether etab is a new file and if so read it again, and 0 between
+ * those checks, which make no system calls.  If etab.gen can't be
+ * mapped, XTAB_BUMPED is always returned.
+ */
+int
+xtab_export_changed(void)
+{
+	static struct etabgen *eg;
+	static struct stat eg_stat;
+	static uint64_t seen, touched;
+	static time_t checked;
+	struct stat stb;
+	time_t now;
+	uint64_t gen;
+
+	now = time(NULL);
+	if (eg != NULL) {
+		gen = __atomic_load_n(&eg->eg_generation, __ATOMIC_ACQUIRE);
+		if (gen != seen) {
+			seen = gen;
+			gen = __atomic_load_n(&eg->eg_touched,
+						__ATOMIC_RELAXED);
+			if (gen == touched)
+				return XTAB_BUMPED;
+			touched = gen;
+			return XTAB_TOUCHED;
+		}
+		if (now >= checked && now - checked < ETABGEN_RECHECK)
+			return 0;
+		checked = now;
+
+		/* a new etab.gen is of no use while the old one is mapped */
+		if (stat(_PATH_ETABGEN, &stb) == 0 &&
+		    stb.st_ino == eg_stat.st_ino &&
+		    stb.st_dev == eg_stat.st_dev)
+			return XTAB_MAYBE;
+		munmap(eg, sizeof(*eg));
+	}
+
+	checked = now;
+	eg = etabgen_map(PROT_READ, &eg_stat);
+	if (eg == NULL)
+		return XTAB_BUMPED;
+	seen = __atomic_load_n(&eg->eg_generation, __ATOMIC_ACQUIRE);
+	touched = __atomic_load_n(&eg->eg_touched, __ATOMIC_RELAXED);
+	return XTAB_BUMPED;
+}
+
 /*
  * mountd now keeps an open fd for the etab at all times to make sure that the
  * inode number changes when the xtab_export_write is done. If you change the
  * routine below such that the files are edited in place, then you'll need to
  * fix the auth_reload logic as well...
+ *
+ * The new table is built in memory, and the file is left alone if it
+ * already holds exactly that, so that mountd does not reload for
+ * nothing.
  */
 static int
 xtab_write(char *xtab, char *xtabtmp, char *lockfn, int is_export)
 {
 	struct exportent	xe;
+	struct etabsnap		*snap;
 	nfs_export		*exp;
-	int			lockid, i;
+	char			*buf = NULL;
+	size_t			len = 0;
+	FILE			*fp;
+	int			lockid, i, ret = 1;
 
 	if ((lockid = xflock(lockfn, "w")) < 0) {
 		xlog(L_ERROR, "can't lock %s for writing", xtab);
 		return 0;
 	}
-	setexportent(xtabtmp, "w");
+	fp = open_memstream(&buf, &len);
+	if (fp == NULL) {
+		xlog(L_ERROR, "can't write %s: %m", xtab);
+		xfunlock(lockid);
+		return 0;
+	}
 
 	for (i = 0; i < MCL_MAXTYPES; i++) {
 		for (exp = exportlist[i].p_head; exp; exp = exp->m_next) {
@@ -117,16 +393,31 @@ xtab_write(char *xtab, char *xtabtmp, char *lockfn, int is_export)
 			/* write out the export entry using the FQDN */
 			xe = exp->m_export;
 			xe.e_hostname = exp->m_client->m_hostname;
-			putexportent(&xe);
+			fputexportent(fp, &xe);
 		}
 	}
-	endexportent();
-
-	cond_rename(xtabtmp, xtab);
+	if (fclose(fp) != 0) {
+		xlog(L_ERROR, "can't write %s: %m", xtab);
+		ret = 0;
+	} else if (xtab_changed(xtab, buf, len)) {
+		ret = xtab_replace(xtab, xtabtmp, buf, len);
+		if (ret && is_export) {
+			etabsnap_write(xtab, _PATH_ETABSNAP, _PATH_ETABSNAPTMP);
+			etabgen_bump(0);
+		}
+	} else if (is_export) {
+		/* etab is as it was; make sure its snapshot is too */
+		snap = etabsnap_open(xtab, _PATH_ETABSNAP);
+		if (snap == NULL)
+			etabsnap_write(xtab, _PATH_ETABSNAP,
+					_PATH_ETABSNAPTMP);
+		etabsnap_close(snap);
+	}
+	free(buf);
 
 	xfunlock(lockid);
 
-	return 1;
+	return ret;
 }
 
 int
@@ -157,47 +448,3 @@ xtab_append(nfs_export *exp)
 	xfunlock(lockid);
 	exp->m_xtabent = 1;
 }
-
-/*
- * rename newfile onto oldfile unless
- * they are identical
- */
-static void cond_rename(char *newfile, char *oldfile)
-{
-	int nfd, ofd;
-	char nbuf[4096], obuf[4096];
-	int ncnt, ocnt;
-
-	nfd = open(newfile, 0);
-	if (nfd < 0)
-		return;
-	ofd = open(oldfile, 0);
-	if (ofd < 0) {
-		close(nfd);
-		rename(newfile, oldfile);
-		return;
-	}
-
-	do {
-		ncnt = read(nfd, nbuf, sizeof(nbuf));
-		if (ncnt < 0)
-			break;
-		ocnt = read(ofd, obuf, sizeof(obuf));
-		if (ocnt < 0)
-			break;
-		if (ncnt != ocnt)
-			break;
-		if (ncnt == 0) {
-			close(nfd);
-			close(ofd);
-			unlink(newfile);
-			return;
-		}
-	} while (memcmp(obuf, nbuf, ncnt) == 0);
-
-	/* some mis-match */
-	close(nfd);
-	close(ofd);
-	rename(newfile, oldfile);
-	return;
-}
@@ -37,9 +37,10 @@ typedef struct mclient {
 	char *			m_hostname;
 	int			m_type;
 	int			m_naddr;
-	union nfs_sockaddr	m_addrlist[NFSCLNT_ADDRMAX];
+	union nfs_sockaddr *	m_addrlist;	/* shared; see client.c */
 	int			m_exported;	/* exported to nfsd */
 	int			m_count;
+	time_t			m_resolved;	/* FQDN: when looked up */
 } nfs_client;
 
 static inline const struct sockaddr *
@@ -95,28 +96,79 @@ typedef struct mexport {
 	int			m_xtabent  : 1,	/* xtab entry exists */
 				m_mayexport: 1,	/* derived from xtabbed */
 				m_changed  : 1, /* options (may) have changed */
-				m_warned   : 1; /* warned about multiple exports
+				m_warned   : 1, /* warned about multiple exports
 						 * matching one client */
+				m_stale    : 1, /* not seen again by a reload */
+				m_added    : 1; /* created by the last reload */
 } nfs_export;
 
-#define HASH_TABLE_SIZE 1021
-#define DEFAULT_TTL	(30 * 60)
+/* What the last reload of the export table did; see export_reload_end() */
+struct export_delta {
+	unsigned int		ed_added;
+	unsigned int		ed_changed;	/* options replaced */
+	unsigned int		ed_removed;
+	unsigned int		ed_kept;	/* reused unchanged */
+	char **			ed_paths;	/* of the exports above */
+	unsigned int		ed_npaths;
+	time_t			ed_started;	/* by export_reload_begin() */
+};
 
-typedef struct _exp_hash_entry {
-	nfs_export * p_first;
-  	nfs_export * p_last;
-} exp_hash_entry;
+#define DEFAULT_TTL	(30 * 60)
 
+/*
+ * The exports to one type of client.  The exports of each path are
+ * kept next to each other on p_head, and are found through the path
+ * index rather than by walking it.
+ */
 typedef struct _exp_hash_table {
-	nfs_export * p_head;
-	exp_hash_entry entries[HASH_TABLE_SIZE];
+	nfs_export *	p_head;
 } exp_hash_table;
 
 extern exp_hash_table exportlist[MCL_MAXTYPES];
 
 extern nfs_client *		clientlist[MCL_MAXTYPES];
 
+/*
+ * The subnetwork clients matching an address, found in one walk of
+ * the subnet tree; see client_match_init()
+ */
+typedef struct _client_match {
+	const struct addrinfo *	cm_ai;
+	unsigned int		cm_count;
+	unsigned int		cm_max;
+	const nfs_client **	cm_subnets;
+} client_match;
+
+/*
+ * Path index over the exports in exportlist[]; see pathidx.c
+ */
+typedef struct _pathidx_node {
+	struct _pathidx_node *	n_next;
+	char *			n_path;
+	size_t			n_pathlen;
+	unsigned int		n_hash;
+	int			n_crossmnt;	/* # of crossmnt exports */
+	int			n_count;
+	int			n_max;
+	nfs_export **		n_exports;	/* sorted by client type */
+} pathidx_node;
+
+/* Upper bound on the number of exported prefixes of one path */
+#define PATHIDX_MAXDEPTH	(NFS_MAXPATHLEN / 2 + 1)
+
+void				pathidx_add(nfs_export *exp);
+void				pathidx_remove(nfs_export *exp);
+pathidx_node *			pathidx_lookup(const char *path);
+int				pathidx_walk(const char *path,
+						pathidx_node **nodes,
+						const int max);
+void				pathidx_freeall(void);
+
 nfs_client *			client_lookup(char *hname, int canonical);
+nfs_client *			client_find(char *hname);
+void				client_resolved(const char *hname,
+						struct addrinfo *ai);
+void				client_resolved_flush(void);
 nfs_client *			client_dup(const nfs_client *clp,
 						const struct addrinfo *ai);
 int				client_gettype(char *hname);
@@ -124,12 +176,22 @@ int				client_check(const nfs_client *clp,
 						const struct addrinfo *ai);
 void				client_release(nfs_client *);
 void				client_freeall(void);
+void				client_sweep(const time_t since);
+void				client_memstat(void);
 char *				client_compose(const struct addrinfo *ai);
+void				client_match_init(client_match *cm,
+						const struct addrinfo *ai);
+int				client_match_check(const client_match *cm,
+						const nfs_client *clp);
+void				client_match_release(client_match *cm);
+void				client_netgroup_expand(int interval);
+void				client_netgroup_reload(int expire);
 struct addrinfo *		client_resolve(const struct sockaddr *sap);
 int 				client_member(const char *client,
 						const char *name);
 
 void				export_read(char *fname);
+void				export_read_entry(struct exportent *eep);
 void				export_reset(nfs_export *);
 nfs_export *			export_lookup(char *hname, char *path, int caconical);
 nfs_export *			export_find(const struct addrinfo *ai,
@@ -138,15 +200,39 @@ nfs_export *			export_allowed(const struct addrinfo *ai,
 						const char *path);
 nfs_export *			export_create(struct exportent *, int canonical);
 void				export_freeall(void);
+void				export_reload_begin(struct export_delta *delta);
+nfs_export *			export_update(struct exportent *xep,
+						nfs_client *clp);
+void				export_reload_prune(struct export_delta *delta);
+void				export_reload_end(struct export_delta *delta);
+void				export_delta_release(struct export_delta *delta);
 int				export_export(nfs_export *);
 int				export_unexport(nfs_export *);
 
+/* Returned by xtab_export_changed() */
+#define XTAB_MAYBE	1	/* etab may have been replaced */
+#define XTAB_BUMPED	2	/* etab.gen has been bumped */
+#define XTAB_TOUCHED	3	/* ...by xtab_export_touch() */
+
 int				xtab_mount_read(void);
 int				xtab_export_read(void);
+int				xtab_export_reload(void);
+int				xtab_export_changed(void);
+void				xtab_export_touch(void);
 int				xtab_mount_write(void);
 int				xtab_export_write(void);
 void				xtab_append(nfs_export *);
 
+struct etabsnap;
+int				etabsnap_write(const char *etab,
+						const char *snap,
+						const char *snaptmp);
+struct etabsnap *		etabsnap_open(const char *etab,
+						const char *snap);
+struct exportent *		etabsnap_next(struct etabsnap *sn);
+void **				etabsnap_hostdata(struct etabsnap *sn);
+void				etabsnap_close(struct etabsnap *sn);
+
 int				secinfo_addflavor(struct flav_info *, struct exportent *);
 
 char *				host_ntop(const struct sockaddr *sap,
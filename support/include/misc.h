@@ -7,6 +7,8 @@
 #ifndef MISC_H
 #define MISC_H
 
+#include <sys/types.h>
+
 /*
  * Generate random key, returning the length of the result. Currently,
  * weakrandomkey generates a maximum of 20 bytes are generated, but this
@@ -17,6 +19,40 @@ int	weakrandomkey(unsigned char *keyout, int len);
 
 extern int is_mountpoint(char *path);
 
+/*
+ * FNV-1a hashing, for the in-memory lookup tables.  The hash can be
+ * extended one byte at a time, so the hashes of successive prefixes
+ * of a string come for free.
+ */
+#define FNV1A_OFFSET	2166136261U
+#define FNV1A_PRIME	16777619U
+
+static inline unsigned int
+fnv1a_add(unsigned int hash, const unsigned char c)
+{
+	return (hash ^ c) * FNV1A_PRIME;
+}
+
+static inline unsigned int
+fnv1a_buf(unsigned int hash, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+
+	while (len--)
+		hash = fnv1a_add(hash, *p++);
+	return hash;
+}
+
+static inline unsigned int
+fnv1a_str(const char *str)
+{
+	unsigned int hash = FNV1A_OFFSET;
+
+	while (*str != '\0')
+		hash = fnv1a_add(hash, (unsigned char)*str++);
+	return hash;
+}
+
 /* size of the file pointer buffers for rpc procfs files */
 #define RPC_CHAN_BUF_SIZE 32768
 
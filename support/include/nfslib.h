@@ -49,6 +49,15 @@
 #ifndef _PATH_ETABTMP
 #define _PATH_ETABTMP		NFS_STATEDIR "/etab.tmp"
 #endif
+#ifndef _PATH_ETABSNAP
+#define _PATH_ETABSNAP		NFS_STATEDIR "/etab.bin"
+#endif
+#ifndef _PATH_ETABSNAPTMP
+#define _PATH_ETABSNAPTMP	NFS_STATEDIR "/etab.bin.tmp"
+#endif
+#ifndef _PATH_ETABGEN
+#define _PATH_ETABGEN		NFS_STATEDIR "/etab.gen"
+#endif
 #ifndef _PATH_ETABLCK
 #define _PATH_ETABLCK		NFS_STATEDIR "/.etab.lock"
 #endif
@@ -61,6 +70,9 @@
 #ifndef _PATH_RMTABLCK
 #define _PATH_RMTABLCK		NFS_STATEDIR "/.rmtab.lock"
 #endif
+#ifndef _PATH_RMTABJOURNAL
+#define _PATH_RMTABJOURNAL	_PATH_RMTAB ".journal"
+#endif
 #ifndef _PATH_PROC_EXPORTS
 #define	_PATH_PROC_EXPORTS	"/proc/fs/nfs/exports"
 #define	_PATH_PROC_EXPORTS_ALT	"/proc/fs/nfsd/exports"
@@ -111,12 +123,21 @@ void			setexportent(char *fname, char *type);
 struct exportent *	getexportent(int,int);
 void 			secinfo_show(FILE *fp, struct exportent *ep);
 void			putexportent(struct exportent *xep);
+void			fputexportent(FILE *fp, struct exportent *xep);
 void			endexportent(void);
 struct exportent *	mkexportent(char *hname, char *path, char *opts);
 void			dupexportent(struct exportent *dst,
 					struct exportent *src);
+int			sameexportent(const struct exportent *a,
+					const struct exportent *b);
 int			updateexportent(struct exportent *eep, char *options);
 
+struct exportmap;
+struct exportmap *	exportmap_open(const char *fname);
+struct exportent *	exportmap_next(struct exportmap *map);
+void **			exportmap_hostdata(struct exportmap *map);
+void			exportmap_close(struct exportmap *map);
+
 int			setrmtabent(char *type);
 struct rmtabent *	getrmtabent(int log, long *pos);
 void			putrmtabent(struct rmtabent *xep, long *pos);
@@ -156,6 +177,10 @@ int readline(int fd, char **buf, int *lenp);
 int qword_get(char **bpp, char *dest, int bufsize);
 int qword_get_int(char **bpp, int *anint);
 void cache_flush(int force);
+typedef void (*cache_entry_fn_t)(char *domain, char *path, void *data);
+int cache_export_entries(char **paths, const int count,
+		cache_entry_fn_t fn, void *data);
+int cache_expire_paths(char **paths, const int count);
 int check_new_cache(void);
 void qword_add(char **bpp, int *lp, char *str);
 void qword_addhex(char **bpp, int *lp, char *buf, int blen);
@@ -64,6 +64,9 @@ extern void	nsm_delete_notified_host(const char *hostname,
 			const char *mon_name, const char *my_name);
 extern size_t	nsm_priv_to_hex(const char *priv, char *buf,
 				const size_t buflen);
+extern _Bool	nsm_use_journal(const _Bool enable,
+				const unsigned int commit_ms);
+extern int	nsm_sync_records(void);
 
 /* rpc.c */
 
@@ -84,10 +87,52 @@ extern uint32_t nsm_xmit_notify(const int sock, const struct sockaddr *sap,
 extern uint32_t nsm_xmit_nlmcall(const int sock, const struct sockaddr *sap,
 			const socklen_t salen, const struct mon *m,
 			const int state);
+extern void	nsm_batch_begin(const int sock);
+extern unsigned int
+		nsm_batch_flush(void);
 extern uint32_t nsm_parse_reply(XDR *xdrs);
 extern unsigned long
 		nsm_recv_getport(XDR *xdrs);
 extern uint16_t nsm_recv_getaddr(XDR *xdrs);
 extern uint16_t nsm_recv_rpcbind(const sa_family_t family, XDR *xdrs);
 
+/* sched.c */
+
+struct nsm_timer {
+	time_t			nt_when;	/* when this is due */
+	long			nt_prio;	/* ties: higher goes first */
+	unsigned long		nt_seq;
+	unsigned int		nt_slot;	/* zero while idle */
+	void *			nt_data;
+};
+
+struct nsm_timers {
+	struct nsm_timer **	ts_heap;
+	unsigned int		ts_count;
+	unsigned int		ts_size;
+	unsigned long		ts_seq;
+};
+
+struct nsm_xid {
+	struct nsm_xid *	nx_next;
+	uint32_t		nx_xid;		/* zero while idle */
+	void *			nx_data;
+};
+
+struct nsm_xids {
+	struct nsm_xid **	xs_table;
+	unsigned int		xs_count;
+	unsigned int		xs_size;
+};
+
+extern _Bool	nsm_timer_set(struct nsm_timers *ts, struct nsm_timer *t,
+			const time_t when);
+extern void	nsm_timer_cancel(struct nsm_timers *ts, struct nsm_timer *t);
+extern struct nsm_timer *
+		nsm_timer_first(const struct nsm_timers *ts);
+extern void	nsm_xid_set(struct nsm_xids *xs, struct nsm_xid *x,
+			const uint32_t xid);
+extern struct nsm_xid *
+		nsm_xid_find(const struct nsm_xids *xs, const uint32_t xid);
+
 #endif	/* !NFS_UTILS_SUPPORT_NSM_H */
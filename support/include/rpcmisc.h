@@ -55,6 +55,13 @@ void		rpc_dispatch(struct svc_req *rq, SVCXPRT *xprt,
 				void *argp, void *resp);
 int		getservport(u_long number, const char *proto);
 
+typedef void	(*nfs_svc_loop_fn_t)(int fd, void *data);
+
+int		nfs_svc_loop_add(const int fd, nfs_svc_loop_fn_t fn,
+				void *data);
+void		nfs_svc_loop_del(const int fd);
+int		nfs_svc_loop_wait(const int timeout);
+
 extern int	_rpcpmstart;
 extern int	_rpcfdtype;
 extern int	_rpcsvcdirty;
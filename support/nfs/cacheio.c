@@ -18,6 +18,9 @@
 #include <nfslib.h>
 #include <stdio.h>
 #include <stdio_ext.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
 #include <ctype.h>
 #include <unistd.h>
 #include <sys/types.h>
@@ -120,9 +123,15 @@ void qword_addeol(char **bpp, int *lp)
 	(*lp)--;
 }
 
-static char qword_buf[8192];
+/*
+ * The formatting buffer lives on the stack so that threads may
+ * write to different cache channels at the same time.
+ */
+#define QWORD_BUFSIZE	8192
+
 void qword_print(FILE *f, char *str)
 {
+	char qword_buf[QWORD_BUFSIZE];
 	char *bp = qword_buf;
 	int len = sizeof(qword_buf);
 	qword_add(&bp, &len, str);
@@ -134,6 +143,7 @@ void qword_print(FILE *f, char *str)
 
 void qword_printhex(FILE *f, char *str, int slen)
 {
+	char qword_buf[QWORD_BUFSIZE];
 	char *bp = qword_buf;
 	int len = sizeof(qword_buf);
 	qword_addhex(&bp, &len, str, slen);
@@ -357,3 +367,264 @@ cache_flush(int force)
 		}
 	}
 }
+
+/*
+ * Targeted flushing.  Rather than flush a whole cache, an entry can be
+ * invalidated by writing a downcall for its key with an expiry time
+ * that has already passed; the next use of the entry makes an upcall.
+ * The entries are found in the cache's "content" file, where invalid
+ * and negative entries are listed with a leading "# ".
+ */
+
+/*
+ * Is @path at or below one of @paths?  Parents of @paths count too,
+ * as the pseudo-root exports above a changed export may change.
+ */
+static int
+cache_path_affected(const char *path, char **paths, const int count)
+{
+	size_t plen = strlen(path), len;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		len = strlen(paths[i]);
+		if (len > plen) {
+			if (strncmp(paths[i], path, plen) == 0 &&
+			    (paths[i][plen] == '/' || plen == 1))
+				return 1;
+		} else if (strncmp(path, paths[i], len) == 0 &&
+			   (path[len] == '\0' || path[len] == '/' || len == 1))
+			return 1;
+	}
+	return 0;
+}
+
+/* Return the next entry from a content file, or NULL at the end */
+static char *
+cache_content_next(FILE *f, char **buf, size_t *buflen)
+{
+	ssize_t n;
+	char *line;
+
+	while ((n = getline(buf, buflen, f)) > 0) {
+		line = *buf;
+		if (line[n - 1] == '\n')
+			line[n - 1] = '\0';
+		if (line[0] != '#')
+			return line;
+		if (line[1] != ' ')
+			continue;	/* column headings */
+		line += 2;
+		if (strncmp(line, "expiry=", 7) == 0)
+			continue;	/* debugging information */
+		return line;
+	}
+	return NULL;
+}
+
+/**
+ * cache_export_entries - find the kernel's nfsd.export entries for some paths
+ * @paths: array of export paths
+ * @count: number of items in @paths
+ * @fn: called with the domain and path of each entry found
+ * @data: passed to @fn
+ *
+ * Entries for paths at, below, or above one of @paths are passed to
+ * @fn, which must not keep the strings it is handed.  Returns the
+ * number of entries found, or -1 if the cache could not be read.
+ */
+int
+cache_export_entries(char **paths, const int count,
+		cache_entry_fn_t fn, void *data)
+{
+	char *buf = NULL, *line, *cp, *domain, *path;
+	size_t buflen = 0;
+	int found = 0;
+	FILE *f;
+
+	f = fopen("/proc/net/rpc/nfsd.export/content", "r");
+	if (f == NULL)
+		return -1;
+
+	/* path <tab> domain(flags) */
+	while ((line = cache_content_next(f, &buf, &buflen)) != NULL) {
+		path = line;
+		domain = strchr(line, '\t');
+		if (domain == NULL)
+			continue;
+		*domain++ = '\0';
+		cp = strchr(domain, '(');
+		if (cp == NULL)
+			continue;
+		*cp = '\0';
+
+		/* Both fields only get shorter, so unescape them in place */
+		cp = path;
+		if (qword_get(&cp, path, strlen(path) + 1) <= 0)
+			continue;
+		cp = domain;
+		if (qword_get(&cp, domain, strlen(domain) + 1) <= 0)
+			continue;
+
+		if (!cache_path_affected(path, paths, count))
+			continue;
+		fn(domain, path, data);
+		found++;
+	}
+
+	free(buf);
+	fclose(f);
+	return found;
+}
+
+struct cache_expiry {
+	int		ce_fd;
+	int		ce_count;
+	int		ce_err;
+	unsigned int	ce_expiry;
+};
+
+/* Each downcall must reach the kernel in a write of its own */
+static void
+cache_expiry_write(struct cache_expiry *ce, char *buf, const int len)
+{
+	if (len < 0 || ce->ce_err)
+		ce->ce_err = 1;
+	else if (write(ce->ce_fd, buf, len) != len)
+		ce->ce_err = 1;
+	else
+		ce->ce_count++;
+}
+
+static void
+cache_expire_export(char *domain, char *path, void *data)
+{
+	struct cache_expiry *ce = data;
+	char buf[QWORD_BUFSIZE];
+	char *bp = buf;
+	int len = sizeof(buf);
+
+	qword_add(&bp, &len, domain);
+	qword_add(&bp, &len, path);
+	qword_adduint(&bp, &len, ce->ce_expiry);
+	qword_addeol(&bp, &len);
+	cache_expiry_write(ce, buf, len > 0 ? bp - buf : -1);
+}
+
+/* Turn the 0x%08x... words of an nfsd.fh entry back into the fsid */
+static int
+cache_parse_fsid(const char *hex, char *fsid, const int size)
+{
+	uint32_t word;
+	char tmp[9];
+	int len = 0;
+
+	if (strncmp(hex, "0x", 2) != 0)
+		return -1;
+	for (hex += 2; *hex; hex += 8) {
+		if (strlen(hex) < 8 || len + 4 > size)
+			return -1;
+		memcpy(tmp, hex, 8);
+		tmp[8] = '\0';
+		word = strtoul(tmp, NULL, 16);
+		memcpy(fsid + len, &word, 4);
+		len += 4;
+	}
+	return len;
+}
+
+/*
+ * nfsd.fh entries read "domain fsidtype 0xfsid path".  Negative
+ * entries have no path, and are all expired, as any of them might be
+ * for one of the new exports.
+ */
+static void
+cache_expire_fh(char **paths, const int count, struct cache_expiry *ce)
+{
+	char *line, *cp, *domain, *type, *hex, *path, *lbuf = NULL;
+	char buf[QWORD_BUFSIZE], fsid[32];
+	size_t lbuflen = 0;
+	int len, fsidlen;
+	char *bp;
+	FILE *f;
+
+	f = fopen("/proc/net/rpc/nfsd.fh/content", "r");
+	if (f == NULL) {
+		ce->ce_err = 1;
+		return;
+	}
+
+	while ((line = cache_content_next(f, &lbuf, &lbuflen)) != NULL) {
+		domain = strtok_r(line, " ", &cp);
+		type = strtok_r(NULL, " ", &cp);
+		hex = strtok_r(NULL, " ", &cp);
+		if (domain == NULL || type == NULL || hex == NULL)
+			continue;
+		path = cp;
+		if (*path != '\0') {
+			if (qword_get(&cp, path, strlen(path) + 1) <= 0)
+				continue;
+			if (!cache_path_affected(path, paths, count))
+				continue;
+		}
+		fsidlen = cache_parse_fsid(hex, fsid, sizeof(fsid));
+		if (fsidlen <= 0)
+			continue;
+
+		bp = buf;
+		len = sizeof(buf);
+		qword_add(&bp, &len, domain);
+		qword_addint(&bp, &len, atoi(type));
+		qword_addhex(&bp, &len, fsid, fsidlen);
+		qword_adduint(&bp, &len, ce->ce_expiry);
+		qword_addeol(&bp, &len);
+		cache_expiry_write(ce, buf, len > 0 ? bp - buf : -1);
+	}
+
+	free(lbuf);
+	fclose(f);
+}
+
+/**
+ * cache_expire_paths - flush only the kernel cache entries for some exports
+ * @paths: array of paths whose exports have changed
+ * @count: number of items in @paths
+ *
+ * Expires the nfsd.fh and nfsd.export entries that depend on the
+ * exports of @paths, leaving the rest of the caches alone.  Each
+ * cache channel is opened once for the whole batch.  Entries for
+ * auth.unix.ip are not touched, so the set of client names in the
+ * export table must be unchanged.
+ *
+ * Returns the number of entries expired, or -1 if the caches could
+ * not be read or written; cache_flush() should then be used instead.
+ */
+int
+cache_expire_paths(char **paths, const int count)
+{
+	struct cache_expiry ce = {
+		.ce_expiry	= time(NULL) - 1,
+	};
+
+	if (count == 0)
+		return 0;
+
+	/* In the same order as cache_flush(), and for the same reason */
+	ce.ce_fd = open("/proc/net/rpc/nfsd.fh/channel", O_WRONLY);
+	if (ce.ce_fd < 0)
+		return -1;
+	cache_expire_fh(paths, count, &ce);
+	close(ce.ce_fd);
+	if (ce.ce_err)
+		return -1;
+
+	ce.ce_fd = open("/proc/net/rpc/nfsd.export/channel", O_WRONLY);
+	if (ce.ce_fd < 0)
+		return -1;
+	if (cache_export_entries(paths, count, cache_expire_export, &ce) < 0)
+		ce.ce_err = 1;
+	close(ce.ce_fd);
+	if (ce.ce_err)
+		return -1;
+	return ce.ce_count;
+}
@@ -19,6 +19,9 @@
 #endif
 
 #include <sys/param.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
@@ -31,6 +34,7 @@
 #include "xlog.h"
 #include "xio.h"
 #include "pseudoflavors.h"
+#include "misc.h"
 
 #define EXPORT_DEFAULT_FLAGS	\
   (NFSEXP_READONLY|NFSEXP_ROOTSQUASH|NFSEXP_GATHERED_WRITES|NFSEXP_NOSUBTREECHECK)
@@ -55,8 +59,46 @@ const int flav_map_size = sizeof(flav_map)/sizeof(flav_map[0]);
 
 int export_errno;
 
+/*
+ * A file of exports being read by exportmap_next().  Strings that
+ * many exports share are interned, in chunks that are freed along
+ * with the map.
+ */
+#define EXPORTMAP_CHUNK		16384
+#define EXPORTMAP_INITSIZE	64	/* interned strings; a power of two */
+
+struct exportmap_str {
+	struct exportmap_str *	es_next;
+	unsigned int		es_hash;
+	void *			es_data;	/* see exportmap_hostdata() */
+	char			es_str[];
+};
+
+struct exportmap_chunk {
+	struct exportmap_chunk *ec_next;
+	size_t			ec_used;
+	char			ec_buf[];
+};
+
+struct exportmap {
+	char *			em_fname;
+	int			em_line;
+	char *			em_data;	/* the mapped file */
+	size_t			em_size;
+	size_t			em_pos;
+	struct exportent	em_ee;
+	struct exportmap_str *	em_host;	/* of em_ee */
+	char *			em_opts;	/* options of the current line */
+	size_t			em_optsize;
+	struct exportmap_chunk *em_chunks;
+	struct exportmap_str **	em_strs;
+	unsigned int		em_nstrs;
+	unsigned int		em_size_strs;
+};
+
 static char	*efname = NULL;
 static XFILE	*efp = NULL;
+static struct exportmap *emap;		/* being parsed */
 static int	first;
 static int	has_default_opts, has_default_subtree_opts;
 static int	*squids = NULL, nsquids = 0,
@@ -98,6 +140,7 @@ static void init_exportent (struct exportent *ee, int fromkernel)
 	}
 	ee->e_anonuid = 65534;
 	ee->e_anongid = 65534;
+	ee->e_fsid = 0;
 	ee->e_squids = NULL;
 	ee->e_sqgids = NULL;
 	ee->e_mountpoint = NULL;
@@ -202,6 +245,291 @@ getexportent(int fromkernel, int fromexports)
 	return &ee;
 }
 
+static void *
+exportmap_alloc(struct exportmap *map, size_t len)
+{
+	struct exportmap_chunk *ec = map->em_chunks;
+	size_t size;
+	void *p;
+
+	len = (len + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+	if (ec == NULL || ec->ec_used + len > EXPORTMAP_CHUNK) {
+		size = len > EXPORTMAP_CHUNK ? len : EXPORTMAP_CHUNK;
+		ec = xmalloc(sizeof(*ec) + size);
+		ec->ec_next = map->em_chunks;
+		ec->ec_used = 0;
+		map->em_chunks = ec;
+	}
+	p = ec->ec_buf + ec->ec_used;
+	ec->ec_used += len;
+	return p;
+}
+
+static void
+exportmap_grow(struct exportmap *map)
+{
+	unsigned int size = map->em_size_strs ? map->em_size_strs << 1 :
+						EXPORTMAP_INITSIZE;
+	struct exportmap_str **strs, *es, *next;
+	unsigned int i;
+
+	strs = xmalloc(size * sizeof(*strs));
+	memset(strs, 0, size * sizeof(*strs));
+	for (i = 0; i < map->em_size_strs; i++)
+		for (es = map->em_strs[i]; es; es = next) {
+			next = es->es_next;
+			es->es_next = strs[es->es_hash & (size - 1)];
+			strs[es->es_hash & (size - 1)] = es;
+		}
+	xfree(map->em_strs);
+	map->em_strs = strs;
+	map->em_size_strs = size;
+}
+
+/* Return the interned copy of the @len bytes at @str */
+static struct exportmap_str *
+exportmap_intern(struct exportmap *map, const char *str, size_t len)
+{
+	unsigned int hash = fnv1a_buf(FNV1A_OFFSET, str, len);
+	struct exportmap_str *es, **head;
+
+	if (map->em_nstrs >= map->em_size_strs)
+		exportmap_grow(map);
+	head = &map->em_strs[hash & (map->em_size_strs - 1)];
+	for (es = *head; es; es = es->es_next)
+		if (es->es_hash == hash && strncmp(es->es_str, str, len) == 0 &&
+		    es->es_str[len] == '\0')
+			return es;
+
+	es = exportmap_alloc(map, sizeof(*es) + len + 1);
+	es->es_hash = hash;
+	es->es_data = NULL;
+	memcpy(es->es_str, str, len);
+	es->es_str[len] = '\0';
+	es->es_next = *head;
+	*head = es;
+	map->em_nstrs++;
+	return es;
+}
+
+/* Replace a string parseopts() allocated with an interned one */
+static char *
+exportmap_intern_opt(struct exportmap *map, char *str)
+{
+	char *es;
+
+	if (str == NULL)
+		return NULL;
+	es = exportmap_intern(map, str, strlen(str))->es_str;
+	free(str);
+	return es;
+}
+
+/**
+ * exportmap_open - prepare to read a file written by putexportent()
+ * @fname: NUL-terminated C string containing name of file to read
+ *
+ * Such files, like etab, have one export per line with no defaults or
+ * continuation lines, so they can be read in one pass over the mapped
+ * file.  Returns a pointer to a map to pass to exportmap_next(), or
+ * NULL if @fname cannot be read.
+ */
+struct exportmap *
+exportmap_open(const char *fname)
+{
+	struct exportmap *map;
+	struct stat stb;
+	int fd;
+
+	fd = open(fname, O_RDONLY);
+	if (fd < 0) {
+		xlog(L_ERROR, "can't open %s for reading", fname);
+		return NULL;
+	}
+	if (fstat(fd, &stb) < 0) {
+		xlog(L_ERROR, "can't stat %s: %m", fname);
+		close(fd);
+		return NULL;
+	}
+
+	map = xmalloc(sizeof(*map));
+	memset(map, 0, sizeof(*map));
+	map->em_fname = xstrdup(fname);
+	map->em_size = stb.st_size;
+	if (map->em_size != 0) {
+		map->em_data = mmap(NULL, map->em_size, PROT_READ,
+					MAP_PRIVATE, fd, 0);
+		if (map->em_data == MAP_FAILED) {
+			xlog(L_ERROR, "can't map %s: %m", fname);
+			close(fd);
+			xfree(map->em_fname);
+			xfree(map);
+			return NULL;
+		}
+		(void)madvise(map->em_data, map->em_size, MADV_SEQUENTIAL);
+	}
+	close(fd);
+	return map;
+}
+
+/* Parse the line of @len bytes at @line into map->em_ee */
+static int
+exportmap_parse(struct exportmap *map, const char *line, size_t len)
+{
+	struct exportent *ee = &map->em_ee;
+	const char *end = line + len, *host, *opts = NULL;
+	size_t i = 0, optlen = 0;
+
+	/* path, with putexportent()'s octal escapes */
+	while (line < end && *line != ' ' && *line != '\t') {
+		if (i == sizeof(ee->e_path) - 1)
+			goto bad_line;
+		if (line[0] == '\\' && end - line >= 4 &&
+		    isdigit(line[1]) && isdigit(line[2]) && isdigit(line[3])) {
+			ee->e_path[i++] = (line[1] - '0') << 6 |
+					  (line[2] - '0') << 3 | (line[3] - '0');
+			line += 4;
+		} else
+			ee->e_path[i++] = *line++;
+	}
+	ee->e_path[i] = '\0';
+	while (line < end && isblank(*line))
+		line++;
+
+	/* client(options) */
+	host = line;
+	while (line < end && *line != '(' && !isblank(*line))
+		line++;
+	if (line == host)
+		goto bad_line;
+	map->em_host = exportmap_intern(map, host, line - host);
+	ee->e_hostname = map->em_host->es_str;
+	if (line < end && *line == '(') {
+		opts = ++line;
+		while (line < end && *line != ')')
+			line++;
+		if (line == end)
+			goto bad_line;
+		optlen = line++ - opts;
+	}
+	while (line < end && isblank(*line))
+		line++;
+	if (line != end)
+		goto bad_line;
+
+	if (opts == NULL)
+		return parseopts(NULL, ee, 0, NULL);
+	if (optlen >= map->em_optsize) {
+		map->em_optsize = optlen + 1;
+		map->em_opts = xrealloc(map->em_opts, map->em_optsize);
+	}
+	memcpy(map->em_opts, opts, optlen);
+	map->em_opts[optlen] = '\0';
+	return parseopts(map->em_opts, ee, 0, NULL);
+
+bad_line:
+	xlog(L_ERROR, "%s:%d: syntax error", map->em_fname, map->em_line);
+	export_errno = EINVAL;
+	return -1;
+}
+
+/**
+ * exportmap_next - read the next export from a map
+ * @map: map returned by exportmap_open()
+ *
+ * Returns a pointer to the next export entry in @map, or NULL at the
+ * end of the file.  Unlike getexportent(), no symlinks are resolved.
+ * The entry and its strings belong to @map, and remain valid only
+ * until the next call.
+ */
+struct exportent *
+exportmap_next(struct exportmap *map)
+{
+	struct exportent *ee = &map->em_ee;
+	const char *line, *nl;
+	size_t len;
+
+	while (map->em_pos < map->em_size) {
+		line = map->em_data + map->em_pos;
+		nl = memchr(line, '\n', map->em_size - map->em_pos);
+		len = nl ? (size_t)(nl - line) : map->em_size - map->em_pos;
+		map->em_pos += len + 1;
+		map->em_line++;
+
+		while (len && isblank(*line)) {
+			line++;
+			len--;
+		}
+		if (len == 0 || *line == '#')
+			continue;
+
+		/* squash lists are the only per-export allocations left */
+		xfree(ee->e_squids);
+		xfree(ee->e_sqgids);
+		init_exportent(ee, 0);
+
+		emap = map;
+		squids = sqgids = NULL;
+		nsquids = nsqgids = 0;
+		if (exportmap_parse(map, line, len) < 0) {
+			emap = NULL;
+			ee->e_squids = squids;
+			ee->e_sqgids = sqgids;
+			continue;
+		}
+		emap = NULL;
+		squids = sqgids = NULL;
+		nsquids = nsqgids = 0;
+
+		ee->e_mountpoint = exportmap_intern_opt(map, ee->e_mountpoint);
+		ee->e_fslocdata = exportmap_intern_opt(map, ee->e_fslocdata);
+		ee->e_uuid = exportmap_intern_opt(map, ee->e_uuid);
+		return ee;
+	}
+	return NULL;
+}
+
+/**
+ * exportmap_hostdata - find the caller's data for an export's client
+ * @map: map whose last entry is of interest
+ *
+ * Returns a pointer to a slot, initially NULL, that is shared by every
+ * entry in @map for the same client name as the last entry returned
+ * by exportmap_next().  Callers can keep what they learn about a
+ * client there, rather than look it up for each of its exports.
+ */
+void **
+exportmap_hostdata(struct exportmap *map)
+{
+	return &map->em_host->es_data;
+}
+
+/**
+ * exportmap_close - release a map
+ * @map: map returned by exportmap_open()
+ *
+ */
+void
+exportmap_close(struct exportmap *map)
+{
+	struct exportmap_chunk *ec, *next;
+
+	if (map == NULL)
+		return;
+	if (map->em_data != NULL)
+		munmap(map->em_data, map->em_size);
+	for (ec = map->em_chunks; ec; ec = next) {
+		next = ec->ec_next;
+		xfree(ec);
+	}
+	xfree(map->em_ee.e_squids);
+	xfree(map->em_ee.e_sqgids);
+	xfree(map->em_strs);
+	xfree(map->em_opts);
+	xfree(map->em_fname);
+	xfree(map);
+}
+
 void secinfo_show(FILE *fp, struct exportent *ep)
 {
 	struct sec_entry *p1, *p2;
@@ -226,19 +554,27 @@ void secinfo_show(FILE *fp, struct exportent *ep)
 void
 putexportent(struct exportent *ep)
 {
-	FILE	*fp;
+	if (efp)
+		fputexportent(efp->x_fp, ep);
+}
+
+/**
+ * fputexportent - write an export in the format of etab
+ * @fp: stream to write to
+ * @ep: export to write
+ *
+ */
+void
+fputexportent(FILE *fp, struct exportent *ep)
+{
 	int	*id, i;
 	char	*esc=ep->e_path;
 
-	if (!efp)
-		return;
-
-	fp = efp->x_fp;
 	for (i=0; esc[i]; i++)
 	        if (iscntrl(esc[i]) || esc[i] == '"' || esc[i] == '\\' || esc[i] == '#' || isspace(esc[i]))
 			fprintf(fp, "\\%03o", esc[i]);
 		else
-			fprintf(fp, "%c", esc[i]);
+			putc(esc[i], fp);
 
 	fprintf(fp, "\t%s(", ep->e_hostname);
 	fprintf(fp, "%s,", (ep->e_flags & NFSEXP_READONLY)? "ro" : "rw");
@@ -343,6 +679,49 @@ dupexportent(struct exportent *dst, struct exportent *src)
 	dst->e_hostname = NULL;
 }
 
+static int
+samestring(const char *a, const char *b)
+{
+	if (a == NULL || b == NULL)
+		return a == b;
+	return strcmp(a, b) == 0;
+}
+
+/*
+ * Return 1 if the export options in @a and @b are the same, otherwise
+ * zero.  The host names and paths are not compared.
+ */
+int
+sameexportent(const struct exportent *a, const struct exportent *b)
+{
+	const struct sec_entry *p, *q;
+
+	if (a->e_flags != b->e_flags ||
+	    a->e_anonuid != b->e_anonuid ||
+	    a->e_anongid != b->e_anongid ||
+	    a->e_fsid != b->e_fsid ||
+	    a->e_fslocmethod != b->e_fslocmethod ||
+	    a->e_ttl != b->e_ttl)
+		return 0;
+	if (a->e_nsquids != b->e_nsquids ||
+	    (a->e_nsquids && memcmp(a->e_squids, b->e_squids,
+				a->e_nsquids * sizeof(int))))
+		return 0;
+	if (a->e_nsqgids != b->e_nsqgids ||
+	    (a->e_nsqgids && memcmp(a->e_sqgids, b->e_sqgids,
+				a->e_nsqgids * sizeof(int))))
+		return 0;
+	if (!samestring(a->e_mountpoint, b->e_mountpoint) ||
+	    !samestring(a->e_fslocdata, b->e_fslocdata) ||
+	    !samestring(a->e_uuid, b->e_uuid))
+		return 0;
+
+	for (p = a->e_secinfo, q = b->e_secinfo; p->flav && q->flav; p++, q++)
+		if (p->flav != q->flav || p->flags != q->flags)
+			return 0;
+	return p->flav == q->flav;
+}
+
 struct exportent *
 mkexportent(char *hname, char *path, char *options)
 {
@@ -495,7 +874,12 @@ parseopts(char *cp, struct exportent *ep, int warn, int *had_subtree_opt_ptr)
 	char 	*flname = efname?efname:"command line";
 	int	flline = efp?efp->x_line:0;
 	unsigned int active = 0;
+	char	optbuf[256], *opt = optbuf;
 
+	if (emap) {
+		flname = emap->em_fname;
+		flline = emap->em_line;
+	}
 	squids = ep->e_squids; nsquids = ep->e_nsquids;
 	sqgids = ep->e_sqgids; nsqgids = ep->e_nsqgids;
 	if (!cp)
@@ -504,15 +888,17 @@ parseopts(char *cp, struct exportent *ep, int warn, int *had_subtree_opt_ptr)
 	while (isblank(*cp))
 		cp++;
 
+	/* Each option is copied out in turn; only long lists need malloc */
+	if (strlen(cp) >= sizeof(optbuf))
+		opt = xmalloc(strlen(cp) + 1);
 	while (*cp) {
-		char *opt = strdup(cp);
 		char *optstart = cp;
 		while (*cp && *cp != ',')
 			cp++;
-		if (*cp) {
-			opt[cp-optstart] = '\0';
+		memcpy(opt, optstart, cp - optstart);
+		opt[cp-optstart] = '\0';
+		if (*cp)
 			cp++;
-		}
 
 		/* process keyword */
 		if (strcmp(opt, "ro") == 0)
@@ -572,7 +958,8 @@ parseopts(char *cp, struct exportent *ep, int warn, int *had_subtree_opt_ptr)
 				xlog(L_ERROR, "%s: %d: bad anonuid \"%s\"\n",
 				     flname, flline, opt);	
 bad_option:
-				free(opt);
+				if (opt != optbuf)
+					free(opt);
 				export_errno = EINVAL;
 				return -1;
 			}
@@ -644,10 +1031,11 @@ bad_option:
 			setflags(NFSEXP_ALLSQUASH | NFSEXP_READONLY, active, ep);
 			goto bad_option;
 		}
-		free(opt);
 		while (isblank(*cp))
 			cp++;
 	}
+	if (opt != optbuf)
+		free(opt);
 
 	fix_pseudoflavor_flags(ep);
 	ep->e_squids = squids;
@@ -0,0 +1,233 @@
+/*
+ * support/nfs/svc_loop.c
+ *
+ * An epoll(7) based service loop for the RPC daemons.
+ *
+ * The RPC library's transports are picked up from svc_pollfd[], and
+ * a daemon may add any other descriptor along with a handler of its
+ * own.  A wakeup costs time in proportion to the number of ready
+ * descriptors rather than to FD_SETSIZE, and each ready descriptor is
+ * dispatched directly.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "xlog.h"
+#include "rpcmisc.h"
+
+#define LOOP_MAXEVENTS	64
+
+enum {
+	LOOP_FREE = 0,
+	LOOP_RPC,		/* transport owned by the RPC library */
+	LOOP_LISTENER,		/* RPC transport accepting connections */
+	LOOP_USER,		/* added by nfs_svc_loop_add() */
+};
+
+struct loop_fd {
+	int		l_kind;
+	nfs_svc_loop_fn_t l_fn;
+	void *		l_data;
+};
+
+static int		loop_epfd = -1;
+static struct loop_fd *	loop_fds;
+static int		loop_nfds;
+static int		loop_rescan = 1;
+
+static int
+loop_init(void)
+{
+	if (loop_epfd >= 0)
+		return 0;
+
+	loop_epfd = epoll_create(LOOP_MAXEVENTS);
+	if (loop_epfd < 0) {
+		xlog(L_ERROR, "%s: epoll_create: %m", __func__);
+		return -1;
+	}
+	(void)fcntl(loop_epfd, F_SETFD, FD_CLOEXEC);
+	return 0;
+}
+
+static struct loop_fd *
+loop_slot(const int fd)
+{
+	struct loop_fd *fds;
+	int n;
+
+	if (fd < loop_nfds)
+		return &loop_fds[fd];
+
+	n = loop_nfds ? loop_nfds : 64;
+	while (n <= fd)
+		n <<= 1;
+	fds = realloc(loop_fds, n * sizeof(*fds));
+	if (fds == NULL)
+		return NULL;
+	memset(fds + loop_nfds, 0, (n - loop_nfds) * sizeof(*fds));
+	loop_fds = fds;
+	loop_nfds = n;
+	return &loop_fds[fd];
+}
+
+static int
+loop_watch(const int fd, const int kind, nfs_svc_loop_fn_t fn, void *data)
+{
+	struct epoll_event ev;
+	struct loop_fd *lf;
+
+	if (loop_init() < 0)
+		return -1;
+	lf = loop_slot(fd);
+	if (lf == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = fd;
+	if (epoll_ctl(loop_epfd, EPOLL_CTL_ADD, fd, &ev) < 0 &&
+	    errno != EEXIST)
+		return -1;
+
+	lf->l_kind = kind;
+	lf->l_fn = fn;
+	lf->l_data = data;
+	return 0;
+}
+
+static void
+loop_unwatch(const int fd)
+{
+	struct epoll_event ev;
+
+	/* fails harmlessly if @fd has already been closed */
+	memset(&ev, 0, sizeof(ev));
+	(void)epoll_ctl(loop_epfd, EPOLL_CTL_DEL, fd, &ev);
+	loop_fds[fd].l_kind = LOOP_FREE;
+}
+
+/*
+ * New RPC transports only appear when a listener accepts a connection,
+ * so svc_pollfd[] is searched only after that has happened.
+ */
+static void
+loop_scan_rpc(void)
+{
+	socklen_t len;
+	int i, fd, on, kind;
+
+	loop_rescan = 0;
+	for (i = 0; i < svc_max_pollfd; i++) {
+		fd = svc_pollfd[i].fd;
+		if (fd < 0)
+			continue;
+		if (fd < loop_nfds && loop_fds[fd].l_kind != LOOP_FREE)
+			continue;
+
+		on = 0;
+		len = (socklen_t)sizeof(on);
+		if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &on, &len) == 0 &&
+		    on)
+			kind = LOOP_LISTENER;
+		else
+			kind = LOOP_RPC;
+		if (loop_watch(fd, kind, NULL, NULL) < 0)
+			xlog(L_ERROR, "%s: can't watch RPC transport %d: %m",
+				__func__, fd);
+	}
+}
+
+/* Has the RPC library let go of this transport? */
+static int
+loop_rpc_gone(const int fd)
+{
+	if (fd < FD_SETSIZE)
+		return !FD_ISSET(fd, &svc_fdset);
+	return fcntl(fd, F_GETFD) < 0;
+}
+
+/**
+ * nfs_svc_loop_add - have the service loop watch a descriptor
+ * @fd: descriptor to watch for input
+ * @fn: handler to call when @fd is readable
+ * @data: passed to @fn
+ *
+ * Returns zero on success; otherwise -1 and errno is set.
+ */
+int
+nfs_svc_loop_add(const int fd, nfs_svc_loop_fn_t fn, void *data)
+{
+	return loop_watch(fd, LOOP_USER, fn, data);
+}
+
+/**
+ * nfs_svc_loop_del - stop watching a descriptor
+ * @fd: descriptor passed to nfs_svc_loop_add() earlier
+ *
+ */
+void
+nfs_svc_loop_del(const int fd)
+{
+	if (fd >= 0 && fd < loop_nfds && loop_fds[fd].l_kind == LOOP_USER)
+		loop_unwatch(fd);
+}
+
+/**
+ * nfs_svc_loop_wait - wait for and dispatch one batch of events
+ * @timeout: longest time to wait, in milliseconds, or -1 for ever
+ *
+ * Ready RPC transports are handed to the RPC library, and other
+ * ready descriptors to their handlers.  Returns the number of ready
+ * descriptors, zero if @timeout expired, or -1 with errno set if
+ * waiting failed.
+ */
+int
+nfs_svc_loop_wait(const int timeout)
+{
+	struct epoll_event events[LOOP_MAXEVENTS];
+	struct loop_fd *lf;
+	int i, n, fd;
+
+	if (loop_init() < 0)
+		return -1;
+	if (loop_rescan)
+		loop_scan_rpc();
+
+	n = epoll_wait(loop_epfd, events, LOOP_MAXEVENTS, timeout);
+	for (i = 0; i < n; i++) {
+		fd = events[i].data.fd;
+		if (fd >= loop_nfds)
+			continue;
+		lf = &loop_fds[fd];
+
+		switch (lf->l_kind) {
+		case LOOP_USER:
+			lf->l_fn(fd, lf->l_data);
+			break;
+		case LOOP_LISTENER:
+			svc_getreq_common(fd);
+			loop_rescan = 1;
+			break;
+		case LOOP_RPC:
+			svc_getreq_common(fd);
+			if (loop_rpc_gone(fd))
+				loop_unwatch(fd);
+			break;
+		}
+	}
+	return n;
+}
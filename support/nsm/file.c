@@ -60,6 +60,9 @@
  * in any way except that they must fit into 1024 bytes.  Our
  * implementation requires that these strings not contain
  * white space or '\0'.
+ *
+ * Instead of these directories, the records may be kept in a single
+ * journal file; see "The journal" below.
  */
 
 #ifdef HAVE_CONFIG_H
@@ -72,8 +75,10 @@
 #endif
 #include <sys/prctl.h>
 #include <sys/stat.h>
+#include <sys/file.h>
 
 #include <ctype.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
 #ifndef S_SPLINT_S
@@ -85,7 +90,9 @@
 #include <fcntl.h>
 #include <dirent.h>
 #include <grp.h>
+#include <time.h>
 
+#include "misc.h"
 #include "xlog.h"
 #include "nsm.h"
 
@@ -99,7 +106,20 @@ static char nsm_base_dirname[PATH_MAX] = NSM_DEFAULT_STATEDIR;
 #define NSM_MONITOR_DIR	"sm"
 #define NSM_NOTIFY_DIR	"sm.bak"
 #define NSM_STATE_FILE	"state"
+#define NSM_JOURNAL_FILE	"sm.journal"
+
+enum {
+	NSM_MONITOR = 0,		/* records under NSM_MONITOR_DIR */
+	NSM_NOTIFY,			/* records under NSM_NOTIFY_DIR */
+};
 
+static _Bool		nsm_journal_used(void);
+static unsigned int	nsm_journal_retire(void);
+static _Bool		nsm_journal_insert(const char *hostname,
+				const char *record);
+static unsigned int	nsm_journal_load(const int dir, nsm_populate_t func);
+static void		nsm_journal_delete(const int dir, const char *hostname,
+				const char *mon_name, const char *my_name);
 
 static _Bool
 error_check(const int len, const size_t buflen)
@@ -113,6 +133,24 @@ exact_error_check(const ssize_t len, const size_t buflen)
 	return (len < 0) || ((size_t)len != buflen);
 }
 
+/*
+ * Block hostnames that contain characters that have
+ * meaning to the file system (like '/'), or that can
+ * be confusing on visual inspection (like ' ').
+ */
+static _Bool
+nsm_bad_hostname(const char *hostname)
+{
+	const char *c;
+
+	for (c = hostname; *c != '\0'; c++)
+		if (*c == '/' || isspace((int)*c) != 0) {
+			xlog(D_GENERAL, "Hostname contains invalid characters");
+			return true;
+		}
+	return false;
+}
+
 /*
  * Returns a dynamically allocated, '\0'-terminated buffer
  * containing an appropriate pathname, or NULL if an error
@@ -122,21 +160,12 @@ __attribute__((__malloc__))
 static char *
 nsm_make_record_pathname(const char *directory, const char *hostname)
 {
-	const char *c;
 	size_t size;
 	char *path;
 	int len;
 
-	/*
-	 * Block hostnames that contain characters that have
-	 * meaning to the file system (like '/'), or that can
-	 * be confusing on visual inspection (like ' ').
-	 */
-	for (c = hostname; *c != '\0'; c++)
-		if (*c == '/' || isspace((int)*c) != 0) {
-			xlog(D_GENERAL, "Hostname contains invalid characters");
-			return NULL;
-		}
+	if (nsm_bad_hostname(hostname))
+		return NULL;
 
 	size = strlen(nsm_base_dirname) + strlen(directory) + strlen(hostname) + 3;
 	if (size > PATH_MAX) {
@@ -545,6 +574,9 @@ nsm_retire_monitored_hosts(void)
 	char *path;
 	DIR *dir;
 
+	if (nsm_journal_used())
+		return nsm_journal_retire();
+
 	path = nsm_make_pathname(NSM_MONITOR_DIR);
 	if (path == NULL) {
 		xlog(L_ERROR, "Failed to allocate path for " NSM_MONITOR_DIR);
@@ -742,6 +774,19 @@ nsm_insert_monitored_host(const char *hostname, const struct sockaddr *sap,
 	size_t size;
 	int fd;
 
+	if (nsm_journal_used()) {
+		if (nsm_bad_hostname(hostname)) {
+			xlog(L_ERROR, "Failed to insert: bad monitor "
+					"hostname '%s'", hostname);
+			return false;
+		}
+		if (nsm_create_monitor_record(buf, sizeof(buf), sap, m) == 0) {
+			xlog(L_ERROR, "Failed to insert: record too long");
+			return false;
+		}
+		return nsm_journal_insert(hostname, buf);
+	}
+
 	path = nsm_make_record_pathname(NSM_MONITOR_DIR, hostname);
 	if (path == NULL) {
 		xlog(L_ERROR, "Failed to insert: bad monitor hostname '%s'",
@@ -942,6 +987,8 @@ nsm_load_dir(const char *directory, nsm_populate_t func)
 unsigned int
 nsm_load_monitor_list(nsm_populate_t func)
 {
+	if (nsm_journal_used())
+		return nsm_journal_load(NSM_MONITOR, func);
 	return nsm_load_dir(NSM_MONITOR_DIR, func);
 }
 
@@ -954,6 +1001,8 @@ nsm_load_monitor_list(nsm_populate_t func)
 unsigned int
 nsm_load_notify_list(nsm_populate_t func)
 {
+	if (nsm_journal_used())
+		return nsm_journal_load(NSM_NOTIFY, func);
 	return nsm_load_dir(NSM_NOTIFY_DIR, func);
 }
 
@@ -1061,7 +1110,10 @@ void
 nsm_delete_monitored_host(const char *hostname, const char *mon_name,
 		const char *my_name)
 {
-	nsm_delete_host(NSM_MONITOR_DIR, hostname, mon_name, my_name);
+	if (nsm_journal_used())
+		nsm_journal_delete(NSM_MONITOR, hostname, mon_name, my_name);
+	else
+		nsm_delete_host(NSM_MONITOR_DIR, hostname, mon_name, my_name);
 }
 
 /**
@@ -1075,5 +1127,1008 @@ void
 nsm_delete_notified_host(const char *hostname, const char *mon_name,
 		const char *my_name)
 {
-	nsm_delete_host(NSM_NOTIFY_DIR, hostname, mon_name, my_name);
+	if (nsm_journal_used())
+		nsm_journal_delete(NSM_NOTIFY, hostname, mon_name, my_name);
+	else
+		nsm_delete_host(NSM_NOTIFY_DIR, hostname, mon_name, my_name);
+}
+
+/*
+ * The journal
+ *
+ * Instead of a file per host, the records may be kept in a single
+ * append-only file, NSM_JOURNAL_FILE, so that an SM_MON costs one
+ * appended line rather than a file created or rewritten with O_SYNC
+ * and renamed.  Each line of the journal is one change:
+ *
+ *	+ <dir> <time> <hostname> <record>	add a record for a host
+ *	- <dir> <hostname> <mon_name> <my_name>	delete a host's matching
+ *						records
+ *	R					retire all monitored hosts
+ *
+ * where <dir> is "sm" or "sm.bak", <time> is in hexadecimal seconds
+ * since the Epoch, and <record> is a line of a host file as described
+ * above.
+ *
+ * Each process that uses the journal keeps the records in memory.
+ * It locks the journal with flock(2), reads whatever other processes
+ * have appended since it last looked, and then appends its own
+ * change.  Once the journal holds many more lines than records, it is
+ * replaced by one with a "+" line for each record.
+ *
+ * An added record reaches stable storage before
+ * nsm_insert_monitored_host() returns.  If a commit interval is set,
+ * it gets there within that many milliseconds instead, so that a
+ * burst of SM_MON requests shares each fdatasync(2).  Deletions are
+ * written out with the next addition; losing one in a crash only
+ * means that a peer is notified twice.
+ */
+
+#define NSM_RECORDS_INITSIZE	64	/* a power of two */
+#define NSM_JOURNAL_COMPACT	1024	/* lines before it is compacted */
+#define JOURNAL_LINELEN		(LINELEN + 3 * (SM_MAXSTRLEN + 1) + 32)
+
+static const char *nsm_dir_names[] = {
+	[NSM_MONITOR]	= NSM_MONITOR_DIR,
+	[NSM_NOTIFY]	= NSM_NOTIFY_DIR,
+};
+
+enum {
+	NSM_JOURNAL_UNKNOWN = 0,	/* not yet looked for */
+	NSM_JOURNAL_UNUSED,
+	NSM_JOURNAL_USED,
+};
+
+struct nsm_record {
+	struct nsm_record *	r_next;
+	unsigned int		r_hash;		/* of r_host */
+	int			r_dir;
+	time_t			r_time;
+	char *			r_line;		/* follows r_host */
+	char			r_host[];
+};
+
+static struct nsm_record **	nsm_records;
+static unsigned int		nsm_records_size;
+static unsigned int		nsm_record_count;
+
+static int			nsm_journal_state;
+static int			nsm_journal_fd = -1;
+static off_t			nsm_journal_end;	/* of what was read */
+static unsigned int		nsm_journal_lines;
+static unsigned int		nsm_journal_commit_ms;
+static _Bool			nsm_journal_unsynced;
+static long long		nsm_journal_due;	/* msec; zero if none */
+
+static int			nsm_import_dir;
+static _Bool			nsm_import_failed;
+
+static long long
+nsm_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Double the size of the record table.  Each chain keeps its records
+ * in the order they were added, so a host's records stay in order.
+ */
+static _Bool
+nsm_records_grow(void)
+{
+	struct nsm_record **table, ***tails, *r, *next;
+	unsigned int size, i;
+
+	size = nsm_records_size ? nsm_records_size << 1 : NSM_RECORDS_INITSIZE;
+	table = calloc(size, sizeof(*table));
+	tails = malloc(size * sizeof(*tails));
+	if (table == NULL || tails == NULL) {
+		free(tails);
+		free(table);
+		return false;
+	}
+	for (i = 0; i < size; i++)
+		tails[i] = &table[i];
+	for (i = 0; i < nsm_records_size; i++)
+		for (r = nsm_records[i]; r != NULL; r = next) {
+			next = r->r_next;
+			r->r_next = NULL;
+			*tails[r->r_hash & (size - 1)] = r;
+			tails[r->r_hash & (size - 1)] = &r->r_next;
+		}
+	free(tails);
+	free(nsm_records);
+	nsm_records = table;
+	nsm_records_size = size;
+	return true;
+}
+
+static struct nsm_record **
+nsm_record_chain(const unsigned int hash)
+{
+	static struct nsm_record *empty;
+
+	if (nsm_records_size == 0)
+		return &empty;
+	return &nsm_records[hash & (nsm_records_size - 1)];
+}
+
+static _Bool
+nsm_record_add(const int dir, const time_t when, const char *hostname,
+		const char *line)
+{
+	size_t hostlen = strlen(hostname) + 1, linelen = strlen(line) + 1;
+	struct nsm_record *r, **chain;
+
+	if (nsm_record_count >= nsm_records_size && !nsm_records_grow() &&
+	    nsm_records_size == 0) {
+		xlog(L_ERROR, "Failed to add record: no memory");
+		return false;
+	}
+	r = malloc(sizeof(*r) + hostlen + linelen);
+	if (r == NULL) {
+		xlog(L_ERROR, "Failed to add record: no memory");
+		return false;
+	}
+	memcpy(r->r_host, hostname, hostlen);
+	r->r_line = r->r_host + hostlen;
+	memcpy(r->r_line, line, linelen);
+	r->r_dir = dir;
+	r->r_time = when;
+	r->r_hash = fnv1a_str(hostname);
+
+	/* in the order added, as lines are in a host file */
+	for (chain = nsm_record_chain(r->r_hash); *chain != NULL;
+	     chain = &(*chain)->r_next)
+		;
+	r->r_next = NULL;
+	*chain = r;
+	nsm_record_count++;
+	return true;
+}
+
+/* Is there a record in @dir for the host @r is a record of? */
+static _Bool
+nsm_record_host_in(const int dir, const struct nsm_record *r)
+{
+	struct nsm_record *p;
+
+	for (p = *nsm_record_chain(r->r_hash); p != NULL; p = p->r_next)
+		if (p->r_dir == dir && p->r_hash == r->r_hash &&
+		    strcmp(p->r_host, r->r_host) == 0)
+			return true;
+	return false;
+}
+
+static _Bool
+nsm_record_find(const int dir, const char *hostname, const char *line)
+{
+	unsigned int hash = fnv1a_str(hostname);
+	struct nsm_record *r;
+
+	for (r = *nsm_record_chain(hash); r != NULL; r = r->r_next)
+		if (r->r_dir == dir && r->r_hash == hash &&
+		    strcmp(r->r_host, hostname) == 0 &&
+		    strcmp(r->r_line, line) == 0)
+			return true;
+	return false;
+}
+
+static _Bool
+nsm_record_matches(const struct nsm_record *r, const char *mon_name,
+		const char *my_name)
+{
+	char line[JOURNAL_LINELEN];
+	struct sockaddr_in sin;
+	struct mon m;
+
+	/* nsm_parse_line destroys the contents of line[] */
+	if (error_check(snprintf(line, sizeof(line), "%s", r->r_line),
+							sizeof(line)))
+		return false;
+	if (!nsm_parse_line(line, &sin, &m))
+		return false;
+	return strcmp(mon_name, m.mon_id.mon_name) == 0 &&
+		strcmp(my_name, m.mon_id.my_id.my_name) == 0;
+}
+
+static unsigned int
+nsm_records_delete(const int dir, const char *hostname,
+		const char *mon_name, const char *my_name)
+{
+	unsigned int hash = fnv1a_str(hostname), count = 0;
+	struct nsm_record *r, **rp;
+
+	for (rp = nsm_record_chain(hash); (r = *rp) != NULL; ) {
+		if (r->r_dir == dir && r->r_hash == hash &&
+		    strcmp(r->r_host, hostname) == 0 &&
+		    nsm_record_matches(r, mon_name, my_name)) {
+			*rp = r->r_next;
+			free(r);
+			nsm_record_count--;
+			count++;
+			continue;
+		}
+		rp = &r->r_next;
+	}
+	return count;
+}
+
+/*
+ * Move every monitored host's records to the notify list.  As
+ * rename(2) would, they replace any that host already had there.
+ */
+static unsigned int
+nsm_records_retire(void)
+{
+	struct nsm_record *r, **rp;
+	unsigned int i, count = 0;
+
+	for (i = 0; i < nsm_records_size; i++)
+		for (rp = &nsm_records[i]; (r = *rp) != NULL; ) {
+			if (r->r_dir == NSM_NOTIFY &&
+			    nsm_record_host_in(NSM_MONITOR, r)) {
+				*rp = r->r_next;
+				free(r);
+				nsm_record_count--;
+				continue;
+			}
+			rp = &r->r_next;
+		}
+
+	for (i = 0; i < nsm_records_size; i++)
+		for (r = nsm_records[i]; r != NULL; r = r->r_next)
+			if (r->r_dir == NSM_MONITOR) {
+				r->r_dir = NSM_NOTIFY;
+				count++;
+			}
+	return count;
+}
+
+static void
+nsm_records_clear(void)
+{
+	struct nsm_record *r;
+	unsigned int i;
+
+	for (i = 0; i < nsm_records_size; i++)
+		while ((r = nsm_records[i]) != NULL) {
+			nsm_records[i] = r->r_next;
+			free(r);
+		}
+	nsm_record_count = 0;
+}
+
+static int
+nsm_journal_dir(const char *name)
+{
+	int dir;
+
+	for (dir = NSM_MONITOR; dir <= NSM_NOTIFY; dir++)
+		if (strcmp(name, nsm_dir_names[dir]) == 0)
+			return dir;
+	return -1;
+}
+
+/* Split @line in place at the first @max - 1 blanks. */
+static int
+nsm_journal_split(char *line, char **field, const int max)
+{
+	int count = 0;
+
+	while (count < max - 1) {
+		field[count++] = line;
+		line = strchr(line, ' ');
+		if (line == NULL)
+			return count;
+		*line++ = '\0';
+	}
+	field[count++] = line;
+	return count;
+}
+
+/*
+ * Apply one line of the journal to the records in memory.  Returns
+ * false if @line, which is modified, cannot be parsed.
+ */
+static _Bool
+nsm_journal_apply(char *line)
+{
+	char *field[5];
+	int dir;
+
+	switch (line[0]) {
+	case '+':
+		if (nsm_journal_split(line, field, 5) != 5)
+			return false;
+		dir = nsm_journal_dir(field[1]);
+		if (dir == -1 || nsm_bad_hostname(field[3]))
+			return false;
+		return nsm_record_add(dir,
+				(time_t)strtoul(field[2], NULL, 16),
+				field[3], field[4]);
+	case '-':
+		if (nsm_journal_split(line, field, 5) != 5)
+			return false;
+		dir = nsm_journal_dir(field[1]);
+		if (dir == -1)
+			return false;
+		(void)nsm_records_delete(dir, field[2], field[3], field[4]);
+		return true;
+	case 'R':
+		(void)nsm_records_retire();
+		return true;
+	case '#':
+		return true;
+	}
+	return false;
+}
+
+/*
+ * Read what has been appended to the locked journal since it was
+ * last read.  A final line left incomplete by a crash is cut off, so
+ * that the next line appended is not mistaken for part of it.
+ */
+static _Bool
+nsm_journal_read(void)
+{
+	char *buf, *line, *nl;
+	struct stat st;
+	ssize_t count;
+	size_t len;
+
+	if (fstat(nsm_journal_fd, &st) == -1) {
+		xlog(L_ERROR, "Failed to stat " NSM_JOURNAL_FILE ": %m");
+		return false;
+	}
+	if (st.st_size <= nsm_journal_end)
+		return true;
+
+	len = (size_t)(st.st_size - nsm_journal_end);
+	buf = malloc(len + 1);
+	if (buf == NULL) {
+		xlog(L_ERROR, "Failed to read " NSM_JOURNAL_FILE ": no memory");
+		return false;
+	}
+	count = pread(nsm_journal_fd, buf, len, nsm_journal_end);
+	if (exact_error_check(count, len)) {
+		xlog(L_ERROR, "Failed to read " NSM_JOURNAL_FILE ": %m");
+		free(buf);
+		return false;
+	}
+	buf[len] = '\0';
+
+	for (line = buf; (nl = memchr(line, '\n', len - (size_t)(line - buf)));
+	     line = nl + 1) {
+		*nl = '\0';
+		if (!nsm_journal_apply(line))
+			xlog_warn("Skipping bad line in " NSM_JOURNAL_FILE);
+		nsm_journal_lines++;
+	}
+	nsm_journal_end += line - buf;
+
+	if (line != buf + len) {
+		xlog_warn("Discarding incomplete line at end of "
+				NSM_JOURNAL_FILE);
+		if (ftruncate(nsm_journal_fd, nsm_journal_end) == -1)
+			xlog(L_ERROR, "Failed to truncate "
+					NSM_JOURNAL_FILE ": %m");
+	}
+
+	free(buf);
+	return true;
+}
+
+static void
+nsm_journal_close(void)
+{
+	if (nsm_journal_fd != -1)
+		(void)close(nsm_journal_fd);
+	nsm_journal_fd = -1;
+	nsm_journal_unsynced = false;
+	nsm_journal_due = 0;
+}
+
+/*
+ * Lock the journal and bring the records in memory up to date.  If
+ * another process has replaced the journal since it was opened, the
+ * new one is read from the start.
+ *
+ * Returns true if the journal is locked, otherwise false.
+ */
+static _Bool
+nsm_journal_lock(void)
+{
+	struct stat cur, st;
+	char *path;
+
+	path = nsm_make_pathname(NSM_JOURNAL_FILE);
+	if (path == NULL) {
+		xlog(L_ERROR, "Failed to allocate path for " NSM_JOURNAL_FILE);
+		return false;
+	}
+
+	for (;;) {
+		if (nsm_journal_fd == -1) {
+			nsm_journal_fd = open(path,
+					O_RDWR | O_APPEND | O_CLOEXEC);
+			if (nsm_journal_fd == -1) {
+				xlog(L_ERROR, "Failed to open %s: %m", path);
+				goto out_err;
+			}
+			nsm_records_clear();
+			nsm_journal_end = 0;
+			nsm_journal_lines = 0;
+		}
+
+		if (flock(nsm_journal_fd, LOCK_EX) == -1) {
+			if (errno == EINTR)
+				continue;
+			xlog(L_ERROR, "Failed to lock %s: %m", path);
+			goto out_close;
+		}
+		if (fstat(nsm_journal_fd, &cur) == -1 ||
+		    stat(path, &st) == -1) {
+			xlog(L_ERROR, "Failed to stat %s: %m", path);
+			goto out_close;
+		}
+		if (cur.st_ino == st.st_ino && cur.st_dev == st.st_dev)
+			break;
+
+		/* Replaced while we waited for the lock */
+		nsm_journal_close();
+	}
+
+	free(path);
+	if (nsm_journal_read())
+		return true;
+	nsm_journal_close();
+	return false;
+
+out_close:
+	nsm_journal_close();
+out_err:
+	free(path);
+	return false;
+}
+
+static void
+nsm_journal_sync(void)
+{
+	if (!nsm_journal_unsynced)
+		return;
+	if (fdatasync(nsm_journal_fd) == -1)
+		xlog(L_ERROR, "Failed to sync " NSM_JOURNAL_FILE ": %m");
+	nsm_journal_unsynced = false;
+	nsm_journal_due = 0;
+}
+
+/* Files created while still root belong to the user statd runs as */
+static void
+nsm_journal_chown(const int fd)
+{
+	struct stat st;
+
+	if (geteuid() != 0 || stat(nsm_base_dirname, &st) == -1 ||
+	    st.st_uid == 0)
+		return;
+	if (fchown(fd, st.st_uid, st.st_gid) == -1)
+		xlog_warn("Failed to change owner of " NSM_JOURNAL_FILE ": %m");
+}
+
+/* Make a rename(2) in the state directory durable */
+static void
+nsm_journal_sync_dir(void)
+{
+	int fd;
+
+	fd = open(nsm_base_dirname, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd == -1) {
+		xlog(L_ERROR, "Failed to open %s: %m", nsm_base_dirname);
+		return;
+	}
+	if (fsync(fd) == -1)
+		xlog(L_ERROR, "Failed to sync %s: %m", nsm_base_dirname);
+	(void)close(fd);
+}
+
+/*
+ * Replace the locked journal with one holding a "+" line for each
+ * record.  The new journal is locked before it is renamed into
+ * place, so other processes find it only once it is complete.
+ *
+ * The old journal is synced first, and the directory after the
+ * rename, so that the records pending a commit are on stable storage
+ * under whichever name survives a crash.
+ */
+static _Bool
+nsm_journal_compact(void)
+{
+	char *path = NULL, *temp = NULL, *buf = NULL, *next;
+	_Bool result = false;
+	struct nsm_record *r;
+	size_t size = 1;
+	unsigned int i;
+	ssize_t len;
+	int fd = -1;
+
+	nsm_journal_sync();
+
+	for (i = 0; i < nsm_records_size; i++)
+		for (r = nsm_records[i]; r != NULL; r = r->r_next)
+			size += strlen(r->r_host) + strlen(r->r_line) + 32;
+	buf = malloc(size);
+	if (buf == NULL) {
+		xlog(L_ERROR, "Failed to compact " NSM_JOURNAL_FILE
+				": no memory");
+		goto out;
+	}
+	next = buf;
+	for (i = 0; i < nsm_records_size; i++)
+		for (r = nsm_records[i]; r != NULL; r = r->r_next)
+			next += sprintf(next, "+ %s %lx %s %s\n",
+					nsm_dir_names[r->r_dir],
+					(unsigned long)r->r_time,
+					r->r_host, r->r_line);
+
+	path = nsm_make_pathname(NSM_JOURNAL_FILE);
+	if (path == NULL)
+		goto out;
+	temp = nsm_make_temp_pathname(path);
+	if (temp == NULL)
+		goto out;
+
+	fd = open(temp, O_RDWR | O_APPEND | O_CREAT | O_TRUNC | O_CLOEXEC,
+			S_IRUSR | S_IWUSR);
+	if (fd == -1) {
+		xlog(L_ERROR, "Failed to create %s: %m", temp);
+		goto out;
+	}
+	if (flock(fd, LOCK_EX) == -1) {
+		xlog(L_ERROR, "Failed to lock %s: %m", temp);
+		goto out_unlink;
+	}
+	nsm_journal_chown(fd);
+
+	len = write(fd, buf, (size_t)(next - buf));
+	if (exact_error_check(len, (size_t)(next - buf)) || fsync(fd) == -1) {
+		xlog(L_ERROR, "Failed to write %s: %m", temp);
+		goto out_unlink;
+	}
+	if (rename(temp, path) == -1) {
+		xlog(L_ERROR, "Failed to rename %s -> %s: %m", temp, path);
+		goto out_unlink;
+	}
+	nsm_journal_sync_dir();
+
+	xlog(D_GENERAL, "Compacted " NSM_JOURNAL_FILE " from %u to %u lines",
+			nsm_journal_lines, nsm_record_count);
+	nsm_journal_close();
+	nsm_journal_fd = fd;
+	nsm_journal_end = next - buf;
+	nsm_journal_lines = nsm_record_count;
+	result = true;
+	goto out;
+
+out_unlink:
+	(void)unlink(temp);
+	(void)close(fd);
+out:
+	free(temp);
+	free(path);
+	free(buf);
+	return result;
+}
+
+/* Finish a change to the locked journal, and unlock it. */
+static void
+nsm_journal_unlock(void)
+{
+	if (nsm_journal_lines >= NSM_JOURNAL_COMPACT &&
+	    nsm_journal_lines > 2 * nsm_record_count)
+		(void)nsm_journal_compact();
+	(void)flock(nsm_journal_fd, LOCK_UN);
+}
+
+static _Bool
+nsm_journal_append(const char *line, const size_t len)
+{
+	ssize_t result;
+
+	result = write(nsm_journal_fd, line, len);
+	if (exact_error_check(result, len)) {
+		xlog(L_ERROR, "Failed to write " NSM_JOURNAL_FILE ": %m");
+		if (result > 0 && ftruncate(nsm_journal_fd, nsm_journal_end))
+			xlog(L_ERROR, "Failed to truncate "
+					NSM_JOURNAL_FILE ": %m");
+		return false;
+	}
+	nsm_journal_end += (off_t)len;
+	nsm_journal_lines++;
+	nsm_journal_unsynced = true;
+	return true;
+}
+
+static void
+nsm_journal_start(void)
+{
+	if (nsm_journal_state == NSM_JOURNAL_USED)
+		return;
+	nsm_journal_state = NSM_JOURNAL_USED;
+	xlog(D_GENERAL, "Keeping monitor records in " NSM_JOURNAL_FILE);
+	atexit(nsm_journal_sync);
+}
+
+/* Are the records kept in the journal? */
+static _Bool
+nsm_journal_used(void)
+{
+	struct stat st;
+	char *path;
+
+	if (nsm_journal_state == NSM_JOURNAL_UNKNOWN) {
+		nsm_journal_state = NSM_JOURNAL_UNUSED;
+		path = nsm_make_pathname(NSM_JOURNAL_FILE);
+		if (path != NULL && stat(path, &st) == 0)
+			nsm_journal_start();
+		free(path);
+	}
+	return nsm_journal_state == NSM_JOURNAL_USED;
+}
+
+static _Bool
+nsm_journal_insert(const char *hostname, const char *record)
+{
+	char line[JOURNAL_LINELEN];
+	time_t now = time(NULL);
+	_Bool result = false;
+	int len;
+
+	if (!nsm_journal_lock())
+		return false;
+
+	/* @record ends with a newline */
+	len = snprintf(line, sizeof(line), "+ %s %lx %s %s",
+			NSM_MONITOR_DIR, (unsigned long)now, hostname, record);
+	if (error_check(len, sizeof(line))) {
+		xlog(L_ERROR, "Failed to insert: record too long");
+		goto out;
+	}
+	if (!nsm_journal_append(line, (size_t)len))
+		goto out;
+	line[len - 1] = '\0';
+	if (!nsm_journal_apply(line)) {
+		/* read it all again next time */
+		nsm_journal_close();
+		goto out;
+	}
+	result = true;
+
+	if (nsm_journal_commit_ms != 0 && nsm_journal_due == 0)
+		nsm_journal_due = nsm_now_ms() + nsm_journal_commit_ms;
+out:
+	if (nsm_journal_fd != -1)
+		nsm_journal_unlock();
+	if (result && nsm_journal_commit_ms == 0)
+		nsm_journal_sync();
+	return result;
+}
+
+static void
+nsm_journal_delete(const int dir, const char *hostname,
+		const char *mon_name, const char *my_name)
+{
+	char line[JOURNAL_LINELEN];
+	int len;
+
+	if (!nsm_journal_lock())
+		return;
+
+	if (nsm_records_delete(dir, hostname, mon_name, my_name) == 0) {
+		xlog(D_GENERAL, "No record of %s (%s, %s) to delete",
+				hostname, mon_name, my_name);
+		goto out;
+	}
+	len = snprintf(line, sizeof(line), "- %s %s %s %s\n",
+			nsm_dir_names[dir], hostname, mon_name, my_name);
+	if (error_check(len, sizeof(line)) ||
+	    !nsm_journal_append(line, (size_t)len))
+		xlog(L_ERROR, "Failed to delete: could not record deletion "
+				"of %s", hostname);
+out:
+	nsm_journal_unlock();
+}
+
+static unsigned int
+nsm_journal_retire(void)
+{
+	unsigned int count;
+
+	if (!nsm_journal_lock())
+		return 0;
+	count = nsm_records_retire();
+	if (count != 0)
+		(void)nsm_journal_append("R\n", 2);
+	nsm_journal_unlock();
+
+	xlog(D_GENERAL, "Retired %u monitor records", count);
+	return count;
+}
+
+/*
+ * @func must not add or delete records, as the journal stays locked
+ * while it runs.
+ */
+static unsigned int
+nsm_journal_load(const int dir, nsm_populate_t func)
+{
+	char line[JOURNAL_LINELEN];
+	unsigned int count = 0, i;
+	struct nsm_record *r;
+
+	if (!nsm_journal_lock())
+		return 0;
+	for (i = 0; i < nsm_records_size; i++)
+		for (r = nsm_records[i]; r != NULL; r = r->r_next) {
+			if (r->r_dir != dir)
+				continue;
+			if (error_check(snprintf(line, sizeof(line), "%s",
+						r->r_line), sizeof(line)))
+				continue;
+			count += nsm_read_line(r->r_host, r->r_time,
+						line, func);
+		}
+	nsm_journal_unlock();
+	return count;
+}
+
+static unsigned int
+nsm_journal_import_one(const char *hostname, const struct sockaddr *sap,
+		const struct mon *m, const time_t timestamp)
+{
+	char line[JOURNAL_LINELEN];
+	size_t len;
+
+	len = nsm_create_monitor_record(line, sizeof(line), sap, m);
+	if (len == 0) {
+		nsm_import_failed = true;
+		return 0;
+	}
+	line[len - 1] = '\0';		/* the newline */
+
+	/* left behind by an import that did not finish */
+	if (nsm_record_find(nsm_import_dir, hostname, line))
+		return 1;
+	if (!nsm_record_add(nsm_import_dir, timestamp, hostname, line)) {
+		nsm_import_failed = true;
+		return 0;
+	}
+	return 1;
+}
+
+/* Remove the host files in @directory, once they are in the journal. */
+static void
+nsm_unlink_dir(const char *directory)
+{
+	struct dirent *de;
+	struct stat stb;
+	char *path;
+	DIR *dir;
+
+	path = nsm_make_pathname(directory);
+	if (path == NULL)
+		return;
+	dir = opendir(path);
+	free(path);
+	if (dir == NULL)
+		return;
+
+	while ((de = readdir(dir)) != NULL) {
+		if (de->d_name[0] == '.')
+			continue;
+		path = nsm_make_record_pathname(directory, de->d_name);
+		if (path == NULL)
+			continue;
+		if (lstat(path, &stb) == 0 && S_ISREG(stb.st_mode) &&
+		    unlink(path) == -1)
+			xlog_warn("Failed to unlink %s: %m", path);
+		free(path);
+	}
+	(void)closedir(dir);
+}
+
+/*
+ * Create the journal if need be, and move into it any records that
+ * are kept in host files.
+ */
+static _Bool
+nsm_journal_import(void)
+{
+	unsigned int count;
+	char *path;
+	int fd;
+
+	path = nsm_make_pathname(NSM_JOURNAL_FILE);
+	if (path == NULL) {
+		xlog(L_ERROR, "Failed to allocate path for " NSM_JOURNAL_FILE);
+		return false;
+	}
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+	if (fd == -1) {
+		xlog(L_ERROR, "Failed to create %s: %m", path);
+		free(path);
+		return false;
+	}
+	nsm_journal_chown(fd);
+	(void)close(fd);
+	free(path);
+
+	nsm_journal_start();
+	if (!nsm_journal_lock())
+		return false;
+
+	nsm_import_failed = false;
+	nsm_import_dir = NSM_MONITOR;
+	count = nsm_load_dir(NSM_MONITOR_DIR, nsm_journal_import_one);
+	nsm_import_dir = NSM_NOTIFY;
+	count += nsm_load_dir(NSM_NOTIFY_DIR, nsm_journal_import_one);
+	if (count == 0)
+		goto out;
+
+	/* The host files are removed only once the journal is safe */
+	if (nsm_import_failed || !nsm_journal_compact()) {
+		xlog(L_ERROR, "Failed to move monitor records into "
+				NSM_JOURNAL_FILE);
+		/* forget what was not written, and the lock with it */
+		nsm_journal_close();
+		return false;
+	}
+	nsm_unlink_dir(NSM_MONITOR_DIR);
+	nsm_unlink_dir(NSM_NOTIFY_DIR);
+	xlog(L_NOTICE, "Moved %u monitor records into " NSM_JOURNAL_FILE,
+			count);
+out:
+	nsm_journal_unlock();
+	return true;
+}
+
+/* Write the records of one host in one directory to its host file. */
+static _Bool
+nsm_journal_export_host(const struct nsm_record *first)
+{
+	const struct nsm_record *r;
+	char *path, *buf, *next;
+	size_t size = 1;
+	_Bool result;
+
+	for (r = first; r != NULL; r = r->r_next)
+		if (r->r_dir == first->r_dir && r->r_hash == first->r_hash &&
+		    strcmp(r->r_host, first->r_host) == 0)
+			size += strlen(r->r_line) + 1;
+	buf = malloc(size);
+	if (buf == NULL)
+		return false;
+	next = buf;
+	for (r = first; r != NULL; r = r->r_next)
+		if (r->r_dir == first->r_dir && r->r_hash == first->r_hash &&
+		    strcmp(r->r_host, first->r_host) == 0)
+			next += sprintf(next, "%s\n", r->r_line);
+
+	path = nsm_make_record_pathname(nsm_dir_names[first->r_dir],
+						first->r_host);
+	result = path != NULL &&
+		nsm_atomic_write(path, buf, (size_t)(next - buf));
+	free(path);
+	free(buf);
+	return result;
+}
+
+/*
+ * Write the records in the journal back to host files, and remove
+ * the journal.
+ */
+static _Bool
+nsm_journal_export(void)
+{
+	struct nsm_record *r;
+	unsigned int i;
+	struct stat st;
+	char *path;
+
+	path = nsm_make_pathname(NSM_JOURNAL_FILE);
+	if (path == NULL) {
+		xlog(L_ERROR, "Failed to allocate path for " NSM_JOURNAL_FILE);
+		return false;
+	}
+	if (stat(path, &st) == -1) {
+		free(path);
+		if (errno != ENOENT) {
+			xlog(L_ERROR, "Failed to stat " NSM_JOURNAL_FILE ": %m");
+			return false;
+		}
+		nsm_journal_state = NSM_JOURNAL_UNUSED;
+		return true;
+	}
+
+	nsm_journal_start();
+	if (!nsm_journal_lock())
+		goto out_err;
+
+	/* A host's records share a chain; write them when first met */
+	for (i = 0; i < nsm_records_size; i++)
+		for (r = nsm_records[i]; r != NULL; r = r->r_next) {
+			const struct nsm_record *p;
+
+			for (p = nsm_records[i]; p != r; p = p->r_next)
+				if (p->r_dir == r->r_dir &&
+				    strcmp(p->r_host, r->r_host) == 0)
+					break;
+			if (p == r && !nsm_journal_export_host(r)) {
+				xlog(L_ERROR, "Failed to move monitor records "
+						"out of " NSM_JOURNAL_FILE);
+				nsm_journal_unlock();
+				goto out_err;
+			}
+		}
+
+	if (unlink(path) == -1) {
+		xlog(L_ERROR, "Failed to unlink %s: %m", path);
+		nsm_journal_unlock();
+		goto out_err;
+	}
+	xlog(L_NOTICE, "Moved %u monitor records out of " NSM_JOURNAL_FILE,
+			nsm_record_count);
+	nsm_journal_close();
+	nsm_records_clear();
+	nsm_journal_state = NSM_JOURNAL_UNUSED;
+	free(path);
+	return true;
+
+out_err:
+	free(path);
+	return false;
+}
+
+/**
+ * nsm_use_journal - choose how monitor records are kept
+ * @enable: true to keep them in a journal, false in a file per host
+ * @commit_ms: longest time an added record may wait to be written to
+ *	stable storage, in milliseconds; zero to write each at once
+ *
+ * Records kept the other way are moved.  Without a call to this
+ * function, the journal is used if it exists.  Call while still
+ * privileged, before other programs use the records.
+ *
+ * Returns true if successful, otherwise false.
+ */
+_Bool
+nsm_use_journal(const _Bool enable, const unsigned int commit_ms)
+{
+	nsm_journal_commit_ms = commit_ms;
+	if (enable)
+		return nsm_journal_import();
+	return nsm_journal_export();
+}
+
+/**
+ * nsm_sync_records - write delayed monitor records to stable storage
+ *
+ * Returns the number of milliseconds until this should next be
+ * called, or -1 if no records are waiting.
+ */
+int
+nsm_sync_records(void)
+{
+	long long now;
+
+	if (nsm_journal_due == 0)
+		return -1;
+	now = nsm_now_ms();
+	if (now < nsm_journal_due)
+		return (int)(nsm_journal_due - now);
+	nsm_journal_sync();
+	return -1;
 }
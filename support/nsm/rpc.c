@@ -34,6 +34,10 @@
 #include <config.h>
 #endif	/* HAVE_CONFIG_H */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE		/* for sendmmsg(2) */
+#endif
+
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/time.h>
@@ -127,18 +131,121 @@ nsm_init_xdrmem(char *msgbuf, const unsigned int msgbuflen,
 }
 
 /*
- * Send a completed RPC call on a socket.
+ * Calls made on the socket passed to nsm_batch_begin() are queued
+ * here until nsm_batch_flush(), and then sent with as few system
+ * calls as possible.
+ */
+#define NSM_BATCH_MAX	64
+
+struct nsm_batch_msg {
+	char			bm_buf[NSM_MAXMSGSIZE];
+	size_t			bm_len;
+	struct sockaddr_storage	bm_addr;
+	socklen_t		bm_addrlen;
+};
+
+static int			nsm_batch_sock = -1;
+static unsigned int		nsm_batch_count;
+static struct nsm_batch_msg	nsm_batch[NSM_BATCH_MAX];
+
+/**
+ * nsm_batch_begin - start queueing calls made on a socket
+ * @sock: datagram socket descriptor
  *
- * Returns true if all the bytes were sent successfully; otherwise
- * false if any error occurred.
+ * Until nsm_batch_flush() is called, the nsm_xmit functions queue
+ * calls on @sock rather than sending them.  Their return values do
+ * not reflect errors in sending calls that were queued.
+ */
+void
+nsm_batch_begin(const int sock)
+{
+	nsm_batch_flush();
+	nsm_batch_sock = sock;
+}
+
+/**
+ * nsm_batch_flush - send the calls queued since nsm_batch_begin()
+ *
+ * Returns the number of calls that were sent, and stops queueing.
+ */
+unsigned int
+nsm_batch_flush(void)
+{
+	unsigned int i, sent = 0;
+#ifdef HAVE_SENDMMSG
+	struct mmsghdr msgs[NSM_BATCH_MAX];
+	struct iovec iov[NSM_BATCH_MAX];
+	int n;
+
+	memset(msgs, 0, sizeof(msgs));
+	for (i = 0; i < nsm_batch_count; i++) {
+		iov[i].iov_base = nsm_batch[i].bm_buf;
+		iov[i].iov_len = nsm_batch[i].bm_len;
+		msgs[i].msg_hdr.msg_name = &nsm_batch[i].bm_addr;
+		msgs[i].msg_hdr.msg_namelen = nsm_batch[i].bm_addrlen;
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+	for (i = 0; i < nsm_batch_count; ) {
+		n = sendmmsg(nsm_batch_sock, msgs + i,
+				nsm_batch_count - i, 0);
+		if (n <= 0) {
+			/* skip the message that failed */
+			xlog(L_ERROR, "%s: sendmmsg failed: %m", __func__);
+			i++;
+			continue;
+		}
+		i += (unsigned int)n;
+		sent += (unsigned int)n;
+	}
+#else	/* !HAVE_SENDMMSG */
+	ssize_t err;
+
+	for (i = 0; i < nsm_batch_count; i++) {
+		err = sendto(nsm_batch_sock, nsm_batch[i].bm_buf,
+				nsm_batch[i].bm_len, 0,
+				(struct sockaddr *)&nsm_batch[i].bm_addr,
+				nsm_batch[i].bm_addrlen);
+		if (err < 0 || (size_t)err != nsm_batch[i].bm_len)
+			xlog(L_ERROR, "%s: sendto failed: %m", __func__);
+		else
+			sent++;
+	}
+#endif	/* !HAVE_SENDMMSG */
+
+	nsm_batch_count = 0;
+	nsm_batch_sock = -1;
+	return sent;
+}
+
+/*
+ * Send a completed RPC call on a socket, or queue it if a batch
+ * has been started on the socket.
+ *
+ * Returns true if all the bytes were sent or queued successfully;
+ * otherwise false if any error occurred.
  */
 static _Bool
 nsm_rpc_sendto(const int sock, const struct sockaddr *sap,
 			const socklen_t salen, XDR *xdrs, void *buf)
 {
 	const size_t buflen = (size_t)xdr_getpos(xdrs);
+	struct nsm_batch_msg *bm;
 	ssize_t err;
 
+	if (sock == nsm_batch_sock && salen <= sizeof(bm->bm_addr)) {
+		if (nsm_batch_count == NSM_BATCH_MAX) {
+			nsm_batch_flush();
+			nsm_batch_sock = sock;
+		}
+		bm = &nsm_batch[nsm_batch_count++];
+		memcpy(bm->bm_buf, buf, buflen);
+		bm->bm_len = buflen;
+		memcpy(&bm->bm_addr, sap, (size_t)salen);
+		bm->bm_addrlen = salen;
+		return true;
+	}
+
 	err = sendto(sock, buf, buflen, 0, sap, salen);
 	if ((err < 0) || ((size_t)err != buflen)) {
 		xlog(L_ERROR, "%s: sendto failed: %m", __func__);
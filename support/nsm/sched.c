@@ -0,0 +1,253 @@
+/*
+ * This file is part of nfs-utils.
+ *
+ * nfs-utils is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * nfs-utils is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with nfs-utils.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * NSM for Linux.
+ *
+ * Retransmission scheduling for statd and sm-notify.  Pending calls
+ * are kept in a binary heap ordered by the time they are next due,
+ * and are found by the XID of a reply in a hash table, so that each
+ * costs O(log n) or O(1) however many peers are being notified.
+ *
+ * The caller embeds a struct nsm_timer and a struct nsm_xid in each
+ * of its own records, and points their data fields at the record.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif	/* HAVE_CONFIG_H */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "nsm.h"
+
+#define NSM_XIDS_INITSIZE	256	/* a power of two */
+
+/* Is @a due before @b? */
+static _Bool
+nsm_timer_before(const struct nsm_timer *a, const struct nsm_timer *b)
+{
+	if (a->nt_when != b->nt_when)
+		return a->nt_when < b->nt_when;
+	if (a->nt_prio != b->nt_prio)
+		return a->nt_prio > b->nt_prio;
+	return a->nt_seq < b->nt_seq;
+}
+
+static void
+nsm_timer_place(struct nsm_timers *ts, struct nsm_timer *t, unsigned int i)
+{
+	ts->ts_heap[i] = t;
+	t->nt_slot = i + 1;
+}
+
+static void
+nsm_timer_up(struct nsm_timers *ts, unsigned int i)
+{
+	struct nsm_timer *t = ts->ts_heap[i];
+	unsigned int parent;
+
+	while (i > 0) {
+		parent = (i - 1) / 2;
+		if (!nsm_timer_before(t, ts->ts_heap[parent]))
+			break;
+		nsm_timer_place(ts, ts->ts_heap[parent], i);
+		i = parent;
+	}
+	nsm_timer_place(ts, t, i);
+}
+
+static void
+nsm_timer_down(struct nsm_timers *ts, unsigned int i)
+{
+	struct nsm_timer *t = ts->ts_heap[i];
+	unsigned int child;
+
+	for (;;) {
+		child = 2 * i + 1;
+		if (child >= ts->ts_count)
+			break;
+		if (child + 1 < ts->ts_count &&
+		    nsm_timer_before(ts->ts_heap[child + 1],
+						ts->ts_heap[child]))
+			child++;
+		if (!nsm_timer_before(ts->ts_heap[child], t))
+			break;
+		nsm_timer_place(ts, ts->ts_heap[child], i);
+		i = child;
+	}
+	nsm_timer_place(ts, t, i);
+}
+
+/**
+ * nsm_timer_set - schedule a timer, or move it
+ * @ts: timer heap
+ * @t: timer to schedule; need not be idle
+ * @when: time @t is due
+ *
+ * Timers due at the same time come due in descending order of their
+ * nt_prio fields, and then in the order they were set.  Returns true
+ * if successful, or false if memory ran out; @t is then idle.
+ */
+_Bool
+nsm_timer_set(struct nsm_timers *ts, struct nsm_timer *t, const time_t when)
+{
+	struct nsm_timer **heap;
+	unsigned int size;
+
+	nsm_timer_cancel(ts, t);
+
+	if (ts->ts_count >= ts->ts_size) {
+		size = ts->ts_size ? ts->ts_size << 1 : 64;
+		heap = realloc(ts->ts_heap, size * sizeof(*heap));
+		if (heap == NULL)
+			return false;
+		ts->ts_heap = heap;
+		ts->ts_size = size;
+	}
+
+	t->nt_when = when;
+	t->nt_seq = ts->ts_seq++;
+	ts->ts_heap[ts->ts_count] = t;
+	nsm_timer_up(ts, ts->ts_count++);
+	return true;
+}
+
+/**
+ * nsm_timer_cancel - make a timer idle
+ * @ts: timer heap
+ * @t: timer to cancel; may already be idle
+ *
+ */
+void
+nsm_timer_cancel(struct nsm_timers *ts, struct nsm_timer *t)
+{
+	struct nsm_timer *last;
+	unsigned int i;
+
+	if (t->nt_slot == 0)
+		return;
+	i = t->nt_slot - 1;
+	t->nt_slot = 0;
+
+	last = ts->ts_heap[--ts->ts_count];
+	if (last == t)
+		return;
+	nsm_timer_place(ts, last, i);
+	if (i > 0 && nsm_timer_before(last, ts->ts_heap[(i - 1) / 2]))
+		nsm_timer_up(ts, i);
+	else
+		nsm_timer_down(ts, i);
+}
+
+/**
+ * nsm_timer_first - find the timer that is due first
+ * @ts: timer heap
+ *
+ * Returns the timer, or NULL if none is scheduled.
+ */
+struct nsm_timer *
+nsm_timer_first(const struct nsm_timers *ts)
+{
+	return ts->ts_count ? ts->ts_heap[0] : NULL;
+}
+
+static struct nsm_xid **
+nsm_xid_bucket(const struct nsm_xids *xs, const uint32_t xid)
+{
+	/* XIDs are handed out in sequence; spread them anyway */
+	return &xs->xs_table[(xid * 2654435761U) & (xs->xs_size - 1)];
+}
+
+static void
+nsm_xid_grow(struct nsm_xids *xs)
+{
+	struct nsm_xid **table, **old = xs->xs_table, *x, *next;
+	unsigned int size, oldsize = xs->xs_size, i;
+
+	size = oldsize ? oldsize << 1 : NSM_XIDS_INITSIZE;
+	table = calloc(size, sizeof(*table));
+	if (table == NULL)
+		return;		/* chains just get longer */
+
+	xs->xs_table = table;
+	xs->xs_size = size;
+	for (i = 0; i < oldsize; i++)
+		for (x = old[i]; x != NULL; x = next) {
+			next = x->nx_next;
+			x->nx_next = *nsm_xid_bucket(xs, x->nx_xid);
+			*nsm_xid_bucket(xs, x->nx_xid) = x;
+		}
+	free(old);
+}
+
+/**
+ * nsm_xid_set - record the XID of the call a reply is awaited for
+ * @xs: XID table
+ * @x: entry to record; need not be idle
+ * @xid: XID of the call just sent, or zero to forget @x
+ *
+ */
+void
+nsm_xid_set(struct nsm_xids *xs, struct nsm_xid *x, const uint32_t xid)
+{
+	struct nsm_xid **xpp;
+
+	if (x->nx_xid != 0) {
+		for (xpp = nsm_xid_bucket(xs, x->nx_xid); *xpp != NULL;
+		     xpp = &(*xpp)->nx_next)
+			if (*xpp == x) {
+				*xpp = x->nx_next;
+				break;
+			}
+		xs->xs_count--;
+		x->nx_xid = 0;
+	}
+	if (xid == 0)
+		return;
+
+	if (xs->xs_count >= xs->xs_size)
+		nsm_xid_grow(xs);
+	if (xs->xs_size == 0)
+		return;
+	x->nx_xid = xid;
+	xpp = nsm_xid_bucket(xs, xid);
+	x->nx_next = *xpp;
+	*xpp = x;
+	xs->xs_count++;
+}
+
+/**
+ * nsm_xid_find - find the entry a reply is for
+ * @xs: XID table
+ * @xid: XID of the reply
+ *
+ * Returns the entry recorded with @xid, or NULL if there is none.
+ */
+struct nsm_xid *
+nsm_xid_find(const struct nsm_xids *xs, const uint32_t xid)
+{
+	struct nsm_xid *x;
+
+	if (xs->xs_size == 0 || xid == 0)
+		return NULL;
+	for (x = *nsm_xid_bucket(xs, xid); x != NULL; x = x->nx_next)
+		if (x->nx_xid == xid)
+			return x;
+	return NULL;
+}
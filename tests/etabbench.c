@@ -0,0 +1,157 @@
+/*
+ * etabbench.c -- measure the cost of reading an etab file
+ *
+ * Writes an etab of the requested size to a temporary file and reports
+ * how many entries per second getexportent() and exportmap_next() can
+ * parse from it.  The file is read several times and the best pass is
+ * reported, so the page cache is warm for both parsers.
+ *
+ * Usage: etabbench [entries [passes]]
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "nfslib.h"
+#include "xlog.h"
+
+static double
+bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+bench_write(const char *fname, const unsigned int count)
+{
+	static const char *hosts[] = {
+		"*", "@trusted", "192.0.2.0/24", "client.example.com",
+	};
+	unsigned int i;
+	FILE *fp;
+
+	fp = fopen(fname, "w");
+	if (fp == NULL)
+		return 0;
+	for (i = 0; i < count; i++)
+		fprintf(fp, "/srv/nfs/projects/group%04u/volume%06u\t%s("
+			"rw,sync,wdelay,hide,nocrossmnt,secure,root_squash,"
+			"no_all_squash,no_subtree_check,secure_locks,acl,"
+			"anonuid=65534,anongid=65534,sec=sys,rw,root_squash,"
+			"no_all_squash)\n",
+			i % 97, i, hosts[i % 4]);
+	return fclose(fp) == 0;
+}
+
+static unsigned int
+bench_getexportent(const char *fname)
+{
+	unsigned int count = 0;
+
+	setexportent((char *)fname, "r");
+	while (getexportent(0, 0) != NULL)
+		count++;
+	endexportent();
+	return count;
+}
+
+static unsigned int
+bench_exportmap(const char *fname)
+{
+	struct exportmap *map;
+	unsigned int count = 0;
+
+	map = exportmap_open(fname);
+	if (map == NULL)
+		return 0;
+	while (exportmap_next(map) != NULL)
+		count++;
+	exportmap_close(map);
+	return count;
+}
+
+static double
+bench_run(unsigned int (*fn)(const char *), const char *fname,
+		const unsigned int count, const unsigned int passes)
+{
+	double start, best = 0;
+	unsigned int i, n;
+
+	for (i = 0; i < passes; i++) {
+		start = bench_now();
+		n = fn(fname);
+		start = bench_now() - start;
+		if (n != count) {
+			fprintf(stderr, "read %u of %u entries\n", n, count);
+			return 0;
+		}
+		if (best == 0 || start < best)
+			best = start;
+	}
+	return count / best;
+}
+
+int
+main(int argc, char **argv)
+{
+	unsigned int count = 100000, passes = 5;
+	char fname[] = "/tmp/etabbench.XXXXXX";
+	int fd, ret = 1;
+
+	xlog_stderr(1);
+	xlog_syslog(0);
+
+	if (argc > 1)
+		count = strtoul(argv[1], NULL, 10);
+	if (argc > 2)
+		passes = strtoul(argv[2], NULL, 10);
+	if (count == 0 || passes == 0) {
+		fprintf(stderr, "usage: %s [entries [passes]]\n", argv[0]);
+		return 1;
+	}
+
+	fd = mkstemp(fname);
+	if (fd < 0) {
+		perror("mkstemp");
+		return 1;
+	}
+	close(fd);
+	if (!bench_write(fname, count)) {
+		perror(fname);
+		goto out;
+	}
+
+	printf("%-16s %14s\n", "parser", "entries/sec");
+	printf("%-16s %14.0f\n", "getexportent",
+			bench_run(bench_getexportent, fname, count, passes));
+	printf("%-16s %14.0f\n", "exportmap_next",
+			bench_run(bench_exportmap, fname, count, passes));
+	ret = 0;
+out:
+	unlink(fname);
+	return ret;
+}
@@ -0,0 +1,288 @@
+/*
+ * etabsnap_test.c -- check that an etab snapshot reads back as etab does
+ *
+ * Loads exports with a variety of options into the export table, and
+ * writes etab from it the way xtab_export_write() does, along with its
+ * snapshot.  Every exportent etabsnap_next() returns must then match
+ * the one getexportent() and exportmap_next() parse from etab.  Last,
+ * a snapshot that was truncated or damaged, or that no longer matches
+ * etab, must be refused.
+ *
+ * Usage: etabsnap_test
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "exportfs.h"
+#include "xlog.h"
+
+static const char *test_exports[] = {
+	"/srv/plain\t*(rw,sync,no_subtree_check)\n",
+	"/srv/fsid\t*.example.com(ro,no_subtree_check,fsid=17,"
+		"anonuid=1000,anongid=100)\n",
+	"/srv/root\t192.0.2.0/24(rw,no_subtree_check,fsid=root,"
+		"no_root_squash)\n",
+	"/srv/uuid\t@trusted(rw,no_subtree_check,"
+		"fsid=6f1b2c3d-4e5f-4a6b-8c7d-9e0f1a2b3c4d,mountpoint=/srv)\n",
+	"/srv/sec\t*(no_subtree_check,sec=krb5p:krb5i,rw,sec=sys,ro,"
+		"all_squash)\n",
+	"/srv/refer\t*.example.com(rw,no_subtree_check,"
+		"refer=/srv/refer@server1.example.com)\n",
+	"/srv/replicas\t192.0.2.0/24(ro,subtree_check,replicas="
+		"/srv/r@server1.example.com+/srv/r@server2.example.com)\n",
+	"/srv/squash\t@trusted(rw,no_subtree_check,squash_uids=0-15,"
+		"squash_gids=0-3,anonuid=65534)\n",
+	"/srv/mp\t*(rw,no_subtree_check,mp,no_wdelay,insecure,crossmnt)\n",
+};
+
+#define TEST_COUNT	(sizeof(test_exports) / sizeof(test_exports[0]))
+
+static char	test_dir[] = "/tmp/etabsnap_test.XXXXXX";
+static char	test_etab[64], test_snap[64], test_snaptmp[64];
+
+static int
+test_load(void)
+{
+	struct exportent *eep;
+	char fname[64];
+	nfs_export *exp;
+	unsigned int i;
+	FILE *fp;
+
+	snprintf(fname, sizeof(fname), "%s/exports", test_dir);
+	fp = fopen(fname, "w");
+	if (fp == NULL)
+		return 0;
+	for (i = 0; i < TEST_COUNT; i++)
+		fputs(test_exports[i], fp);
+	if (fclose(fp) != 0)
+		return 0;
+
+	setexportent(fname, "r");
+	for (i = 0; (eep = getexportent(0, 1)) != NULL; i++) {
+		exp = export_create(eep, 0);
+		if (exp == NULL)
+			break;
+		exp->m_xtabent = 1;
+	}
+	endexportent();
+	unlink(fname);
+	if (i != TEST_COUNT)
+		fprintf(stderr, "loaded %u of %zu exports\n", i, TEST_COUNT);
+	return i == TEST_COUNT;
+}
+
+/* Write etab as xtab_export_write() does, then its snapshot */
+static int
+test_write(void)
+{
+	struct exportent xe;
+	nfs_export *exp;
+	FILE *fp;
+	int i;
+
+	fp = fopen(test_etab, "w");
+	if (fp == NULL)
+		return 0;
+	for (i = 0; i < MCL_MAXTYPES; i++)
+		for (exp = exportlist[i].p_head; exp; exp = exp->m_next) {
+			xe = exp->m_export;
+			xe.e_hostname = exp->m_client->m_hostname;
+			fputexportent(fp, &xe);
+		}
+	if (fclose(fp) != 0)
+		return 0;
+	return etabsnap_write(test_etab, test_snap, test_snaptmp) == 0;
+}
+
+static int
+test_same(const struct exportent *a, const struct exportent *b,
+		const char *what, const unsigned int n)
+{
+	if (strcmp(a->e_hostname, b->e_hostname) != 0 ||
+	    strcmp(a->e_path, b->e_path) != 0 ||
+	    !sameexportent(a, b)) {
+		fprintf(stderr, "FAIL: entry %u differs from %s: "
+				"%s:%s vs %s:%s\n", n, what,
+				a->e_hostname, a->e_path,
+				b->e_hostname, b->e_path);
+		return 0;
+	}
+	return 1;
+}
+
+/* Read etab three ways in step, and compare every entry */
+static int
+test_compare(void)
+{
+	struct exportent *se, *me, *ge;
+	struct exportmap *map;
+	struct etabsnap *snap;
+	unsigned int n = 0;
+	int ret = 1;
+
+	snap = etabsnap_open(test_etab, test_snap);
+	if (snap == NULL) {
+		fprintf(stderr, "FAIL: current snapshot was refused\n");
+		return 0;
+	}
+	map = exportmap_open(test_etab);
+	if (map == NULL) {
+		fprintf(stderr, "FAIL: can't map %s\n", test_etab);
+		etabsnap_close(snap);
+		return 0;
+	}
+	setexportent(test_etab, "r");
+
+	for (;;) {
+		se = etabsnap_next(snap);
+		me = exportmap_next(map);
+		ge = getexportent(0, 0);
+		if (se == NULL || me == NULL || ge == NULL) {
+			if (se != NULL || me != NULL || ge != NULL) {
+				fprintf(stderr, "FAIL: entry counts differ "
+					"after %u entries\n", n);
+				ret = 0;
+			}
+			break;
+		}
+
+		if (!test_same(se, me, "exportmap_next", n) ||
+		    !test_same(se, ge, "getexportent", n))
+			ret = 0;
+		n++;
+	}
+
+	endexportent();
+	exportmap_close(map);
+	etabsnap_close(snap);
+	if (ret && n != TEST_COUNT) {
+		fprintf(stderr, "FAIL: read %u of %zu entries\n",
+				n, TEST_COUNT);
+		ret = 0;
+	}
+	return ret;
+}
+
+static int
+test_refused(const char *why)
+{
+	struct etabsnap *snap;
+
+	snap = etabsnap_open(test_etab, test_snap);
+	if (snap == NULL)
+		return 1;
+	fprintf(stderr, "FAIL: %s snapshot was accepted\n", why);
+	etabsnap_close(snap);
+	return 0;
+}
+
+/*
+ * Flip the byte @percent of the way through the snapshot, or drop its
+ * last byte if @percent is negative.
+ */
+static int
+test_damage(const int percent)
+{
+	off_t off;
+	struct stat stb;
+	unsigned char c;
+	int fd, ret = 0;
+
+	fd = open(test_snap, O_RDWR);
+	if (fd < 0 || fstat(fd, &stb) < 0)
+		goto out;
+	off = stb.st_size * percent / 100;
+	if (percent < 0)
+		ret = ftruncate(fd, stb.st_size - 1) == 0;
+	else if (pread(fd, &c, 1, off) == 1) {
+		c ^= 0x5a;
+		ret = pwrite(fd, &c, 1, off) == 1;
+	}
+out:
+	if (fd >= 0)
+		close(fd);
+	return ret;
+}
+
+static int
+test_append(void)
+{
+	FILE *fp;
+
+	fp = fopen(test_etab, "a");
+	if (fp == NULL)
+		return 0;
+	fputs("/srv/late\t*(ro)\n", fp);
+	return fclose(fp) == 0;
+}
+
+int
+main(void)
+{
+	int ret = 1;
+
+	xlog_stderr(1);
+	xlog_syslog(0);
+
+	if (mkdtemp(test_dir) == NULL) {
+		perror("mkdtemp");
+		return 1;
+	}
+	snprintf(test_etab, sizeof(test_etab), "%s/etab", test_dir);
+	snprintf(test_snap, sizeof(test_snap), "%s/etab.snap", test_dir);
+	snprintf(test_snaptmp, sizeof(test_snaptmp), "%s/etab.snaptmp",
+			test_dir);
+
+	if (!test_load() || !test_write()) {
+		fprintf(stderr, "FAIL: can't write etab and its snapshot\n");
+		goto out;
+	}
+	if (!test_compare())
+		goto out;
+
+	/* a byte short */
+	if (!test_damage(-1) || !test_refused("truncated"))
+		goto out;
+
+	/* a byte changed halfway through */
+	if (!test_write() || !test_damage(50) || !test_refused("damaged"))
+		goto out;
+
+	/* etab changed behind the snapshot's back */
+	if (!test_write() || !test_append() || !test_refused("stale"))
+		goto out;
+	ret = 0;
+out:
+	unlink(test_etab);
+	unlink(test_snap);
+	unlink(test_snaptmp);
+	rmdir(test_dir);
+	if (ret == 0)
+		printf("PASS: %zu exports read back alike\n", TEST_COUNT);
+	return ret;
+}
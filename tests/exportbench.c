@@ -0,0 +1,162 @@
+/*
+ * exportbench.c -- measure in-core export table lookups
+ *
+ * Fills the export table with a growing number of exports of long,
+ * similar paths, and reports the average cost of export_lookup() and
+ * export_allowed() at each size, the latter both for exported paths
+ * and for paths several directories below them.  With a working hash
+ * the cost should stay flat as the table grows.
+ *
+ * Usage: exportbench [max-exports [lookups]]
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "exportfs.h"
+#include "xlog.h"
+
+static char hostname[] = "*";
+
+static void
+bench_path(char *buf, const size_t len, const unsigned int i)
+{
+	snprintf(buf, len, "/srv/nfs/projects/group%04u/volume%06u",
+			i % 97, i);
+}
+
+static double
+bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int
+bench_fill(const unsigned int count)
+{
+	struct exportent *eep;
+	nfs_export *exp;
+	char path[NFS_MAXPATHLEN];
+	unsigned int i;
+
+	export_freeall();
+	for (i = 0; i < count; i++) {
+		bench_path(path, sizeof(path), i);
+		eep = mkexportent(hostname, path, "ro");
+		if (eep == NULL)
+			return 0;
+		exp = export_create(eep, 0);
+		if (exp == NULL)
+			return 0;
+		exp->m_mayexport = 1;
+	}
+	return 1;
+}
+
+static double
+bench_lookup(const unsigned int count, const unsigned int lookups)
+{
+	char path[NFS_MAXPATHLEN];
+	unsigned int i, found = 0;
+	double start;
+
+	start = bench_now();
+	for (i = 0; i < lookups; i++) {
+		bench_path(path, sizeof(path), (i * 7919) % count);
+		if (export_lookup(hostname, path, 0) != NULL)
+			found++;
+	}
+	if (found != lookups)
+		fprintf(stderr, "export_lookup missed %u exports\n",
+				lookups - found);
+	return (bench_now() - start) / lookups;
+}
+
+static double
+bench_allowed(const unsigned int count, const unsigned int lookups,
+		const struct addrinfo *ai, const char *below)
+{
+	char path[NFS_MAXPATHLEN];
+	unsigned int i, found = 0;
+	double start;
+	size_t len;
+
+	start = bench_now();
+	for (i = 0; i < lookups; i++) {
+		bench_path(path, sizeof(path), (i * 7919) % count);
+		len = strlen(path);
+		snprintf(path + len, sizeof(path) - len, "%s", below);
+		if (export_allowed(ai, path) != NULL)
+			found++;
+	}
+	if (found != lookups)
+		fprintf(stderr, "export_allowed missed %u exports\n",
+				lookups - found);
+	return (bench_now() - start) / lookups;
+}
+
+int
+main(int argc, char **argv)
+{
+	unsigned int max = 16384, lookups = 100000, count;
+	struct addrinfo *ai;
+
+	xlog_stderr(1);
+	xlog_syslog(0);
+
+	if (argc > 1)
+		max = strtoul(argv[1], NULL, 10);
+	if (argc > 2)
+		lookups = strtoul(argv[2], NULL, 10);
+	if (max == 0 || lookups == 0) {
+		fprintf(stderr, "usage: %s [max-exports [lookups]]\n",
+				argv[0]);
+		return 1;
+	}
+
+	ai = host_pton("192.0.2.1");
+	if (ai == NULL)
+		return 1;
+
+	printf("%10s %14s %14s %14s\n", "exports", "lookup (ns)",
+			"allowed (ns)", "below (ns)");
+	for (count = 16; count <= max; count <<= 1) {
+		if (!bench_fill(count)) {
+			fprintf(stderr, "failed to create %u exports\n", count);
+			return 1;
+		}
+		printf("%10u %14.1f %14.1f %14.1f\n", count,
+				bench_lookup(count, lookups),
+				bench_allowed(count, lookups, ai, ""),
+				bench_allowed(count, lookups, ai,
+					"/home/user/src/project/file.c"));
+	}
+
+	export_freeall();
+	freeaddrinfo(ai);
+	return 0;
+}
@@ -0,0 +1,95 @@
+#!/bin/bash
+#
+# statd_journal -- test mon/unmon with statd keeping its records in a journal
+#
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the GNU General Public License
+# as published by the Free Software Foundation; either version 2
+# of the License, or (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software Foundation, Inc.,
+# 51 Franklin Street, Fifth Floor, Boston, MA 0211-1301 USA
+#
+
+. ./test-lib.sh
+
+# This test needs root privileges
+check_root
+
+JOURNAL=/var/lib/nfs/sm.journal
+
+# wait for statd to unregister, so that it can be started again
+wait_statd_down() {
+	for i in 1 2 3 4 5 6 7 8 9 10; do
+		rpcinfo -u 127.0.0.1 status 1 &> /dev/null || return 0
+		sleep 1
+	done
+	return 1
+}
+
+start_statd --journal 0
+if [ $? -ne 0 ]; then
+	echo "FAIL: problem starting statd"
+	exit 1
+fi
+
+if [ ! -f $JOURNAL ]; then
+	echo "FAIL: statd did not create $JOURNAL"
+	kill_statd
+	exit 1
+fi
+
+COOKIE=`echo $$ | md5sum | cut -d' ' -f1`
+MON_NAME=`hostname`
+
+nsm_client mon $MON_NAME $COOKIE
+if [ $? -ne 0 ]; then
+	echo "FAIL: mon failed"
+	kill_statd
+	exit 1
+fi
+
+statdb_dump | grep $MON_NAME | grep -q $COOKIE
+if [ $? -ne 0 ]; then
+	echo "FAIL: monitor DB doesn't seem to contain entry"
+	kill_statd
+	exit 1
+fi
+
+nsm_client unmon $MON_NAME
+if [ $? -ne 0 ]; then
+	echo "FAIL: unmon failed"
+	kill_statd
+	exit 1
+fi
+
+statdb_dump | grep $MON_NAME | grep -q $COOKIE
+if [ $? -eq 0 ]; then
+	echo "FAIL: monitor DB still contains entry after unmon"
+	kill_statd
+	exit 1
+fi
+
+kill_statd
+wait_statd_down
+
+# put the records back in a file per host
+start_statd --no-journal
+if [ $? -ne 0 ]; then
+	echo "FAIL: problem restarting statd"
+	exit 1
+fi
+
+if [ -f $JOURNAL ]; then
+	echo "FAIL: statd did not remove $JOURNAL"
+	kill_statd
+	exit 1
+fi
+
+kill_statd
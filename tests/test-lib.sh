@@ -51,7 +51,7 @@ start_statd() {
 		echo "             be down when starting this test"
 		return 1
 	fi
-	$srcdir/../utils/statd/statd --no-notify
+	$srcdir/../utils/statd/statd --no-notify "$@"
 }
 
 # shut down statd
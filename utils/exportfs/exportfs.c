@@ -26,12 +26,17 @@
 #include <netdb.h>
 #include <errno.h>
 #include <dirent.h>
+#include <ctype.h>
+#include <time.h>
+#include <pthread.h>
 
 #include "sockaddr.h"
 #include "misc.h"
 #include "nfslib.h"
 #include "exportfs.h"
 #include "xlog.h"
+#include "xmalloc.h"
+#include "xio.h"
 
 static void	export_all(int verbose);
 static void	exportfs(char *arg, char *options, int verbose);
@@ -40,9 +45,53 @@ static void	exports_update(int verbose);
 static void	dump(int verbose);
 static void	error(nfs_export *exp, int err);
 static void	usage(const char *progname);
-static void	validate_export(nfs_export *exp);
+static void	validate_export(nfs_export *exp, int verbose);
+static void	validate_exports_run(void);
+static void	exports_read(char *fname);
+static void	exports_read_run(void);
 static int	matchhostname(const char *hostname1, const char *hostname2);
 static void	export_d_read(const char *dname);
+struct etab_snap;
+static struct etab_snap *etab_read(void);
+static void	etab_free(struct etab_snap *snap);
+static void	flush_changes(struct etab_snap *old, int force, int reexport,
+				int verbose);
+
+/*
+ * With -j, validate_export() queues exports, and validate_exports_run()
+ * checks several of them at once; some file systems are slow to stat.
+ * Likewise, exports_read() queues the entries of the exports files, and
+ * exports_read_run() resolves the client names they mention at once.
+ */
+#define VALIDATE_MAXJOBS	64
+#define VALIDATE_MSGLEN		(NFS_MAXPATHLEN + 64)
+
+struct validate_job {
+	nfs_export *	v_exp;
+	int		v_verbose;
+	int		v_done;
+	char		v_msg[VALIDATE_MSGLEN];
+};
+
+static int			validate_jobs = 1;
+static struct validate_job *	validate_queue;
+static unsigned int		validate_count;
+static unsigned int		validate_max;
+static unsigned int		validate_next;
+static unsigned int		validate_reported;
+static pthread_mutex_t		validate_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct resolve_job {
+	char *			r_name;
+	struct addrinfo *	r_ai;
+};
+
+static struct exportent *	read_queue;
+static unsigned int		read_count;
+static unsigned int		read_max;
+static struct resolve_job *	resolve_queue;
+static unsigned int		resolve_count;
+static unsigned int		resolve_next;
 
 int
 main(int argc, char **argv)
@@ -57,6 +106,8 @@ main(int argc, char **argv)
 	int	i, c;
 	int	new_cache = 0;
 	int	force_flush = 0;
+	struct etab_snap *old_etab = NULL;
+	char	*end;
 
 	if ((progname = strrchr(argv[0], '/')) != NULL)
 		progname++;
@@ -69,7 +120,7 @@ main(int argc, char **argv)
 
 	export_errno = 0;
 
-	while ((c = getopt(argc, argv, "aio:ruvf")) != EOF) {
+	while ((c = getopt(argc, argv, "aio:ruvfj:")) != EOF) {
 		switch(c) {
 		case 'a':
 			f_all = 1;
@@ -93,6 +144,15 @@ main(int argc, char **argv)
 		case 'f':
 			force_flush = 1;
 			break;
+		case 'j':
+			validate_jobs = strtol(optarg, &end, 10);
+			if (*end != '\0' || validate_jobs < 1 ||
+			    validate_jobs > VALIDATE_MAXJOBS) {
+				xlog(L_ERROR, "-j needs a number of jobs "
+					"between 1 and %d", VALIDATE_MAXJOBS);
+				return 1;
+			}
+			break;
 		default:
 			usage(progname);
 			break;
@@ -130,8 +190,9 @@ main(int argc, char **argv)
 		}
 	}
 	if (f_export && ! f_ignore) {
-		export_read(_PATH_EXPORTS);
+		exports_read(_PATH_EXPORTS);
 		export_d_read(_PATH_EXPORTS_D);
+		exports_read_run();
 	}
 	if (f_export) {
 		if (f_all)
@@ -139,6 +200,7 @@ main(int argc, char **argv)
 		else
 			for (i = optind; i < argc ; i++)
 				exportfs(argv[i], options, f_verbose);
+		validate_exports_run();
 	}
 	/* If we are unexporting everything, then
 	 * don't care about what should be exported, as that
@@ -160,18 +222,40 @@ main(int argc, char **argv)
 		xtab_mount_read();
 		exports_update(f_verbose);
 	}
+	if (new_cache)
+		old_etab = etab_read();
 	xtab_export_write();
+	if (f_reexport)
+		/* even if etab is unchanged, DNS or netgroups may not be */
+		xtab_export_touch();
 	if (new_cache)
-		cache_flush(force_flush);
+		flush_changes(old_etab, force_flush, f_reexport, f_verbose);
+	etab_free(old_etab);
 	if (!new_cache)
 		xtab_mount_write();
 
 	return export_errno;
 }
 
-static void
+/* In verbose mode, report progress after this many kernel updates */
+#define UPDATE_PROGRESS	1000
+
+static double
+elapsed_ms(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1e3 +
+		(now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+/* Returns the number of kernel updates made for @exp */
+static int
 exports_update_one(nfs_export *exp, int verbose)
 {
+	int updates = 0;
+
 		/* check mountpoint option */
 	if (exp->m_mayexport &&
 	    exp->m_export.e_mountpoint &&
@@ -190,6 +274,7 @@ exports_update_one(nfs_export *exp, int verbose)
 			       exp->m_export.e_path);
 		if (!export_export(exp))
 			error(exp, errno);
+		updates++;
 	}
 	if (exp->m_exported && ! exp->m_mayexport) {
 		if (verbose)
@@ -198,7 +283,9 @@ exports_update_one(nfs_export *exp, int verbose)
 			       exp->m_export.e_path);
 		if (!export_unexport(exp))
 			error(exp, errno);
+		updates++;
 	}
+	return updates;
 }
 
 
@@ -210,14 +297,274 @@ exports_update_one(nfs_export *exp, int verbose)
 static void
 exports_update(int verbose)
 {
+	static const int types[] = { MCL_FQDN, MCL_GSS };
+	struct timespec start;
+	unsigned int updates = 0, next = UPDATE_PROGRESS;
 	nfs_export 	*exp;
+	unsigned int	i;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < sizeof(types) / sizeof(types[0]); i++)
+		for (exp = exportlist[types[i]].p_head; exp; exp=exp->m_next) {
+			updates += exports_update_one(exp, verbose);
+			if (verbose && updates >= next) {
+				printf("%u kernel updates, %.0f ms\n",
+					updates, elapsed_ms(&start));
+				next += UPDATE_PROGRESS;
+			}
+		}
+	if (verbose && updates)
+		printf("made %u kernel updates in %.1f ms\n",
+			updates, elapsed_ms(&start));
+}
+
+/*
+ * Flushing only what changed.  etab is written the same way every
+ * time, so the kernel holds nothing stale for an export whose etab
+ * line is unchanged.  The lines of the etab about to be replaced are
+ * kept, and compared with those of the new etab once it is written.
+ */
+#define ETAB_SET_SIZE	4096	/* a power of two */
+
+struct etab_str {
+	struct etab_str *	s_next;
+	unsigned int		s_hash;
+	int			s_seen;
+	char *			s_str;
+};
+
+struct etab_set {
+	unsigned int		s_count;
+	struct etab_str *	s_table[ETAB_SET_SIZE];
+};
+
+struct etab_snap {
+	struct etab_set		es_lines;
+	struct etab_set		es_names;	/* client names */
+};
+
+static struct etab_str *
+etab_set_find(struct etab_set *set, const char *str, unsigned int hash)
+{
+	struct etab_str *s;
+
+	for (s = set->s_table[hash & (ETAB_SET_SIZE - 1)]; s; s = s->s_next)
+		if (s->s_hash == hash && strcmp(s->s_str, str) == 0)
+			return s;
+	return NULL;
+}
+
+static struct etab_str *
+etab_set_add(struct etab_set *set, const char *str)
+{
+	unsigned int hash = fnv1a_str(str);
+	struct etab_str **sp, *s;
+
+	s = etab_set_find(set, str, hash);
+	if (s != NULL)
+		return s;
+
+	sp = &set->s_table[hash & (ETAB_SET_SIZE - 1)];
+	s = xmalloc(sizeof(*s));
+	s->s_next = *sp;
+	s->s_hash = hash;
+	s->s_seen = 0;
+	s->s_str = xstrdup(str);
+	*sp = s;
+	set->s_count++;
+	return s;
+}
+
+static void
+etab_set_free(struct etab_set *set)
+{
+	struct etab_str *s, *next;
+	int i;
+
+	for (i = 0; i < ETAB_SET_SIZE; i++)
+		for (s = set->s_table[i]; s; s = next) {
+			next = s->s_next;
+			xfree(s->s_str);
+			xfree(s);
+		}
+}
+
+static void
+etab_free(struct etab_snap *snap)
+{
+	if (snap == NULL)
+		return;
+	etab_set_free(&snap->es_lines);
+	etab_set_free(&snap->es_names);
+	xfree(snap);
+}
 
-	for (exp = exportlist[MCL_FQDN].p_head; exp; exp=exp->m_next) {
-		exports_update_one(exp, verbose);
+/*
+ * Read the lines of etab, and the client names they mention.
+ * Returns NULL if etab can't be read.
+ */
+static struct etab_snap *
+etab_read(void)
+{
+	struct etab_snap *snap;
+	char *line = NULL, *name, *end;
+	size_t len = 0;
+	ssize_t n;
+	int lockid;
+	FILE *f;
+
+	if ((lockid = xflock(_PATH_ETABLCK, "r")) < 0)
+		return NULL;
+	f = fopen(_PATH_ETAB, "r");
+	if (f == NULL) {
+		xfunlock(lockid);
+		return NULL;
+	}
+
+	snap = xmalloc(sizeof(*snap));
+	memset(snap, 0, sizeof(*snap));
+	while ((n = getline(&line, &len, f)) > 0) {
+		if (line[n - 1] == '\n')
+			line[n - 1] = '\0';
+		etab_set_add(&snap->es_lines, line);
+
+		/* path <tab> name(options) */
+		name = strchr(line, '\t');
+		if (name == NULL || (end = strchr(++name, '(')) == NULL)
+			continue;
+		*end = '\0';
+		etab_set_add(&snap->es_names, name);
 	}
-	for (exp = exportlist[MCL_GSS].p_head; exp; exp=exp->m_next) {
-		exports_update_one(exp, verbose);
+	free(line);
+	fclose(f);
+	xfunlock(lockid);
+	return snap;
+}
+
+/* The path an etab line is for, without putexportent()'s escapes */
+static char *
+etab_path(const char *line, char *buf, const size_t size)
+{
+	size_t i = 0;
+
+	while (*line != '\0' && *line != '\t' && i < size - 1) {
+		if (line[0] == '\\' && isdigit(line[1]) &&
+		    isdigit(line[2]) && isdigit(line[3])) {
+			buf[i++] = (line[1] - '0') << 6 |
+				   (line[2] - '0') << 3 | (line[3] - '0');
+			line += 4;
+		} else
+			buf[i++] = *line++;
 	}
+	buf[i] = '\0';
+	return buf;
+}
+
+/* Do @a and @b hold the same strings? */
+static int
+etab_set_same(struct etab_set *a, struct etab_set *b)
+{
+	struct etab_str *s;
+	int i;
+
+	if (a->s_count != b->s_count)
+		return 0;
+	for (i = 0; i < ETAB_SET_SIZE; i++)
+		for (s = a->s_table[i]; s; s = s->s_next)
+			if (!etab_set_find(b, s->s_str, s->s_hash))
+				return 0;
+	return 1;
+}
+
+/*
+ * Might the addresses the clients in @names stand for have changed
+ * without etab changing, through DNS or netgroup updates?
+ */
+static int
+etab_names_resolved(struct etab_set *names)
+{
+	struct etab_str *s;
+	int i;
+
+	for (i = 0; i < ETAB_SET_SIZE; i++)
+		for (s = names->s_table[i]; s; s = s->s_next)
+			switch (client_gettype(s->s_str)) {
+			case MCL_FQDN:
+			case MCL_NETGROUP:
+			case MCL_WILDCARD:
+				return 1;
+			}
+	return 0;
+}
+
+/*
+ * Make the kernel drop what it knows of the exports that differ
+ * between @old and the etab that has just been written.  Everything
+ * is flushed if @force is set, if @old could not be read, or if the
+ * set of client names has changed, as the kernel's auth.unix.ip
+ * entries name the clients each address belongs to.  With -r, it is
+ * also flushed if any client is named by host name, wildcard or
+ * netgroup, as what those match may have changed since.
+ */
+static void
+flush_changes(struct etab_snap *old, int force, int reexport, int verbose)
+{
+	char path[NFS_MAXPATHLEN + 1];
+	struct etab_snap *new = NULL;
+	struct timespec start;
+	struct etab_set paths;
+	struct etab_str *s, *o;
+	char **list = NULL;
+	unsigned int n = 0;
+	int i, count;
+
+	memset(&paths, 0, sizeof(paths));
+	if (force || old == NULL ||
+	    (new = etab_read()) == NULL ||
+	    !etab_set_same(&old->es_names, &new->es_names)) {
+		cache_flush(force);
+		goto out;
+	}
+	if (reexport && etab_names_resolved(&new->es_names)) {
+		/* etab's mtime may be old, so flush up to now */
+		cache_flush(1);
+		goto out;
+	}
+
+	for (i = 0; i < ETAB_SET_SIZE; i++)
+		for (s = new->es_lines.s_table[i]; s; s = s->s_next) {
+			o = etab_set_find(&old->es_lines, s->s_str, s->s_hash);
+			if (o != NULL)
+				o->s_seen = 1;
+			else
+				etab_set_add(&paths, etab_path(s->s_str,
+							path, sizeof(path)));
+		}
+	for (i = 0; i < ETAB_SET_SIZE; i++)
+		for (o = old->es_lines.s_table[i]; o; o = o->s_next)
+			if (!o->s_seen)
+				etab_set_add(&paths, etab_path(o->s_str,
+							path, sizeof(path)));
+	if (paths.s_count == 0)
+		goto out;
+
+	list = xmalloc(paths.s_count * sizeof(char *));
+	for (i = 0; i < ETAB_SET_SIZE; i++)
+		for (s = paths.s_table[i]; s; s = s->s_next)
+			list[n++] = s->s_str;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	count = cache_expire_paths(list, n);
+	if (count < 0)
+		cache_flush(0);
+	else if (verbose)
+		printf("expired %d kernel cache entries for %u changed "
+			"export paths in %.1f ms\n", count, n,
+			elapsed_ms(&start));
+out:
+	xfree(list);
+	etab_set_free(&paths);
+	etab_free(new);
 }
 			
 /*
@@ -232,15 +579,11 @@ export_all(int verbose)
 
 	for (i = 0; i < MCL_MAXTYPES; i++) {
 		for (exp = exportlist[i].p_head; exp; exp = exp->m_next) {
-			if (verbose)
-				printf("exporting %s:%s\n",
-				       exp->m_client->m_hostname, 
-				       exp->m_export.e_path);
 			exp->m_xtabent = 1;
 			exp->m_mayexport = 1;
 			exp->m_changed = 1;
 			exp->m_warned = 0;
-			validate_export(exp);
+			validate_export(exp, verbose);
 		}
 	}
 }
@@ -280,14 +623,11 @@ exportfs(char *arg, char *options, int verbose)
 	} else if (!updateexportent(&exp->m_export, options))
 		goto out;
 
-	if (verbose)
-		printf("exporting %s:%s\n", exp->m_client->m_hostname, 
-			exp->m_export.e_path);
 	exp->m_xtabent = 1;
 	exp->m_mayexport = 1;
 	exp->m_changed = 1;
 	exp->m_warned = 0;
-	validate_export(exp);
+	validate_export(exp, verbose);
 
 out:
 	freeaddrinfo(ai);
@@ -354,9 +694,15 @@ unexportfs(char *arg, int verbose)
 
 static int can_test(void)
 {
+	static int tested = -1;
 	int fd;
 	int n;
 	char *setup = "nfsd 0.0.0.0 2147483647 -test-client-\n";
+
+	/* the test client never expires, so set it up once per run */
+	if (tested >= 0)
+		return tested;
+	tested = 0;
 	fd = open("/proc/net/rpc/auth.unix.ip/channel", O_WRONLY);
 	if ( fd < 0) return 0;
 	n = write(fd, setup, strlen(setup));
@@ -366,6 +712,7 @@ static int can_test(void)
 	fd = open("/proc/net/rpc/nfsd.export/channel", O_WRONLY);
 	if ( fd < 0) return 0;
 	close(fd);
+	tested = 1;
 	return 1;
 }
 
@@ -387,25 +734,30 @@ static int test_export(char *path, int with_fsid)
 	return 1;
 }
 
+/*
+ * Check that the given export point is potentially exportable.
+ * We just give warnings here, don't cause anything to fail.
+ * If a path doesn't exist, or is not a dir or file, give an warning
+ * otherwise trial-export to '-test-client-' and check for failure.
+ * The warning is left in @msg rather than logged, so that several
+ * exports can be checked at once.
+ */
 static void
-validate_export(nfs_export *exp)
+check_export(nfs_export *exp, char *msg, const size_t len)
 {
-	/* Check that the given export point is potentially exportable.
-	 * We just give warnings here, don't cause anything to fail.
-	 * If a path doesn't exist, or is not a dir or file, give an warning
-	 * otherwise trial-export to '-test-client-' and check for failure.
-	 */
 	struct stat stb;
 	char *path = exp->m_export.e_path;
 	struct statfs64 stf;
 	int fs_has_fsid = 0;
 
+	msg[0] = '\0';
 	if (stat(path, &stb) < 0) {
-		xlog(L_ERROR, "Failed to stat %s: %m", path);
+		snprintf(msg, len, "Failed to stat %s: %s", path,
+			strerror(errno));
 		return;
 	}
 	if (!S_ISDIR(stb.st_mode) && !S_ISREG(stb.st_mode)) {
-		xlog(L_ERROR, "%s is neither a directory nor a file. "
+		snprintf(msg, len, "%s is neither a directory nor a file. "
 			"Remote access will fail", path);
 		return;
 	}
@@ -419,17 +771,227 @@ validate_export(nfs_export *exp)
 	if ((exp->m_export.e_flags & NFSEXP_FSID) || exp->m_export.e_uuid ||
 	    fs_has_fsid) {
 		if ( !test_export(path, 1)) {
-			xlog(L_ERROR, "%s does not support NFS export", path);
+			snprintf(msg, len, "%s does not support NFS export",
+				path);
 			return;
 		}
 	} else if ( ! test_export(path, 0)) {
 		if (test_export(path, 1))
-			xlog(L_ERROR, "%s requires fsid= for NFS export", path);
+			snprintf(msg, len, "%s requires fsid= for NFS export",
+				path);
 		else
-			xlog(L_ERROR, "%s does not support NFS export", path);
+			snprintf(msg, len, "%s does not support NFS export",
+				path);
+		return;
+
+	}
+}
+
+/* Announce @exp if @verbose, then give the warning left in @msg */
+static void
+validate_report(nfs_export *exp, const int verbose, const char *msg)
+{
+	if (verbose)
+		printf("exporting %s:%s\n", exp->m_client->m_hostname,
+		       exp->m_export.e_path);
+	if (msg[0] != '\0')
+		xlog(L_ERROR, "%s", msg);
+}
+
+static void
+validate_export(nfs_export *exp, int verbose)
+{
+	struct validate_job *job;
+	char msg[VALIDATE_MSGLEN];
+
+	if (validate_jobs <= 1) {
+		check_export(exp, msg, sizeof(msg));
+		validate_report(exp, verbose, msg);
 		return;
+	}
+
+	if (validate_count == validate_max) {
+		validate_max = validate_max ? validate_max << 1 : 64;
+		validate_queue = xrealloc(validate_queue,
+				validate_max * sizeof(*validate_queue));
+	}
+	job = &validate_queue[validate_count++];
+	job->v_exp = exp;
+	job->v_verbose = verbose;
+	job->v_done = 0;
+}
+
+static void *
+validate_worker(void *UNUSED(arg))
+{
+	struct validate_job *job;
+
+	for (;;) {
+		pthread_mutex_lock(&validate_lock);
+		job = validate_next < validate_count ?
+			&validate_queue[validate_next++] : NULL;
+		pthread_mutex_unlock(&validate_lock);
+		if (job == NULL)
+			break;
+		check_export(job->v_exp, job->v_msg, sizeof(job->v_msg));
+
+		/* report every job checked so far that none before awaits */
+		pthread_mutex_lock(&validate_lock);
+		job->v_done = 1;
+		while (validate_reported < validate_count &&
+		       validate_queue[validate_reported].v_done) {
+			job = &validate_queue[validate_reported++];
+			validate_report(job->v_exp, job->v_verbose,
+					job->v_msg);
+		}
+		pthread_mutex_unlock(&validate_lock);
+	}
+	return NULL;
+}
 
+/*
+ * Run @worker in up to -j threads, no more than there are @count jobs
+ */
+static void
+validate_pool_run(void *(*worker)(void *), const unsigned int count)
+{
+	pthread_t threads[VALIDATE_MAXJOBS];
+	int n, err;
+
+	for (n = 0; n < validate_jobs - 1 && (unsigned int)n < count; n++) {
+		err = pthread_create(&threads[n], NULL, worker, NULL);
+		if (err) {
+			xlog(L_WARNING, "can't start validation thread: %s",
+				strerror(err));
+			break;
+		}
 	}
+	/* this thread is the last of the -j workers */
+	worker(NULL);
+	while (n-- > 0)
+		pthread_join(threads[n], NULL);
+}
+
+/*
+ * Check the exports queued by validate_export() with up to -j threads.
+ * Each export is reported as soon as it and every export queued before
+ * it have been checked, so the output is in the same order as without
+ * -j.
+ */
+static void
+validate_exports_run(void)
+{
+	if (validate_count == 0)
+		return;
+
+	/* before the workers start, so that they need not race for it */
+	(void)can_test();
+
+	validate_pool_run(validate_worker, validate_count);
+
+	xfree(validate_queue);
+	validate_queue = NULL;
+	validate_count = validate_max = validate_next = 0;
+	validate_reported = 0;
+}
+
+static void
+exports_read(char *fname)
+{
+	struct exportent *eep;
+
+	if (validate_jobs <= 1) {
+		export_read(fname);
+		return;
+	}
+
+	setexportent(fname, "r");
+	while ((eep = getexportent(0, 1)) != NULL) {
+		if (read_count == read_max) {
+			read_max = read_max ? read_max << 1 : 64;
+			read_queue = xrealloc(read_queue,
+					read_max * sizeof(*read_queue));
+		}
+		dupexportent(&read_queue[read_count], eep);
+		read_queue[read_count++].e_hostname =
+					xstrdup(eep->e_hostname);
+	}
+	endexportent();
+}
+
+static void *
+resolve_worker(void *UNUSED(arg))
+{
+	struct resolve_job *job;
+
+	for (;;) {
+		pthread_mutex_lock(&validate_lock);
+		job = resolve_next < resolve_count ?
+			&resolve_queue[resolve_next++] : NULL;
+		pthread_mutex_unlock(&validate_lock);
+		if (job == NULL)
+			break;
+		job->r_ai = host_addrinfo(job->r_name);
+	}
+	return NULL;
+}
+
+/*
+ * Resolve the client names of the entries queued by exports_read()
+ * with up to -j threads.  libexport is not thread-safe, so the results
+ * are handed to it, and the entries added, by this thread alone.
+ */
+static void
+exports_read_run(void)
+{
+	struct exportent *eep;
+	struct etab_set *names;
+	struct etab_str *name;
+	unsigned int i;
+
+	if (read_count == 0)
+		return;
+
+	names = xmalloc(sizeof(*names));
+	memset(names, 0, sizeof(*names));
+	resolve_queue = xmalloc(read_count * sizeof(*resolve_queue));
+	for (i = 0; i < read_count; i++) {
+		if (client_gettype(read_queue[i].e_hostname) != MCL_FQDN)
+			continue;
+		name = etab_set_add(names, read_queue[i].e_hostname);
+		if (name->s_seen)
+			continue;
+		name->s_seen = 1;
+		resolve_queue[resolve_count].r_name = name->s_str;
+		resolve_queue[resolve_count++].r_ai = NULL;
+	}
+
+	validate_pool_run(resolve_worker, resolve_count);
+
+	for (i = 0; i < resolve_count; i++)
+		client_resolved(resolve_queue[i].r_name, resolve_queue[i].r_ai);
+	for (i = 0; i < read_count; i++) {
+		eep = &read_queue[i];
+		export_read_entry(eep);
+		xfree(eep->e_hostname);
+		if (eep->e_nsquids)
+			xfree(eep->e_squids);
+		if (eep->e_nsqgids)
+			xfree(eep->e_sqgids);
+		free(eep->e_mountpoint);
+		free(eep->e_fslocdata);
+		free(eep->e_uuid);
+	}
+	client_resolved_flush();
+
+	etab_set_free(names);
+	xfree(names);
+	xfree(resolve_queue);
+	resolve_queue = NULL;
+	resolve_count = resolve_next = 0;
+	xfree(read_queue);
+	read_queue = NULL;
+	read_count = read_max = 0;
 }
 
 static _Bool
@@ -565,7 +1127,7 @@ export_d_read(const char *dname)
 			continue;
 		}
 
-		export_read(fname);
+		exports_read(fname);
 	}
 		
 	for (i = 0; i < n; i++)
@@ -682,6 +1244,7 @@ error(nfs_export *exp, int err)
 static void
 usage(const char *progname)
 {
-	fprintf(stderr, "usage: %s [-aruv] [host:/path]\n", progname);
+	fprintf(stderr, "usage: %s [-aruv] [-j jobs] [host:/path]\n",
+		progname);
 	exit(1);
 }
@@ -15,6 +15,7 @@
 #include <arpa/inet.h>
 #include <errno.h>
 #include <unistd.h>
+#include <pthread.h>
 
 #include "sockaddr.h"
 #include "misc.h"
@@ -38,10 +39,23 @@ static void		auth_fixpath(char *path);
 static char	*export_file = NULL;
 static nfs_export my_exp;
 static nfs_client my_client;
+static union nfs_sockaddr my_addr;
 
 extern int new_cache;
 extern int use_ipaddr;
 
+/*
+ * In threaded mode the export table is shared by the RPC service loop
+ * and the cache channel threads.  Each request holds it for reading
+ * while it runs; auth_reload() takes it for writing to replace it.
+ */
+static int		auth_threaded;
+static pthread_rwlock_t	auth_lock;
+static pthread_mutex_t	auth_reload_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread int	auth_held;
+static unsigned int	auth_counter;
+static unsigned int	auth_reread;
+
 void
 auth_init(char *exports)
 {
@@ -79,39 +93,149 @@ check_useipaddr(void)
 		cache_flush(1);
 }
 
-unsigned int
-auth_reload()
+/*
+ * A new etab is merged into the export table: exports and clients
+ * that are still listed are kept, so a reload that changes little
+ * costs little.  auth_counter only moves when the table changed.
+ */
+static unsigned int
+auth_reload_etab(void)
 {
+	struct export_delta	delta;
 	struct stat		stb;
 	static ino_t		last_inode;
 	static int		last_fd;
-	static unsigned int	counter;
-	int			fd;
+	int			fd, changed;
 
+	changed = xtab_export_changed();
+	if (!changed)
+		return auth_counter;
 	if ((fd = open(_PATH_ETAB, O_RDONLY)) < 0) {
 		xlog(L_FATAL, "couldn't open %s", _PATH_ETAB);
 	} else if (fstat(fd, &stb) < 0) {
 		xlog(L_FATAL, "couldn't stat %s", _PATH_ETAB);
-	} else if (stb.st_ino == last_inode) {
+	} else if (stb.st_ino == last_inode && changed < XTAB_BUMPED) {
 		close(fd);
-		return counter;
+		return auth_counter;
 	} else {
 		close(last_fd);
 		last_fd = fd;
 		last_inode = stb.st_ino;
 	}
 
-	export_freeall();
+	if (auth_threaded)
+		pthread_rwlock_wrlock(&auth_lock);
 	memset(&my_client, 0, sizeof(my_client));
-	xtab_export_read();
-	check_useipaddr();
+	export_reload_begin(&delta);
+	xtab_export_reload();
+	export_reload_prune(&delta);
 	v4root_set();
+	export_reload_end(&delta);
+	client_netgroup_reload(changed == XTAB_TOUCHED);
+	check_useipaddr();
 
-	++counter;
+	xlog(D_GENERAL, "%s: %u exports added, %u changed, %u removed, "
+			"%u unchanged", _PATH_ETAB, delta.ed_added,
+			delta.ed_changed, delta.ed_removed, delta.ed_kept);
+	client_memstat();
+	if (delta.ed_added || delta.ed_changed || delta.ed_removed)
+		++auth_counter;
+	if (new_cache)
+		cache_prime_exports(&delta);
+	export_delta_release(&delta);
+	++auth_reread;
+	if (auth_threaded)
+		pthread_rwlock_unlock(&auth_lock);
+
+	return auth_counter;
+}
 
+/**
+ * auth_reload - bring the export table up to date with etab
+ *
+ * Returns a counter that changes whenever the contents of the
+ * export table change.
+ */
+unsigned int
+auth_reload()
+{
+	unsigned int counter;
+
+	/* The table can't be replaced under a request that is using it */
+	if (auth_held)
+		return auth_counter;
+
+	if (auth_threaded)
+		pthread_mutex_lock(&auth_reload_lock);
+	counter = auth_reload_etab();
+	if (auth_threaded)
+		pthread_mutex_unlock(&auth_reload_lock);
 	return counter;
 }
 
+/**
+ * auth_reread_count - count the times etab has been read
+ *
+ * Unlike the counter returned by auth_reload(), this changes even
+ * when etab is read again without changes, e.g. after "exportfs -r",
+ * which bumps etab.gen with xtab_export_touch() for that reason.
+ * Answers that depend on DNS or netgroups should be recomputed then.
+ */
+unsigned int
+auth_reread_count(void)
+{
+	return auth_reread;
+}
+
+/**
+ * auth_init_threads - prepare the export table for sharing between threads
+ *
+ * Must be called before any thread other than the main one is started.
+ */
+void
+auth_init_threads(void)
+{
+	pthread_rwlockattr_t attr;
+
+	pthread_rwlockattr_init(&attr);
+	/* don't let a stream of requests hold off a reload for ever */
+	pthread_rwlockattr_setkind_np(&attr,
+			PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+	pthread_rwlock_init(&auth_lock, &attr);
+	pthread_rwlockattr_destroy(&attr);
+	auth_threaded = 1;
+}
+
+/**
+ * auth_hold - bring the export table up to date and pin it
+ *
+ * Until auth_release() is called, the calling thread may look at the
+ * export table, and auth_reload() in that thread will not replace it.
+ * Does nothing unless running threaded.
+ */
+void
+auth_hold(void)
+{
+	if (!auth_threaded)
+		return;
+	auth_reload();
+	pthread_rwlock_rdlock(&auth_lock);
+	auth_held = 1;
+}
+
+/**
+ * auth_release - unpin the export table pinned by auth_hold()
+ *
+ */
+void
+auth_release(void)
+{
+	if (!auth_held)
+		return;
+	auth_held = 0;
+	pthread_rwlock_unlock(&auth_lock);
+}
+
 static char *
 get_client_hostname(const struct sockaddr *caller, struct addrinfo *ai,
 		enum auth_error *error)
@@ -137,7 +261,9 @@ auth_authenticate_newcache(const struct sockaddr *caller,
 			   const char *path, struct addrinfo *ai,
 			   enum auth_error *error)
 {
+	pathidx_node *node;
 	nfs_export *exp;
+	client_match cm;
 	int i;
 
 	free(my_client.m_hostname);
@@ -147,20 +273,22 @@ auth_authenticate_newcache(const struct sockaddr *caller,
 		return NULL;
 
 	my_client.m_naddr = 1;
+	my_client.m_addrlist = &my_addr;
 	set_addrlist(&my_client, 0, caller);
 	my_exp.m_client = &my_client;
 
+	/* the exports of @path, in the order of exportlist[] */
 	exp = NULL;
-	for (i = 0; !exp && i < MCL_MAXTYPES; i++)
-		for (exp = exportlist[i].p_head; exp; exp = exp->m_next) {
-			if (strcmp(path, exp->m_export.e_path))
-				continue;
-			if (!use_ipaddr && !client_member(my_client.m_hostname, exp->m_client->m_hostname))
-				continue;
-			if (use_ipaddr && !client_check(exp->m_client, ai))
-				continue;
-			break;
-		}
+	node = pathidx_lookup(path);
+	client_match_init(&cm, use_ipaddr ? ai : NULL);
+	for (i = 0; !exp && node && i < node->n_count; i++) {
+		exp = node->n_exports[i];
+		if (!use_ipaddr && !client_member(my_client.m_hostname, exp->m_client->m_hostname))
+			exp = NULL;
+		else if (use_ipaddr && !client_match_check(&cm, exp->m_client))
+			exp = NULL;
+	}
+	client_match_release(&cm);
 	*error = not_exported;
 	if (!exp)
 		return NULL;
@@ -205,12 +333,13 @@ nfs_export *
 auth_authenticate(const char *what, const struct sockaddr *caller,
 		const char *path)
 {
+	pathidx_node	*nodes[PATHIDX_MAXDEPTH];
 	nfs_export	*exp = NULL;
 	char		epath[MAXPATHLEN+1];
-	char		*p = NULL;
 	char		buf[INET6_ADDRSTRLEN];
 	struct addrinfo *ai = NULL;
 	enum auth_error	error = bad_path;
+	int		n;
 
 	if (path[0] != '/') {
 		xlog(L_WARNING, "Bad path in %s request from %s: \"%s\"",
@@ -226,17 +355,20 @@ auth_authenticate(const char *what, const struct sockaddr *caller,
 	if (ai == NULL)
 		return exp;
 
-	/* Try the longest matching exported pathname. */
-	while (1) {
-		exp = auth_authenticate_internal(caller, epath, ai, &error);
-		if (exp || (error != not_exported && error != no_entry))
+	/* Try the longest matching exported pathname.  Prefixes that
+	 * are not exported to anyone need not be tried at all. */
+	error = new_cache ? not_exported : no_entry;
+	n = pathidx_walk(epath, nodes, PATHIDX_MAXDEPTH);
+	while (n-- > 0) {
+		exp = auth_authenticate_internal(caller, nodes[n]->n_path,
+						ai, &error);
+		if (exp || (error != not_exported && error != no_entry)) {
+			strcpy(epath, nodes[n]->n_path);
 			break;
-		/* We have to treat the root, "/", specially. */
-		if (p == &epath[1]) break;
-		p = strrchr(epath, '/');
-		if (p == epath) p++;
-		*p = '\0';
+		}
 	}
+	if (!exp && (error == not_exported || error == no_entry))
+		strcpy(epath, "/");
 
 	switch (error) {
 	case bad_path:
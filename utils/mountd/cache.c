@@ -25,10 +25,13 @@
 #include <pwd.h>
 #include <grp.h>
 #include <mntent.h>
+#include <poll.h>
+#include <pthread.h>
 #include "misc.h"
 #include "nfslib.h"
 #include "exportfs.h"
 #include "mountd.h"
+#include "rpcmisc.h"
 #include "xmalloc.h"
 #include "fsloc.h"
 #include "pseudoflavors.h"
@@ -40,8 +43,7 @@
 /*
  * Invoked by RPC service loop
  */
-void	cache_set_fds(fd_set *fdset);
-int	cache_process_req(fd_set *readfds);
+void	cache_add_fds(void);
 
 enum nfsd_fsid {
 	FSID_DEV = 0,
@@ -62,15 +64,163 @@ enum nfsd_fsid {
  * Record is terminated with newline.
  *
  */
-static int cache_export_ent(char *domain, struct exportent *exp, char *p);
+static int cache_export_ent(FILE *f, char *domain, struct exportent *exp,
+			    char *p);
+static FILE *cache_channel(const char *name, int *opened);
 
 #define INITIAL_MANAGED_GROUPS 100
 
-char *lbuf  = NULL;
-int lbuflen = 0;
 extern int use_ipaddr;
 
-static void auth_unix_ip(FILE *f)
+/*
+ * Resolving a client address to a domain name may take several DNS
+ * and netgroup lookups, and the kernel asks again for the same
+ * addresses whenever its own entries expire or are flushed.  So each
+ * answer is remembered for a while, including the answer that no
+ * client matched.  Answers depend on the export table, so they are
+ * all forgotten when it is reloaded.
+ */
+#define IPCACHE_TTL		DEFAULT_TTL
+#define IPCACHE_NEG_TTL		(2 * 60)
+#define IPCACHE_MAX		65536
+#define IPCACHE_INITSIZE	1024	/* a power of two */
+
+struct ipcache_ent {
+	struct ipcache_ent *	ic_next;
+	unsigned int		ic_hash;
+	time_t			ic_expiry;
+	char *			ic_client;	/* NULL if nothing matched */
+	char			ic_addr[INET6_ADDRSTRLEN];
+};
+
+static pthread_mutex_t ipcache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct {
+	unsigned int		generation;
+	unsigned int		size;
+	unsigned int		count;
+	struct ipcache_ent **	hash;
+	unsigned long		hits;
+	unsigned long		misses;
+} ipcache;
+
+static void ipcache_flush(void)
+{
+	struct ipcache_ent *ic, *next;
+	unsigned int i;
+
+	if (ipcache.hits || ipcache.misses)
+		xlog(D_GENERAL, "auth.unix.ip cache: %lu hits, %lu misses, "
+		     "%u entries flushed", ipcache.hits, ipcache.misses,
+		     ipcache.count);
+	for (i = 0; i < ipcache.size; i++)
+		for (ic = ipcache.hash[i]; ic; ic = next) {
+			next = ic->ic_next;
+			free(ic->ic_client);
+			xfree(ic);
+		}
+	xfree(ipcache.hash);
+	ipcache.hash = NULL;
+	ipcache.size = ipcache.count = 0;
+	ipcache.hits = ipcache.misses = 0;
+}
+
+/* Double the table once it holds as many entries as it has buckets */
+static void ipcache_grow(void)
+{
+	struct ipcache_ent **hash, *ic, *next;
+	unsigned int size, i;
+
+	size = ipcache.size ? ipcache.size << 1 : IPCACHE_INITSIZE;
+	hash = xmalloc(size * sizeof(*hash));
+	memset(hash, 0, size * sizeof(*hash));
+	for (i = 0; i < ipcache.size; i++)
+		for (ic = ipcache.hash[i]; ic; ic = next) {
+			next = ic->ic_next;
+			ic->ic_next = hash[ic->ic_hash & (size - 1)];
+			hash[ic->ic_hash & (size - 1)] = ic;
+		}
+	xfree(ipcache.hash);
+	ipcache.hash = hash;
+	ipcache.size = size;
+}
+
+/* Forget everything learned from an older export table */
+static void ipcache_check(unsigned int generation)
+{
+	if (ipcache.generation == generation)
+		return;
+	ipcache_flush();
+	ipcache.generation = generation;
+}
+
+/*
+ * Returns 1 and sets *@client to a copy of the cached answer if
+ * @ipaddr is in the cache, otherwise zero.
+ */
+static int ipcache_lookup(unsigned int generation, const char *ipaddr,
+			  char **client)
+{
+	unsigned int hash = fnv1a_str(ipaddr);
+	struct ipcache_ent *ic, **icp;
+	time_t now = time(0);
+	int found = 0;
+
+	pthread_mutex_lock(&ipcache_lock);
+	ipcache_check(generation);
+	if (ipcache.size == 0)
+		goto out;
+	for (icp = &ipcache.hash[hash & (ipcache.size - 1)];
+	     (ic = *icp) != NULL; icp = &ic->ic_next) {
+		if (ic->ic_hash != hash || strcmp(ic->ic_addr, ipaddr) != 0)
+			continue;
+		if (ic->ic_expiry <= now) {
+			*icp = ic->ic_next;
+			free(ic->ic_client);
+			xfree(ic);
+			ipcache.count--;
+			break;
+		}
+		*client = ic->ic_client ? xstrdup(ic->ic_client) : NULL;
+		found = 1;
+		break;
+	}
+ out:
+	if (found)
+		ipcache.hits++;
+	else
+		ipcache.misses++;
+	pthread_mutex_unlock(&ipcache_lock);
+	return found;
+}
+
+static void ipcache_insert(unsigned int generation, const char *ipaddr,
+			   const char *client)
+{
+	unsigned int hash = fnv1a_str(ipaddr);
+	struct ipcache_ent *ic;
+
+	pthread_mutex_lock(&ipcache_lock);
+	ipcache_check(generation);
+	if (ipcache.count >= IPCACHE_MAX)
+		ipcache_flush();
+	if (ipcache.count >= ipcache.size)
+		ipcache_grow();
+
+	ic = xmalloc(sizeof(*ic));
+	ic->ic_hash = hash;
+	strncpy(ic->ic_addr, ipaddr, sizeof(ic->ic_addr) - 1);
+	ic->ic_addr[sizeof(ic->ic_addr) - 1] = '\0';
+	ic->ic_client = client ? xstrdup(client) : NULL;
+	ic->ic_expiry = time(0) +
+		(client && *client ? IPCACHE_TTL : IPCACHE_NEG_TTL);
+	ic->ic_next = ipcache.hash[hash & (ipcache.size - 1)];
+	ipcache.hash[hash & (ipcache.size - 1)] = ic;
+	ipcache.count++;
+	pthread_mutex_unlock(&ipcache_lock);
+}
+
+static void auth_unix_ip(FILE *f, char *lbuf)
 {
 	/* requests are
 	 *  class IP-ADDR
@@ -85,8 +235,7 @@ static void auth_unix_ip(FILE *f)
 	char *client = NULL;
 	struct addrinfo *tmp = NULL;
 	struct addrinfo *ai = NULL;
-	if (readline(fileno(f), &lbuf, &lbuflen) != 1)
-		return;
+	unsigned int generation;
 
 	xlog(D_CALL, "auth_unix_ip: inbuf '%s'", lbuf);
 
@@ -104,15 +253,19 @@ static void auth_unix_ip(FILE *f)
 		return;
 
 	auth_reload();
+	generation = auth_reread_count();
 
 	/* addr is a valid, interesting address, find the domain name... */
-	if (!use_ipaddr) {
+	if (!use_ipaddr && !ipcache_lookup(generation, ipaddr, &client)) {
 		ai = client_resolve(tmp->ai_addr);
 		client = client_compose(ai);
 		freeaddrinfo(ai);
+		ipcache_insert(generation, ipaddr, client);
 	}
 	freeaddrinfo(tmp);
 
+	/* replies from several resolver threads share this channel */
+	flockfile(f);
 	qword_print(f, "nfsd");
 	qword_print(f, ipaddr);
 	qword_printuint(f, time(0) + DEFAULT_TTL);
@@ -121,12 +274,13 @@ static void auth_unix_ip(FILE *f)
 	else if (client)
 		qword_print(f, *client?client:"DEFAULT");
 	qword_eol(f);
+	funlockfile(f);
 	xlog(D_CALL, "auth_unix_ip: client %p '%s'", client, client?client: "DEFAULT");
 
 	free(client);
 }
 
-static void auth_unix_gid(FILE *f)
+static void auth_unix_gid(FILE *f, char *lbuf)
 {
 	/* Request are
 	 *  uid
@@ -152,9 +306,6 @@ static void auth_unix_gid(FILE *f)
 
 	ngroups = groups_len;
 
-	if (readline(fileno(f), &lbuf, &lbuflen) != 1)
-		return;
-
 	cp = lbuf;
 	if (qword_get_uint(&cp, &uid) != 0)
 		return;
@@ -187,8 +338,16 @@ static void auth_unix_gid(FILE *f)
 	qword_eol(f);
 }
 
+#define UUID_VAL_MAX	64
+
 #if USE_BLKID
-static const char *get_uuid_blkdev(char *path)
+/*
+ * The blkid cache is shared by every thread that exports something,
+ * so the uuid is copied out into @buf while it is held.
+ */
+static pthread_mutex_t blkid_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *get_uuid_blkdev(char *path, char *buf)
 {
 	/* We set *safe if we know that we need the
 	 * fsid from statfs too.
@@ -201,21 +360,22 @@ static const char *get_uuid_blkdev(char *path)
 	const char *type;
 	const char *val, *uuid = NULL;
 
-	if (cache == NULL)
-		blkid_get_cache(&cache, NULL);
-
 	if (stat(path, &stb) != 0)
 		return NULL;
 	devname = blkid_devno_to_devname(stb.st_dev);
 	if (!devname)
 		return NULL;
+
+	pthread_mutex_lock(&blkid_lock);
+	if (cache == NULL)
+		blkid_get_cache(&cache, NULL);
 	dev = blkid_get_dev(cache, devname, BLKID_DEV_NORMAL);
 	free(devname);
 	if (!dev)
-		return NULL;
+		goto out;
 	iter = blkid_tag_iterate_begin(dev);
 	if (!iter)
-		return NULL;
+		goto out;
 	while (blkid_tag_next(iter, &type, &val) == 0) {
 		if (strcmp(type, "UUID") == 0)
 			uuid = val;
@@ -225,11 +385,18 @@ static const char *get_uuid_blkdev(char *path)
 			break;
 		}
 	}
+	if (uuid) {
+		strncpy(buf, uuid, UUID_VAL_MAX - 1);
+		buf[UUID_VAL_MAX - 1] = '\0';
+		uuid = buf;
+	}
 	blkid_tag_iterate_end(iter);
+ out:
+	pthread_mutex_unlock(&blkid_lock);
 	return uuid;
 }
 #else
-#define get_uuid_blkdev(path) (NULL)
+#define get_uuid_blkdev(path, buf) (NULL)
 #endif
 
 static int get_uuid(const char *val, int uuidlen, char *u)
@@ -262,19 +429,18 @@ static int get_uuid(const char *val, int uuidlen, char *u)
 	return 1;
 }
 
-static int uuid_by_path(char *path, int type, int uuidlen, char *uuid)
-{
-	/* get a uuid for the filesystem found at 'path'.
-	 * There are several possible ways of generating the
-	 * uuids (types).
-	 * Type 0 is used for new filehandles, while other types
-	 * may be used to interpret old filehandle - to ensure smooth
-	 * forward migration.
-	 * We return 1 if a uuid was found (and it might be worth 
-	 * trying the next type) or 0 if no more uuid types can be
-	 * extracted.
-	 */
+/* Possible uuid values of one filesystem, in order of preference */
+struct uuid_vals {
+	const char *	vals[2];
+	char		blkid_val[UUID_VAL_MAX];
+	char		fsid_val[17];
+};
 
+/* Collect the uuid sources for the filesystem found at 'path'.
+ * Returns the number of values stored in @uv->vals.
+ */
+static int uuid_vals_by_path(char *path, struct uuid_vals *uv)
+{
 	/* Possible sources of uuid are
 	 * - blkid uuid
 	 * - statfs64 uuid
@@ -292,27 +458,43 @@ static int uuid_by_path(char *path, int type, int uuidlen, char *uuid)
 	 *
 	 */
 	struct statfs64 st;
-	char fsid_val[17];
 	const char *blkid_val;
-	const char *val;
+	int n = 0;
 
-	blkid_val = get_uuid_blkdev(path);
+	blkid_val = get_uuid_blkdev(path, uv->blkid_val);
 
 	if (statfs64(path, &st) == 0 &&
 	    (st.f_fsid.__val[0] || st.f_fsid.__val[1]))
-		snprintf(fsid_val, 17, "%08x%08x",
+		snprintf(uv->fsid_val, 17, "%08x%08x",
 			 st.f_fsid.__val[0], st.f_fsid.__val[1]);
 	else
-		fsid_val[0] = 0;
+		uv->fsid_val[0] = 0;
 
-	if (blkid_val && (type--) == 0)
-		val = blkid_val;
-	else if (fsid_val[0] && (type--) == 0)
-		val = fsid_val;
-	else
+	if (blkid_val)
+		uv->vals[n++] = blkid_val;
+	if (uv->fsid_val[0])
+		uv->vals[n++] = uv->fsid_val;
+	return n;
+}
+
+static int uuid_by_path(char *path, int type, int uuidlen, char *uuid)
+{
+	/* get a uuid for the filesystem found at 'path'.
+	 * There are several possible ways of generating the
+	 * uuids (types).
+	 * Type 0 is used for new filehandles, while other types
+	 * may be used to interpret old filehandle - to ensure smooth
+	 * forward migration.
+	 * We return 1 if a uuid was found (and it might be worth 
+	 * trying the next type) or 0 if no more uuid types can be
+	 * extracted.
+	 */
+	struct uuid_vals uv;
+
+	if (type >= uuid_vals_by_path(path, &uv))
 		return 0;
 
-	get_uuid(val, uuidlen, uuid);
+	get_uuid(uv.vals[type], uuidlen, uuid);
 	return 1;
 }
 
@@ -442,60 +624,490 @@ int parse_fsid(int fsidtype, int fsidlen, char *fsid, struct parsed_fsid *parsed
 	return 0;
 }
 
-static bool match_fsid(struct parsed_fsid *parsed, nfs_export *exp, char *path)
+/*
+ * An nfsd.fh upcall carries only an fsid.  Finding its export used to
+ * mean stat()ing every export, and every mount below each crossmnt
+ * export, until one matched - which spins up every disk on the server
+ * after a reboot.  Instead, mountd keeps a table of every exported
+ * path along with each fsid it can be known by, filled in once per
+ * etab reload.  Changes to the mount table are noticed by polling
+ * /proc/self/mountinfo, and then only exports at, above or below a
+ * mount that changed are probed again.
+ */
+enum {
+	FSIDKEY_NUM = 0,	/* fsid= */
+	FSIDKEY_DEV,		/* device and inode number */
+	FSIDKEY_UUID,		/* uuid=, or uuid of the filesystem */
+};
+
+/* An export root, or a mount point below a crossmnt export */
+struct fsid_path {
+	struct fsid_path *	fp_next;	/* next path of same export */
+	nfs_export *		fp_exp;
+	char *			fp_path;
+	dev_t			fp_dev;
+	ino_t			fp_ino;
+	int			fp_valid;	/* stat()able dir or file */
+	int			fp_mountpoint;
+	int			fp_stale;
+};
+
+struct fsid_devkey {
+	unsigned int		dk_major;
+	unsigned int		dk_minor;
+	unsigned long long	dk_inode;
+};
+
+struct fsid_ent {
+	struct fsid_ent *	fe_next;
+	unsigned int		fe_hash;
+	int			fe_kind;
+	int			fe_len;
+	char			fe_key[16];
+	struct fsid_path *	fe_fp;
+};
+
+struct exp_vec {
+	nfs_export **		v_exp;
+	int			v_count;
+	int			v_max;
+};
+
+static struct {
+	unsigned int		generation;
+	unsigned int		size;
+	struct fsid_ent **	hash;
+	struct exp_vec		all;	/* every export */
+	struct fsid_path **	paths;	/* paths of each of all.v_exp[] */
+	struct exp_vec		mntpt;	/* exports with mountpoint= */
+	int			unresolved; /* paths that failed stat() */
+	FILE *			mountinfo;
+	char **			mounts;	/* sorted "dev mountpoint" */
+	int			nmounts;
+} fsid_table;
+
+static void exp_vec_add(struct exp_vec *v, nfs_export *exp)
+{
+	if (v->v_count == v->v_max) {
+		v->v_max = v->v_max ? v->v_max << 1 : 16;
+		v->v_exp = xrealloc(v->v_exp, v->v_max * sizeof(nfs_export *));
+	}
+	v->v_exp[v->v_count++] = exp;
+}
+
+static void exp_vec_free(struct exp_vec *v)
+{
+	xfree(v->v_exp);
+	v->v_exp = NULL;
+	v->v_count = v->v_max = 0;
+}
+
+static unsigned int fsid_key_hash(int kind, int len, const char *key)
+{
+	unsigned int hash = FNV1A_OFFSET;
+
+	hash = fnv1a_add(hash, kind);
+	hash = fnv1a_add(hash, len);
+	return fnv1a_buf(hash, key, len);
+}
+
+static inline bool fsid_ent_match(struct fsid_ent *fe, unsigned int hash,
+				  int kind, int len, const char *key)
+{
+	return fe->fe_hash == hash && fe->fe_kind == kind &&
+		fe->fe_len == len && memcmp(fe->fe_key, key, len) == 0;
+}
+
+static void fsid_table_insert(int kind, int len, const char *key,
+			      struct fsid_path *fp)
+{
+	struct fsid_ent *fe, **fep;
+
+	fe = xmalloc(sizeof(*fe));
+	fe->fe_next = NULL;
+	fe->fe_hash = fsid_key_hash(kind, len, key);
+	fe->fe_kind = kind;
+	fe->fe_len = len;
+	memcpy(fe->fe_key, key, len);
+	fe->fe_fp = fp;
+
+	/* keep exportlist order within a chain */
+	fep = &fsid_table.hash[fe->fe_hash & (fsid_table.size - 1)];
+	while (*fep)
+		fep = &(*fep)->fe_next;
+	*fep = fe;
+}
+
+static void fsid_path_probe(struct fsid_path *fp)
 {
 	struct stat stb;
-	int type;
+
+	fp->fp_valid = stat(fp->fp_path, &stb) == 0 &&
+		(S_ISDIR(stb.st_mode) || S_ISREG(stb.st_mode));
+	if (!fp->fp_valid)
+		return;
+	fp->fp_dev = stb.st_dev;
+	fp->fp_ino = stb.st_ino;
+	fp->fp_mountpoint = is_mountpoint(fp->fp_path);
+}
+
+/* Enter the device and uuid keys of a path that could be stat()ed */
+static void fsid_path_index(struct fsid_path *fp)
+{
+	static const int uuidlens[] = { 4, 8, 16 };
+	struct exportent *ep = &fp->fp_exp->m_export;
+	struct fsid_devkey dk;
+	struct uuid_vals uv;
 	char u[16];
+	int i, j, n;
 
-	if (stat(path, &stb) != 0)
+	memset(&dk, 0, sizeof(dk));
+	dk.dk_major = major(fp->fp_dev);
+	dk.dk_minor = minor(fp->fp_dev);
+	dk.dk_inode = fp->fp_ino;
+	fsid_table_insert(FSIDKEY_DEV, sizeof(dk), (char *)&dk, fp);
+
+	if (ep->e_uuid) {
+		uv.vals[0] = ep->e_uuid;
+		n = 1;
+	} else
+		n = uuid_vals_by_path(fp->fp_path, &uv);
+	for (i = 0; i < n; i++)
+		for (j = 0; j < (int)(sizeof(uuidlens) / sizeof(uuidlens[0])); j++) {
+			get_uuid(uv.vals[i], uuidlens[j], u);
+			fsid_table_insert(FSIDKEY_UUID, uuidlens[j], u, fp);
+		}
+}
+
+/* Record the export root of all.v_exp[i] and any mounts below it */
+static void fsid_probe_export(int i)
+{
+	nfs_export *exp = fsid_table.all.v_exp[i];
+	struct exportent *ep = &exp->m_export;
+	struct fsid_path *fp, **fpp;
+	void *mnt = NULL;
+	char *path;
+
+	fpp = &fsid_table.paths[i];
+	for (path = ep->e_path; path;
+	     path = (ep->e_flags & NFSEXP_CROSSMOUNT) ?
+		    next_mnt(&mnt, ep->e_path) : NULL) {
+		fp = xmalloc(sizeof(*fp));
+		memset(fp, 0, sizeof(*fp));
+		fp->fp_exp = exp;
+		fp->fp_path = xstrdup(path);
+		*fpp = fp;
+		fpp = &fp->fp_next;
+	}
+
+	fp = fsid_table.paths[i];
+	if (ep->e_flags & NFSEXP_FSID)
+		fsid_table_insert(FSIDKEY_NUM, sizeof(ep->e_fsid),
+				  (char *)&ep->e_fsid, fp);
+	for (; fp; fp = fp->fp_next) {
+		fsid_path_probe(fp);
+		if (fp->fp_valid)
+			fsid_path_index(fp);
+		else
+			fsid_table.unresolved++;
+	}
+}
+
+static void fsid_free_paths(int i)
+{
+	struct fsid_path *fp, *next;
+
+	for (fp = fsid_table.paths[i]; fp; fp = next) {
+		next = fp->fp_next;
+		if (!fp->fp_valid)
+			fsid_table.unresolved--;
+		xfree(fp->fp_path);
+		xfree(fp);
+	}
+	fsid_table.paths[i] = NULL;
+}
+
+/*
+ * Paths that could not be stat()ed when they were probed may have
+ * appeared since.  Returns the number that now can be.
+ */
+static int fsid_table_resolve(void)
+{
+	struct fsid_path *fp;
+	int i, count = 0;
+
+	for (i = 0; fsid_table.unresolved && i < fsid_table.all.v_count; i++)
+		for (fp = fsid_table.paths[i]; fp; fp = fp->fp_next) {
+			if (fp->fp_valid)
+				continue;
+			fsid_path_probe(fp);
+			if (!fp->fp_valid)
+				continue;
+			fsid_table.unresolved--;
+			fsid_path_index(fp);
+			count++;
+		}
+	return count;
+}
+
+static int mount_cmp(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+static void free_mounts(char **mounts, int n)
+{
+	while (n--)
+		xfree(mounts[n]);
+	xfree(mounts);
+}
+
+/*
+ * Read the mount table as a sorted list of "major:minor mountpoint"
+ * strings, the mount point still octal-escaped.  Reading the file
+ * also rearms change notification.
+ */
+static char **read_mounts(int *countp)
+{
+	char *line = NULL;
+	size_t len = 0;
+	char **mounts = NULL;
+	int count = 0, max = 0;
+
+	rewind(fsid_table.mountinfo);
+	while (getline(&line, &len, fsid_table.mountinfo) != -1) {
+		char *field[5], *cp, *save;
+		int i;
+
+		/* ID parent-ID major:minor root mountpoint ... */
+		for (i = 0, cp = line; i < 5; i++, cp = NULL)
+			if ((field[i] = strtok_r(cp, " \n", &save)) == NULL)
+				break;
+		if (i < 5)
+			continue;
+		if (count == max) {
+			max = max ? max << 1 : 64;
+			mounts = xrealloc(mounts, max * sizeof(char *));
+		}
+		mounts[count] = xmalloc(strlen(field[2]) + strlen(field[4]) + 2);
+		sprintf(mounts[count++], "%s %s", field[2], field[4]);
+	}
+	free(line);
+
+	if (count)
+		qsort(mounts, count, sizeof(char *), mount_cmp);
+	*countp = count;
+	return mounts;
+}
+
+/* True if one of @a and @b is a pathname at or below the other */
+static bool path_overlaps(const char *a, const char *b)
+{
+	size_t la = strlen(a), lb = strlen(b);
+
+	if (la > lb) {
+		const char *t = a;
+		a = b;
+		b = t;
+		la = lb;
+	}
+	/* now a is the shorter one */
+	if (strncmp(a, b, la) != 0)
+		return false;
+	return la == 1 || b[la] == '/' || b[la] == '\0';
+}
+
+/* A mount at @escaped came or went: forget what we knew near it */
+static void fsid_mark_stale(const char *escaped)
+{
+	char dir[NFS_MAXPATHLEN+1];
+	struct fsid_path *fp;
+	size_t len = 0;
+	int i;
+
+	/* mountinfo escapes space, tab, newline and backslash as \ooo */
+	while (*escaped && len < sizeof(dir) - 1) {
+		if (escaped[0] == '\\' && isdigit(escaped[1]) &&
+		    isdigit(escaped[2]) && isdigit(escaped[3])) {
+			dir[len++] = ((escaped[1] - '0') << 6) |
+				((escaped[2] - '0') << 3) | (escaped[3] - '0');
+			escaped += 4;
+		} else
+			dir[len++] = *escaped++;
+	}
+	dir[len] = '\0';
+
+	xlog(D_GENERAL, "mount table changed at %s", dir);
+	for (i = 0; i < fsid_table.all.v_count; i++) {
+		if (!path_overlaps(fsid_table.all.v_exp[i]->m_export.e_path, dir))
+			continue;
+		for (fp = fsid_table.paths[i]; fp; fp = fp->fp_next)
+			fp->fp_stale = 1;
+	}
+}
+
+/* Bring the table up to date after the mount table has changed */
+static void fsid_table_remount(void)
+{
+	struct fsid_ent *fe, **fep;
+	char **mounts;
+	unsigned int h;
+	int i, j, n, cmp;
+
+	mounts = read_mounts(&n);
+
+	/* Both lists are sorted; anything in only one of them changed */
+	for (i = j = 0; i < fsid_table.nmounts || j < n; ) {
+		if (i == fsid_table.nmounts)
+			cmp = 1;
+		else if (j == n)
+			cmp = -1;
+		else
+			cmp = strcmp(fsid_table.mounts[i], mounts[j]);
+		if (cmp == 0) {
+			i++;
+			j++;
+			continue;
+		}
+		fsid_mark_stale(strchr(cmp < 0 ? fsid_table.mounts[i++] :
+					mounts[j++], ' ') + 1);
+	}
+	free_mounts(fsid_table.mounts, fsid_table.nmounts);
+	fsid_table.mounts = mounts;
+	fsid_table.nmounts = n;
+
+	for (h = 0; h < fsid_table.size; h++)
+		for (fep = &fsid_table.hash[h]; (fe = *fep) != NULL; ) {
+			if (fe->fe_fp->fp_stale) {
+				*fep = fe->fe_next;
+				xfree(fe);
+			} else
+				fep = &fe->fe_next;
+		}
+	for (i = 0; i < fsid_table.all.v_count; i++) {
+		if (!fsid_table.paths[i]->fp_stale)
+			continue;
+		fsid_free_paths(i);
+		fsid_probe_export(i);
+	}
+}
+
+static bool mounts_changed(void)
+{
+	struct pollfd pfd;
+
+	if (fsid_table.mountinfo == NULL)
 		return false;
-	if (!S_ISDIR(stb.st_mode) && !S_ISREG(stb.st_mode))
+	pfd.fd = fileno(fsid_table.mountinfo);
+	pfd.events = POLLPRI;
+	pfd.revents = 0;
+	return poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLERR|POLLPRI));
+}
+
+static void fsid_table_free(void)
+{
+	struct fsid_ent *fe, *next;
+	unsigned int i;
+	int j;
+
+	for (i = 0; i < fsid_table.size; i++)
+		for (fe = fsid_table.hash[i]; fe; fe = next) {
+			next = fe->fe_next;
+			xfree(fe);
+		}
+	xfree(fsid_table.hash);
+	fsid_table.hash = NULL;
+	fsid_table.size = 0;
+	for (j = 0; j < fsid_table.all.v_count; j++)
+		fsid_free_paths(j);
+	xfree(fsid_table.paths);
+	fsid_table.paths = NULL;
+	exp_vec_free(&fsid_table.all);
+	exp_vec_free(&fsid_table.mntpt);
+	free_mounts(fsid_table.mounts, fsid_table.nmounts);
+	fsid_table.mounts = NULL;
+	fsid_table.nmounts = 0;
+}
+
+static void fsid_table_refresh(unsigned int generation)
+{
+	nfs_export *exp;
+	int i;
+
+	if (fsid_table.hash && fsid_table.generation == generation) {
+		if (mounts_changed())
+			fsid_table_remount();
+		return;
+	}
+
+	fsid_table_free();
+	if (fsid_table.mountinfo == NULL) {
+		fsid_table.mountinfo = fopen("/proc/self/mountinfo", "r");
+		if (fsid_table.mountinfo == NULL)
+			xlog(L_WARNING, "Cannot watch /proc/self/mountinfo: "
+			     "mount changes are only noticed on export "
+			     "table reload");
+	}
+	if (fsid_table.mountinfo) {
+		(void)mounts_changed();
+		fsid_table.mounts = read_mounts(&fsid_table.nmounts);
+	}
+
+	for (i = 0; i < MCL_MAXTYPES; i++)
+		for (exp = exportlist[i].p_head; exp; exp = exp->m_next) {
+			exp_vec_add(&fsid_table.all, exp);
+			if (exp->m_export.e_mountpoint)
+				exp_vec_add(&fsid_table.mntpt, exp);
+		}
+
+	fsid_table.size = 64;
+	while (fsid_table.size < 8 * (unsigned int)fsid_table.all.v_count)
+		fsid_table.size <<= 1;
+	fsid_table.hash = xmalloc(fsid_table.size * sizeof(struct fsid_ent *));
+	memset(fsid_table.hash, 0, fsid_table.size * sizeof(struct fsid_ent *));
+	fsid_table.paths = xmalloc((fsid_table.all.v_count + 1) *
+				   sizeof(struct fsid_path *));
+	memset(fsid_table.paths, 0, (fsid_table.all.v_count + 1) *
+				   sizeof(struct fsid_path *));
+
+	for (i = 0; i < fsid_table.all.v_count; i++)
+		fsid_probe_export(i);
+	fsid_table.generation = generation;
+}
+
+/* Can @fp be what the filehandle refers to, given that its key matched? */
+static bool fsid_path_match(struct parsed_fsid *parsed, struct fsid_path *fp)
+{
+	if (!fp->fp_valid)
 		return false;
 
 	switch (parsed->fsidtype) {
-	case FSID_DEV:
-	case FSID_MAJOR_MINOR:
-	case FSID_ENCODE_DEV:
-		if (stb.st_ino != parsed->inode)
-			return false;
-		if (parsed->major != major(stb.st_dev) ||
-		    parsed->minor != minor(stb.st_dev))
-			return false;
-		return true;
-	case FSID_NUM:
-		if (((exp->m_export.e_flags & NFSEXP_FSID) == 0 ||
-		     exp->m_export.e_fsid != parsed->fsidnum))
-			return false;
-		return true;
 	case FSID_UUID4_INUM:
 	case FSID_UUID16_INUM:
-		if (stb.st_ino != parsed->inode)
-			return false;
-		goto check_uuid;
+		return fp->fp_ino == parsed->inode;
 	case FSID_UUID8:
 	case FSID_UUID16:
-		if (!is_mountpoint(path))
-			return false;
-	check_uuid:
-		if (exp->m_export.e_uuid)
-			get_uuid(exp->m_export.e_uuid, parsed->uuidlen, u);
-		else
-			for (type = 0;
-			     uuid_by_path(path, type, parsed->uuidlen, u);
-			     type++)
-				if (memcmp(u, parsed->fhuuid, parsed->uuidlen) == 0)
-					return true;
-
-		if (memcmp(u, parsed->fhuuid, parsed->uuidlen) != 0)
-			return false;
-		return true;
+		return fp->fp_mountpoint;
 	}
-	/* Well, unreachable, actually: */
-	return false;
+	return true;
 }
 
-static void nfsd_fh(FILE *f)
+/* Resolve the IP address in @dom, once per upcall */
+static int nfsd_fh_resolve(char *dom, struct addrinfo **ai)
+{
+	struct addrinfo *tmp;
+
+	if (*ai != NULL)
+		return 0;
+	tmp = host_pton(dom);
+	if (tmp == NULL)
+		return -1;
+	*ai = client_resolve(tmp->ai_addr);
+	freeaddrinfo(tmp);
+	return 0;
+}
+
+static void nfsd_fh(FILE *f, char *lbuf)
 {
 	/* request are:
 	 *  domain fsidtype fsid
@@ -507,17 +1119,21 @@ static void nfsd_fh(FILE *f)
 	int fsidtype;
 	int fsidlen;
 	char fsid[32];
+	FILE *ef;
+	int opened;
 	struct parsed_fsid parsed;
 	struct exportent *found = NULL;
 	struct addrinfo *ai = NULL;
 	char *found_path = NULL;
 	nfs_export *exp;
+	struct fsid_devkey dk;
+	struct fsid_ent *fe;
+	unsigned int hash;
+	int kind, keylen;
+	char *key;
 	int i;
 	int dev_missing = 0;
 
-	if (readline(fileno(f), &lbuf, &lbuflen) != 1)
-		return;
-
 	xlog(D_CALL, "nfsd_fh: inbuf '%s'", lbuf);
 
 	cp = lbuf;
@@ -536,74 +1152,66 @@ static void nfsd_fh(FILE *f)
 	if (parse_fsid(fsidtype, fsidlen, fsid, &parsed))
 		goto out;
 
-	auth_reload();
+	fsid_table_refresh(auth_reload());
 
-	/* Now determine export point for this fsid/domain */
-	for (i=0 ; i < MCL_MAXTYPES; i++) {
-		nfs_export *next_exp;
-		for (exp = exportlist[i].p_head; exp; exp = next_exp) {
-			char *path;
-
-			if (exp->m_export.e_flags & NFSEXP_CROSSMOUNT) {
-				static nfs_export *prev = NULL;
-				static void *mnt = NULL;
-				
-				if (prev == exp) {
-					/* try a submount */
-					path = next_mnt(&mnt, exp->m_export.e_path);
-					if (!path) {
-						next_exp = exp->m_next;
-						prev = NULL;
-						continue;
-					}
-					next_exp = exp;
-				} else {
-					prev = exp;
-					mnt = NULL;
-					path = exp->m_export.e_path;
-					next_exp = exp;
-				}
-			} else {
-				path = exp->m_export.e_path;
-				next_exp = exp->m_next;
-			}
+	switch (parsed.fsidtype) {
+	case FSID_NUM:
+		kind = FSIDKEY_NUM;
+		keylen = sizeof(parsed.fsidnum);
+		key = (char *)&parsed.fsidnum;
+		break;
+	case FSID_DEV:
+	case FSID_MAJOR_MINOR:
+	case FSID_ENCODE_DEV:
+		memset(&dk, 0, sizeof(dk));
+		dk.dk_major = parsed.major;
+		dk.dk_minor = parsed.minor;
+		dk.dk_inode = parsed.inode;
+		kind = FSIDKEY_DEV;
+		keylen = sizeof(dk);
+		key = (char *)&dk;
+		break;
+	default:
+		kind = FSIDKEY_UUID;
+		keylen = parsed.uuidlen;
+		key = parsed.fhuuid;
+	}
+	hash = fsid_key_hash(kind, keylen, key);
 
-			if (!use_ipaddr && !client_member(dom, exp->m_client->m_hostname))
-				continue;
-			if (exp->m_export.e_mountpoint &&
-			    !is_mountpoint(exp->m_export.e_mountpoint[0]?
-					   exp->m_export.e_mountpoint:
-					   exp->m_export.e_path))
-				dev_missing ++;
+	/* Now determine export point for this fsid/domain */
+ retry:
+	for (fe = fsid_table.hash[hash & (fsid_table.size - 1)];
+	     fe; fe = fe->fe_next) {
+		struct fsid_path *fp = fe->fe_fp;
 
-			if (!match_fsid(&parsed, exp, path))
+		if (!fsid_ent_match(fe, hash, kind, keylen, key))
+			continue;
+		exp = fp->fp_exp;
+		if (!use_ipaddr && !client_member(dom, exp->m_client->m_hostname))
+			continue;
+		if (!fsid_path_match(&parsed, fp))
+			continue;
+		if (use_ipaddr) {
+			if (nfsd_fh_resolve(dom, &ai) < 0)
+				goto out;
+			if (!client_check(exp->m_client, ai))
 				continue;
-			if (use_ipaddr) {
-				if (ai == NULL) {
-					struct addrinfo *tmp;
-					tmp = host_pton(dom);
-					if (tmp == NULL)
-						goto out;
-					ai = client_resolve(tmp->ai_addr);
-					freeaddrinfo(tmp);
-				}
-				if (!client_check(exp->m_client, ai))
-					continue;
-			}
-			if (!found || subexport(&exp->m_export, found)) {
-				found = &exp->m_export;
-				free(found_path);
-				found_path = strdup(path);
-				if (found_path == NULL)
-					goto out;
-			} else if (strcmp(found->e_path, exp->m_export.e_path)
-				   && !subexport(found, &exp->m_export))
-			{
-				xlog(L_WARNING, "%s and %s have same filehandle for %s, using first",
-				     found_path, path, dom);
-			}
+		}
+		if (!found || subexport(&exp->m_export, found)) {
+			found = &exp->m_export;
+			free(found_path);
+			found_path = strdup(fp->fp_path);
+			if (found_path == NULL)
+				goto out;
+		} else if (strcmp(found->e_path, exp->m_export.e_path)
+			   && !subexport(found, &exp->m_export))
+		{
+			xlog(L_WARNING, "%s and %s have same filehandle for %s, using first",
+			     found_path, fp->fp_path, dom);
 		}
 	}
+	if (!found && fsid_table_resolve())
+		goto retry;
 	if (found && 
 	    found->e_mountpoint &&
 	    !is_mountpoint(found->e_mountpoint[0]?
@@ -617,6 +1225,15 @@ static void nfsd_fh(FILE *f)
 		/* FIXME we need to make sure we re-visit this later */
 		goto out;
 	}
+	for (i = 0; !found && i < fsid_table.mntpt.v_count; i++) {
+		exp = fsid_table.mntpt.v_exp[i];
+		if (!use_ipaddr && !client_member(dom, exp->m_client->m_hostname))
+			continue;
+		if (!is_mountpoint(exp->m_export.e_mountpoint[0]?
+				   exp->m_export.e_mountpoint:
+				   exp->m_export.e_path))
+			dev_missing ++;
+	}
 	if (!found && dev_missing) {
 		/* The missing dev could be what we want, so just be
 		 * quite rather than returning stale yet
@@ -624,9 +1241,14 @@ static void nfsd_fh(FILE *f)
 		goto out;
 	}
 
-	if (found)
-		if (cache_export_ent(dom, found, found_path) < 0)
+	if (found) {
+		ef = cache_channel("nfsd.export", &opened);
+		if (ef == NULL ||
+		    cache_export_ent(ef, dom, found, found_path) < 0)
 			found = 0;
+		if (opened)
+			fclose(ef);
+	}
 
 	qword_print(f, dom);
 	qword_printint(f, fsidtype);
@@ -696,6 +1318,10 @@ static void write_secinfo(FILE *f, struct exportent *ep, int flag_mask)
 
 static int dump_to_cache(FILE *f, char *domain, char *path, struct exportent *exp)
 {
+	int err;
+
+	/* the channel may be shared with cache_export() and priming */
+	flockfile(f);
 	qword_print(f, domain);
 	qword_print(f, path);
 	if (exp) {
@@ -723,7 +1349,9 @@ static int dump_to_cache(FILE *f, char *domain, char *path, struct exportent *ex
  		}
 	} else
 		qword_printuint(f, time(0) + DEFAULT_TTL);
-	return qword_eol(f);
+	err = qword_eol(f);
+	funlockfile(f);
+	return err;
 }
 
 static int is_subdirectory(char *child, char *parent)
@@ -742,30 +1370,41 @@ static int path_matches(nfs_export *exp, char *path)
 }
 
 static int
-client_matches(nfs_export *exp, char *dom, struct addrinfo *ai)
+client_matches(nfs_export *exp, char *dom, client_match *cm)
 {
 	if (use_ipaddr)
-		return client_check(exp->m_client, ai);
+		return client_match_check(cm, exp->m_client);
 	return client_member(dom, exp->m_client->m_hostname);
 }
 
 static int
-export_matches(nfs_export *exp, char *dom, char *path, struct addrinfo *ai)
+export_matches(nfs_export *exp, char *dom, char *path, client_match *cm)
 {
-	return path_matches(exp, path) && client_matches(exp, dom, ai);
+	return path_matches(exp, path) && client_matches(exp, dom, cm);
 }
 
 static nfs_export *
 lookup_export(char *dom, char *path, struct addrinfo *ai)
 {
+	pathidx_node *nodes[PATHIDX_MAXDEPTH];
 	nfs_export *exp;
 	nfs_export *found = NULL;
+	client_match cm;
 	int found_type = 0;
-	int i;
+	int i, j, k, n;
+
+	/* Only exports of @path itself, or crossmnt exports of one of
+	 * its parents, can match */
+	n = pathidx_walk(path, nodes, PATHIDX_MAXDEPTH);
+	client_match_init(&cm, ai);
 
 	for (i=0 ; i < MCL_MAXTYPES; i++) {
-		for (exp = exportlist[i].p_head; exp; exp = exp->m_next) {
-			if (!export_matches(exp, dom, path, ai))
+	    for (j = 0; j < n; j++) {
+		for (k = 0; k < nodes[j]->n_count; k++) {
+			exp = nodes[j]->n_exports[k];
+			if (exp->m_client->m_type != i)
+				continue;
+			if (!export_matches(exp, dom, path, &cm))
 				continue;
 			if (!found) {
 				found = exp;
@@ -798,7 +1437,9 @@ lookup_export(char *dom, char *path, struct addrinfo *ai)
 				found->m_warned = 1;
 			}
 		}
+	    }
 	}
+	client_match_release(&cm);
 	return found;
 }
 
@@ -1025,7 +1666,27 @@ static inline struct exportent *lookup_junction(const char *UNUSED(pathname))
 }
 #endif	/* !HAVE_NFS_PLUGIN_H */
 
-static void nfsd_export(FILE *f)
+/* Tell the kernel how @path is exported to @dom */
+static nfs_export *
+nfsd_export_answer(FILE *f, char *dom, char *path, struct addrinfo *ai)
+{
+	nfs_export *found;
+
+	found = lookup_export(dom, path, ai);
+	if (found) {
+		if (dump_to_cache(f, dom, path, &found->m_export) < 0) {
+			xlog(L_WARNING,
+			     "Cannot export %s, possibly unsupported filesystem"
+			     " or fsid= required", path);
+			dump_to_cache(f, dom, path, NULL);
+		}
+	} else {
+		dump_to_cache(f, dom, path, lookup_junction(path));
+	}
+	return found;
+}
+
+static void nfsd_export(FILE *f, char *lbuf)
 {
 	/* requests are:
 	 *  domain path
@@ -1038,9 +1699,6 @@ static void nfsd_export(FILE *f)
 	nfs_export *found = NULL;
 	struct addrinfo *ai = NULL;
 
-	if (readline(fileno(f), &lbuf, &lbuflen) != 1)
-		return;
-
 	xlog(D_CALL, "nfsd_export: inbuf '%s'", lbuf);
 
 	cp = lbuf;
@@ -1067,18 +1725,7 @@ static void nfsd_export(FILE *f)
 			goto out;
 	}
 
-	found = lookup_export(dom, path, ai);
-
-	if (found) {
-		if (dump_to_cache(f, dom, path, &found->m_export) < 0) {
-			xlog(L_WARNING,
-			     "Cannot export %s, possibly unsupported filesystem"
-			     " or fsid= required", path);
-			dump_to_cache(f, dom, path, NULL);
-		}
-	} else {
-		dump_to_cache(f, dom, path, lookup_junction(path));
-	}
+	found = nfsd_export_answer(f, dom, path, ai);
  out:
 	xlog(D_CALL, "nfsd_export: found %p path %s", found, path ? path : NULL);
 	if (dom) free(dom);
@@ -1089,19 +1736,34 @@ static void nfsd_export(FILE *f)
 
 struct {
 	char *cache_name;
-	void (*cache_handle)(FILE *f);
+	void (*cache_handle)(FILE *f, char *lbuf);
+	int cache_exports;	/* handler uses the export table */
+	int cache_slow;		/* handler may wait on DNS or netgroups */
 	FILE *f;
 	char vbuf[RPC_CHAN_BUF_SIZE];
 } cachelist[] = {
-	{ "auth.unix.ip", auth_unix_ip, NULL, ""},
-	{ "auth.unix.gid", auth_unix_gid, NULL, ""},
-	{ "nfsd.export", nfsd_export, NULL, ""},
-	{ "nfsd.fh", nfsd_fh, NULL, ""},
-	{ NULL, NULL, NULL, ""}
+	{ "auth.unix.ip", auth_unix_ip, 1, 1, NULL, ""},
+	{ "auth.unix.gid", auth_unix_gid, 0, 0, NULL, ""},
+	{ "nfsd.export", nfsd_export, 1, 0, NULL, ""},
+	{ "nfsd.fh", nfsd_fh, 1, 0, NULL, ""},
+	{ NULL, NULL, 0, 0, NULL, ""}
 };
 
 extern int manage_gids;
 
+static char *lbuf  = NULL;
+static int lbuflen = 0;
+static int cache_threaded;	/* channels have their own readers */
+
+static void cache_handle_req(int i, char *line)
+{
+	if (cachelist[i].cache_exports)
+		auth_hold();
+	cachelist[i].cache_handle(cachelist[i].f, line);
+	if (cachelist[i].cache_exports)
+		auth_release();
+}
+
 /**
  * cache_open - prepare communications channels with kernel RPC caches
  *
@@ -1122,36 +1784,128 @@ void cache_open(void)
 	}
 }
 
+/*
+ * Downcalls that mountd makes on its own, rather than in answer to an
+ * upcall, go through the channel opened by cache_open() when there is
+ * one.  The kernel takes one entry per write, which the line-buffered
+ * channel does; keeping it open saves an open and close per entry.
+ * Returns NULL if the channel cannot be opened; otherwise *@opened is
+ * set if the caller must fclose() the stream returned.
+ */
+static FILE *cache_channel(const char *name, int *opened)
+{
+	char path[100];
+	FILE *f;
+	int i;
+
+	*opened = 0;
+	for (i = 0; cachelist[i].cache_name; i++)
+		if (strcmp(cachelist[i].cache_name, name) == 0 &&
+		    cachelist[i].f != NULL)
+			return cachelist[i].f;
+
+	snprintf(path, sizeof(path), "/proc/net/rpc/%s/channel", name);
+	f = fopen(path, "w");
+	if (f != NULL)
+		*opened = 1;
+	return f;
+}
+
+static void cache_ready(int UNUSED(fd), void *data)
+{
+	int i = (int)(long)data;
+
+	if (readline(fileno(cachelist[i].f), &lbuf, &lbuflen) == 1)
+		cache_handle_req(i, lbuf);
+}
+
 /**
- * cache_set_fds - prepare cache file descriptors for one iteration of the service loop
- * @fdset: pointer to fd_set to prepare
+ * cache_add_fds - have the service loop watch the cache channels
+ *
+ * In threaded mode the channels have readers of their own instead.
  */
-void cache_set_fds(fd_set *fdset)
+void cache_add_fds(void)
 {
 	int i;
+
+	if (cache_threaded)
+		return;
 	for (i=0; cachelist[i].cache_name; i++) {
-		if (cachelist[i].f)
-			FD_SET(fileno(cachelist[i].f), fdset);
+		if (cachelist[i].f &&
+		    nfs_svc_loop_add(fileno(cachelist[i].f), cache_ready,
+				     (void *)(long)i) < 0)
+			xlog(L_ERROR, "Cannot watch %s channel: %m",
+			     cachelist[i].cache_name);
+	}
+}
+
+struct cache_req {
+	int	idx;
+	char	*line;
+};
+
+static void cache_req_run(void *arg)
+{
+	struct cache_req *req = arg;
+
+	cache_handle_req(req->idx, req->line);
+	xfree(req->line);
+	xfree(req);
+}
+
+/* In threaded mode, each open channel is read by one of these */
+static void *cache_reader(void *arg)
+{
+	int i = (int)(long)arg;
+	int fd = fileno(cachelist[i].f);
+	struct cache_req *req;
+	struct pollfd pfd;
+	char *buf = NULL;
+	int buflen = 0;
+
+	for (;;) {
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		if (poll(&pfd, 1, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			xlog(L_FATAL, "%s reader - poll: %m",
+			     cachelist[i].cache_name);
+		}
+		if (readline(fd, &buf, &buflen) != 1)
+			continue;
+		if (!cachelist[i].cache_slow) {
+			cache_handle_req(i, buf);
+			continue;
+		}
+		req = xmalloc(sizeof(*req));
+		req->idx = i;
+		req->line = xstrdup(buf);
+		thread_pool_queue(cache_req_run, req);
 	}
+	return NULL;
 }
 
 /**
- * cache_process_req - process any active cache file descriptors during service loop iteration
- * @fdset: pointer to fd_set to examine for activity
+ * cache_start_threads - serve the cache channels from their own threads
+ * @resolvers: number of threads for requests that may block on lookups
+ *
+ * Each open channel gets a thread of its own, and requests that may wait
+ * on DNS or netgroup lookups are handed on to a pool of @resolvers
+ * threads, so one slow lookup no longer holds up every other client.
+ * The service loop stops watching the channels.
  */
-int cache_process_req(fd_set *readfds) 
+void cache_start_threads(int resolvers)
 {
 	int i;
-	int cnt = 0;
+
+	cache_threaded = 1;
+	thread_pool_start(resolvers);
 	for (i=0; cachelist[i].cache_name; i++) {
-		if (cachelist[i].f != NULL &&
-		    FD_ISSET(fileno(cachelist[i].f), readfds)) {
-			cnt++;
-			cachelist[i].cache_handle(cachelist[i].f);
-			FD_CLR(fileno(cachelist[i].f), readfds);
-		}
+		if (cachelist[i].f)
+			thread_spawn(cache_reader, (void *)(long)i);
 	}
-	return cnt;
 }
 
 
@@ -1161,12 +1915,10 @@ int cache_process_req(fd_set *readfds)
  * % echo $domain $path $[now+DEFAULT_TTL] $options $anonuid $anongid $fsid > /proc/net/rpc/nfsd.export/channel
  */
 
-static int cache_export_ent(char *domain, struct exportent *exp, char *path)
+static int cache_export_ent(FILE *f, char *domain, struct exportent *exp,
+			    char *path)
 {
 	int err;
-	FILE *f = fopen("/proc/net/rpc/nfsd.export/channel", "w");
-	if (!f)
-		return -1;
 
 	err = dump_to_cache(f, domain, exp->e_path, exp);
 	if (err) {
@@ -1214,11 +1966,50 @@ static int cache_export_ent(char *domain, struct exportent *exp, char *path)
 		}
 		break;
 	}
-
-	fclose(f);
 	return err;
 }
 
+static void
+cache_prime_one(char *dom, char *path, void *data)
+{
+	nfsd_export_answer(data, dom, path, NULL);
+}
+
+/**
+ * cache_prime_exports - refresh the kernel's entries for changed exports
+ * @delta: what the last reload of the export table changed
+ *
+ * "exportfs" expires only the nfsd.export entries for the paths
+ * whose exports it changed.  Rather than wait for each of those to
+ * come back as an upcall, send fresh answers for all of them at once.
+ * Entries keyed by client address are left to their upcalls, as
+ * answering them may need DNS.  Called with the export table locked.
+ */
+void
+cache_prime_exports(const struct export_delta *delta)
+{
+	struct timespec start, end;
+	int n, opened;
+	FILE *f;
+
+	if (use_ipaddr || delta->ed_npaths == 0)
+		return;
+
+	f = cache_channel("nfsd.export", &opened);
+	if (f == NULL)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	n = cache_export_entries(delta->ed_paths, delta->ed_npaths,
+				cache_prime_one, f);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	if (opened)
+		fclose(f);
+	if (n > 0)
+		xlog(D_GENERAL, "refreshed %d nfsd.export entries in %ld ms",
+			n, (end.tv_sec - start.tv_sec) * 1000 +
+			(end.tv_nsec - start.tv_nsec) / 1000000);
+}
+
 /**
  * cache_export - Inform kernel of a new nfs_export
  * @exp: target nfs_export
@@ -1227,25 +2018,31 @@ static int cache_export_ent(char *domain, struct exportent *exp, char *path)
 int cache_export(nfs_export *exp, char *path)
 {
 	char buf[INET6_ADDRSTRLEN];
-	int err;
+	int err, opened;
 	FILE *f;
 
-	f = fopen("/proc/net/rpc/auth.unix.ip/channel", "w");
+	f = cache_channel("auth.unix.ip", &opened);
 	if (!f)
 		return -1;
 
-
+	flockfile(f);
 	qword_print(f, "nfsd");
 	qword_print(f,
 		host_ntop(get_addrlist(exp->m_client, 0), buf, sizeof(buf)));
 	qword_printuint(f, time(0) + exp->m_export.e_ttl);
 	qword_print(f, exp->m_client->m_hostname);
 	err = qword_eol(f);
-	
-	fclose(f);
+	funlockfile(f);
+	if (opened)
+		fclose(f);
 
-	err = cache_export_ent(exp->m_client->m_hostname, &exp->m_export, path)
-		|| err;
+	f = cache_channel("nfsd.export", &opened);
+	if (!f)
+		return -1;
+	err = cache_export_ent(f, exp->m_client->m_hostname, &exp->m_export,
+				path) || err;
+	if (opened)
+		fclose(f);
 	return err;
 }
 
@@ -0,0 +1,237 @@
+/*
+ * utils/mountd/hostcache.c
+ *
+ * Names of client addresses, for DUMP replies.
+ *
+ * Addresses are looked up in the background by a few resolver threads
+ * of their own, so a DUMP request waits on DNS for HOSTCACHE_WAIT
+ * milliseconds at most, however many clients there are.  Answers,
+ * including failures, are kept for HOSTCACHE_TTL seconds.  Once the
+ * cache holds HOSTCACHE_MAX entries, expired ones are freed to make
+ * room for new ones.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <pthread.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+
+#include "misc.h"
+#include "xmalloc.h"
+#include "xlog.h"
+#include "exportfs.h"
+#include "mountd.h"
+
+#define HOSTCACHE_THREADS	4
+#define HOSTCACHE_SIZE		1024		/* hash chains; a power of two */
+#define HOSTCACHE_MAX		65536		/* entries */
+#define HOSTCACHE_TTL		(30 * 60)
+
+struct hostcache_ent {
+	struct hostcache_ent *	hc_next;
+	struct hostcache_ent *	hc_qnext;	/* on the lookup queue */
+	unsigned int		hc_hash;
+	int			hc_pending;
+	time_t			hc_time;	/* of the last answer */
+	char *			hc_name;	/* NULL if none was found */
+	char			hc_addr[];
+};
+
+static pthread_mutex_t		hostcache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t		hostcache_queued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t		hostcache_answered = PTHREAD_COND_INITIALIZER;
+static struct hostcache_ent *	hostcache_table[HOSTCACHE_SIZE];
+static struct hostcache_ent *	hostcache_head;
+static struct hostcache_ent **	hostcache_tail = &hostcache_head;
+static unsigned int		hostcache_count;
+static unsigned int		hostcache_pending;
+static unsigned int		hostcache_gen;
+static int			hostcache_started;
+static time_t			hostcache_expiry;	/* of the oldest entry */
+
+static void *
+hostcache_resolver(void *UNUSED(arg))
+{
+	struct hostcache_ent *h;
+	struct addrinfo *ai;
+	char *name;
+
+	for (;;) {
+		pthread_mutex_lock(&hostcache_lock);
+		while (hostcache_head == NULL)
+			pthread_cond_wait(&hostcache_queued, &hostcache_lock);
+		h = hostcache_head;
+		hostcache_head = h->hc_qnext;
+		if (hostcache_head == NULL)
+			hostcache_tail = &hostcache_head;
+		pthread_mutex_unlock(&hostcache_lock);
+
+		/* Pending entries are never freed, so @h can be used unlocked */
+		name = NULL;
+		ai = host_pton(h->hc_addr);
+		if (ai != NULL) {
+			name = host_canonname(ai->ai_addr);
+			freeaddrinfo(ai);
+		}
+
+		pthread_mutex_lock(&hostcache_lock);
+		free(h->hc_name);
+		h->hc_name = name;
+		h->hc_time = time(NULL);
+		h->hc_pending = 0;
+		hostcache_pending--;
+		hostcache_gen++;
+		pthread_cond_broadcast(&hostcache_answered);
+		pthread_mutex_unlock(&hostcache_lock);
+	}
+	return NULL;
+}
+
+/* Called with hostcache_lock held */
+static void
+hostcache_queue(struct hostcache_ent *h)
+{
+	int i;
+
+	if (!hostcache_started) {
+		for (i = 0; i < HOSTCACHE_THREADS; i++)
+			thread_spawn(hostcache_resolver, NULL);
+		hostcache_started = 1;
+	}
+
+	h->hc_pending = 1;
+	h->hc_qnext = NULL;
+	*hostcache_tail = h;
+	hostcache_tail = &h->hc_qnext;
+	hostcache_pending++;
+	pthread_cond_signal(&hostcache_queued);
+}
+
+/*
+ * Free the entries that have expired.  The table is only scanned
+ * again once the oldest entry it kept has expired too.  Called with
+ * hostcache_lock held.
+ */
+static void
+hostcache_evict(const time_t now)
+{
+	struct hostcache_ent *h, **hp;
+	time_t oldest = now;
+	unsigned int i;
+
+	if (now < hostcache_expiry)
+		return;
+	for (i = 0; i < HOSTCACHE_SIZE; i++)
+		for (hp = &hostcache_table[i]; (h = *hp) != NULL; ) {
+			if (h->hc_pending || now - h->hc_time < HOSTCACHE_TTL) {
+				if (!h->hc_pending && h->hc_time < oldest)
+					oldest = h->hc_time;
+				hp = &h->hc_next;
+				continue;
+			}
+			*hp = h->hc_next;
+			free(h->hc_name);
+			free(h);
+			hostcache_count--;
+		}
+	hostcache_expiry = oldest + HOSTCACHE_TTL;
+}
+
+/**
+ * hostcache_name - look up the name of a client address
+ * @addr: NUL-terminated C string containing a presentation address
+ *
+ * Returns a freshly allocated copy of the name of @addr, if it is
+ * known.  Otherwise returns NULL; unless a lookup of @addr has failed
+ * recently, one is started in the background.
+ */
+char *
+hostcache_name(const char *addr)
+{
+	unsigned int hash = fnv1a_str(addr);
+	struct hostcache_ent *h, **hp;
+	time_t now = time(NULL);
+	char *name = NULL;
+	size_t len;
+
+	pthread_mutex_lock(&hostcache_lock);
+	hp = &hostcache_table[hash & (HOSTCACHE_SIZE - 1)];
+	for (h = *hp; h; h = h->hc_next)
+		if (h->hc_hash == hash && strcmp(h->hc_addr, addr) == 0)
+			break;
+
+	if (h == NULL) {
+		if (hostcache_count >= HOSTCACHE_MAX)
+			hostcache_evict(now);
+		if (hostcache_count >= HOSTCACHE_MAX)
+			goto out;
+		len = strlen(addr) + 1;
+		h = xmalloc(sizeof(*h) + len);
+		memset(h, 0, sizeof(*h));
+		memcpy(h->hc_addr, addr, len);
+		h->hc_hash = hash;
+		h->hc_next = *hp;
+		*hp = h;
+		hostcache_count++;
+		hostcache_queue(h);
+	} else if (!h->hc_pending && now - h->hc_time >= HOSTCACHE_TTL)
+		hostcache_queue(h);
+
+	/* A stale name is better than none while it is looked up again */
+	if (h->hc_name != NULL)
+		name = strdup(h->hc_name);
+out:
+	pthread_mutex_unlock(&hostcache_lock);
+	return name;
+}
+
+/**
+ * hostcache_wait - wait for the lookups started so far to finish
+ * @msecs: longest time to wait, in milliseconds
+ *
+ * Returns the number of lookups still outstanding.
+ */
+unsigned int
+hostcache_wait(const int msecs)
+{
+	struct timespec deadline;
+	unsigned int pending;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += msecs / 1000;
+	deadline.tv_nsec += (msecs % 1000) * 1000000L;
+	if (deadline.tv_nsec >= 1000000000L) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+
+	pthread_mutex_lock(&hostcache_lock);
+	while (hostcache_pending != 0)
+		if (pthread_cond_timedwait(&hostcache_answered, &hostcache_lock,
+					&deadline) == ETIMEDOUT)
+			break;
+	pending = hostcache_pending;
+	pthread_mutex_unlock(&hostcache_lock);
+	return pending;
+}
+
+/**
+ * hostcache_generation - find out whether any lookups have finished
+ *
+ * Returns a counter that changes whenever a lookup finishes.
+ */
+unsigned int
+hostcache_generation(void)
+{
+	unsigned int gen;
+
+	pthread_mutex_lock(&hostcache_lock);
+	gen = hostcache_gen;
+	pthread_mutex_unlock(&hostcache_lock);
+	return gen;
+}
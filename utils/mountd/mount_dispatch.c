@@ -79,6 +79,8 @@ mount_dispatch(struct svc_req *rqstp, SVCXPRT *transp)
 	}
 #endif
 
+	auth_hold();
 	rpc_dispatch(rqstp, transp, dtable, number_of(dtable),
 			&argument, &result);
+	auth_release();
 }
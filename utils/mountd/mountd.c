@@ -51,6 +51,10 @@ static int num_threads = 1;
 /* Arbitrary limit on number of threads */
 #define MAX_THREADS 64
 
+/* With -T, run one process sharing its export table among threads:
+ * num_threads then counts the threads that resolve client addresses */
+static int threaded = 0;
+
 static struct option longopts[] =
 {
 	{ "foreground", 0, 0, 'F' },
@@ -66,6 +70,8 @@ static struct option longopts[] =
 	{ "ha-callout", 1, 0, 'H' },
 	{ "state-directory-path", 1, 0, 's' },
 	{ "num-threads", 1, 0, 't' },
+	{ "threaded", 0, 0, 'T' },
+	{ "expand-netgroups", 1, 0, 'e' },
 	{ "reverse-lookup", 0, 0, 'r' },
 	{ "manage-gids", 0, 0, 'g' },
 	{ NULL, 0, 0, 0 }
@@ -694,6 +700,7 @@ main(int argc, char **argv)
 	int	foreground = 0;
 	int	port = 0;
 	int	descriptors = 0;
+	int	netgroup_interval = 0;
 	int	c;
 	int	vers;
 	struct sigaction sa;
@@ -707,7 +714,7 @@ main(int argc, char **argv)
 
 	/* Parse the command line options and arguments. */
 	opterr = 0;
-	while ((c = getopt_long(argc, argv, "o:nFd:f:p:P:hH:N:V:vrs:t:g", longopts, NULL)) != EOF)
+	while ((c = getopt_long(argc, argv, "o:nFd:f:p:P:hH:N:V:vrs:t:Tge:", longopts, NULL)) != EOF)
 		switch (c) {
 		case 'g':
 			manage_gids = 1;
@@ -769,6 +776,17 @@ main(int argc, char **argv)
 		case 't':
 			num_threads = atoi (optarg);
 			break;
+		case 'T':
+			threaded = 1;
+			break;
+		case 'e':
+			netgroup_interval = atoi(optarg);
+			if (netgroup_interval <= 0) {
+				fprintf(stderr, "%s: bad netgroup interval: %s\n",
+					progname, optarg);
+				usage(progname, 1);
+			}
+			break;
 		case 'V':
 			vers = atoi(optarg);
 			if (vers < 2 || vers > 4) {
@@ -856,6 +874,8 @@ main(int argc, char **argv)
 	sa.sa_handler = sig_hup;
 	sigaction(SIGHUP, &sa, NULL);
 
+	if (netgroup_interval)
+		client_netgroup_expand(netgroup_interval);
 	auth_init(export_file);
 
 	if (!foreground) {
@@ -879,14 +899,19 @@ main(int argc, char **argv)
 	}
 
 	/* silently bounds check num_threads */
-	if (foreground)
+	if (foreground && !threaded)
 		num_threads = 1;
 	else if (num_threads < 1)
 		num_threads = 1;
 	else if (num_threads > MAX_THREADS)
 		num_threads = MAX_THREADS;
 
-	if (num_threads > 1)
+	if (threaded) {
+		auth_init_threads();
+		if (new_cache)
+			cache_start_threads(num_threads);
+		num_threads = 1;
+	} else if (num_threads > 1)
 		fork_workers();
 
 	xlog(L_NOTICE, "Version " VERSION " starting");
@@ -906,6 +931,7 @@ usage(const char *prog, int n)
 "	[-p|--port port] [-V version|--nfs-version version]\n"
 "	[-N version|--no-nfs-version version] [-n|--no-tcp]\n"
 "	[-H ha-callout-prog] [-s|--state-directory-path path]\n"
-"	[-g|--manage-gids] [-t num|--num-threads=num]\n", prog);
+"	[-g|--manage-gids] [-t num|--num-threads=num] [-T|--threaded]\n"
+"	[-e secs|--expand-netgroups=secs]\n", prog);
 	exit(n);
 }
@@ -41,6 +41,10 @@ bool_t		mount_mnt_3_svc(struct svc_req *, dirpath *, mountres3 *);
 void		mount_dispatch(struct svc_req *, SVCXPRT *);
 void		auth_init(char *export_file);
 unsigned int	auth_reload(void);
+unsigned int	auth_reread_count(void);
+void		auth_init_threads(void);
+void		auth_hold(void);
+void		auth_release(void);
 nfs_export *	auth_authenticate(const char *what,
 					const struct sockaddr *caller,
 					const char *path);
@@ -51,9 +55,19 @@ void		mountlist_del(char *host, const char *path);
 void		mountlist_del_all(const struct sockaddr *sap);
 mountlist	mountlist_list(void);
 
+char *		hostcache_name(const char *addr);
+unsigned int	hostcache_wait(const int msecs);
+unsigned int	hostcache_generation(void);
+
 void		cache_open(void);
+void		cache_start_threads(int resolvers);
 struct nfs_fh_len *
 		cache_get_filehandle(nfs_export *exp, int len, char *p);
 int		cache_export(nfs_export *exp, char *path);
+void		cache_prime_exports(const struct export_delta *delta);
+
+void		thread_spawn(void *(*fn)(void *), void *arg);
+void		thread_pool_start(int count);
+void		thread_pool_queue(void (*fn)(void *), void *arg);
 
 #endif /* MOUNTD_H */
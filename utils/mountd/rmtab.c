@@ -3,6 +3,15 @@
  *
  * Manage the rmtab file for mountd.
  *
+ * The mount list is kept in a hash table keyed by client and path.
+ * A change is made on disk by appending the entry's new count to
+ * _PATH_RMTABJOURNAL; a count of zero removes the entry.  Once the
+ * journal grows long, the table is written out to _PATH_RMTAB in the
+ * usual format and the journal is emptied.  Other mountd processes
+ * notice a new rmtab by its inode and mtime, and otherwise catch up
+ * by reading the journal from where they last stopped.  All of this
+ * happens under _PATH_RMTABLCK.
+ *
  * Copyright (C) 1995, 1996 Olaf Kirch <okir@monad.swb.de>
  */
 
@@ -19,14 +28,38 @@
 
 #include "misc.h"
 #include "exportfs.h"
+#include "xmalloc.h"
 #include "xio.h"
 #include "mountd.h"
 #include "ha-callout.h"
 
 #include <limits.h> /* PATH_MAX */
 #include <errno.h>
+#include <stdio.h>
 
 extern int reverse_resolve;
+extern int new_cache;
+
+#define RMTAB_HASH_INITSIZE	256	/* a power of two */
+#define RMTAB_COMPACT_MIN	1024	/* journal records */
+#define MOUNTLIST_RESOLVE_WAIT	2000	/* msecs, for names in DUMP replies */
+
+struct rmtab_ent {
+	struct rmtab_ent *	re_next;
+	unsigned int		re_hash;
+	struct rmtabent		re_ent;
+};
+
+static struct rmtab_ent **	rmtab_hash;
+static unsigned int		rmtab_size;
+static unsigned int		rmtab_count;
+static unsigned int		rmtab_generation;	/* bumped by changes */
+
+/* Which rmtab the table was loaded from, and how much journal since */
+static int			rmtab_loaded;
+static struct stat		rmtab_stat;
+static long			rmtab_jpos;
+static unsigned int		rmtab_jrecords;
 
 /* If new path is a link do not destroy it but place the
  * file where the link points.
@@ -51,91 +84,296 @@ slink_safe_rename(const char * oldpath, const char * newpath)
 	return rename(oldpath, real_newpath);
 }
 
-void
-mountlist_add(char *host, const char *path)
+static unsigned int
+rmtab_hashkey(const char *client, const char *path)
 {
-	struct rmtabent	xe;
-	struct rmtabent	*rep;
-	int		lockid;
-	long		pos;
+	unsigned int hash;
 
-	if ((lockid = xflock(_PATH_RMTABLCK, "a")) < 0)
-		return;
-	setrmtabent("r+");
-	while ((rep = getrmtabent(1, &pos)) != NULL) {
-		if (strcmp (rep->r_client,
-			    host) == 0
-		    && strcmp(rep->r_path, path) == 0) {
-			rep->r_count++;
-			/* PRC: do the HA callout: */
-			ha_callout("mount", rep->r_client, rep->r_path, rep->r_count);
-			putrmtabent(rep, &pos);
-			endrmtabent();
-			xfunlock(lockid);
-			return;
+	hash = fnv1a_buf(FNV1A_OFFSET, client, strlen(client) + 1);
+	return fnv1a_buf(hash, path, strlen(path));
+}
+
+static struct rmtab_ent *
+rmtab_lookup(const char *client, const char *path, unsigned int hash)
+{
+	struct rmtab_ent *re;
+
+	if (rmtab_size == 0)
+		return NULL;
+	for (re = rmtab_hash[hash & (rmtab_size - 1)]; re; re = re->re_next)
+		if (re->re_hash == hash &&
+		    strcmp(re->re_ent.r_client, client) == 0 &&
+		    strcmp(re->re_ent.r_path, path) == 0)
+			return re;
+	return NULL;
+}
+
+static void
+rmtab_grow(void)
+{
+	unsigned int size = rmtab_size ? rmtab_size << 1 : RMTAB_HASH_INITSIZE;
+	struct rmtab_ent **hash, *re, *next;
+	unsigned int i;
+
+	hash = xmalloc(size * sizeof(*hash));
+	memset(hash, 0, size * sizeof(*hash));
+	for (i = 0; i < rmtab_size; i++)
+		for (re = rmtab_hash[i]; re; re = next) {
+			next = re->re_next;
+			re->re_next = hash[re->re_hash & (size - 1)];
+			hash[re->re_hash & (size - 1)] = re;
 		}
+	xfree(rmtab_hash);
+	rmtab_hash = hash;
+	rmtab_size = size;
+}
+
+/*
+ * Set the count of an entry, creating or removing it as needed.
+ * Returns the entry, or NULL if it has been removed.
+ */
+static struct rmtab_ent *
+rmtab_set(const char *client, const char *path, int count)
+{
+	unsigned int hash = rmtab_hashkey(client, path);
+	struct rmtab_ent *re, **rp;
+
+	rmtab_generation++;
+	re = rmtab_lookup(client, path, hash);
+	if (count <= 0) {
+		if (re == NULL)
+			return NULL;
+		for (rp = &rmtab_hash[hash & (rmtab_size - 1)]; *rp != re;
+		     rp = &(*rp)->re_next)
+			;
+		*rp = re->re_next;
+		xfree(re);
+		rmtab_count--;
+		return NULL;
 	}
-	endrmtabent();
-	strncpy(xe.r_client, host,
-		sizeof (xe.r_client) - 1);
-	xe.r_client [sizeof (xe.r_client) - 1] = '\0';
-	strncpy(xe.r_path, path, sizeof (xe.r_path) - 1);
-	xe.r_path [sizeof (xe.r_path) - 1] = '\0';
-	xe.r_count = 1;
-	if (setrmtabent("a")) {
-		/* PRC: do the HA callout: */
-		ha_callout("mount", xe.r_client, xe.r_path, xe.r_count);
-		putrmtabent(&xe, NULL);
-		endrmtabent();
+
+	if (re == NULL) {
+		if (rmtab_count >= rmtab_size)
+			rmtab_grow();
+		re = xmalloc(sizeof(*re));
+		strncpy(re->re_ent.r_client, client,
+			sizeof(re->re_ent.r_client) - 1);
+		re->re_ent.r_client[sizeof(re->re_ent.r_client) - 1] = '\0';
+		strncpy(re->re_ent.r_path, path, sizeof(re->re_ent.r_path) - 1);
+		re->re_ent.r_path[sizeof(re->re_ent.r_path) - 1] = '\0';
+		re->re_hash = rmtab_hashkey(re->re_ent.r_client,
+					re->re_ent.r_path);
+		re->re_next = rmtab_hash[re->re_hash & (rmtab_size - 1)];
+		rmtab_hash[re->re_hash & (rmtab_size - 1)] = re;
+		rmtab_count++;
 	}
-	xfunlock(lockid);
+	re->re_ent.r_count = count;
+	return re;
 }
 
-void
-mountlist_del(char *hname, const char *path)
+static void
+rmtab_clear(void)
+{
+	struct rmtab_ent *re, *next;
+	unsigned int i;
+
+	for (i = 0; i < rmtab_size; i++) {
+		for (re = rmtab_hash[i]; re; re = next) {
+			next = re->re_next;
+			xfree(re);
+		}
+		rmtab_hash[i] = NULL;
+	}
+	rmtab_count = 0;
+	rmtab_generation++;
+}
+
+static int
+rmtab_same_file(const struct stat *a, const struct stat *b)
+{
+	return a->st_dev == b->st_dev && a->st_ino == b->st_ino &&
+		a->st_mtim.tv_sec == b->st_mtim.tv_sec &&
+		a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+/*
+ * Bring the table up to date with rmtab and the journal.  Called with
+ * _PATH_RMTABLCK held.
+ */
+static void
+rmtab_sync(void)
 {
 	struct rmtabent	*rep;
+	struct rmtab_ent *re;
+	struct stat	stb;
 	FILE		*fp;
-	int		lockid;
-	int		match;
+	int		count;
 
-	if ((lockid = xflock(_PATH_RMTABLCK, "w")) < 0)
-		return;
-	if (!setrmtabent("r")) {
-		xfunlock(lockid);
-		return;
+	if (stat(_PATH_RMTAB, &stb) < 0)
+		memset(&stb, 0, sizeof(stb));
+	if (!rmtab_loaded || !rmtab_same_file(&stb, &rmtab_stat)) {
+		rmtab_clear();
+		if (setrmtabent("r")) {
+			while ((rep = getrmtabent(1, NULL)) != NULL) {
+				re = rmtab_lookup(rep->r_client, rep->r_path,
+					rmtab_hashkey(rep->r_client,
+							rep->r_path));
+				count = rep->r_count;
+				if (re != NULL)
+					count += re->re_ent.r_count;
+				rmtab_set(rep->r_client, rep->r_path, count);
+			}
+			endrmtabent();
+		}
+		rmtab_stat = stb;
+		rmtab_loaded = 1;
+		rmtab_jpos = 0;
+		rmtab_jrecords = 0;
 	}
-	if (!(fp = fsetrmtabent(_PATH_RMTABTMP, "w"))) {
-		endrmtabent();
-		xfunlock(lockid);
+
+	fp = fopen(_PATH_RMTABJOURNAL, "r");
+	if (fp == NULL)
+		return;
+	if (fseek(fp, 0, SEEK_END) == 0 && ftell(fp) < rmtab_jpos) {
+		/* emptied without a new rmtab: start over */
+		fclose(fp);
+		rmtab_loaded = 0;
+		rmtab_sync();
 		return;
 	}
-	while ((rep = getrmtabent(1, NULL)) != NULL) {
-		match = !strcmp (rep->r_client, hname)
-			&& !strcmp(rep->r_path, path);
-		if (match) {
-			rep->r_count--;
-			/* PRC: do the HA callout: */
-			ha_callout("unmount", rep->r_client, rep->r_path, rep->r_count);
+	if (fseek(fp, rmtab_jpos, SEEK_SET) == 0) {
+		while ((rep = fgetrmtabent(fp, 1, NULL)) != NULL) {
+			rmtab_set(rep->r_client, rep->r_path, rep->r_count);
+			rmtab_jrecords++;
 		}
-		if (!match || rep->r_count)
-			fputrmtabent(fp, rep, NULL);
+		rmtab_jpos = ftell(fp);
 	}
+	fclose(fp);
+}
+
+/*
+ * Write the whole table out as a new rmtab, and empty the journal.
+ * Called with _PATH_RMTABLCK held for writing.
+ */
+static void
+rmtab_compact(void)
+{
+	struct rmtab_ent *re;
+	unsigned int	i;
+	FILE		*fp;
+
+	if (!(fp = fsetrmtabent(_PATH_RMTABTMP, "w")))
+		return;
+	for (i = 0; i < rmtab_size; i++)
+		for (re = rmtab_hash[i]; re; re = re->re_next)
+			fputrmtabent(fp, &re->re_ent, NULL);
+	/* The journal is about to go, so rmtab must be on disk first */
+	if (fflush(fp) != 0 || fdatasync(fileno(fp)) != 0) {
+		xlog(L_ERROR, "couldn't write %s: %m", _PATH_RMTABTMP);
+		fclose(fp);
+		return;
+	}
+	fclose(fp);
 	if (slink_safe_rename(_PATH_RMTABTMP, _PATH_RMTAB) < 0) {
 		xlog(L_ERROR, "couldn't rename %s to %s",
 				_PATH_RMTABTMP, _PATH_RMTAB);
+		return;
 	}
-	endrmtabent();	/* close & unlink */
+	if (truncate(_PATH_RMTABJOURNAL, 0) < 0 && errno != ENOENT)
+		xlog(L_ERROR, "couldn't empty %s: %m", _PATH_RMTABJOURNAL);
+
+	if (stat(_PATH_RMTAB, &rmtab_stat) < 0)
+		memset(&rmtab_stat, 0, sizeof(rmtab_stat));
+	rmtab_jpos = 0;
+	rmtab_jrecords = 0;
+}
+
+/*
+ * Record the new count of @rep on disk.  Called with _PATH_RMTABLCK
+ * held for writing.  Without the new cache interface, exportfs reads
+ * rmtab itself, so it is rewritten every time instead.
+ */
+static void
+rmtab_commit(struct rmtabent *rep)
+{
+	FILE	*fp;
+
+	if (!new_cache) {
+		rmtab_compact();
+		return;
+	}
+
+	if (!(fp = fsetrmtabent(_PATH_RMTABJOURNAL, "a")))
+		return;
+	fputrmtabent(fp, rep, NULL);
+	if (fflush(fp) == 0)
+		rmtab_jpos = ftell(fp);
 	fendrmtabent(fp);
+	rmtab_jrecords++;
+
+	if (rmtab_jrecords >= RMTAB_COMPACT_MIN &&
+	    rmtab_jrecords > rmtab_count)
+		rmtab_compact();
+}
+
+/* Change the count of an entry by @delta, and record it */
+static void
+mountlist_change(char *op, char *host, const char *path, int delta)
+{
+	struct rmtab_ent *re;
+	struct rmtabent	xe;
+
+	re = rmtab_lookup(host, path, rmtab_hashkey(host, path));
+	if (re == NULL && delta < 0)
+		return;
+	xe.r_count = (re ? re->re_ent.r_count : 0) + delta;
+	re = rmtab_set(host, path, xe.r_count);
+	if (re != NULL)
+		xe = re->re_ent;
+	else {
+		strncpy(xe.r_client, host, sizeof(xe.r_client) - 1);
+		xe.r_client[sizeof(xe.r_client) - 1] = '\0';
+		strncpy(xe.r_path, path, sizeof(xe.r_path) - 1);
+		xe.r_path[sizeof(xe.r_path) - 1] = '\0';
+		xe.r_count = 0;
+	}
+
+	/* PRC: do the HA callout: */
+	ha_callout(op, xe.r_client, xe.r_path, xe.r_count);
+	rmtab_commit(&xe);
+}
+
+void
+mountlist_add(char *host, const char *path)
+{
+	int		lockid;
+
+	if ((lockid = xflock(_PATH_RMTABLCK, "w")) < 0)
+		return;
+	rmtab_sync();
+	mountlist_change("mount", host, path, 1);
+	xfunlock(lockid);
+}
+
+void
+mountlist_del(char *hname, const char *path)
+{
+	int		lockid;
+
+	if ((lockid = xflock(_PATH_RMTABLCK, "w")) < 0)
+		return;
+	rmtab_sync();
+	mountlist_change("unmount", hname, path, -1);
 	xfunlock(lockid);
 }
 
 void
 mountlist_del_all(const struct sockaddr *sap)
 {
+	struct rmtab_ent *re, *next;
+	struct rmtabent	xe;
 	char		*hostname;
-	struct rmtabent	*rep;
-	FILE		*fp;
+	unsigned int	i;
 	int		lockid;
 
 	if ((lockid = xflock(_PATH_RMTABLCK, "w")) < 0)
@@ -148,26 +386,20 @@ mountlist_del_all(const struct sockaddr *sap)
 		goto out_unlock;
 	}
 
-	if (!setrmtabent("r"))
-		goto out_free;
-
-	if (!(fp = fsetrmtabent(_PATH_RMTABTMP, "w")))
-		goto out_close;
+	rmtab_sync();
+	for (i = 0; i < rmtab_size; i++)
+		for (re = rmtab_hash[i]; re; re = next) {
+			next = re->re_next;
+			if (strcmp(re->re_ent.r_client, hostname) != 0 ||
+			    auth_authenticate("umountall", sap,
+					re->re_ent.r_path) == NULL)
+				continue;
+			xe = re->re_ent;
+			xe.r_count = 0;
+			rmtab_set(xe.r_client, xe.r_path, 0);
+			rmtab_commit(&xe);
+		}
 
-	while ((rep = getrmtabent(1, NULL)) != NULL) {
-		if (strcmp(rep->r_client, hostname) == 0 &&
-		    auth_authenticate("umountall", sap, rep->r_path) != NULL)
-			continue;
-		fputrmtabent(fp, rep, NULL);
-	}
-	if (slink_safe_rename(_PATH_RMTABTMP, _PATH_RMTAB) < 0) {
-		xlog(L_ERROR, "couldn't rename %s to %s",
-				_PATH_RMTABTMP, _PATH_RMTAB);
-	}
-	fendrmtabent(fp);
-out_close:
-	endrmtabent();	/* close & unlink */
-out_free:
 	free(hostname);
 out_unlock:
 	xfunlock(lockid);
@@ -185,67 +417,90 @@ mountlist_freeall(mountlist list)
 	}
 }
 
-mountlist
-mountlist_list(void)
+/*
+ * Turn the snapshot of the table into a DUMP reply.  With
+ * reverse_resolve, client names come from the host cache, which is
+ * given a little time to look up names it doesn't know yet.
+ */
+static mountlist
+mountlist_build(struct rmtabent *ents, unsigned int count)
 {
-	static mountlist	mlist = NULL;
-	static time_t		last_mtime = 0;
-	mountlist		m;
-	struct rmtabent		*rep;
-	struct stat		stb;
-	int			lockid;
+	mountlist	mlist = NULL, m;
+	unsigned int	i, missing = 0;
+	char		*name;
 
-	if ((lockid = xflock(_PATH_RMTABLCK, "r")) < 0)
-		return NULL;
-	if (stat(_PATH_RMTAB, &stb) < 0) {
-		xlog(L_ERROR, "can't stat %s: %s",
-				_PATH_RMTAB, strerror(errno));
-		xfunlock(lockid);
-		return NULL;
+	if (reverse_resolve) {
+		/* Start looking up every unknown name, then wait for all */
+		for (i = 0; i < count; i++) {
+			name = hostcache_name(ents[i].r_client);
+			if (name == NULL)
+				missing++;
+			free(name);
+		}
+		if (missing)
+			hostcache_wait(MOUNTLIST_RESOLVE_WAIT);
 	}
-	if (stb.st_mtime != last_mtime) {
-		mountlist_freeall(mlist);
-		mlist = NULL;
-		last_mtime = stb.st_mtime;
-
-		setrmtabent("r");
-		while ((rep = getrmtabent(1, NULL)) != NULL) {
-			m = calloc(1, sizeof(*m));
-			if (m == NULL) {
-				mountlist_freeall(mlist);
-				mlist = NULL;
-				xlog(L_ERROR, "%s: memory allocation failed",
-						__func__);
-				break;
-			}
 
-			if (reverse_resolve) {
-				struct addrinfo *ai;
-				ai = host_pton(rep->r_client);
-				if (ai != NULL) {
-					m->ml_hostname = host_canonname(ai->ai_addr);
-					freeaddrinfo(ai);
-				}
-			}
-			if (m->ml_hostname == NULL)
-				m->ml_hostname = strdup(rep->r_client);
+	for (i = 0; i < count; i++) {
+		m = calloc(1, sizeof(*m));
+		if (m == NULL)
+			goto out_nomem;
+		m->ml_next = mlist;
+		mlist = m;
 
-			m->ml_directory = strdup(rep->r_path);
+		if (reverse_resolve)
+			m->ml_hostname = hostcache_name(ents[i].r_client);
+		if (m->ml_hostname == NULL)
+			m->ml_hostname = strdup(ents[i].r_client);
+		m->ml_directory = strdup(ents[i].r_path);
+		if (m->ml_hostname == NULL || m->ml_directory == NULL)
+			goto out_nomem;
+	}
+	return mlist;
 
-			if (m->ml_hostname == NULL || m->ml_directory == NULL) {
-				mountlist_freeall(mlist);
-				mlist = NULL;
-				xlog(L_ERROR, "%s: memory allocation failed",
-						__func__);
-				break;
-			}
+out_nomem:
+	mountlist_freeall(mlist);
+	xlog(L_ERROR, "%s: memory allocation failed", __func__);
+	return NULL;
+}
 
-			m->ml_next = mlist;
-			mlist = m;
-		}
-		endrmtabent();
+/*
+ * The reply is rebuilt only when the table has changed or, with
+ * reverse_resolve, when more names have been looked up.  No DNS
+ * lookups are done while rmtab is locked.
+ */
+mountlist
+mountlist_list(void)
+{
+	static mountlist	mlist = NULL;
+	static unsigned int	last_generation, last_names;
+	static int		listed;
+	static struct rmtabent	*ents;
+	static unsigned int	nents;
+	struct rmtab_ent	*re;
+	unsigned int		i, names;
+	int			lockid, changed = 0;
+
+	if ((lockid = xflock(_PATH_RMTABLCK, "r")) < 0)
+		return NULL;
+	rmtab_sync();
+	if (!listed || rmtab_generation != last_generation) {
+		ents = xrealloc(ents, (rmtab_count + 1) * sizeof(*ents));
+		nents = 0;
+		for (i = 0; i < rmtab_size; i++)
+			for (re = rmtab_hash[i]; re; re = re->re_next)
+				ents[nents++] = re->re_ent;
+		last_generation = rmtab_generation;
+		listed = 1;
+		changed = 1;
 	}
 	xfunlock(lockid);
 
+	names = reverse_resolve ? hostcache_generation() : 0;
+	if (changed || names != last_names) {
+		mountlist_freeall(mlist);
+		mlist = mountlist_build(ents, nents);
+		last_names = reverse_resolve ? hostcache_generation() : 0;
+	}
 	return mlist;
 }
@@ -50,73 +50,29 @@
 #include <sys/types.h>
 #include <rpc/rpc.h>
 #include "xlog.h"
+#include "rpcmisc.h"
 #include <errno.h>
 #include <time.h>
 
-#ifdef HAVE_LIBTIRPC
-#include <rpc/rpc_com.h>
-#endif
-
-void cache_set_fds(fd_set *fdset);
-int cache_process_req(fd_set *readfds);
-
-#if LONG_MAX != INT_MAX	
-/* bug in glibc 2.3.6 and earlier, we need
- * our own svc_getreqset
- */
-static void
-my_svc_getreqset (fd_set *readfds)
-{
-	fd_mask mask;
-	fd_mask *maskp;
-	int setsize;
-	int sock;
-	int bit;
-
-	setsize = _rpc_dtablesize ();
-	if (setsize > FD_SETSIZE)
-		setsize = FD_SETSIZE;
-	maskp = readfds->fds_bits;
-	for (sock = 0; sock < setsize; sock += NFDBITS)
-		for (mask = *maskp++;
-		     (bit = ffsl (mask));
-		     mask ^= (1L << (bit - 1)))
-			svc_getreq_common (sock + bit - 1);
-}
-#define svc_getreqset my_svc_getreqset
-
-#endif
+void cache_add_fds(void);
 
 /*
- * The heart of the server.  A crib from libc for the most part...
+ * The heart of the server.  RPC transports and, unless they have
+ * threads of their own, the kernel cache channels are all watched
+ * by the shared epoll loop.
  */
 void
 my_svc_run(void)
 {
-	fd_set	readfds;
-	int	selret;
+	cache_add_fds();
 
 	for (;;) {
-
-		readfds = svc_fdset;
-		cache_set_fds(&readfds);
-
-		selret = select(FD_SETSIZE, &readfds,
-				(void *) 0, (void *) 0, (struct timeval *) 0);
-
-
-		switch (selret) {
-		case -1:
-			if (errno == EINTR || errno == ECONNREFUSED
-			 || errno == ENETUNREACH || errno == EHOSTUNREACH)
-				continue;
-			xlog(L_ERROR, "my_svc_run() - select: %m");
-			return;
-
-		default:
-			selret -= cache_process_req(&readfds);
-			if (selret)
-				svc_getreqset(&readfds);
-		}
+		if (nfs_svc_loop_wait(-1) >= 0)
+			continue;
+		if (errno == EINTR || errno == ECONNREFUSED
+		 || errno == ENETUNREACH || errno == EHOSTUNREACH)
+			continue;
+		xlog(L_ERROR, "my_svc_run() - epoll_wait: %m");
+		return;
 	}
 }
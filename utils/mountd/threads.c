@@ -0,0 +1,120 @@
+/*
+ * utils/mountd/threads.c
+ *
+ * Thread support for mountd's threaded mode.
+ *
+ * A fixed pool of worker threads takes jobs off a FIFO queue.  The
+ * cache channel readers hand it requests that may block for a long
+ * time on DNS or netgroup lookups.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include "xmalloc.h"
+#include "xlog.h"
+#include "mountd.h"
+
+struct job {
+	struct job *	j_next;
+	void		(*j_fn)(void *);
+	void *		j_arg;
+};
+
+static pthread_mutex_t	queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	queue_cond = PTHREAD_COND_INITIALIZER;
+static struct job *	queue_head;
+static struct job **	queue_tail = &queue_head;
+
+static void *
+worker(void *UNUSED(arg))
+{
+	struct job *job;
+
+	for (;;) {
+		pthread_mutex_lock(&queue_lock);
+		while (queue_head == NULL)
+			pthread_cond_wait(&queue_cond, &queue_lock);
+		job = queue_head;
+		queue_head = job->j_next;
+		if (queue_head == NULL)
+			queue_tail = &queue_head;
+		pthread_mutex_unlock(&queue_lock);
+
+		job->j_fn(job->j_arg);
+		xfree(job);
+	}
+	return NULL;
+}
+
+/**
+ * thread_spawn - start a detached thread
+ * @fn: thread start routine
+ * @arg: argument passed to @fn
+ *
+ * All signals are blocked in the new thread, so that SIGTERM and
+ * friends are still delivered to the main thread.  Exits if the
+ * thread cannot be created.
+ */
+void
+thread_spawn(void *(*fn)(void *), void *arg)
+{
+	pthread_attr_t attr;
+	pthread_t thread;
+	sigset_t set, oset;
+	int err;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, &oset);
+	err = pthread_create(&thread, &attr, fn, arg);
+	pthread_sigmask(SIG_SETMASK, &oset, NULL);
+	pthread_attr_destroy(&attr);
+	if (err)
+		xlog(L_FATAL, "mountd: cannot create thread: %s\n",
+				strerror(err));
+}
+
+/**
+ * thread_pool_start - start the worker threads
+ * @count: number of workers
+ *
+ */
+void
+thread_pool_start(int count)
+{
+	int i;
+
+	xlog(L_NOTICE, "mountd: starting %d worker threads\n", count);
+	for (i = 0; i < count; i++)
+		thread_spawn(worker, NULL);
+}
+
+/**
+ * thread_pool_queue - hand a job to the worker threads
+ * @fn: function to call
+ * @arg: argument passed to @fn
+ *
+ * Jobs are started in the order they are queued.
+ */
+void
+thread_pool_queue(void (*fn)(void *), void *arg)
+{
+	struct job *job;
+
+	job = xmalloc(sizeof(*job));
+	job->j_next = NULL;
+	job->j_fn = fn;
+	job->j_arg = arg;
+
+	pthread_mutex_lock(&queue_lock);
+	*queue_tail = job;
+	queue_tail = &job->j_next;
+	pthread_cond_signal(&queue_cond);
+	pthread_mutex_unlock(&queue_lock);
+}
@@ -16,12 +16,14 @@
 #include <sys/queue.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <ctype.h>
 
 #include <unistd.h>
 #include <errno.h>
 
 #include "xlog.h"
+#include "xmalloc.h"
 #include "exportfs.h"
 #include "nfslib.h"
 #include "misc.h"
@@ -134,6 +136,7 @@ int pseudofs_update(char *hostname, char *path, nfs_export *source)
 	}
 	/* Update an existing V4ROOT export: */
 	set_pseudofs_security(&exp->m_export, &source->m_export);
+	exp->m_stale = 0;
 	return 0;
 }
 
@@ -165,26 +168,100 @@ static int v4root_add_parents(nfs_export *exp)
 	return 0;
 }
 
+/*
+ * Pseudo exports left over from before a reload are reused.  Their
+ * security settings are reset here and then built up again from the
+ * real exports below them, as for a new pseudo export.  The old
+ * settings are saved so that v4root_compare() can tell whether they
+ * changed.
+ */
+struct v4root_saved {
+	nfs_export *		exp;
+	int			flags;
+	struct sec_entry	secinfo[SECFLAVOR_COUNT+1];
+};
+
+static struct v4root_saved *
+v4root_reset(int *count)
+{
+	struct v4root_saved *saved = NULL;
+	nfs_export *exp;
+	int i, n = 0;
+
+	for (i = 0; i < MCL_MAXTYPES; i++)
+		for (exp = exportlist[i].p_head; exp; exp = exp->m_next)
+			if (exp->m_export.e_flags & NFSEXP_V4ROOT)
+				n++;
+	if (n)
+		saved = xmalloc(n * sizeof(*saved));
+
+	n = 0;
+	for (i = 0; i < MCL_MAXTYPES; i++)
+		for (exp = exportlist[i].p_head; exp; exp = exp->m_next) {
+			struct exportent *e = &exp->m_export;
+
+			if (!(e->e_flags & NFSEXP_V4ROOT))
+				continue;
+			saved[n].exp = exp;
+			saved[n].flags = e->e_flags;
+			memcpy(saved[n].secinfo, e->e_secinfo,
+					sizeof(e->e_secinfo));
+			n++;
+
+			e->e_flags = pseudo_root.m_export.e_flags;
+			if (strcmp(e->e_path, "/") != 0)
+				e->e_flags &= ~NFSEXP_FSID;
+			memset(e->e_secinfo, 0, sizeof(e->e_secinfo));
+		}
+	*count = n;
+	return saved;
+}
+
+static void
+v4root_compare(struct v4root_saved *saved, int count)
+{
+	struct exportent *e;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		e = &saved[i].exp->m_export;
+		if (e->e_flags != saved[i].flags ||
+		    memcmp(e->e_secinfo, saved[i].secinfo,
+				sizeof(e->e_secinfo)) != 0)
+			saved[i].exp->m_changed = 1;
+	}
+	free(saved);
+}
+
 /*
  * Create pseudo exports by running through the real export
  * looking at the components of the path that make up the export.
  * Those path components, if not exported, will become pseudo
  * exports allowing them to be found when the kernel does an upcall
  * looking for components of the v4 mount.
+ *
+ * Real exports a reload did not see are gone already; see
+ * export_reload_prune().  Pseudo exports that are no longer needed
+ * are left stale, for export_reload_end() to remove.
  */
 void
 v4root_set()
 {
+	struct v4root_saved *saved;
 	nfs_export	*exp;
-	int	i;
+	int	i, count;
 
 	if (!v4root_needed)
 		return;
 	if (!v4root_support())
 		return;
 
+	saved = v4root_reset(&count);
 	for (i = 0; i < MCL_MAXTYPES; i++) {
 		for (exp = exportlist[i].p_head; exp; exp = exp->m_next) {
+			/* On its way out; its parents are not needed */
+			if (exp->m_stale)
+				continue;
 			if (exp->m_export.e_flags & NFSEXP_V4ROOT)
 				/*
 				 * We just added this one, so its
@@ -196,4 +273,5 @@ v4root_set()
 			/* XXX: error handling! */
 		}
 	}
+	v4root_compare(saved, count);
 }
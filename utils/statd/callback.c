@@ -56,6 +56,9 @@
  *
  *   2.  If statd's monitor list becomes substantial, finding a match
  *       can generate a not inconsequential amount of DNS traffic.
+ *       To limit this, the addresses of monitored hosts are looked
+ *       up when they are added and kept in an index (see notlist.c),
+ *       so each SM_NOTIFY costs lookups of the sender only.
  *
  *   3.  statd is a single-threaded service.  When DNS becomes slow or
  *       unresponsive, statd also becomes slow or unresponsive.
@@ -76,10 +79,22 @@
  *       server's name from the devname it was passed by the mount
  *       command.  This is often not a fully-qualified domain name.
  */
+static void
+sm_notify_one(notify_list *lp, void *data)
+{
+	struct stat_chge *argp = data;
+	notify_list *call;
+
+	if (NL_STATE(lp) != argp->state) {
+		NL_STATE(lp) = argp->state;
+		call = nlist_clone(lp);
+		notify_queue(call);
+	}
+}
+
 void *
 sm_notify_1_svc(struct stat_chge *argp, struct svc_req *rqstp)
 {
-	notify_list    *lp, *call;
 	static char    *result = NULL;
 	struct sockaddr *sap = nfs_getrpccaller(rqstp->rq_xprt);
 	char		ip_addr[INET6_ADDRSTRLEN];
@@ -104,15 +119,8 @@ sm_notify_1_svc(struct stat_chge *argp, struct svc_req *rqstp)
 	 * it. Lockd will want to continue monitoring the remote host
 	 * until it issues an SM_UNMON call.
 	 */
-	for (lp = rtnl ; lp ; lp = lp->next)
-		if (NL_STATE(lp) != argp->state &&
-		    (statd_matchhostname(argp->mon_name, lp->dns_name) ||
-		     statd_matchhostname(ip_addr, lp->dns_name))) {
-			NL_STATE(lp) = argp->state;
-			call = nlist_clone(lp);
-			nlist_insert(&notify, call);
-		}
-
+	nlist_match(argp->mon_name, sm_notify_one, argp);
+	nlist_match(ip_addr, sm_notify_one, argp);
 
 	return ((void *) &result);
 }
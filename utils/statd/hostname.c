@@ -32,11 +32,16 @@
 #include <stdbool.h>
 #include <string.h>
 #include <strings.h>
+#include <time.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 
 #include "sockaddr.h"
+#include "misc.h"
+#include "rpcmisc.h"
 #include "statd.h"
+#include "notlist.h"
+#include "resolver.h"
 #include "xlog.h"
 
 /**
@@ -169,24 +174,12 @@ get_nameinfo(const struct sockaddr *sap,
 }
 #endif	/* !HAVE_GETNAMEINFO */
 
-/**
- * statd_canonical_name - choose file name for monitor record files
- * @hostname: C string containing hostname or presentation address
- *
- * Returns a '\0'-terminated ASCII string containing a fully qualified
- * canonical hostname, or NULL if @hostname does not have a reverse
- * mapping.  Caller must free the result with free(3).
- *
- * Incoming hostnames are looked up to determine the canonical hostname,
- * and incoming presentation addresses are converted to canonical
- * hostnames.
- *
- * We won't monitor peers that don't have a reverse map.  The canonical
- * name gives us a key for our monitor list.
+/*
+ * Presentation addresses are converted to their canonical hostnames.
  */
 __attribute_malloc__
-char *
-statd_canonical_name(const char *hostname)
+static char *
+canonical_name(const char *hostname)
 {
 	struct addrinfo hint = {
 #ifdef IPV6_SUPPORTED
@@ -229,14 +222,10 @@ statd_canonical_name(const char *hostname)
  * Take care to perform an explicit reverse lookup on presentation
  * addresses.  Otherwise we don't get a real canonical name or a
  * complete list of addresses.
- *
- * Returns an addrinfo list that has ai_canonname filled in, or
- * NULL if some error occurs.  Caller must free the returned
- * list with freeaddrinfo(3).
  */
 __attribute_malloc__
 static struct addrinfo *
-statd_canonical_list(const char *hostname)
+canonical_list(const char *hostname)
 {
 	struct addrinfo hint = {
 #ifdef IPV6_SUPPORTED
@@ -268,6 +257,397 @@ out:
 	return get_addrinfo(buf, &hint);
 }
 
+/*
+ * Answers are kept, so that SM_MON, SM_UNMON and SM_NOTIFY requests
+ * about hosts statd has seen before need no DNS queries.  An answer
+ * older than RESOLVE_TTL seconds is still used while a resolver thread
+ * looks the host up again.  A failed lookup is believed for only
+ * RESOLVE_NEG_TTL seconds, and is then repeated while the caller waits.
+ *
+ * Answers are replaced, and entries freed, only from the service loop,
+ * so what statd_canonical_list() returns stays valid until statd next
+ * waits for requests.
+ *
+ * Entries held with statd_hold_name(), which back the keys of the
+ * run-time notify list, are never freed.  Other entries are freed
+ * once unused for 2 * RESOLVE_TTL seconds, or, least recently used
+ * first, when there are more than DNS_CACHE_SPARE of them for each
+ * held entry plus DNS_CACHE_MIN.
+ */
+#define DNS_CACHE_INITSIZE	1024		/* hash chains; a power of two */
+#define DNS_CACHE_MIN		8192		/* unheld entries always allowed */
+#define DNS_CACHE_SPARE		2		/* more per held entry */
+
+enum {
+	DNS_NAME,				/* statd_canonical_name() */
+	DNS_LIST,				/* statd_canonical_list() */
+};
+
+struct dns_ent {
+	struct resolver_job	d_job;		/* must be first */
+	struct dns_ent *	d_next;
+	unsigned int		d_hash;
+	int			d_kind;
+	_Bool			d_pending;
+	unsigned int		d_refs;		/* statd_hold_name() */
+	time_t			d_time;		/* of the answer; zero if none */
+	time_t			d_used;
+	char *			d_name;		/* DNS_NAME answer */
+	struct addrinfo *	d_list;		/* DNS_LIST answer */
+	char *			d_new_name;	/* set by a resolver thread */
+	struct addrinfo *	d_new_list;
+	char			d_host[];
+};
+
+static struct dns_ent **	dns_table;
+static unsigned int	dns_size;
+static unsigned int	dns_count;
+static unsigned int	dns_held;		/* entries with d_refs set */
+static unsigned int	dns_swept;		/* dns_count after a sweep */
+static time_t		dns_next_sweep;
+
+static unsigned int
+dns_limit(void)
+{
+	return DNS_CACHE_MIN + dns_held * (DNS_CACHE_SPARE + 1);
+}
+
+static void
+dns_grow(void)
+{
+	struct dns_ent **table, *d, *next;
+	unsigned int size, i;
+
+	size = dns_size ? dns_size << 1 : DNS_CACHE_INITSIZE;
+	table = xmalloc(size * sizeof(*table));
+	memset(table, 0, size * sizeof(*table));
+	for (i = 0; i < dns_size; i++)
+		for (d = dns_table[i]; d != NULL; d = next) {
+			next = d->d_next;
+			d->d_next = table[d->d_hash & (size - 1)];
+			table[d->d_hash & (size - 1)] = d;
+		}
+	free(dns_table);
+	dns_table = table;
+	dns_size = size;
+}
+
+static void
+dns_set(struct dns_ent *d, char *name, struct addrinfo *list)
+{
+	free(d->d_name);
+	if (d->d_list != NULL)
+		freeaddrinfo(d->d_list);
+	d->d_name = name;
+	d->d_list = list;
+	d->d_time = time(NULL);
+}
+
+static _Bool
+dns_answered(const struct dns_ent *d)
+{
+	return d->d_kind == DNS_NAME ? d->d_name != NULL : d->d_list != NULL;
+}
+
+/* Runs on a resolver thread */
+static void
+dns_lookup(struct resolver_job *job)
+{
+	struct dns_ent *d = (struct dns_ent *)job;
+
+	if (d->d_kind == DNS_NAME)
+		d->d_new_name = canonical_name(d->d_host);
+	else
+		d->d_new_list = canonical_list(d->d_host);
+}
+
+static void
+dns_done(struct resolver_job *job)
+{
+	struct dns_ent *d = (struct dns_ent *)job;
+
+	dns_set(d, d->d_new_name, d->d_new_list);
+	d->d_new_name = NULL;
+	d->d_new_list = NULL;
+	d->d_pending = false;
+	if (d->d_kind == DNS_LIST)
+		nlist_resolved(d->d_host);
+}
+
+static void
+dns_queue(struct dns_ent *d)
+{
+	if (d->d_pending)
+		return;
+	d->d_pending = true;
+	d->d_job.rj_lookup = dns_lookup;
+	d->d_job.rj_done = dns_done;
+	resolver_queue(&d->d_job);
+}
+
+static struct dns_ent *
+dns_find(const char *hostname, const int kind)
+{
+	unsigned int hash = fnv1a_str(hostname);
+	struct dns_ent *d, **dp;
+	size_t len;
+
+	if (dns_count >= dns_size)
+		dns_grow();
+	dp = &dns_table[hash & (dns_size - 1)];
+	for (d = *dp; d != NULL; d = d->d_next)
+		if (d->d_hash == hash && d->d_kind == kind &&
+		    strcmp(d->d_host, hostname) == 0)
+			break;
+
+	if (d == NULL) {
+		len = strlen(hostname) + 1;
+		d = xmalloc(sizeof(*d) + len);
+		memset(d, 0, sizeof(*d));
+		memcpy(d->d_host, hostname, len);
+		d->d_hash = hash;
+		d->d_kind = kind;
+		d->d_next = *dp;
+		*dp = d;
+		dns_count++;
+	}
+	d->d_used = time(NULL);
+	return d;
+}
+
+static struct dns_ent *
+dns_get(const char *hostname, const int kind)
+{
+	struct dns_ent *d = dns_find(hostname, kind);
+
+	if (dns_answered(d)) {
+		/* A stale answer is better than none while it is renewed */
+		if (d->d_used - d->d_time >= RESOLVE_TTL)
+			dns_queue(d);
+		return d;
+	}
+
+	if (d->d_time == 0 || d->d_used - d->d_time >= RESOLVE_NEG_TTL) {
+		if (kind == DNS_NAME)
+			dns_set(d, canonical_name(hostname), NULL);
+		else
+			dns_set(d, NULL, canonical_list(hostname));
+	}
+	return d;
+}
+
+/**
+ * statd_canonical_name - choose file name for monitor record files
+ * @hostname: C string containing hostname or presentation address
+ *
+ * Returns a '\0'-terminated ASCII string containing a fully qualified
+ * canonical hostname, or NULL if @hostname does not have a reverse
+ * mapping.  Caller must free the result with free(3).
+ *
+ * Incoming hostnames are looked up to determine the canonical hostname,
+ * and incoming presentation addresses are converted to canonical
+ * hostnames.
+ *
+ * We won't monitor peers that don't have a reverse map.  The canonical
+ * name gives us a key for our monitor list.
+ */
+__attribute_malloc__
+char *
+statd_canonical_name(const char *hostname)
+{
+	struct dns_ent *d = dns_get(hostname, DNS_NAME);
+
+	return d->d_name != NULL ? strdup(d->d_name) : NULL;
+}
+
+/**
+ * statd_canonical_list - look up the canonical name and addresses of a host
+ * @hostname: C string containing hostname or presentation address
+ *
+ * Returns an addrinfo list that has ai_canonname filled in, or
+ * NULL if some error occurs.  The list belongs to the cache and
+ * must not be freed; it stays valid until statd next waits for
+ * requests.
+ */
+const struct addrinfo *
+statd_canonical_list(const char *hostname)
+{
+	return dns_get(hostname, DNS_LIST)->d_list;
+}
+
+/**
+ * statd_prefetch - start looking up a host statd will soon ask about
+ * @hostname: C string containing hostname or presentation address
+ *
+ */
+void
+statd_prefetch(const char *hostname)
+{
+	struct dns_ent *d = dns_find(hostname, DNS_LIST);
+
+	if (d->d_time == 0)
+		dns_queue(d);
+}
+
+/**
+ * statd_refresh - look a host up again in the background if needed
+ * @hostname: C string containing hostname or presentation address
+ *
+ * Returns true if @hostname is being looked up, in which case
+ * nlist_resolved() is called once it has been, or false if what
+ * statd_canonical_list() gives for @hostname is recent enough.
+ */
+_Bool
+statd_refresh(const char *hostname)
+{
+	struct dns_ent *d = dns_find(hostname, DNS_LIST);
+
+	if (d->d_time == 0 ||
+	    d->d_used - d->d_time >= (dns_answered(d) ?
+					RESOLVE_TTL : RESOLVE_NEG_TTL))
+		dns_queue(d);
+	return d->d_pending;
+}
+
+/**
+ * statd_hold_name - keep what a host resolves to for as long as needed
+ * @hostname: C string containing hostname or presentation address
+ *
+ * The answer statd_canonical_list() gives for @hostname is kept until
+ * a matching call to statd_release_name().
+ */
+void
+statd_hold_name(const char *hostname)
+{
+	struct dns_ent *d = dns_find(hostname, DNS_LIST);
+
+	if (d->d_refs++ == 0)
+		dns_held++;
+}
+
+/**
+ * statd_release_name - undo statd_hold_name()
+ * @hostname: C string passed to statd_hold_name()
+ *
+ */
+void
+statd_release_name(const char *hostname)
+{
+	struct dns_ent *d = dns_find(hostname, DNS_LIST);
+
+	if (d->d_refs != 0 && --d->d_refs == 0)
+		dns_held--;
+}
+
+static void
+dns_ready(__attribute__ ((unused)) int fd,
+		__attribute__ ((unused)) void *data)
+{
+	resolver_finish();
+}
+
+/**
+ * statd_resolver_start - start looking hosts up in the background
+ *
+ * Call after dropping privileges, which only the calling thread
+ * would lose.  Lookups started by statd_prefetch() before now begin.
+ */
+void
+statd_resolver_start(void)
+{
+	int fd;
+
+	fd = resolver_start(RESOLVER_THREADS);
+	if (fd != -1 && nfs_svc_loop_add(fd, dns_ready, NULL) == -1)
+		xlog(L_ERROR, "%s: can't watch resolver: %m", __func__);
+}
+
+static int
+dns_cmp_used(const void *a, const void *b)
+{
+	time_t x = *(const time_t *)a, y = *(const time_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Find the time of last use of the newest entry that must go so that
+ * no more than @limit entries remain.  Entries being looked up and
+ * held entries are never counted.
+ */
+static time_t
+dns_lru_cutoff(const unsigned int limit)
+{
+	unsigned int i, n = 0, excess = dns_count - limit;
+	struct dns_ent *d;
+	time_t *used, cutoff;
+
+	used = xmalloc(dns_count * sizeof(*used));
+	for (i = 0; i < dns_size; i++)
+		for (d = dns_table[i]; d != NULL; d = d->d_next)
+			if (!d->d_pending && d->d_refs == 0)
+				used[n++] = d->d_used;
+	if (n == 0) {
+		free(used);
+		return 0;
+	}
+	qsort(used, n, sizeof(*used), dns_cmp_used);
+	cutoff = used[(excess < n ? excess : n) - 1];
+	free(used);
+	return cutoff;
+}
+
+static void
+dns_free(struct dns_ent **dp)
+{
+	struct dns_ent *d = *dp;
+
+	*dp = d->d_next;
+	free(d->d_name);
+	if (d->d_list != NULL)
+		freeaddrinfo(d->d_list);
+	free(d);
+	dns_count--;
+}
+
+/**
+ * statd_expire_names - forget hosts that statd has not asked about lately
+ *
+ * Call from the service loop, between requests.
+ */
+void
+statd_expire_names(void)
+{
+	unsigned int limit = dns_limit(), target, i;
+	time_t now = time(NULL), cutoff, lru = 0;
+	struct dns_ent *d, **dp;
+
+	/* What is held or being looked up may keep the count over limit */
+	if (now < dns_next_sweep &&
+	    (dns_count <= limit || dns_count <= dns_swept + limit / 8))
+		return;
+	dns_next_sweep = now + RESOLVE_TTL;
+
+	/* Over the limit, the least recently used go too, with room to spare */
+	target = limit - limit / 8;
+	if (dns_count > limit)
+		lru = dns_lru_cutoff(target);
+	cutoff = now - 2 * RESOLVE_TTL;
+	if (lru >= cutoff)
+		cutoff = lru;
+	for (i = 0; i < dns_size; i++)
+		for (dp = &dns_table[i]; (d = *dp) != NULL; ) {
+			if (d->d_pending || d->d_refs != 0 ||
+			    d->d_used > cutoff ||
+			    (d->d_used == cutoff && dns_count <= target)) {
+				dp = &d->d_next;
+				continue;
+			}
+			dns_free(dp);
+		}
+	dns_swept = dns_count;
+}
+
 /**
  * statd_matchhostname - check if two hostnames are equivalent
  * @hostname1: C string containing hostname
@@ -283,7 +663,7 @@ out:
 _Bool
 statd_matchhostname(const char *hostname1, const char *hostname2)
 {
-	struct addrinfo *ai1, *ai2, *results1 = NULL, *results2 = NULL;
+	const struct addrinfo *ai1, *ai2, *results1, *results2;
 	_Bool result = false;
 
 	if (strcasecmp(hostname1, hostname2) == 0) {
@@ -311,9 +691,6 @@ statd_matchhostname(const char *hostname1, const char *hostname2)
 			}
 
 out:
-	freeaddrinfo(results2);
-	freeaddrinfo(results1);
-
 	xlog(D_CALL, "%s: hostnames %s and %s %s", __func__,
 			hostname1, hostname2,
 			(result ? "matched" : "did not match"));
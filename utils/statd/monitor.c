@@ -26,6 +26,7 @@
 #include "nsm.h"
 #include "statd.h"
 #include "notlist.h"
+#include "resolver.h"
 #include "ha-callout.h"
 
 notify_list *		rtnl = NULL;	/* Run-time notify list. */
@@ -191,6 +192,7 @@ sm_mon_1_svc(struct mon *argp, struct svc_req *rqstp)
 	/* PRC: do the HA callout: */
 	ha_callout("add-client", mon_name, my_name, -1);
 	nlist_insert(&rtnl, clnt);
+	nlist_index(clnt);
 	xlog(D_GENERAL, "MONITORING %s for %s", mon_name, my_name);
  success:
 	result.res_stat = STAT_SUCC;
@@ -240,6 +242,8 @@ load_one_host(const char *hostname,
 	memcpy(NL_PRIV(clnt), m->priv, SM_PRIV_SIZE);
 
 	nlist_insert(&rtnl, clnt);
+	statd_prefetch(clnt->dns_name);
+	statd_prefetch(NL_MON_NAME(clnt));
 	return 1;
 }
 
@@ -252,6 +256,18 @@ void load_state(void)
 		xlog(D_GENERAL, "Loaded %u previously monitored hosts", count);
 }
 
+/*
+ * The hosts loaded by load_state() are looked up in parallel by the
+ * resolver threads, and each is indexed as its lookup finishes.
+ */
+void index_state(void)
+{
+	notify_list *clnt;
+
+	for (clnt = rtnl; clnt != NULL; clnt = NL_NEXT(clnt))
+		nlist_index_later(clnt);
+}
+
 /*
  * Services SM_UNMON requests.
  *
@@ -16,7 +16,13 @@
 #include <config.h>
 #endif
 
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <ctype.h>
+#include <netdb.h>
 #include <string.h>
+#include <time.h>
+#include "misc.h"
 #include "statd.h"
 #include "notlist.h"
 
@@ -60,6 +66,8 @@ nlist_new(char *my_name, char *mon_name, int state)
 	NL_STATE(new) = state;
 	NL_MY_NAME(new) = xstrdup(my_name);
 	NL_MON_NAME(new) = xstrdup(mon_name);
+	new->xid.nx_data = new;
+	new->timer.nt_data = new;
 
 	return new;
 }
@@ -67,8 +75,7 @@ nlist_new(char *my_name, char *mon_name, int state)
 /*
  * Insert *entry into a notify list at the point specified by
  * **head.  This can be in the middle.  However, we do not handle
- * list _append_ in this function; rather, the only place we should
- * have to worry about this case is in nlist_insert_timer below.
+ * list _append_ in this function.
  * - entry must not be NULL.
  */
 void 
@@ -77,8 +84,7 @@ nlist_insert(notify_list **head, notify_list *entry)
 	if (*head) {
 		/* 
 		 * Cases where we're prepending a non-empty list
-		 * or inserting possibly in the middle somewhere (eg,
-		 * nlist_insert_timer...)
+		 * or inserting possibly in the middle somewhere
 		 */
 		entry->next = (*head);		/* Forward pointer */
 		entry->prev = (*head)->prev;	/* Back pointer */
@@ -93,63 +99,9 @@ nlist_insert(notify_list **head, notify_list *entry)
 #endif
 }
 
-/* 
- * (re)insert *entry into notify_list **head.  This requires that
- * NL_WHEN(entry) has been set (usually, this is time() + 5 seconds).
- * - entry must not be NULL
- *
- * LH - This used to cause (a) a memory leak and (b) dropped notify-list
- * entries.  The pointer ran off the end of the list, and changed the 
- * head-end to point to the new, one-entry list.  All other entries became garbage.
- *
- * FIXME: Optimize this function. (I'll work on it - LH)
- */
-void 
-nlist_insert_timer(notify_list **head, notify_list *entry)
-{
-	notify_list 	*spot = *head,	 	/* Insertion location */
-						/* ...Start at head */
-			*back = NULL;		/* Back pointer */
-
-
-	/* Find first entry with higher timeout value or end of list */
-	while (spot && NL_WHEN(spot) <= NL_WHEN(entry)) {
-		/* 
-		 * Keep the back pointer in case we 
-		 * run off the end...  (see below)
-		 */
-		back = spot;
-		spot = spot->next;
-	}
-
-	if (spot == (*head)) {
-		/* 
-		 * case where we're prepending an empty or non-empty
-		 * list or inserting in the middle somewhere.  Pass 
-		 * the real head of the list, since we'll be changing 
-		 * during the insert... 
-		 */
-		nlist_insert(head, entry);
-	} else {
-		/* all other cases - don't move the real head pointer */
-		nlist_insert(&spot, entry);
-
-		/* 
-		 * If spot == entry, then spot was NULL when we called
-		 * nlist_insert.  This happened because we had run off 
-		 * the end of the list.  Append entry to original list.
-		 */
-		if (spot == entry) {
-			back->next = entry;
-			entry->prev = back;
-		}
-	}
-}
-
 /* 
  * Remove *entry from the list pointed to by **head.
- * Do not destroy *entry.  This is normally done before
- * a re-insertion with a timer, but can be done anywhere.
+ * Do not destroy *entry.
  * - entry must not be NULL.
  */
 void 
@@ -209,6 +161,7 @@ nlist_free(notify_list **head, notify_list *entry)
 		free(NL_MY_NAME(entry));
 	if (NL_MON_NAME(entry))
 		free(NL_MON_NAME(entry));
+	nlist_unindex(entry);
 	free(entry->dns_name);
 	free(entry);
 }
@@ -239,3 +192,318 @@ nlist_gethost(notify_list *list, char *host, int myname)
 
 	return (notify_list *) NULL;
 }
+
+/*
+ * The run-time list is indexed by every name and address that
+ * statd_matchhostname() could match each entry by: its dns_name, the
+ * canonical name that resolves to, and the presentation form of each
+ * resulting address.  An incoming SM_NOTIFY is then looked up in
+ * the index instead of being compared, with two DNS queries each,
+ * against every monitored host.  Once their keys are RESOLVE_TTL
+ * seconds old, entries are looked up again by a resolver thread,
+ * starting the next time the index is searched; their old keys are
+ * used meanwhile.
+ *
+ * Entries given to nlist_index_later() are indexed only by their
+ * dns_name until a resolver thread has looked that up, and are
+ * compared one by one with each incoming name meanwhile.
+ */
+#define NL_KEYS_INITSIZE	256	/* a power of two */
+
+struct nl_key {
+	struct nl_key *		k_next;		/* hash chain */
+	struct nl_key *		k_sibling;	/* more keys of k_entry */
+	notify_list *		k_entry;
+	unsigned int		k_hash;
+	char			k_name[];
+};
+
+static struct nl_key **	nl_keys;
+static unsigned int	nl_keys_size;
+static unsigned int	nl_keys_count;
+
+struct nl_queue {
+	notify_list *		q_head;
+	notify_list *		q_tail;
+};
+
+/* indexed entries in the order they were looked up, oldest first */
+static struct nl_queue	nl_stale;
+/* entries waiting for their lookup to finish */
+static struct nl_queue	nl_waiting;
+
+static unsigned int
+nl_key_hash(const char *name)
+{
+	unsigned int hash = FNV1A_OFFSET;
+
+	while (*name != '\0')
+		hash = fnv1a_add(hash, tolower((unsigned char)*name++));
+	return hash;
+}
+
+static void
+nl_keys_grow(void)
+{
+	struct nl_key **table, *key, *next;
+	unsigned int size, i;
+
+	size = nl_keys_size ? nl_keys_size << 1 : NL_KEYS_INITSIZE;
+	table = xmalloc(size * sizeof(*table));
+	memset(table, 0, size * sizeof(*table));
+	for (i = 0; i < nl_keys_size; i++)
+		for (key = nl_keys[i]; key; key = next) {
+			next = key->k_next;
+			key->k_next = table[key->k_hash & (size - 1)];
+			table[key->k_hash & (size - 1)] = key;
+		}
+	free(nl_keys);
+	nl_keys = table;
+	nl_keys_size = size;
+}
+
+static void
+nl_key_add(notify_list *entry, const char *name)
+{
+	struct nl_key *key;
+	size_t len;
+
+	if (name == NULL || *name == '\0')
+		return;
+	for (key = entry->keys; key; key = key->k_sibling)
+		if (strcasecmp(key->k_name, name) == 0)
+			return;
+
+	if (nl_keys_count >= nl_keys_size)
+		nl_keys_grow();
+	len = strlen(name) + 1;
+	key = xmalloc(sizeof(*key) + len);
+	memcpy(key->k_name, name, len);
+	key->k_hash = nl_key_hash(name);
+	key->k_entry = entry;
+	key->k_sibling = entry->keys;
+	entry->keys = key;
+	key->k_next = nl_keys[key->k_hash & (nl_keys_size - 1)];
+	nl_keys[key->k_hash & (nl_keys_size - 1)] = key;
+	nl_keys_count++;
+}
+
+static void
+nl_keys_drop(notify_list *entry)
+{
+	struct nl_key *key, **kpp;
+
+	while ((key = entry->keys) != NULL) {
+		entry->keys = key->k_sibling;
+		for (kpp = &nl_keys[key->k_hash & (nl_keys_size - 1)]; *kpp;
+		     kpp = &(*kpp)->k_next)
+			if (*kpp == key) {
+				*kpp = key->k_next;
+				break;
+			}
+		nl_keys_count--;
+		free(key);
+	}
+}
+
+static void
+nl_queue_remove(struct nl_queue *q, notify_list *entry)
+{
+	if (entry->rprev)
+		entry->rprev->rnext = entry->rnext;
+	else
+		q->q_head = entry->rnext;
+	if (entry->rnext)
+		entry->rnext->rprev = entry->rprev;
+	else
+		q->q_tail = entry->rprev;
+	entry->rnext = entry->rprev = NULL;
+}
+
+static void
+nl_queue_append(struct nl_queue *q, notify_list *entry)
+{
+	entry->rnext = NULL;
+	entry->rprev = q->q_tail;
+	if (q->q_tail)
+		q->q_tail->rnext = entry;
+	else
+		q->q_head = entry;
+	q->q_tail = entry;
+}
+
+/* Add the names and addresses @hostname resolves to as keys of @entry. */
+static void
+nl_resolve(notify_list *entry, const char *hostname)
+{
+	char buf[INET6_ADDRSTRLEN];
+	const struct addrinfo *ai, *results;
+
+	results = statd_canonical_list(hostname);
+	if (results == NULL)
+		return;
+	nl_key_add(entry, results->ai_canonname);
+	for (ai = results; ai != NULL; ai = ai->ai_next)
+		if (statd_present_address(ai->ai_addr, buf, sizeof(buf)))
+			nl_key_add(entry, buf);
+}
+
+/* Replace the keys of a waiting entry, now that it has been looked up */
+static void
+nl_finish(notify_list *entry)
+{
+	nl_queue_remove(&nl_waiting, entry);
+	entry->waiting = 0;
+	nl_keys_drop(entry);
+	nl_key_add(entry, entry->dns_name);
+	nl_resolve(entry, entry->dns_name);
+	entry->resolved = time(NULL);
+	nl_queue_append(&nl_stale, entry);
+}
+
+/* Wait for a resolver thread to look up an entry that is on no queue */
+static void
+nl_wait(notify_list *entry)
+{
+	entry->waiting = 1;
+	nl_queue_append(&nl_waiting, entry);
+	if (!statd_refresh(entry->dns_name) && entry->waiting)
+		nl_finish(entry);
+}
+
+/**
+ * nlist_index - add an entry of the run-time list to its index
+ * @entry: entry whose dns_name is set
+ *
+ * Looks up the canonical name and addresses of @entry's dns_name.
+ */
+void
+nlist_index(notify_list *entry)
+{
+	nlist_unindex(entry);
+
+	statd_hold_name(entry->dns_name);
+	nl_key_add(entry, entry->dns_name);
+	nl_resolve(entry, entry->dns_name);
+	entry->resolved = time(NULL);
+	nl_queue_append(&nl_stale, entry);
+}
+
+/**
+ * nlist_index_later - add an entry of the run-time list to its index
+ * @entry: entry whose dns_name is set
+ *
+ * Like nlist_index(), but @entry's dns_name is looked up by a resolver
+ * thread, and @entry is fully indexed once nlist_resolved() is called.
+ */
+void
+nlist_index_later(notify_list *entry)
+{
+	nlist_unindex(entry);
+
+	statd_hold_name(entry->dns_name);
+	nl_key_add(entry, entry->dns_name);
+	nl_wait(entry);
+}
+
+/**
+ * nlist_resolved - index the entries waiting for a lookup
+ * @hostname: C string containing the name that has been looked up
+ *
+ */
+void
+nlist_resolved(const char *hostname)
+{
+	unsigned int hash = nl_key_hash(hostname);
+	notify_list *entry;
+	struct nl_key *key;
+
+	if (nl_waiting.q_head == NULL)
+		return;
+	do {
+		/* nl_finish() changes the keys, so start again after each */
+		entry = NULL;
+		for (key = nl_keys[hash & (nl_keys_size - 1)]; key;
+		     key = key->k_next)
+			if (key->k_entry->waiting &&
+			    key->k_hash == hash &&
+			    strcasecmp(key->k_entry->dns_name, hostname) == 0) {
+				entry = key->k_entry;
+				break;
+			}
+		if (entry != NULL)
+			nl_finish(entry);
+	} while (entry != NULL);
+}
+
+/**
+ * nlist_unindex - remove an entry from the run-time list's index
+ * @entry: entry to remove; need not be indexed
+ *
+ */
+void
+nlist_unindex(notify_list *entry)
+{
+	if (!entry->resolved && !entry->waiting)
+		return;
+	statd_release_name(entry->dns_name);
+	nl_keys_drop(entry);
+	nl_queue_remove(entry->waiting ? &nl_waiting : &nl_stale, entry);
+	entry->resolved = 0;
+	entry->waiting = 0;
+}
+
+static void
+nl_lookup(const char *name, void (*fn)(notify_list *, void *), void *data)
+{
+	unsigned int hash = nl_key_hash(name);
+	struct nl_key *key;
+
+	for (key = nl_keys[hash & (nl_keys_size - 1)]; key; key = key->k_next)
+		if (key->k_hash == hash && strcasecmp(key->k_name, name) == 0)
+			fn(key->k_entry, data);
+}
+
+/**
+ * nlist_match - find the monitored hosts that match a hostname
+ * @hostname: C string containing hostname or presentation address
+ * @fn: function to call for each matching entry of the run-time list
+ * @data: passed to @fn
+ *
+ * Matches as statd_matchhostname() would, but costs one lookup of
+ * @hostname rather than two per monitored host.  @fn may be called
+ * more than once for the same entry, and must not remove entries.
+ */
+void
+nlist_match(const char *hostname, void (*fn)(notify_list *, void *),
+		void *data)
+{
+	char buf[INET6_ADDRSTRLEN];
+	const struct addrinfo *ai, *results;
+	time_t stale = time(NULL) - RESOLVE_TTL;
+	notify_list *entry, *next;
+
+	while ((entry = nl_stale.q_head) != NULL && entry->resolved <= stale) {
+		nl_queue_remove(&nl_stale, entry);
+		nl_wait(entry);
+	}
+
+	for (entry = nl_waiting.q_head; entry != NULL; entry = next) {
+		next = entry->rnext;
+		if (!entry->resolved &&
+		    statd_matchhostname(entry->dns_name, hostname))
+			fn(entry, data);
+	}
+	if (nl_keys_count == 0)
+		return;
+
+	nl_lookup(hostname, fn, data);
+	results = statd_canonical_list(hostname);
+	if (results == NULL)
+		return;
+	if (results->ai_canonname != NULL)
+		nl_lookup(results->ai_canonname, fn, data);
+	for (ai = results; ai != NULL; ai = ai->ai_next)
+		if (statd_present_address(ai->ai_addr, buf, sizeof(buf)))
+			nl_lookup(buf, fn, data);
+}
@@ -7,6 +7,10 @@
 
 #include <netinet/in.h>
 
+#include "nsm.h"
+
+struct nl_key;
+
 /*
  * Primary information structure.
  */
@@ -19,8 +23,13 @@ struct notify_list {
 				    * NOTIFY requests */
   struct notify_list	*next;	/* Linked list forward pointer. */
   struct notify_list	*prev;	/* Linked list backward pointer. */
-  uint32_t		xid;	/* XID of MS_NOTIFY RPC call */
-  time_t		when;	/* notify: timeout for re-xmit */
+  struct nsm_xid	xid;	/* XID of MS_NOTIFY RPC call */
+  struct nsm_timer	timer;	/* notify: timeout for re-xmit */
+  struct nl_key		*keys;	/* names and addresses rtnl is indexed by */
+  time_t		resolved; /* when keys were looked up */
+  int			waiting; /* for nlist_resolved() */
+  struct notify_list	*rnext;	/* Next and previous entries to be */
+  struct notify_list	*rprev;	/* ...looked up again. */
 };
 
 typedef struct notify_list notify_list;
@@ -29,7 +38,6 @@ typedef struct notify_list notify_list;
  * Global Variables
  */
 extern notify_list *	rtnl;	/* Run-time notify list */
-extern notify_list *	notify;	/* Pending RPC calls */
 
 /*
  * List-handling functions
@@ -37,11 +45,22 @@ extern notify_list *	notify;	/* Pending RPC calls */
 extern notify_list *	nlist_new(char *, char *, int);
 extern void		nlist_insert(notify_list **, notify_list *);
 extern void		nlist_remove(notify_list **, notify_list *);
-extern void		nlist_insert_timer(notify_list **, notify_list *);
 extern notify_list *	nlist_clone(notify_list *);
 extern void		nlist_free(notify_list **, notify_list *);
 extern void		nlist_kill(notify_list **);
 extern notify_list *	nlist_gethost(notify_list *, char *, int);
+extern void		nlist_index(notify_list *);
+extern void		nlist_index_later(notify_list *);
+extern void		nlist_resolved(const char *);
+extern void		nlist_unindex(notify_list *);
+extern void		nlist_match(const char *,
+				void (*)(notify_list *, void *), void *);
+
+/*
+ * Pending SM_NOTIFY and CALLBACK requests (rmtcall.c)
+ */
+extern void		notify_queue(notify_list *);
+extern notify_list *	notify_first(void);
 
 /* 
  * List-handling macros.
@@ -62,4 +81,4 @@ extern notify_list *	nlist_gethost(notify_list *, char *, int);
 #define NL_MY_PROC(L)	(NL_MY_ID((L)).my_proc)
 #define NL_MY_PROG(L)	(NL_MY_ID((L)).my_prog)
 #define NL_MY_VERS(L)	(NL_MY_ID((L)).my_vers)
-#define NL_WHEN(L)	((L)->when)
+#define NL_WHEN(L)	((L)->timer.nt_when)
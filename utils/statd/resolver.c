@@ -0,0 +1,220 @@
+/*
+ * This file is part of nfs-utils.
+ *
+ * nfs-utils is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * nfs-utils is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with nfs-utils.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * NSM for Linux.
+ *
+ * Name lookups for statd and sm-notify are handed to a few threads
+ * of their own, so that many hosts are looked up at once and a slow
+ * DNS server holds up neither the other lookups nor the main loop.
+ *
+ * The caller embeds a struct resolver_job in each lookup.  The
+ * descriptor returned by resolver_start() becomes readable when jobs
+ * have finished, and resolver_finish() then hands each back on the
+ * main thread, so the caller's own data needs no locking.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif	/* HAVE_CONFIG_H */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#include "xlog.h"
+#include "resolver.h"
+
+static pthread_mutex_t		resolver_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t		resolver_queued = PTHREAD_COND_INITIALIZER;
+static struct resolver_job *	resolver_head;	/* waiting for a thread */
+static struct resolver_job **	resolver_tail = &resolver_head;
+static struct resolver_job *	resolver_done;	/* waiting for the caller */
+static struct resolver_job **	resolver_done_tail = &resolver_done;
+static unsigned int		resolver_pending;
+static int			resolver_pipe[2] = { -1, -1 };
+static _Bool			resolver_inline;
+
+static void *
+resolver_thread(__attribute__ ((unused)) void *arg)
+{
+	struct resolver_job *job;
+	_Bool wake;
+
+	for (;;) {
+		pthread_mutex_lock(&resolver_lock);
+		while (resolver_head == NULL)
+			pthread_cond_wait(&resolver_queued, &resolver_lock);
+		job = resolver_head;
+		resolver_head = job->rj_next;
+		if (resolver_head == NULL)
+			resolver_tail = &resolver_head;
+		pthread_mutex_unlock(&resolver_lock);
+
+		job->rj_lookup(job);
+
+		pthread_mutex_lock(&resolver_lock);
+		wake = (resolver_done == NULL);
+		job->rj_next = NULL;
+		*resolver_done_tail = job;
+		resolver_done_tail = &job->rj_next;
+		pthread_mutex_unlock(&resolver_lock);
+
+		/* A full pipe already has the main loop's attention */
+		if (wake && write(resolver_pipe[1], "", 1) < 0 &&
+		    errno != EAGAIN)
+			xlog(D_GENERAL, "%s: write: %m", __func__);
+	}
+	return NULL;
+}
+
+static void
+resolver_run_queue(void)
+{
+	struct resolver_job *job;
+
+	while ((job = resolver_head) != NULL) {
+		resolver_head = job->rj_next;
+		if (resolver_head == NULL)
+			resolver_tail = &resolver_head;
+		resolver_pending--;
+		job->rj_lookup(job);
+		job->rj_done(job);
+	}
+}
+
+/**
+ * resolver_start - start the resolver threads
+ * @threads: number of threads to start
+ *
+ * Jobs queued before the threads are started wait for them.  Threads
+ * are started with all signals blocked, so that signals are still
+ * delivered to the main thread.
+ *
+ * Returns a descriptor that becomes readable when jobs have finished.
+ * If no thread can be started, returns -1 after running any queued
+ * jobs, and later jobs are run as they are queued.
+ */
+int
+resolver_start(const unsigned int threads)
+{
+	sigset_t all, old;
+	pthread_attr_t attr;
+	pthread_t thread;
+	unsigned int i, started = 0;
+	int err;
+
+	if (pipe(resolver_pipe) == -1) {
+		xlog(L_ERROR, "%s: pipe: %m", __func__);
+		goto out_inline;
+	}
+	for (i = 0; i < 2; i++) {
+		(void)fcntl(resolver_pipe[i], F_SETFD, FD_CLOEXEC);
+		(void)fcntl(resolver_pipe[i], F_SETFL, O_NONBLOCK);
+	}
+
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	for (i = 0; i < threads; i++) {
+		err = pthread_create(&thread, &attr, resolver_thread, NULL);
+		if (err != 0) {
+			xlog(L_WARNING, "%s: pthread_create: %s",
+					__func__, strerror(err));
+			break;
+		}
+		started++;
+	}
+	pthread_attr_destroy(&attr);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (started != 0) {
+		xlog(D_GENERAL, "Started %u resolver threads", started);
+		return resolver_pipe[0];
+	}
+
+	(void)close(resolver_pipe[0]);
+	(void)close(resolver_pipe[1]);
+	resolver_pipe[0] = resolver_pipe[1] = -1;
+out_inline:
+	xlog(L_WARNING, "Looking up hosts one at a time");
+	resolver_inline = true;
+	resolver_run_queue();
+	return -1;
+}
+
+/**
+ * resolver_queue - look a host up in the background
+ * @job: lookup to run; must not be queued already
+ *
+ * @job->rj_done is called from resolver_finish() once @job->rj_lookup
+ * has run, or before resolver_queue() returns if there are no
+ * resolver threads.
+ */
+void
+resolver_queue(struct resolver_job *job)
+{
+	if (resolver_inline) {
+		job->rj_lookup(job);
+		job->rj_done(job);
+		return;
+	}
+
+	pthread_mutex_lock(&resolver_lock);
+	job->rj_next = NULL;
+	*resolver_tail = job;
+	resolver_tail = &job->rj_next;
+	resolver_pending++;
+	pthread_cond_signal(&resolver_queued);
+	pthread_mutex_unlock(&resolver_lock);
+}
+
+/**
+ * resolver_finish - hand back the jobs that have finished
+ *
+ * Call when the descriptor returned by resolver_start() is readable.
+ * @rj_done may queue further jobs.
+ *
+ * Returns the number of jobs still queued or running.
+ */
+unsigned int
+resolver_finish(void)
+{
+	struct resolver_job *job, *next;
+	char buf[64];
+
+	while (read(resolver_pipe[0], buf, sizeof(buf)) > 0)
+		;
+
+	pthread_mutex_lock(&resolver_lock);
+	job = resolver_done;
+	resolver_done = NULL;
+	resolver_done_tail = &resolver_done;
+	pthread_mutex_unlock(&resolver_lock);
+
+	for (; job != NULL; job = next) {
+		next = job->rj_next;
+		resolver_pending--;
+		job->rj_done(job);
+	}
+	return resolver_pending;
+}
@@ -0,0 +1,22 @@
+/*
+ * Name lookups run by threads of their own, for statd and sm-notify.
+ *
+ * NSM for Linux.
+ */
+
+#ifndef STATD_RESOLVER_H
+#define STATD_RESOLVER_H
+
+struct resolver_job {
+	struct resolver_job *	rj_next;
+	/* called on a resolver thread; must not touch the caller's state */
+	void			(*rj_lookup)(struct resolver_job *);
+	/* called on the main thread, from resolver_finish() */
+	void			(*rj_done)(struct resolver_job *);
+};
+
+extern int		resolver_start(const unsigned int threads);
+extern void		resolver_queue(struct resolver_job *job);
+extern unsigned int	resolver_finish(void);
+
+#endif	/* STATD_RESOLVER_H */
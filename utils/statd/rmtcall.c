@@ -45,6 +45,7 @@
 
 #include "nsm.h"
 #include "nfsrpc.h"
+#include "rpcmisc.h"
 
 #if SIZEOF_SOCKLEN_T - 0 == 0
 #define socklen_t int
@@ -52,6 +53,15 @@
 
 static int		sockfd = -1;	/* notify socket */
 
+/*
+ * Pending SM_NOTIFY and CALLBACK requests, by the time they are next
+ * due and by the XID of the call last sent for them.
+ */
+static struct nsm_timers notify_timers;
+static struct nsm_xids	notify_xids;
+
+static void		process_reply(int fd, void *data);
+
 /*
  * Initialize socket used to notify lockd of peer reboots.
  *
@@ -97,10 +107,62 @@ statd_get_socket(void)
 			break;
 		/* rather not use that port, try again */
 	}
-	FD_SET(sockfd, &SVC_FDSET);
+	if (nfs_svc_loop_add(sockfd, process_reply, NULL) < 0) {
+		xlog(L_ERROR, "%s: Can't watch socket: %m", __func__);
+		close(sockfd);
+		sockfd = -1;
+	}
 	return sockfd;
 }
 
+/*
+ * Schedule @lp to be processed at @when
+ */
+static void
+notify_schedule(notify_list *lp, time_t when)
+{
+	if (!nsm_timer_set(&notify_timers, &lp->timer, when)) {
+		xlog_warn("%s: out of memory", __func__);
+		nsm_xid_set(&notify_xids, &lp->xid, 0);
+		nlist_free(NULL, lp);
+	}
+}
+
+/*
+ * Forget a request that has completed or been given up on
+ */
+static void
+notify_done(notify_list *lp)
+{
+	nsm_timer_cancel(&notify_timers, &lp->timer);
+	nsm_xid_set(&notify_xids, &lp->xid, 0);
+	nlist_free(NULL, lp);
+}
+
+/**
+ * notify_queue - queue a request to be processed at once
+ * @lp: request to queue, which is not on any list
+ *
+ */
+void
+notify_queue(notify_list *lp)
+{
+	notify_schedule(lp, 0);
+}
+
+/**
+ * notify_first - find the pending request that is due first
+ *
+ * Returns the request, or NULL if there are none.
+ */
+notify_list *
+notify_first(void)
+{
+	struct nsm_timer *t = nsm_timer_first(&notify_timers);
+
+	return t != NULL ? t->nt_data : NULL;
+}
+
 static notify_list *
 recv_rply(u_long *portp)
 {
@@ -110,6 +172,7 @@ recv_rply(u_long *portp)
 	XDR			xdr;
 	struct sockaddr_in	sin;
 	socklen_t		alen = (socklen_t)sizeof(sin);
+	struct nsm_xid		*x;
 	uint32_t		xid;
 
 	memset(msgbuf, 0, sizeof(msgbuf));
@@ -135,16 +198,12 @@ recv_rply(u_long *portp)
 		goto done;
 	}
 
-	for (lp = notify; lp != NULL; lp = lp->next) {
-		/* LH - this was a bug... it should have been checking
-		 * the xid from the response message from the client,
-		 * not the static, internal xid */
-		if (lp->xid != xid)
-			continue;
-		if (lp->port == 0)
-			*portp = nsm_recv_getport(&xdr);
-		break;
-	}
+	x = nsm_xid_find(&notify_xids, xid);
+	if (x == NULL)
+		goto done;
+	lp = x->nx_data;
+	if (lp->port == 0)
+		*portp = nsm_recv_getport(&xdr);
 
 done:
 	xdr_destroy(&xdr);
@@ -158,6 +217,7 @@ static int
 process_entry(notify_list *lp)
 {
 	struct sockaddr_in	sin;
+	uint32_t		xid;
 
 	if (NL_TIMES(lp) == 0) {
 		xlog(D_GENERAL, "%s: Cannot notify localhost, giving up",
@@ -175,7 +235,7 @@ process_entry(notify_list *lp)
 	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
 
 	if (sin.sin_port == 0)
-		lp->xid = nsm_xmit_getport(sockfd, &sin,
+		xid = nsm_xmit_getport(sockfd, &sin,
 					(rpcprog_t)NL_MY_PROG(lp),
 					(rpcvers_t)NL_MY_VERS(lp));
 	else {
@@ -189,11 +249,12 @@ process_entry(notify_list *lp)
 		m.mon_id.my_id.my_vers = NL_MY_VERS(lp);
 		m.mon_id.my_id.my_proc = NL_MY_PROC(lp);
 
-		lp->xid = nsm_xmit_nlmcall(sockfd,
+		xid = nsm_xmit_nlmcall(sockfd,
 				(struct sockaddr *)(char *)&sin,
 				(socklen_t)sizeof(sin), &m, NL_STATE(lp));
 	}
-	if (lp->xid == 0) {
+	nsm_xid_set(&notify_xids, &lp->xid, xid);
+	if (xid == 0) {
 		xlog_warn("%s: failed to notify port %d",
 				__func__, ntohs(lp->port));
 	}
@@ -205,26 +266,22 @@ process_entry(notify_list *lp)
 /*
  * Process a datagram received on the notify socket
  */
-int
-process_reply(FD_SET_TYPE *rfds)
+static void
+process_reply(__attribute__ ((unused)) int fd,
+		__attribute__ ((unused)) void *data)
 {
 	notify_list		*lp;
 	u_long			port;
 
-	if (sockfd == -1 || !FD_ISSET(sockfd, rfds))
-		return 0;
-
 	if (!(lp = recv_rply(&port)))
-		return 1;
+		return;
 
 	if (lp->port == 0) {
 		if (port != 0) {
 			lp->port = htons((unsigned short) port);
 			process_entry(lp);
-			NL_WHEN(lp) = time(NULL) + NOTIFY_TIMEOUT;
-			nlist_remove(&notify, lp);
-			nlist_insert_timer(&notify, lp);
-			return 1;
+			notify_schedule(lp, time(NULL) + NOTIFY_TIMEOUT);
+			return;
 		}
 		xlog_warn("%s: service %d not registered on localhost",
 			__func__, NL_MY_PROG(lp));
@@ -232,8 +289,7 @@ process_reply(FD_SET_TYPE *rfds)
 		xlog(D_GENERAL, "%s: Callback to %s (for %d) succeeded",
 			__func__, NL_MY_NAME(lp), NL_MON_NAME(lp));
 	}
-	nlist_free(&notify, lp);
-	return 1;
+	notify_done(lp);
 }
 
 /*
@@ -247,19 +303,18 @@ process_notify_list(void)
 	notify_list	*entry;
 	time_t		now;
 
-	while ((entry = notify) != NULL && NL_WHEN(entry) < time(&now)) {
-		if (process_entry(entry)) {
-			NL_WHEN(entry) = time(NULL) + NOTIFY_TIMEOUT;
-			nlist_remove(&notify, entry);
-			nlist_insert_timer(&notify, entry);
-		} else {
+	while ((entry = notify_first()) != NULL &&
+	       NL_WHEN(entry) <= time(&now)) {
+		if (process_entry(entry))
+			notify_schedule(entry, time(NULL) + NOTIFY_TIMEOUT);
+		else {
 			xlog(L_ERROR,
 				"%s: Can't callback %s (%d,%d), giving up",
 					__func__,
 					NL_MY_NAME(entry),
 					NL_MY_PROG(entry),
 					NL_MY_VERS(entry));
-			nlist_free(&notify, entry);
+			notify_done(entry);
 		}
 	}
 
@@ -8,6 +8,10 @@
 #include <config.h>
 #endif
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE		/* for recvmmsg(2) */
+#endif
+
 #include <err.h>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -28,11 +32,13 @@
 #include <netdb.h>
 #include <errno.h>
 #include <grp.h>
+#include <limits.h>
 
 #include "sockaddr.h"
 #include "xlog.h"
 #include "nsm.h"
 #include "nfsrpc.h"
+#include "resolver.h"
 
 /* glibc before 2.3.4 */
 #ifndef AI_NUMERICSERV
@@ -41,19 +47,24 @@
 
 #define NSM_TIMEOUT	2
 #define NSM_MAX_TIMEOUT	120	/* don't make this too big */
+#define NSM_RATE	1000	/* default calls per second */
+#define NSM_RECV_BATCH	64	/* replies read per system call */
+#define NSM_RESOLVERS	16	/* hosts looked up at once */
+
+struct smn_lookup;
 
 struct nsm_host {
-	struct nsm_host *	next;
 	char *			name;
 	const char *		mon_name;
 	const char *		my_name;
 	char *			notify_arg;
 	struct addrinfo		*ai;
-	time_t			last_used;
-	time_t			send_next;
+	struct smn_lookup *	lookup;		/* of ai, if under way */
+	struct nsm_timer	send_next;	/* nt_prio is last used time */
 	unsigned int		timeout;
 	unsigned int		retries;
-	uint32_t		xid;
+	struct nsm_xid		xid;
+	long long		first_sent;	/* msec; zero until sent */
 };
 
 static char		nsm_hostname[SM_MAXSTRLEN + 1];
@@ -64,15 +75,28 @@ static _Bool		opt_update_state = true;
 static unsigned int	opt_max_retry = 15 * 60;
 static char *		opt_srcaddr = NULL;
 static char *		opt_srcport = NULL;
+static unsigned int	opt_rate = NSM_RATE;
+
+/* how long each host took to notify, in milliseconds */
+static unsigned int *	latencies;
+static unsigned int	latency_count;
+static unsigned int	latency_size;
 
-static void		notify(const int sock);
+static void		notify(const int sock, const int resolver);
 static int		notify_host(int, struct nsm_host *);
-static void		recv_reply(int);
-static void		insert_host(struct nsm_host *);
+static void		recv_reply(char *, const ssize_t);
+static void		recv_replies(const int);
+static void		insert_host(struct nsm_host *, const time_t);
 static struct nsm_host *find_host(uint32_t);
+static struct nsm_host *first_host(void);
 static int		record_pid(void);
 
-static struct nsm_host *	hosts = NULL;
+/*
+ * Hosts still to be notified, by the time they are next due, and
+ * by the XID of the last call sent to each.
+ */
+static struct nsm_timers	hosts;
+static struct nsm_xids		host_xids;
 
 __attribute_malloc__
 static struct addrinfo *
@@ -94,6 +118,82 @@ smn_lookup(const char *name)
 	return ai;
 }
 
+/*
+ * A lookup run by a resolver thread, which sees only this and not
+ * the host it is for.  The host may be freed while the lookup runs.
+ */
+struct smn_lookup {
+	struct resolver_job	job;		/* must be first */
+	struct nsm_host *	host;		/* NULL once freed */
+	struct addrinfo *	ai;
+	char			name[];
+};
+
+static void
+smn_lookup_run(struct resolver_job *job)
+{
+	struct smn_lookup *lookup = (struct smn_lookup *)job;
+
+	lookup->ai = smn_lookup(lookup->name);
+}
+
+static void
+smn_lookup_done(struct resolver_job *job)
+{
+	struct smn_lookup *lookup = (struct smn_lookup *)job;
+	struct nsm_host *host = lookup->host;
+	unsigned int wait;
+
+	if (host == NULL) {
+		if (lookup->ai != NULL)
+			freeaddrinfo(lookup->ai);
+		free(lookup);
+		return;
+	}
+
+	host->lookup = NULL;
+	host->ai = lookup->ai;
+	free(lookup);
+	if (host->ai != NULL) {
+		insert_host(host, time(NULL));
+		return;
+	}
+
+	xlog_warn("DNS resolution of %s failed; retrying later", host->name);
+	wait = host->timeout;
+	if ((host->timeout <<= 1) > NSM_MAX_TIMEOUT)
+		host->timeout = NSM_MAX_TIMEOUT;
+	insert_host(host, time(NULL) + wait);
+}
+
+/*
+ * Have @host looked up in the background.  It is set aside meanwhile,
+ * and comes due again as soon as the answer arrives.
+ */
+static void
+smn_resolve(struct nsm_host *host, const time_t now)
+{
+	struct smn_lookup *lookup;
+	size_t len;
+
+	insert_host(host, now + NSM_MAX_TIMEOUT);
+	if (host->lookup != NULL)
+		return;
+
+	len = strlen(host->name) + 1;
+	lookup = calloc(1, sizeof(*lookup) + len);
+	if (lookup == NULL) {
+		xlog_warn("Unable to allocate memory");
+		return;
+	}
+	memcpy(lookup->name, host->name, len);
+	lookup->host = host;
+	lookup->job.rj_lookup = smn_lookup_run;
+	lookup->job.rj_done = smn_lookup_done;
+	host->lookup = lookup;
+	resolver_queue(&lookup->job);
+}
+
 #ifdef HAVE_GETNAMEINFO
 static char *
 smn_get_hostname(const struct sockaddr *sap, const socklen_t salen,
@@ -222,7 +322,9 @@ smn_alloc_host(const char *hostname, const char *mon_name,
 		goto out_nomem;
 	}
 
-	host->last_used = timestamp;
+	host->send_next.nt_prio = (long)timestamp;
+	host->send_next.nt_data = host;
+	host->xid.nx_data = host;
 	host->timeout = NSM_TIMEOUT;
 	host->retries = 100;		/* force address retry */
 
@@ -233,12 +335,12 @@ out_nomem:
 	return NULL;
 }
 
-static void smn_forget_host(struct nsm_host *host)
+static void smn_free_host(struct nsm_host *host)
 {
-	xlog(D_CALL, "Removing %s (%s, %s) from notify list",
-			host->name, host->mon_name, host->my_name);
-
-	nsm_delete_notified_host(host->name, host->mon_name, host->my_name);
+	nsm_timer_cancel(&hosts, &host->send_next);
+	nsm_xid_set(&host_xids, &host->xid, 0);
+	if (host->lookup != NULL)
+		host->lookup->host = NULL;
 
 	free(host->notify_arg);
 	free((void *)host->my_name);
@@ -250,6 +352,15 @@ static void smn_forget_host(struct nsm_host *host)
 	free(host);
 }
 
+static void smn_forget_host(struct nsm_host *host)
+{
+	xlog(D_CALL, "Removing %s (%s, %s) from notify list",
+			host->name, host->mon_name, host->my_name);
+
+	nsm_delete_notified_host(host->name, host->mon_name, host->my_name);
+	smn_free_host(host);
+}
+
 static unsigned int
 smn_get_host(const char *hostname,
 		__attribute__ ((unused)) const struct sockaddr *sap,
@@ -262,7 +373,7 @@ smn_get_host(const char *hostname,
 	if (host == NULL)
 		return 0;
 
-	insert_host(host);
+	insert_host(host, 0);
 	return 1;
 }
 
@@ -453,8 +564,9 @@ retry:
 int
 main(int argc, char **argv)
 {
-	int	c, sock, force = 0;
-	char *	progname;
+	int	c, sock, resolver, force = 0;
+	unsigned long rate;
+	char *	progname, *endptr;
 
 	progname = strrchr(argv[0], '/');
 	if (progname != NULL)
@@ -462,7 +574,7 @@ main(int argc, char **argv)
 	else
 		progname = argv[0];
 
-	while ((c = getopt(argc, argv, "dm:np:v:P:f")) != -1) {
+	while ((c = getopt(argc, argv, "dm:np:r:v:P:f")) != -1) {
 		switch (c) {
 		case 'f':
 			force = 1;
@@ -479,6 +591,17 @@ main(int argc, char **argv)
 		case 'p':
 			opt_srcport = optarg;
 			break;
+		case 'r':
+			errno = 0;
+			rate = strtoul(optarg, &endptr, 10);
+			if (errno != 0 || *endptr != '\0' || endptr == optarg ||
+			    rate == 0 || rate > UINT_MAX) {
+				fprintf(stderr, "%s: bad rate: %s\n",
+					progname, optarg);
+				goto usage;
+			}
+			opt_rate = (unsigned int)rate;
+			break;
 		case 'v':
 			opt_srcaddr = optarg;
 			break;
@@ -495,7 +618,8 @@ main(int argc, char **argv)
 	if (optind < argc) {
 usage:		fprintf(stderr,
 			"Usage: %s -notify [-dfq] [-m max-retry-minutes] [-p srcport]\n"
-			"            [-P /path/to/state/directory] [-v my_host_name]\n",
+			"            [-P /path/to/state/directory] [-r calls-per-second]\n"
+			"            [-v my_host_name]\n",
 			progname);
 		exit(1);
 	}
@@ -562,15 +686,18 @@ usage:		fprintf(stderr,
 	if (!nsm_drop_privileges(-1))
 		exit(1);
 
-	notify(sock);
+	/* ORDER: threads would keep the privileges just dropped */
+	resolver = resolver_start(NSM_RESOLVERS);
+
+	notify(sock, resolver);
 
-	if (hosts) {
+	if (first_host() != NULL) {
 		struct nsm_host	*hp;
 
-		while ((hp = hosts) != 0) {
-			hosts = hp->next;
+		while ((hp = first_host()) != NULL) {
 			xlog(L_NOTICE, "Unable to notify %s, giving up",
 				hp->name);
+			smn_free_host(hp);
 		}
 		exit(1);
 	}
@@ -578,66 +705,158 @@ usage:		fprintf(stderr,
 	exit(0);
 }
 
+static long long
+smn_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void
+smn_record_latency(const struct nsm_host *host)
+{
+	unsigned int *new;
+	unsigned int size;
+
+	if (host->first_sent == 0)
+		return;
+	if (latency_count == latency_size) {
+		size = latency_size ? latency_size << 1 : 1024;
+		new = realloc(latencies, size * sizeof(*new));
+		if (new == NULL)
+			return;
+		latencies = new;
+		latency_size = size;
+	}
+	latencies[latency_count++] =
+			(unsigned int)(smn_now_ms() - host->first_sent);
+}
+
+static int
+smn_cmp_latency(const void *a, const void *b)
+{
+	const unsigned int *x = a, *y = b;
+
+	return (*x > *y) - (*x < *y);
+}
+
+static unsigned int
+smn_percentile(const unsigned int percent)
+{
+	return latencies[(latency_count - 1) * percent / 100];
+}
+
+/* @start is when notify() began, in smn_now_ms() time */
+static void
+smn_report_latency(const long long start)
+{
+	if (latency_count == 0)
+		return;
+	qsort(latencies, latency_count, sizeof(*latencies), smn_cmp_latency);
+	xlog(L_NOTICE, "Notified %u hosts in %lld ms (median %u ms, "
+			"90%% %u ms, 99%% %u ms, max %u ms)", latency_count,
+			smn_now_ms() - start, smn_percentile(50),
+			smn_percentile(90), smn_percentile(99),
+			smn_percentile(100));
+}
+
 /*
  * Notify hosts
+ *
+ * Calls are paced by a token bucket that fills at opt_rate calls per
+ * second and holds a tenth of a second's worth, so that a server with
+ * many peers neither floods the network nor waits needlessly between
+ * bursts.  The calls due in each round are sent together, and every
+ * reply waiting on the socket is read each time it becomes readable.
+ *
+ * Hosts are looked up by resolver threads, all of them at once to
+ * begin with, and each is sent its first call as soon as its
+ * addresses are known.  A host still being looked up costs no tokens.
  */
 static void
-notify(const int sock)
+notify(const int sock, const int resolver)
 {
-	time_t	failtime = 0;
+	double		tokens, burst;
+	long long	start, last, now_ms;
+	time_t		failtime = 0;
 
 	if (opt_max_retry)
 		failtime = time(NULL) + opt_max_retry;
 
-	while (hosts) {
-		struct pollfd	pfd;
+	burst = opt_rate / 10;
+	if (burst < 1)
+		burst = 1;
+	tokens = burst;
+	start = last = smn_now_ms();
+
+	while (first_host() != NULL) {
+		struct pollfd	pfd[2];
 		time_t		now = time(NULL);
-		unsigned int	sent = 0;
 		struct nsm_host	*hp;
 		long		wait;
 
 		if (failtime && now >= failtime)
 			break;
 
-		while (hosts && ((wait = hosts->send_next - now) <= 0)) {
-			/* Never send more than 10 packets at once */
-			if (sent++ >= 10)
+		now_ms = smn_now_ms();
+		tokens += (double)(now_ms - last) * opt_rate / 1000;
+		if (tokens > burst)
+			tokens = burst;
+		last = now_ms;
+
+		nsm_batch_begin(sock);
+		while ((hp = first_host()) != NULL &&
+		       hp->send_next.nt_when <= now) {
+			if (hp->ai == NULL) {
+				smn_resolve(hp, now);
+				continue;
+			}
+			if (tokens < 1)
 				break;
+			tokens -= 1;
 
-			/* Remove queue head */
-			hp = hosts;
-			hosts = hp->next;
-
-			if (notify_host(sock, hp))
+			if (notify_host(sock, hp)) {
+				nsm_timer_cancel(&hosts, &hp->send_next);
 				continue;
+			}
 
 			/* Set the timeout for this call, using an
 			   exponential timeout strategy */
 			wait = hp->timeout;
 			if ((hp->timeout <<= 1) > NSM_MAX_TIMEOUT)
 				hp->timeout = NSM_MAX_TIMEOUT;
-			hp->send_next = now + wait;
 			hp->retries++;
 
-			insert_host(hp);
+			insert_host(hp, now + wait);
 		}
-		if (hosts == NULL)
-			return;
-
-		xlog(D_GENERAL, "Host %s due in %ld seconds",
-				hosts->name, wait);
-
-		pfd.fd = sock;
-		pfd.events = POLLIN;
+		nsm_batch_flush();
 
-		wait *= 1000;
-		if (wait < 100)
-			wait = 100;
-		if (poll(&pfd, 1, wait) != 1)
-			continue;
-
-		recv_reply(sock);
+		if ((hp = first_host()) == NULL)
+			break;
+		if (hp->send_next.nt_when > now) {
+			wait = hp->send_next.nt_when - now;
+			xlog(D_GENERAL, "Host %s due in %ld seconds",
+					hp->name, wait);
+			wait *= 1000;
+		} else
+			/* until the bucket holds another token */
+			wait = (long)((1 - tokens) * 1000 / opt_rate) + 1;
+
+		pfd[0].fd = sock;
+		pfd[0].events = POLLIN;
+		pfd[1].fd = resolver;
+		pfd[1].events = POLLIN;
+		if (poll(pfd, 2, (int)wait) > 0) {
+			if (pfd[0].revents & POLLIN)
+				recv_replies(sock);
+			if (pfd[1].revents & POLLIN)
+				resolver_finish();
+		}
 	}
+
+	smn_report_latency(start);
 }
 
 /*
@@ -648,15 +867,7 @@ notify_host(int sock, struct nsm_host *host)
 {
 	struct sockaddr *sap;
 	socklen_t salen;
-
-	if (host->ai == NULL) {
-		host->ai = smn_lookup(host->name);
-		if (host->ai == NULL) {
-			xlog_warn("DNS resolution of %s failed; "
-				"retrying later", host->name);
-			return 0;
-		}
-	}
+	uint32_t xid;
 
 	/* If we retransmitted 4 times, reset the port to force
 	 * a new portmap lookup (in case statd was restarted).
@@ -687,11 +898,14 @@ notify_host(int sock, struct nsm_host *host)
 	sap = host->ai->ai_addr;
 	salen = host->ai->ai_addrlen;
 
+	if (host->first_sent == 0)
+		host->first_sent = smn_now_ms();
 	if (nfs_get_port(sap) == 0)
-		host->xid = nsm_xmit_rpcbind(sock, sap, SM_PROG, SM_VERS);
+		xid = nsm_xmit_rpcbind(sock, sap, SM_PROG, SM_VERS);
 	else
-		host->xid = nsm_xmit_notify(sock, sap, salen,
+		xid = nsm_xmit_notify(sock, sap, salen,
 					SM_PROG, host->notify_arg, nsm_state);
+	nsm_xid_set(&host_xids, &host->xid, xid);
 
 	return 0;
 }
@@ -699,20 +913,18 @@ notify_host(int sock, struct nsm_host *host)
 static void
 smn_defer(struct nsm_host *host)
 {
-	host->xid = 0;
-	host->send_next = time(NULL) + NSM_MAX_TIMEOUT;
+	nsm_xid_set(&host_xids, &host->xid, 0);
 	host->timeout = NSM_MAX_TIMEOUT;
-	insert_host(host);
+	insert_host(host, time(NULL) + NSM_MAX_TIMEOUT);
 }
 
 static void
 smn_schedule(struct nsm_host *host)
 {
 	host->retries = 0;
-	host->xid = 0;
-	host->send_next = time(NULL);
+	nsm_xid_set(&host_xids, &host->xid, 0);
 	host->timeout = NSM_TIMEOUT;
-	insert_host(host);
+	insert_host(host, time(NULL));
 }
 
 /*
@@ -752,28 +964,22 @@ recv_notify_reply(struct nsm_host *host)
 		smn_schedule(host);
 	} else {
 		xlog(D_GENERAL, "Host %s notified successfully", host->name);
+		smn_record_latency(host);
 		smn_forget_host(host);
 	}
 }
 
 /*
- * Receive reply from remote host
+ * Process a reply from a remote host
  */
 static void
-recv_reply(int sock)
+recv_reply(char *msgbuf, const ssize_t msglen)
 {
 	struct nsm_host	*hp;
 	struct sockaddr *sap;
-	char msgbuf[NSM_MAXMSGSIZE];
 	uint32_t	xid;
-	ssize_t		msglen;
 	XDR		xdr;
 
-	memset(msgbuf, 0 , sizeof(msgbuf));
-	msglen = recv(sock, msgbuf, sizeof(msgbuf), 0);
-	if (msglen < 0)
-		return;
-
 	xlog(D_GENERAL, "Received packet...");
 
 	memset(&xdr, 0, sizeof(xdr));
@@ -798,31 +1004,53 @@ out:
 }
 
 /*
- * Insert host into notification list, sorted by next send time
+ * Receive all the replies waiting on the socket
  */
 static void
-insert_host(struct nsm_host *host)
+recv_replies(const int sock)
 {
-	struct nsm_host	**where, *p;
+#ifdef HAVE_RECVMMSG
+	static char msgbufs[NSM_RECV_BATCH][NSM_MAXMSGSIZE];
+	struct mmsghdr msgs[NSM_RECV_BATCH];
+	struct iovec iov[NSM_RECV_BATCH];
+	int i, n;
+
+	do {
+		memset(msgs, 0, sizeof(msgs));
+		for (i = 0; i < NSM_RECV_BATCH; i++) {
+			iov[i].iov_base = msgbufs[i];
+			iov[i].iov_len = NSM_MAXMSGSIZE;
+			msgs[i].msg_hdr.msg_iov = &iov[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+		n = recvmmsg(sock, msgs, NSM_RECV_BATCH, MSG_DONTWAIT, NULL);
+		for (i = 0; i < n; i++)
+			recv_reply(msgbufs[i], (ssize_t)msgs[i].msg_len);
+	} while (n == NSM_RECV_BATCH);
+#else	/* !HAVE_RECVMMSG */
+	char msgbuf[NSM_MAXMSGSIZE];
+	ssize_t msglen;
 
-	where = &hosts;
-	while ((p = *where) != 0) {
-		/* Sort in ascending order of timeout */
-		if (host->send_next < p->send_next)
-			break;
-		/* If we have the same timeout, put the
-		 * most recently used host first.
-		 * This makes sure that "recent" hosts
-		 * get notified first.
-		 */
-		if (host->send_next == p->send_next
-		 && host->last_used > p->last_used)
-			break;
-		where = &p->next;
-	}
+	while ((msglen = recv(sock, msgbuf, sizeof(msgbuf),
+						MSG_DONTWAIT)) >= 0)
+		recv_reply(msgbuf, msglen);
+#endif	/* !HAVE_RECVMMSG */
+}
 
-	host->next = *where;
-	*where = host;
+/*
+ * Schedule host to be sent to at @when.  Among hosts due at the same
+ * time, the most recently used host goes first.  This makes sure that
+ * "recent" hosts get notified first.
+ */
+static void
+insert_host(struct nsm_host *host, const time_t when)
+{
+	if (!nsm_timer_set(&hosts, &host->send_next, when)) {
+		/* its record stays in sm.bak for next time */
+		xlog_warn("Unable to allocate memory");
+		smn_free_host(host);
+		return;
+	}
 	xlog(D_GENERAL, "Added host %s to notify list", host->name);
 }
 
@@ -832,17 +1060,20 @@ insert_host(struct nsm_host *host)
 static struct nsm_host *
 find_host(uint32_t xid)
 {
-	struct nsm_host	**where, *p;
+	struct nsm_xid *x = nsm_xid_find(&host_xids, xid);
 
-	where = &hosts;
-	while ((p = *where) != 0) {
-		if (p->xid == xid) {
-			*where = p->next;
-			return p;
-		}
-		where = &p->next;
-	}
-	return NULL;
+	return x != NULL ? x->nx_data : NULL;
+}
+
+/*
+ * Find the host that is due first
+ */
+static struct nsm_host *
+first_host(void)
+{
+	struct nsm_timer *t = nsm_timer_first(&hosts);
+
+	return t != NULL ? t->nt_data : NULL;
 }
 
 /*
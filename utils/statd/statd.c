@@ -59,6 +59,8 @@ static struct option longopts[] =
 	{ "notify-mode", 0, 0, 'N' },
 	{ "ha-callout", 1, 0, 'H' },
 	{ "no-notify", 0, 0, 'L' },
+	{ "journal", 1, 0, 'J' },
+	{ "no-journal", 0, 0, 'j' },
 	{ NULL, 0, 0, 0 }
 };
 
@@ -153,6 +155,8 @@ usage(void)
 	fprintf(stderr,"      -N                   Run in notify only mode.\n");
 	fprintf(stderr,"      -L, --no-notify      Do not perform any notification.\n");
 	fprintf(stderr,"      -H                   Specify a high-availability callout program.\n");
+	fprintf(stderr,"      -J, --journal msecs  Keep monitor records in a journal, synced within msecs.\n");
+	fprintf(stderr,"      --no-journal         Keep monitor records in a file per host.\n");
 }
 
 static const char *pidfile = "/var/run/rpc.statd.pid";
@@ -216,6 +220,8 @@ int main (int argc, char **argv)
 	int pid;
 	int arg;
 	int port = 0, out_port = 0;
+	int journal = -1;
+	char *endptr;
 	struct rlimit rlim;
 
 	int pipefds[2] = { -1, -1};
@@ -237,7 +243,7 @@ int main (int argc, char **argv)
 	MY_NAME = NULL;
 
 	/* Process command line switches */
-	while ((arg = getopt_long(argc, argv, "h?vVFNH:dn:p:o:P:L", longopts, NULL)) != EOF) {
+	while ((arg = getopt_long(argc, argv, "h?vVFNH:dn:p:o:P:LJ:", longopts, NULL)) != EOF) {
 		switch (arg) {
 		case 'V':	/* Version */
 		case 'v':
@@ -281,6 +287,20 @@ int main (int argc, char **argv)
 			if (!nsm_setup_pathnames(argv[0], optarg))
 				exit(1);
 			break;
+		case 'J':
+			errno = 0;
+			journal = (int)strtol(optarg, &endptr, 10);
+			if (errno != 0 || *endptr != '\0' || endptr == optarg ||
+			    journal < 0) {
+				fprintf(stderr, "%s: bad commit interval: %s\n",
+					argv[0], optarg);
+				usage();
+				exit(1);
+			}
+			break;
+		case 'j':
+			journal = -2;
+			break;
 		case 'H': /* PRC: specify the ha-callout program */
 			if ((ha_callout_prog = xstrdup(optarg)) == NULL) {
 				fprintf(stderr, "%s: xstrdup(%s) failed!\n",
@@ -402,6 +422,11 @@ int main (int argc, char **argv)
 	create_pidfile();
 	atexit(truncate_pidfile);
 
+	/* Move the records before sm-notify or anyone else reads them */
+	if (journal != -1 && !nsm_use_journal(journal >= 0,
+				journal >= 0 ? (unsigned int)journal : 0))
+		exit(1);
+
 	if (! (run_mode & MODE_NO_NOTIFY))
 		switch (pid = fork()) {
 		case 0:
@@ -453,6 +478,15 @@ int main (int argc, char **argv)
 	}
 	atexit(statd_unregister);
 
+	/*
+	 * ORDER
+	 * Start the resolver threads after dropping privileges, which
+	 * only this thread would lose.  The hosts load_state() found are
+	 * indexed as their lookups finish, without holding up startup.
+	 */
+	statd_resolver_start();
+	index_state();
+
 	/* If we got this far, we have successfully started, so notify parent */
 	if (pipefds[1] > 0) {
 		status = 0;
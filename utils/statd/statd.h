@@ -27,16 +27,23 @@ extern _Bool	statd_present_address(const struct sockaddr *sap, char *buf,
 					const size_t buflen);
 __attribute_malloc__
 extern char *	statd_canonical_name(const char *hostname);
+extern const struct addrinfo *statd_canonical_list(const char *hostname);
+extern void	statd_prefetch(const char *hostname);
+extern _Bool	statd_refresh(const char *hostname);
+extern void	statd_hold_name(const char *hostname);
+extern void	statd_release_name(const char *hostname);
+extern void	statd_resolver_start(void);
+extern void	statd_expire_names(void);
 
 extern void	my_svc_run(void);
 extern void	notify_hosts(void);
 extern void	shuffle_dirs(void);
 extern int	statd_get_socket(void);
 extern int	process_notify_list(void);
-extern int	process_reply(FD_SET_TYPE *);
 extern char *	xstrdup(const char *);
 extern void *	xmalloc(size_t);
 extern void	load_state(void);
+extern void	index_state(void);
 
 /*
  * Host status structure and macros.
@@ -52,6 +59,9 @@ stat_chge		SM_stat_chge;
 #define NOTIFY_TIMEOUT		 5 /* For status-change notifications. */
 #define SELECT_TIMEOUT		10 /* Max select() timeout when work to do. */
 #define MAX_TRIES		 5 /* Max number of tries for any host. */
+#define RESOLVE_TTL		1800 /* Look monitored hosts up this often. */
+#define RESOLVE_NEG_TTL		  60 /* Retry failed lookups this often. */
+#define RESOLVER_THREADS	   8 /* Hosts looked up at once. */
 
 /*
  * Modes of operation - Lon
@@ -55,15 +55,10 @@
 #include <time.h>
 #include "statd.h"
 #include "notlist.h"
+#include "rpcmisc.h"
 
 static int	svc_stop = 0;
 
-/*
- * This is the global notify list onto which all SM_NOTIFY and CALLBACK
- * requests are put.
- */
-notify_list *	notify = NULL;
-
 /*
  * Jump-off function.
  */
@@ -80,8 +75,10 @@ my_svc_exit(void)
 void
 my_svc_run(void)
 {
-	FD_SET_TYPE	readfds;
-	int             selret;
+	notify_list	*first;
+	int		timeout;
+	int		sync;
+	int		ret;
 	time_t		now;
 
 	svc_stop = 0;
@@ -90,43 +87,36 @@ my_svc_run(void)
 		if (svc_stop)
 			return;
 
+		statd_expire_names();
+
 		/* Ah, there are some notifications to be processed */
-		while (notify && NL_WHEN(notify) <= time(&now)) {
+		while ((first = notify_first()) != NULL &&
+		       NL_WHEN(first) <= time(&now)) {
 			process_notify_list();
 		}
 
-		readfds = SVC_FDSET;
-		if (notify) {
-			struct timeval	tv;
-
-			tv.tv_sec  = NL_WHEN(notify) - now;
-			tv.tv_usec = 0;
+		if (first) {
+			timeout = (NL_WHEN(first) - now) * 1000;
 			xlog(D_GENERAL, "Waiting for reply... (timeo %d)",
-							tv.tv_sec);
-			selret = select(FD_SETSIZE, &readfds,
-				(void *) 0, (void *) 0, &tv);
+							timeout / 1000);
 		} else {
+			timeout = -1;
 			xlog(D_GENERAL, "Waiting for client connections");
-			selret = select(FD_SETSIZE, &readfds,
-				(void *) 0, (void *) 0, (struct timeval *) 0);
 		}
 
-		switch (selret) {
-		case -1:
+		/* Monitor records waiting to be synced */
+		sync = nsm_sync_records();
+		if (sync >= 0 && (timeout < 0 || sync < timeout))
+			timeout = sync;
+
+		ret = nfs_svc_loop_wait(timeout);
+		if (ret == -1) {
 			if (errno == EINTR || errno == ECONNREFUSED
 			 || errno == ENETUNREACH || errno == EHOSTUNREACH)
 				continue;
-			xlog(L_ERROR, "my_svc_run() - select: %m");
+			xlog(L_ERROR, "my_svc_run() - epoll_wait: %m");
 			return;
-
-		case 0:
-			/* A notify/callback timed out. */
-			continue;
-
-		default:
-			selret -= process_reply(&readfds);
-			if (selret)
-				svc_getreqset(&readfds);
 		}
+		/* ret == 0: a notify/callback timed out. */
 	}
 }